@@ -0,0 +1,561 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  counted B+tree. a separator keys[i] of an inner node is <= all keys of child i
+  and > all keys of child i-1, keys[0] is not used for searching. merging and
+  redistributing nodes thus never needs separators pulled down from the parent,
+  except for the first separator of the right node.
+
+  lock-free readers may see nodes in the middle of an update. child pointers
+  are only ever moved with word-sized stores and unused child slots are NULL,
+  so a reader either finds a live (or retired, not yet freed) node or NULL.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "mem.h"
+#include "logger.h"
+#include "json.h"
+#include "epoch.h"
+#include "slab.h"
+#include "search.h"
+#include "nlkup.h"
+#include "btree.h"
+
+// below that, a node is merged with or refilled from a sibling
+#define BT_LEAF_MIN (BT_LEAF_MAX/4)
+#define BT_INNER_MIN (BT_INNER_MAX/4)
+
+// bulk loading leaves room for inserts
+#define BT_LEAF_FILL (BT_LEAF_MAX*3/4)
+#define BT_INNER_FILL (BT_INNER_MAX*3/4)
+
+// deeper than that is not a tree but a reader looking at garbage
+#define BT_MAX_HEIGHT 16
+
+typedef struct {
+  int leaf;  // TRUE for leaves
+  int n;     // nbr of entries or children
+} BT_Node;
+
+typedef struct {
+  BT_Node hdr;
+  LkupKey keys[BT_LEAF_MAX];
+  LkupAlias aliases[BT_LEAF_MAX];
+} BT_Leaf;
+
+typedef struct {
+  BT_Node hdr;
+  LkupKey keys[BT_INNER_MAX];     // separators
+  long counts[BT_INNER_MAX];      // nbr of entries below each child
+  BT_Node *children[BT_INNER_MAX];
+} BT_Inner;
+
+struct BT_Tree {
+  BT_Node *root;
+  long count;
+};
+
+#define LEAF( node) ((BT_Leaf *) (node))
+#define INNER( node) ((BT_Inner *) (node))
+
+// nodes are counted as memory of B+tree blocks
+static void *alloc_node( size_t sz) {
+  void *p = SL_alloc( sz);
+  mem_count( MEM_BTREE_NODES, SL_size( p));
+  return p;
+}
+
+static void release_node( void *p) {
+  mem_count( MEM_BTREE_NODES, -(long) SL_size( p));
+  SL_free( p);
+}
+
+static BT_Leaf *new_leaf() {
+  BT_Leaf *l = alloc_node( sizeof( BT_Leaf));
+  l->hdr.leaf = TRUE;
+  return l;
+}
+
+static BT_Inner *new_inner() {
+  BT_Inner *in = alloc_node( sizeof( BT_Inner));
+  in->hdr.leaf = FALSE;
+  return in;
+}
+
+static long node_count( const BT_Node *node) {
+  if ( node->leaf) 
+    return node->n;
+
+  const BT_Inner *in = INNER( node);
+  long cnt = 0;
+  int i = 0;
+  for ( i = 0; i < node->n; i++) {
+    cnt += in->counts[i];
+  }
+  return cnt;
+}
+
+// smallest key below node. for inner nodes the separator of the first child.
+static LkupKey node_min_key( const BT_Node *node) {
+  return node->leaf ? LEAF( node)->keys[0] : INNER( node)->keys[0];
+}
+
+// index of the child whose range covers key
+static int child_index( const BT_Inner *in, const int n, const LkupKey key) {
+  long i = SRCH_find( &in->keys[1], n-1, key);
+  return i >= 0 ? i + 1 : -i - 1;
+}
+
+// moves len children with their keys and counts. pointers are copied
+// one by one so a concurrent reader never sees a torn pointer.
+static void move_children( BT_Inner *dst, const int dst_idx, BT_Inner *src, const int src_idx, const int len) {
+  int i = 0;
+
+  if ( len <= 0) 
+    return;
+
+  memmove( &dst->keys[dst_idx], &src->keys[src_idx], len * sizeof( LkupKey));
+  memmove( &dst->counts[dst_idx], &src->counts[src_idx], len * sizeof( long));
+
+  if ( dst != src || dst_idx < src_idx) {
+    for ( i = 0; i < len; i++) 
+      dst->children[dst_idx+i] = src->children[src_idx+i];
+  } else {
+    for ( i = len-1; i >= 0; i--) 
+      dst->children[dst_idx+i] = src->children[src_idx+i];
+  }
+}
+
+static void clear_children( BT_Inner *in, const int from, const int to) {
+  int i = 0;
+  for ( i = from; i < to; i++) 
+    in->children[i] = NULL;
+}
+
+static void move_entries( BT_Leaf *dst, const int dst_idx, BT_Leaf *src, const int src_idx, const int len) {
+  if ( len <= 0) 
+    return;
+  memmove( &dst->keys[dst_idx], &src->keys[src_idx], len * sizeof( LkupKey));
+  memmove( &dst->aliases[dst_idx], &src->aliases[src_idx], len * sizeof( LkupAlias));
+}
+
+static void free_node( BT_Node *node) {
+  if ( !node->leaf) {
+    BT_Inner *in = INNER( node);
+    int i = 0;
+    for ( i = 0; i < node->n; i++) {
+      free_node( in->children[i]);
+    }
+  }
+  release_node( node);
+}
+
+void BT_free( BT_Tree *tree) {
+  if ( tree->root != NULL) 
+    free_node( tree->root);
+  release_node( tree);
+}
+
+static void free_tree( void *ptr) {
+  BT_free( (BT_Tree *) ptr);
+}
+
+void BT_retire( BT_Tree *tree) {
+  // unlinked as a whole, one deferred free for all nodes
+  EP_retire( tree, free_tree);
+}
+
+long BT_count( const BT_Tree *tree) {
+  return tree->count;
+}
+
+// next level of n nodes, grouped evenly into parents of about BT_INNER_FILL children
+static BT_Node **build_level( BT_Node **nodes, long n, long *nbr_parents) {
+
+  long m = (n + BT_INNER_FILL - 1) / BT_INNER_FILL;
+  BT_Node **parents = mem_alloc( m * sizeof( BT_Node *));
+  long j = 0;
+
+  for ( j = 0; j < m; j++) {
+    long lo = n * j / m;
+    long hi = n * (j+1) / m;
+    BT_Inner *in = new_inner();
+    long i = 0;
+    for ( i = lo; i < hi; i++) {
+      in->keys[i-lo] = node_min_key( nodes[i]);
+      in->counts[i-lo] = node_count( nodes[i]);
+      in->children[i-lo] = nodes[i];
+    }
+    in->hdr.n = hi - lo;
+    parents[j] = (BT_Node *) in;
+  }
+
+  *nbr_parents = m;
+  return parents;
+}
+
+BT_Tree *BT_build( const LkupKey keys[], const LkupAlias aliases[], const long n) {
+
+  BT_Tree *tree = alloc_node( sizeof( BT_Tree));
+  tree->count = n;
+
+  // leaves, evenly filled
+  long m = n > 0 ? (n + BT_LEAF_FILL - 1) / BT_LEAF_FILL : 1;
+  BT_Node **nodes = mem_alloc( m * sizeof( BT_Node *));
+  long j = 0;
+
+  for ( j = 0; j < m; j++) {
+    long lo = n * j / m;
+    long hi = n * (j+1) / m;
+    BT_Leaf *l = new_leaf();
+    memcpy( l->keys, &keys[lo], (hi - lo) * sizeof( LkupKey));
+    memcpy( l->aliases, &aliases[lo], (hi - lo) * sizeof( LkupAlias));
+    l->hdr.n = hi - lo;
+    nodes[j] = (BT_Node *) l;
+  }
+
+  while ( m > 1) {
+    BT_Node **parents = build_level( nodes, m, &m);
+    mem_free( nodes);
+    nodes = parents;
+  }
+
+  tree->root = nodes[0];
+  mem_free( nodes);
+
+  return tree;
+}
+
+int BT_search( const BT_Tree *tree, const LkupKey key, long *rank, LkupAlias *alias) {
+
+  const BT_Node *node = __atomic_load_n( &tree->root, __ATOMIC_ACQUIRE);
+  long r = 0;
+  int h = 0;
+
+  for ( h = 0; node != NULL && h < BT_MAX_HEIGHT; h++) {
+
+    int n = __atomic_load_n( &node->n, __ATOMIC_ACQUIRE);
+
+    if ( node->leaf) {
+
+      if ( n < 0 || n > BT_LEAF_MAX) 
+	return BT_INCONSISTENT;
+
+      const BT_Leaf *l = LEAF( node);
+      long i = SRCH_find( l->keys, n, key);
+
+      if ( i < 0) {
+	*rank = r - i - 1;
+	return 0;
+      }
+
+      *rank = r + i;
+      if ( alias != NULL) 
+	*alias = l->aliases[i];
+      return 1;
+    }
+
+    if ( n <= 0 || n > BT_INNER_MAX) 
+      return BT_INCONSISTENT;
+
+    const BT_Inner *in = INNER( node);
+    int c = child_index( in, n, key);
+    int i = 0;
+
+    for ( i = 0; i < c; i++) {
+      r += in->counts[i];
+    }
+
+    node = __atomic_load_n( &in->children[c], __ATOMIC_ACQUIRE);
+  }
+
+  return BT_INCONSISTENT;
+}
+
+// inserts into the subtree at node. *right is set if node had to be split.
+static int insert_node( BT_Node *node, const LkupKey key, const LkupAlias *alias, BT_Node **right) {
+
+  *right = NULL;
+
+  if ( node->leaf) {
+
+    BT_Leaf *l = LEAF( node);
+    long i = SRCH_find( l->keys, node->n, key);
+
+    if ( i >= 0) { // replace alias
+      l->aliases[i] = *alias;
+      return 0;
+    }
+
+    int pos = -i - 1;
+
+    if ( node->n == BT_LEAF_MAX) { // split, upper half goes to a new leaf
+
+      BT_Leaf *r = new_leaf();
+      int half = BT_LEAF_MAX / 2;
+
+      move_entries( r, 0, l, half, BT_LEAF_MAX - half);
+      r->hdr.n = BT_LEAF_MAX - half;
+      __atomic_store_n( &node->n, half, __ATOMIC_RELEASE);
+
+      *right = (BT_Node *) r;
+      if ( pos > half) {
+	pos -= half;
+	l = r;
+      }
+    }
+
+    move_entries( l, pos+1, l, pos, l->hdr.n - pos);
+    l->keys[pos] = key;
+    l->aliases[pos] = *alias;
+    __atomic_store_n( &l->hdr.n, l->hdr.n + 1, __ATOMIC_RELEASE);
+
+    return 1;
+  }
+
+  BT_Inner *in = INNER( node);
+  int c = child_index( in, node->n, key);
+  BT_Node *child = in->children[c];
+  BT_Node *child_right = NULL;
+
+  int added = insert_node( child, key, alias, &child_right);
+
+  if ( child_right == NULL) {
+    in->counts[c] += added;
+    return added;
+  }
+
+  // child was split, link its right half after it
+  in->counts[c] = node_count( child);
+
+  int pos = c + 1;
+
+  if ( node->n == BT_INNER_MAX) { // split, upper half goes to a new inner node
+
+    BT_Inner *r = new_inner();
+    int half = BT_INNER_MAX / 2;
+
+    move_children( r, 0, in, half, BT_INNER_MAX - half);
+    r->hdr.n = BT_INNER_MAX - half;
+    __atomic_store_n( &node->n, half, __ATOMIC_RELEASE);
+    clear_children( in, half, BT_INNER_MAX);
+
+    *right = (BT_Node *) r;
+    if ( pos > half) {
+      pos -= half;
+      in = r;
+    }
+  }
+
+  move_children( in, pos+1, in, pos, in->hdr.n - pos);
+  in->keys[pos] = node_min_key( child_right);
+  in->counts[pos] = node_count( child_right);
+  in->children[pos] = child_right;
+  __atomic_store_n( &in->hdr.n, in->hdr.n + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+int BT_insert( BT_Tree *tree, const LkupKey key, const LkupAlias *alias) {
+
+  BT_Node *right = NULL;
+  int added = insert_node( tree->root, key, alias, &right);
+
+  if ( right != NULL) { // root was split, grow by one level
+    BT_Inner *root = new_inner();
+    root->keys[0] = node_min_key( tree->root);
+    root->counts[0] = node_count( tree->root);
+    root->children[0] = tree->root;
+    root->keys[1] = node_min_key( right);
+    root->counts[1] = node_count( right);
+    root->children[1] = right;
+    root->hdr.n = 2;
+    __atomic_store_n( &tree->root, (BT_Node *) root, __ATOMIC_RELEASE);
+  }
+
+  tree->count += added;
+  return added;
+}
+
+// children l and l+1 of in. merges them if they fit into one node, evens them out otherwise.
+static void rebalance( BT_Inner *in, const int l) {
+
+  int r = l + 1;
+  BT_Node *left = in->children[l];
+  BT_Node *right = in->children[r];
+  int max = left->leaf ? BT_LEAF_MAX : BT_INNER_MAX;
+  int nl = left->n;
+  int nr = right->n;
+
+  if ( !left->leaf) {
+    // the first separator of the right node is only known to the parent
+    INNER( right)->keys[0] = in->keys[r];
+  }
+
+  if ( nl + nr <= max) { // merge right into left
+
+    if ( left->leaf) {
+      move_entries( LEAF( left), nl, LEAF( right), 0, nr);
+    } else {
+      move_children( INNER( left), nl, INNER( right), 0, nr);
+    }
+    __atomic_store_n( &left->n, nl + nr, __ATOMIC_RELEASE);
+    in->counts[l] = node_count( left);
+
+    // unlink right
+    move_children( in, r, in, r+1, in->hdr.n - (r+1));
+    clear_children( in, in->hdr.n - 1, in->hdr.n);
+    __atomic_store_n( &in->hdr.n, in->hdr.n - 1, __ATOMIC_RELEASE);
+
+    EP_retire( right, release_node);
+    return;
+  }
+
+  int target = (nl + nr) / 2;
+
+  if ( nl < target) { // move head of right to the end of left
+    int k = target - nl;
+    if ( left->leaf) {
+      move_entries( LEAF( left), nl, LEAF( right), 0, k);
+      __atomic_store_n( &left->n, nl + k, __ATOMIC_RELEASE);
+      move_entries( LEAF( right), 0, LEAF( right), k, nr - k);
+    } else {
+      move_children( INNER( left), nl, INNER( right), 0, k);
+      __atomic_store_n( &left->n, nl + k, __ATOMIC_RELEASE);
+      move_children( INNER( right), 0, INNER( right), k, nr - k);
+      clear_children( INNER( right), nr - k, nr);
+    }
+    __atomic_store_n( &right->n, nr - k, __ATOMIC_RELEASE);
+  } else { // move tail of left to the front of right
+    int k = nl - target;
+    if ( left->leaf) {
+      move_entries( LEAF( right), k, LEAF( right), 0, nr);
+      move_entries( LEAF( right), 0, LEAF( left), nl - k, k);
+    } else {
+      move_children( INNER( right), k, INNER( right), 0, nr);
+      move_children( INNER( right), 0, INNER( left), nl - k, k);
+    }
+    __atomic_store_n( &right->n, nr + k, __ATOMIC_RELEASE);
+    __atomic_store_n( &left->n, nl - k, __ATOMIC_RELEASE);
+    if ( !left->leaf) 
+      clear_children( INNER( left), nl - k, nl);
+  }
+
+  in->keys[r] = node_min_key( right);
+  in->counts[l] = node_count( left);
+  in->counts[r] = node_count( right);
+}
+
+// deletes from the subtree at node. underfull children are rebalanced on the way up.
+static int delete_node( BT_Node *node, const LkupKey key) {
+
+  if ( node->leaf) {
+
+    BT_Leaf *l = LEAF( node);
+    long i = SRCH_find( l->keys, node->n, key);
+
+    if ( i < 0) 
+      return 0;
+
+    move_entries( l, i, l, i+1, node->n - (i+1));
+    __atomic_store_n( &node->n, node->n - 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+
+  BT_Inner *in = INNER( node);
+  int c = child_index( in, node->n, key);
+  BT_Node *child = in->children[c];
+
+  if ( delete_node( child, key) == 0) 
+    return 0;
+
+  in->counts[c]--;
+
+  int min = child->leaf ? BT_LEAF_MIN : BT_INNER_MIN;
+  if ( child->n < min && node->n > 1) {
+    rebalance( in, c > 0 ? c - 1 : c);
+  }
+
+  return 1;
+}
+
+int BT_delete( BT_Tree *tree, const LkupKey key) {
+
+  int deleted = delete_node( tree->root, key);
+
+  BT_Node *root = tree->root;
+  if ( !root->leaf && root->n == 1) { // shrink by one level
+    __atomic_store_n( &tree->root, INNER( root)->children[0], __ATOMIC_RELEASE);
+    EP_retire( root, release_node);
+  }
+
+  tree->count -= deleted;
+  return deleted;
+}
+
+static long copy_node( const BT_Node *node, long from, long len, LkupKey keys[], LkupAlias aliases[]) {
+
+  if ( node->leaf) {
+    const BT_Leaf *l = LEAF( node);
+    long n = node->n - from;
+    if ( n > len) 
+      n = len;
+    if ( n <= 0) 
+      return 0;
+    memcpy( keys, &l->keys[from], n * sizeof( LkupKey));
+    memcpy( aliases, &l->aliases[from], n * sizeof( LkupAlias));
+    return n;
+  }
+
+  const BT_Inner *in = INNER( node);
+  long copied = 0;
+  int i = 0;
+
+  for ( i = 0; i < node->n && copied < len; i++) {
+    if ( from >= in->counts[i]) { // skip entire child
+      from -= in->counts[i];
+      continue;
+    }
+    copied += copy_node( in->children[i], from, len - copied, &keys[copied], &aliases[copied]);
+    from = 0;
+  }
+  return copied;
+}
+
+long BT_copy( const BT_Tree *tree, const long from, const long len, LkupKey keys[], LkupAlias aliases[]) {
+  if ( from < 0 || len <= 0 || from >= tree->count) 
+    return 0;
+  return copy_node( tree->root, from, len, keys, aliases);
+}
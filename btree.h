@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  counted B+tree of postfix keys and aliases, used for blocks which have grown
+  too large for a sorted array. inner nodes keep the entry count of each child
+  so that entries can be addressed by rank, just like array indices.
+
+  the tree is not synchronized. writers hold the block lock and bump the block
+  version, lock-free readers validate the version after BT_search(). nodes a
+  writer unlinks are handed to the epoch module, BT_search() copes with the
+  half-updated nodes it may see and then returns BT_INCONSISTENT.
+
+  requires nlkup.h for LkupKey and LkupAlias.
+*/
+
+#ifndef _BTREE_H_
+#define _BTREE_H_
+
+// max entries per leaf and children per inner node
+#define BT_LEAF_MAX 64
+#define BT_INNER_MAX 64
+
+// returned by BT_search() if it ran into a node being modified
+#define BT_INCONSISTENT -1
+
+typedef struct BT_Tree BT_Tree;
+
+// builds a tree from n ascending keys and their aliases
+BT_Tree *BT_build( const LkupKey keys[], const LkupAlias aliases[], const long n);
+
+// frees the tree right away
+void BT_free( BT_Tree *tree);
+
+// frees the tree once no lock-free reader can look at it any longer
+void BT_retire( BT_Tree *tree);
+
+// nbr of entries
+long BT_count( const BT_Tree *tree);
+
+// returns 1 if key was found, 0 if not or BT_INCONSISTENT. *rank is set to the
+// rank of key or its insertion point, *alias to its alias if alias != NULL
+int BT_search( const BT_Tree *tree, const LkupKey key, long *rank, LkupAlias *alias);
+
+// returns 1 if key was added, 0 if the alias of an existing key was replaced
+int BT_insert( BT_Tree *tree, const LkupKey key, const LkupAlias *alias);
+
+// returns 1 if key was deleted, 0 if there is no such key
+int BT_delete( BT_Tree *tree, const LkupKey key);
+
+// copies up to len entries starting with rank from. returns the nbr copied.
+long BT_copy( const BT_Tree *tree, const long from, const long len, LkupKey keys[], LkupAlias aliases[]);
+
+#endif
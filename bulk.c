@@ -0,0 +1,873 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <assert.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem.h"
+#include "logger.h"
+#include "json.h"
+#include "utils.h"
+#include "nlkup.h"
+#include "wal.h"
+#include "bulk.h"
+
+#define BL_SKIP -1000  // not a slot, not a status
+#define BL_MAX_LOGGED_ERRORS 10
+
+// slots handed to a build thread at a time
+#define BL_SLOT_CHUNK 1024
+
+#define NBR_SLOTS (INDEX_SIZE - INDEX_OFFSET)
+
+// one part of the file, lines starting in [from, to)
+typedef struct {
+  const char *from;
+  const char *to;
+  int *offsets;       // per slot: nbr of entries, then where the part scatters to
+  LkupTbl **tables;
+  long lines;
+  long errors;
+} BL_Part;
+
+// what the build threads share
+typedef struct {
+  IdxTblEntry *index_table;
+  LkupTbl **tables;
+  int *sizes;
+  int next_slot;      // next chunk of slots to build
+  long entries;
+  WAL_Log *log;       // the loaded entries are appended to it, if non NULL
+  uint64_t lsn;       // the last lsn appended
+  long failures;      // slots not switched in: out of heap space or not logged
+} BL_Build;
+
+// an add or del command, pointing into the mapped file
+typedef struct {
+  const char *nbr;
+  const char *alias;   // NULL for a del
+  int nbr_len;
+  int alias_len;
+} BL_Cmd;
+
+// one part of a command file. the commands are grouped by worker.
+typedef struct {
+  const char *from;
+  const char *to;
+  int nbr_workers;
+  long *offsets;      // per worker: nbr of commands, then the end of its group
+  BL_Cmd *cmds;
+  long lines;
+  long errors;
+} BL_CmdPart;
+
+// a worker applies the commands of the slots of its lock stripes
+typedef struct {
+  IdxTblEntry *index_table;
+  BL_CmdPart *parts;
+  int nbr_parts;
+  int id;
+  WAL_Log *log;       // the commands are appended to it, if non NULL
+  uint64_t lsn;       // the last lsn appended
+  BL_WorkerStats *stats;
+} BL_Worker;
+
+static int is_sep( const char c) {
+  return c == '=' || c == ',' || c == ' ' || c == '\t';
+}
+
+// parses a line in [cp, eol): the slot of the number is returned, its key and
+// packed alias are set. BL_SKIP for comments and empty lines, FAILURE if malformed.
+static int parse_line( const char *cp, const char *eol, LkupKey *key, LkupAlias *alias) {
+
+  while ( cp < eol && isspace( *cp)) 
+    cp++;
+  while ( eol > cp && isspace( eol[-1])) 
+    eol--;
+
+  if ( cp == eol || *cp == '#') 
+    return BL_SKIP;
+
+  if ( eol - cp > 4 && strncasecmp( cp, "add=", 4) == 0) 
+    cp += 4;
+
+  const char *nbr = cp;
+  while ( cp < eol && isdigit( *cp)) 
+    cp++;
+  int nbr_len = cp - nbr;
+
+  if ( nbr_len < PREFIX_LENGTH || nbr_len > MAX_NBR_LENGTH || nbr[0] == '0' || cp == eol || !is_sep( *cp)) 
+    return FAILURE;
+
+  while ( cp < eol && is_sep( *cp)) 
+    cp++;
+
+  const char *a = cp;
+  while ( cp < eol && isdigit( *cp)) 
+    cp++;
+  int alias_len = cp - a;
+
+  if ( alias_len == 0 || alias_len > MAX_NBR_LENGTH || cp != eol) 
+    return FAILURE;
+
+  if ( encode_postfix( nbr, PREFIX_LENGTH, nbr_len - PREFIX_LENGTH, key) < 0 || 
+       compress_to_buf( a, 0, alias_len, alias->alias, ALIAS_LENGTH) < 0) 
+    return FAILURE;
+
+  int idx = 0;
+  int i = 0;
+  for ( i = 0; i < PREFIX_LENGTH; i++) {
+    idx = idx * 10 + (nbr[i] - '0');
+  }
+  return idx - INDEX_OFFSET;
+}
+
+// counts the entries per slot if tables is NULL, else scatters them into the tables
+static void *parse_part( void *arg) {
+
+  BL_Part *p = (BL_Part *) arg;
+  const char *cp = p->from;
+
+  p->lines = 0;
+  p->errors = 0;
+
+  while ( cp < p->to) {
+
+    const char *eol = memchr( cp, '\n', p->to - cp);
+    if ( eol == NULL) 
+      eol = p->to;
+
+    LkupKey key;
+    LkupAlias alias;
+    int idx = parse_line( cp, eol, &key, &alias);
+
+    if ( idx == FAILURE) {
+      if ( p->tables == NULL && p->errors < BL_MAX_LOGGED_ERRORS) 
+	log_msg( ERR, "BL_load: bad line %.*s\n", (int) (eol - cp), cp);
+      p->errors++;
+    } else if ( idx != BL_SKIP) {
+      if ( p->tables == NULL) {
+	p->offsets[idx]++;
+      } else {
+	LkupTbl *t = p->tables[idx];
+	int i = p->offsets[idx]++;
+	t->keys[i] = key;
+	t->aliases[i] = alias;
+      }
+      p->lines++;
+    }
+
+    cp = eol + 1;
+  }
+
+  return NULL;
+}
+
+static int compare_sort_keys( const void *a, const void *b) {
+  uint64_t x = *((const uint64_t *) a);
+  uint64_t y = *((const uint64_t *) b);
+  return (x > y) - (x < y);
+}
+
+// merges the sorted entries of t with those of old, t's win. NULL if out of
+// heap space, t is left as is then.
+static LkupTbl *merge_tables( LkupTbl *t, LkupTbl *old) {
+
+  long old_len = old->table_len;
+  LkupKey *old_keys = mem_alloc( old_len * sizeof( LkupKey));
+  LkupAlias *old_aliases = mem_alloc( old_len * sizeof( LkupAlias));
+  if ( old_keys == NULL || old_aliases == NULL) {
+    if ( old_keys != NULL) 
+      mem_free( old_keys);
+    if ( old_aliases != NULL) 
+      mem_free( old_aliases);
+    return NULL;
+  }
+  get_lkup_tbl_entries( old, 0, old_len, old_keys, old_aliases);
+
+  LkupTbl *nt = new_lkup_tbl( t->table_len + old_len);
+  long i = 0;
+  long j = 0;
+  long n = 0;
+
+  while ( i < t->table_len || j < old_len) {
+    if ( j == old_len || (i < t->table_len && t->keys[i] <= old_keys[j])) {
+      if ( j < old_len && t->keys[i] == old_keys[j]) 
+	j++;
+      nt->keys[n] = t->keys[i];
+      nt->aliases[n++] = t->aliases[i++];
+    } else {
+      nt->keys[n] = old_keys[j];
+      nt->aliases[n++] = old_aliases[j++];
+    }
+  }
+  nt->table_len = n;
+
+  mem_free( old_keys);
+  mem_free( old_aliases);
+  free_lkup_tbl( t);
+  return nt;
+}
+
+// decodes the sorted entries of slot idx into recs
+static int decode_loaded( const int idx, const LkupTbl *t, NumberAliasStruct recs[]) {
+
+  char prefix[PREFIX_LENGTH+1];
+  snprintf( prefix, sizeof( prefix), "%ld", (long) (idx + INDEX_OFFSET));
+
+  long i = 0;
+  for ( i = 0; i < t->table_len; i++) {
+    memcpy( recs[i].nbr, prefix, PREFIX_LENGTH);
+    if ( decode_postfix( t->keys[i], recs[i].nbr + PREFIX_LENGTH, sizeof( recs[i].nbr) - PREFIX_LENGTH) < 0 || 
+	 decompress_to_buf( t->aliases[i].alias, recs[i].alias, sizeof( recs[i].alias)) < 0) 
+      return FAILURE;
+  }
+  return SUCCESS;
+}
+
+// appends the n decoded entries to the log and notes the last lsn
+static int log_loaded( BL_Build *b, const NumberAliasStruct recs[], const long n) {
+
+  uint64_t lsn = 0;
+  long i = 0;
+  for ( i = 0; i < n; i++) {
+    lsn = WAL_append( b->log, WAL_ENTER, recs[i].nbr, strlen( recs[i].nbr), recs[i].alias, strlen( recs[i].alias));
+    if ( lsn == 0) 
+      return FAILURE;
+  }
+
+  uint64_t last = __atomic_load_n( &b->lsn, __ATOMIC_RELAXED);
+  while ( lsn > last && 
+	  !__atomic_compare_exchange_n( &b->lsn, &last, lsn, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) 
+    ;
+  return SUCCESS;
+}
+
+// sorts the entries of the scattered tables, drops duplicates and switches
+// the tables into the index. the loaded entries are logged if b->log is set.
+static void *build_tables( void *arg) {
+
+  BL_Build *b = (BL_Build *) arg;
+  IdxTblEntry *index_table = b->index_table;
+
+  long sort_sz = 0;
+  uint64_t *sort_keys = NULL;
+  LkupAlias *aliases = NULL;
+  long recs_sz = 0;
+  NumberAliasStruct *recs = NULL;
+  long entries = 0;
+
+  for ( ;;) {
+
+    int from = __atomic_fetch_add( &b->next_slot, BL_SLOT_CHUNK, __ATOMIC_RELAXED);
+    if ( from >= NBR_SLOTS) 
+      break;
+
+    int idx = 0;
+    for ( idx = from; idx < from + BL_SLOT_CHUNK && idx < NBR_SLOTS; idx++) {
+
+      LkupTbl *t = b->tables[idx];
+      long n = b->sizes[idx];
+      if ( t == NULL) 
+	continue;
+
+      if ( n > sort_sz) {
+	if ( sort_keys != NULL) {
+	  mem_free( sort_keys);
+	  mem_free( aliases);
+	}
+	sort_keys = mem_alloc( n * sizeof( uint64_t));
+	aliases = mem_alloc( n * sizeof( LkupAlias));
+	sort_sz = n;
+	if ( sort_keys == NULL || aliases == NULL) {
+	  if ( sort_keys != NULL) 
+	    mem_free( sort_keys);
+	  if ( aliases != NULL) 
+	    mem_free( aliases);
+	  sort_keys = NULL;
+	  aliases = NULL;
+	  sort_sz = 0;
+	  log_msg( CRIT, "build_tables: out of heap space, slot %d not loaded\n", idx);
+	  free_lkup_tbl( t);
+	  __atomic_fetch_add( &b->failures, 1, __ATOMIC_RELAXED);
+	  continue;
+	}
+      }
+
+      // key and file position, equal keys stay in file order
+      long i = 0;
+      for ( i = 0; i < n; i++) {
+	sort_keys[i] = ((uint64_t) t->keys[i] << 32) | i;
+      }
+      qsort( sort_keys, n, sizeof( uint64_t), compare_sort_keys);
+
+      // the last of equal keys wins
+      long m = 0;
+      for ( i = 0; i < n; i++) {
+	if ( i + 1 < n && (sort_keys[i] >> 32) == (sort_keys[i+1] >> 32)) 
+	  continue;
+	aliases[m] = t->aliases[sort_keys[i] & 0xFFFFFFFF];
+	t->keys[m] = (LkupKey) (sort_keys[i] >> 32);
+	m++;
+      }
+      memcpy( t->aliases, aliases, m * sizeof( LkupAlias));
+      t->table_len = m;
+
+      // the log records of the loaded entries, decoded before the slot is locked
+      if ( b->log != NULL) {
+	if ( m > recs_sz) {
+	  if ( recs != NULL) 
+	    mem_free( recs);
+	  recs = mem_alloc( m * sizeof( NumberAliasStruct));
+	  recs_sz = recs != NULL ? m : 0;
+	}
+	if ( recs == NULL || decode_loaded( idx, t, recs) != SUCCESS) {
+	  log_msg( ERR, "build_tables: failure to log the entries of slot %d\n", idx);
+	  free_lkup_tbl( t);
+	  __atomic_fetch_add( &b->failures, 1, __ATOMIC_RELAXED);
+	  continue;
+	}
+      }
+
+      lock_table( index_table, idx);
+
+      LkupTbl *old = index_table[idx].table;
+      LkupTbl *merged = old != NULL ? merge_tables( t, old) : t;
+      if ( merged == NULL) {
+	unlock_table( index_table, idx);
+	log_msg( CRIT, "build_tables: out of heap space, slot %d not loaded\n", idx);
+	free_lkup_tbl( t);
+	__atomic_fetch_add( &b->failures, 1, __ATOMIC_RELAXED);
+	continue;
+      }
+      t = merged;
+      adapt_lkup_tbl( t);
+
+      // logged in the write bracket: a checkpoint sees either the records and
+      // the switched table or neither. if appending fails the slot is left as is.
+      begin_table_write( index_table, idx);
+      if ( b->log != NULL && log_loaded( b, recs, m) != SUCCESS) {
+	end_table_write( index_table, idx);
+	unlock_table( index_table, idx);
+	log_msg( ERR, "build_tables: failure to log the entries of slot %d\n", idx);
+	free_lkup_tbl( t);
+	__atomic_fetch_add( &b->failures, 1, __ATOMIC_RELAXED);
+	continue;
+      }
+      index_table[idx].table = t;
+      end_table_write( index_table, idx);
+
+      if ( old != NULL) 
+	retire_lkup_tbl( old);
+
+      unlock_table( index_table, idx);
+
+      entries += t->table_len;
+    }
+  }
+
+  if ( sort_keys != NULL) {
+    mem_free( sort_keys);
+    mem_free( aliases);
+  }
+  if ( recs != NULL) 
+    mem_free( recs);
+
+  __atomic_fetch_add( &b->entries, entries, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// maps fn read-only. an empty file gives data NULL and data_sz 0.
+static int map_file( const char *who, const unsigned char *fn, char **data, size_t *data_sz) {
+
+  *data = NULL;
+  *data_sz = 0;
+
+  int fd = open( fn, O_RDONLY);
+  if ( fd < 0) {
+    log_msg( ERR, "%s: failure to open %s\n", who, fn);
+    return FAILURE;
+  }
+
+  struct stat st;
+  if ( fstat( fd, &st) < 0) {
+    log_msg( ERR, "%s: failure to stat %s\n", who, fn);
+    close( fd);
+    return FAILURE;
+  }
+
+  if ( st.st_size > 0) {
+    char *d = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( d == MAP_FAILED) {
+      log_msg( ERR, "%s: failure to map %s\n", who, fn);
+      close( fd);
+      return FAILURE;
+    }
+    madvise( d, st.st_size, MADV_SEQUENTIAL);
+    *data = d;
+    *data_sz = st.st_size;
+  }
+
+  close( fd);
+  return SUCCESS;
+}
+
+// start of part i of n of the data, at a line boundary. part n is the end.
+static const char *part_start( const char *data, size_t data_sz, int i, int n) {
+  if ( i == 0) 
+    return data;
+  if ( i >= n) 
+    return data + data_sz;
+  const char *cp = data + data_sz * i / n;
+  const char *nl = memchr( cp - 1, '\n', data + data_sz - (cp - 1));
+  return nl != NULL ? nl + 1 : data + data_sz;
+}
+
+// runs f in n threads, thread i gets args + i * arg_sz
+static void run_threads( void *(*f)( void *), void *args, size_t arg_sz, int n) {
+  pthread_t threads[BL_MAX_THREADS];
+  int i = 0;
+
+  for ( i = 0; i < n; i++) {
+    if ( pthread_create( &threads[i], NULL, f, (char *) args + i * arg_sz) != 0) {
+      log_msg( ERR, "BL_load: pthread_create failed\n");
+      f( (char *) args + i * arg_sz); // do it ourselves
+      threads[i] = 0;
+    }
+  }
+  for ( i = 0; i < n; i++) {
+    if ( threads[i] != 0) 
+      pthread_join( threads[i], NULL);
+  }
+}
+
+int BL_load( IdxTblEntry index_table[], const unsigned char *fn, int nbr_threads, WAL_Log *log, BL_Stats *stats) {
+
+  long start_time = get_time_micro();
+  int s = FAILURE;
+  char *data = NULL;
+  size_t data_sz = 0;
+  BL_Part parts[BL_MAX_THREADS];
+  LkupTbl **tables = NULL;
+  int *sizes = NULL;
+  int i = 0;
+  int idx = 0;
+
+  memset( stats, 0, sizeof( BL_Stats));
+  memset( parts, 0, sizeof( parts));
+
+  if ( nbr_threads <= 0) 
+    nbr_threads = sysconf( _SC_NPROCESSORS_ONLN);
+  if ( nbr_threads > BL_MAX_THREADS) 
+    nbr_threads = BL_MAX_THREADS;
+  if ( nbr_threads <= 0) 
+    nbr_threads = 1;
+
+  if ( map_file( "BL_load", fn, &data, &data_sz) < 0) 
+    goto out;
+
+  if ( data_sz == 0) { // nothing to load
+    s = SUCCESS;
+    goto out;
+  }
+
+  tables = mem_alloc( NBR_SLOTS * sizeof( LkupTbl *));
+  sizes = mem_alloc( NBR_SLOTS * sizeof( int));
+  if ( tables == NULL || sizes == NULL) {
+    log_msg( CRIT, "BL_load: out of heap space\n");
+    goto out;
+  }
+
+  for ( i = 0; i < nbr_threads; i++) {
+    parts[i].from = part_start( data, data_sz, i, nbr_threads);
+    parts[i].to = part_start( data, data_sz, i + 1, nbr_threads);
+    parts[i].offsets = mem_alloc( NBR_SLOTS * sizeof( int));
+    if ( parts[i].offsets == NULL) {
+      log_msg( CRIT, "BL_load: out of heap space\n");
+      goto out;
+    }
+  }
+
+  // count entries per slot and part
+  run_threads( parse_part, parts, sizeof( BL_Part), nbr_threads);
+
+  // exactly sized tables. each part scatters behind the entries of the previous parts.
+  for ( idx = 0; idx < NBR_SLOTS; idx++) {
+    int n = 0;
+    for ( i = 0; i < nbr_threads; i++) {
+      int cnt = parts[i].offsets[idx];
+      parts[i].offsets[idx] = n;
+      n += cnt;
+    }
+    sizes[idx] = n;
+    tables[idx] = n > 0 ? new_lkup_tbl( n) : NULL;
+  }
+
+  for ( i = 0; i < nbr_threads; i++) {
+    parts[i].tables = tables;
+    stats->lines += parts[i].lines;
+    stats->errors += parts[i].errors;
+  }
+
+  run_threads( parse_part, parts, sizeof( BL_Part), nbr_threads);
+
+  // sort, merge and switch tables in, slot chunk by slot chunk
+  BL_Build build;
+  build.index_table = index_table;
+  build.tables = tables;
+  build.sizes = sizes;
+  build.next_slot = 0;
+  build.entries = 0;
+  build.log = log;
+  build.lsn = 0;
+  build.failures = 0;
+
+  run_threads( build_tables, &build, 0, nbr_threads);
+
+  stats->entries = build.entries;
+  stats->threads = nbr_threads;
+  stats->usec = get_time_micro() - start_time;
+
+  log_msg( INFO, "BL_load: %ld lines, %ld errors, %ld entries in loaded slots from %s in %ld [usec], %.0f entries/s, %d threads\n",
+	   stats->lines, stats->errors, stats->entries, fn, stats->usec, 
+	   stats->usec > 0 ? 1e6 * stats->lines / stats->usec : 0.0, nbr_threads);
+
+  s = SUCCESS;
+
+  // one sync for all the slots
+  if ( build.lsn > 0 && WAL_sync( log, build.lsn) != SUCCESS) {
+    log_msg( ERR, "BL_load: failure to sync the log\n");
+    s = FAILURE;
+  }
+  if ( build.failures > 0) {
+    log_msg( ERR, "BL_load: %ld slots of %s not loaded\n", build.failures, fn);
+    s = FAILURE;
+  }
+
+ out:
+  for ( i = 0; i < nbr_threads; i++) {
+    if ( parts[i].offsets != NULL) 
+      mem_free( parts[i].offsets);
+  }
+  if ( tables != NULL) 
+    mem_free( tables);
+  if ( sizes != NULL) 
+    mem_free( sizes);
+  if ( data != NULL) 
+    munmap( data, data_sz);
+  return s;
+}
+
+// parses a command line in [cp, eol) in place: "add=number=alias" or
+// "del=number", nothing is allocated or copied. returns the slot of the
+// number, BL_SKIP for comments and empty lines, FAILURE if malformed.
+static int parse_cmd( const char *cp, const char *eol, BL_Cmd *cmd) {
+
+  while ( cp < eol && isspace( *cp)) 
+    cp++;
+  while ( eol > cp && isspace( eol[-1])) 
+    eol--;
+
+  if ( cp == eol || *cp == '#') 
+    return BL_SKIP;
+
+  if ( eol - cp < 4 || cp[3] != '=') 
+    return FAILURE;
+
+  int add = strncasecmp( cp, "add", 3) == 0;
+  if ( !add && strncasecmp( cp, "del", 3) != 0) 
+    return FAILURE;
+  cp += 4;
+
+  cmd->nbr = cp;
+  while ( cp < eol && isdigit( *cp)) 
+    cp++;
+  cmd->nbr_len = cp - cmd->nbr;
+
+  if ( cmd->nbr_len < PREFIX_LENGTH || cmd->nbr_len >= MAX_NBR_LENGTH) 
+    return FAILURE;
+
+  cmd->alias = NULL;
+  cmd->alias_len = 0;
+
+  if ( add) {
+    if ( cp == eol || *cp++ != '=') 
+      return FAILURE;
+    cmd->alias = cp;
+    while ( cp < eol && isdigit( *cp)) 
+      cp++;
+    cmd->alias_len = cp - cmd->alias;
+    if ( cmd->alias_len == 0 || cmd->alias_len >= MAX_NBR_LENGTH) 
+      return FAILURE;
+  }
+
+  if ( cp != eol) 
+    return FAILURE;
+
+  int idx = 0;
+  int i = 0;
+  for ( i = 0; i < PREFIX_LENGTH; i++) {
+    idx = idx * 10 + (cmd->nbr[i] - '0');
+  }
+  return idx - INDEX_OFFSET;
+}
+
+// counts the commands per worker if cmds is NULL, else buckets them
+static void *parse_cmd_part( void *arg) {
+
+  BL_CmdPart *p = (BL_CmdPart *) arg;
+  const char *cp = p->from;
+
+  p->lines = 0;
+  p->errors = 0;
+
+  while ( cp < p->to) {
+
+    const char *eol = memchr( cp, '\n', p->to - cp);
+    if ( eol == NULL) 
+      eol = p->to;
+
+    BL_Cmd cmd;
+    int idx = parse_cmd( cp, eol, &cmd);
+
+    if ( idx == FAILURE) {
+      if ( p->cmds == NULL && p->errors < BL_MAX_LOGGED_ERRORS) 
+	log_msg( ERR, "BL_process: bad line %.*s\n", (int) (eol - cp), cp);
+      p->errors++;
+    } else if ( idx != BL_SKIP) {
+      // all slots of a lock stripe go to the same worker
+      int w = table_stripe( idx) % p->nbr_workers;
+      if ( p->cmds == NULL) {
+	p->offsets[w]++;
+      } else {
+	p->cmds[p->offsets[w]++] = cmd;
+      }
+      p->lines++;
+    }
+
+    cp = eol + 1;
+  }
+
+  return NULL;
+}
+
+// applies the commands of one worker, part by part in file order
+static void *apply_cmds( void *arg) {
+
+  BL_Worker *w = (BL_Worker *) arg;
+  long start_time = get_time_micro();
+  int i = 0;
+
+  for ( i = 0; i < w->nbr_parts; i++) {
+
+    BL_CmdPart *p = &w->parts[i];
+    long from = w->id == 0 ? 0 : p->offsets[w->id-1];
+    long j = 0;
+
+    for ( j = from; j < p->offsets[w->id]; j++) {
+
+      BL_Cmd *cmd = &p->cmds[j];
+      int s = FAILURE;
+
+      uint64_t lsn = 0;
+
+      // straight from the mapped file
+      if ( cmd->alias != NULL) {
+	s = enter_entry_logged( w->index_table, cmd->nbr, cmd->nbr_len, cmd->alias, cmd->alias_len, w->log, &lsn);
+      } else {
+	s = delete_entry_logged( w->index_table, cmd->nbr, cmd->nbr_len, w->log, &lsn);
+      }
+      if ( lsn > w->lsn) 
+	w->lsn = lsn;
+
+      w->stats->commands++;
+      if ( s < 0) 
+	w->stats->errors++;
+    }
+  }
+
+  w->stats->usec = get_time_micro() - start_time;
+  return NULL;
+}
+
+int BL_process( IdxTblEntry index_table[], const unsigned char *fn, int nbr_threads, WAL_Log *log, BL_ProcStats *stats) {
+
+  long start_time = get_time_micro();
+  int s = FAILURE;
+  char *data = NULL;
+  size_t data_sz = 0;
+  BL_CmdPart parts[BL_MAX_THREADS];
+  BL_Worker workers[BL_MAX_THREADS];
+  int i = 0;
+  int w = 0;
+
+  memset( stats, 0, sizeof( BL_ProcStats));
+  memset( parts, 0, sizeof( parts));
+
+  if ( nbr_threads <= 0) 
+    nbr_threads = sysconf( _SC_NPROCESSORS_ONLN);
+  if ( nbr_threads > BL_MAX_THREADS) 
+    nbr_threads = BL_MAX_THREADS;
+  if ( nbr_threads <= 0) 
+    nbr_threads = 1;
+  stats->threads = nbr_threads;
+
+  if ( map_file( "BL_process", fn, &data, &data_sz) < 0) 
+    goto out;
+
+  // the file is parsed in as many parts as there are workers
+  for ( i = 0; i < nbr_threads; i++) {
+    parts[i].from = part_start( data, data_sz, i, nbr_threads);
+    parts[i].to = part_start( data, data_sz, i + 1, nbr_threads);
+    parts[i].nbr_workers = nbr_threads;
+    parts[i].offsets = mem_alloc( nbr_threads * sizeof( long));
+    if ( parts[i].offsets == NULL) {
+      log_msg( CRIT, "BL_process: out of heap space\n");
+      goto out;
+    }
+    memset( parts[i].offsets, 0, nbr_threads * sizeof( long));
+  }
+
+  stats->bytes = data_sz;
+  long parse_start = get_time_micro();
+
+  if ( data_sz > 0) 
+    run_threads( parse_cmd_part, parts, sizeof( BL_CmdPart), nbr_threads);
+
+  // a part's commands are grouped by worker, in file order within a worker
+  for ( i = 0; i < nbr_threads; i++) {
+    long n = 0;
+    for ( w = 0; w < nbr_threads; w++) {
+      long cnt = parts[i].offsets[w];
+      parts[i].offsets[w] = n;
+      n += cnt;
+    }
+    if ( n > 0 && (parts[i].cmds = mem_alloc( n * sizeof( BL_Cmd))) == NULL) {
+      log_msg( CRIT, "BL_process: out of heap space\n");
+      goto out;
+    }
+    stats->lines += parts[i].lines;
+    stats->errors += parts[i].errors;
+  }
+
+  if ( data_sz > 0) 
+    run_threads( parse_cmd_part, parts, sizeof( BL_CmdPart), nbr_threads);
+
+  stats->parse_usec = get_time_micro() - parse_start;
+
+  for ( w = 0; w < nbr_threads; w++) {
+    workers[w].index_table = index_table;
+    workers[w].parts = parts;
+    workers[w].nbr_parts = nbr_threads;
+    workers[w].id = w;
+    workers[w].log = log;
+    workers[w].lsn = 0;
+    workers[w].stats = &stats->workers[w];
+  }
+
+  run_threads( apply_cmds, workers, sizeof( BL_Worker), nbr_threads);
+
+  uint64_t lsn = 0;
+  for ( w = 0; w < nbr_threads; w++) {
+    stats->errors += stats->workers[w].errors;
+    if ( workers[w].lsn > lsn) 
+      lsn = workers[w].lsn;
+  }
+
+  // one sync for all the workers
+  if ( lsn > 0 && WAL_sync( log, lsn) != SUCCESS) {
+    log_msg( ERR, "BL_process: failure to sync the log\n");
+    stats->errors++;
+  }
+  stats->usec = get_time_micro() - start_time;
+
+  log_msg( INFO, "BL_process: %ld commands, %ld errors from %s in %ld [usec], %.0f commands/s, parsed at %.0f MB/s, %d threads\n",
+	   stats->lines, stats->errors, fn, stats->usec, 
+	   stats->usec > 0 ? 1e6 * stats->lines / stats->usec : 0.0, 
+	   stats->parse_usec > 0 ? (double) stats->bytes / stats->parse_usec : 0.0, nbr_threads);
+
+  s = stats->errors > 0 ? FAILURE : SUCCESS;
+
+ out:
+  for ( i = 0; i < nbr_threads; i++) {
+    if ( parts[i].offsets != NULL) 
+      mem_free( parts[i].offsets);
+    if ( parts[i].cmds != NULL) 
+      mem_free( parts[i].cmds);
+  }
+  if ( data != NULL) 
+    munmap( data, data_sz);
+  return s;
+}
+
+static long per_sec( long n, long usec) {
+  return usec > 0 ? (long) (1e6 * n / usec) : 0;
+}
+
+JSON_Buffer BL_proc_stats_to_json( const int status, const BL_ProcStats *stats) {
+
+  JSON_Buffer json = json_new();
+  int w = 0;
+
+  json_begin_obj( json, NULL);
+  json_append_int( json, "status", status);
+  json_append_long( json, "lines", stats->lines);
+  json_append_long( json, "errors", stats->errors);
+  json_append_long( json, "usec", stats->usec);
+  json_append_long( json, "commands_per_sec", per_sec( stats->lines, stats->usec));
+  json_append_long( json, "bytes", stats->bytes);
+  json_append_long( json, "parse_usec", stats->parse_usec);
+  json_append_long( json, "parse_mb_per_sec", stats->parse_usec > 0 ? stats->bytes / stats->parse_usec : 0);
+
+  json_begin_arr( json, "workers");
+  for ( w = 0; w < stats->threads; w++) {
+    const BL_WorkerStats *ws = &stats->workers[w];
+    json_begin_obj( json, NULL);
+    json_append_long( json, "commands", ws->commands);
+    json_append_long( json, "errors", ws->errors);
+    json_append_long( json, "usec", ws->usec);
+    json_append_long( json, "commands_per_sec", per_sec( ws->commands, ws->usec));
+    json_end_obj( json);
+  }
+  json_end_arr( json);
+
+  json_end_obj( json);
+  return json;
+}
@@ -0,0 +1,91 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  bulk loading of an unsorted number/alias file. the file is parsed twice in
+  parallel: once to count the entries of each index slot, then to scatter them
+  into tables of exactly that size. each table is then sorted on its own,
+  merged with the entries already present and switched into the index.
+
+  batch files of add/del commands are applied by a pool of workers. each
+  worker owns the slots of a disjoint set of lock stripes, so the workers
+  never contend and the commands on a number keep their file order.
+  both append their mutations to a write-ahead log if one is given and sync
+  it once at the end. requires json.h, nlkup.h and wal.h.
+*/
+
+#ifndef _BULK_H_
+#define _BULK_H_
+
+#define BL_MAX_THREADS 64
+
+typedef struct {
+  long lines;      // lines with an entry
+  long errors;     // malformed lines, skipped
+  long entries;    // entries of the slots loaded, without duplicates
+  long usec;       // total time
+  int threads;
+} BL_Stats;
+
+// loads "number=alias" lines, "add=number=alias" as used by process_file()
+// is accepted too. later lines win over earlier ones and over entries already
+// in the index. nbr_threads <= 0 uses all cores.
+int BL_load( IdxTblEntry index_table[], const unsigned char *fn, int nbr_threads, WAL_Log *log, BL_Stats *stats);
+
+// bulk loads into the index, with the nbr of threads configured
+int nlkup_bulk_load( const unsigned char *fn, BL_Stats *stats);
+
+typedef struct {
+  long commands;   // commands applied
+  long errors;     // commands which failed
+  long usec;
+} BL_WorkerStats;
+
+typedef struct {
+  long lines;      // lines with a command
+  long errors;     // malformed lines and failed commands
+  long usec;       // total time
+  long bytes;      // file size
+  long parse_usec; // time to parse and bucket the commands, both passes
+  int threads;
+  BL_WorkerStats workers[BL_MAX_THREADS];
+} BL_ProcStats;
+
+// applies "add=number=alias" and "del=number" lines with nbr_threads workers,
+// nbr_threads <= 0 uses all cores. FAILURE if a line was malformed or failed.
+int BL_process( IdxTblEntry index_table[], const unsigned char *fn, int nbr_threads, WAL_Log *log, BL_ProcStats *stats);
+
+// the status and stats of BL_process() incl. throughput per worker
+JSON_Buffer BL_proc_stats_to_json( const int status, const BL_ProcStats *stats);
+
+// processing a file of add or del commands, with the nbr of threads configured
+int nlkup_process_file( const unsigned char *fn, BL_ProcStats *stats);
+
+#endif
@@ -31,7 +31,7 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
-int CFG_open( const char *fn);
+int CFG_init( const char *fn);
 
 int CFG_get_int( const char *key, int def_val);
 
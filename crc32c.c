@@ -0,0 +1,189 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined( __x86_64__)
+#include <immintrin.h>
+#define CRC_X86
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+
+// the crc32 instruction takes 3 cycles but can start every cycle: 3 streams
+// over consecutive spans are run at once and combined
+#define CRC_LONG 1024
+#define CRC_SHORT 64
+
+typedef uint32_t (*CrcFunc)( uint32_t crc, const unsigned char *cp, size_t len);
+
+static uint32_t table[8][256];
+
+// appending n zero bytes to a crc is linear: its 4 bytes are looked up
+static uint32_t long_zeros[4][256];  // n = CRC_LONG
+static uint32_t short_zeros[4][256]; // n = CRC_SHORT
+
+static void init_table() {
+  int i = 0;
+  int j = 0;
+  for ( i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for ( j = 0; j < 8; j++) {
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    }
+    table[0][i] = c;
+  }
+  for ( i = 0; i < 256; i++) {
+    for ( j = 1; j < 8; j++) {
+      table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xff];
+    }
+  }
+}
+
+static void init_zeros( uint32_t zeros[4][256], const size_t n) {
+  int i = 0;
+  int k = 0;
+  size_t j = 0;
+  for ( k = 0; k < 4; k++) {
+    for ( i = 0; i < 256; i++) {
+      uint32_t c = (uint32_t) i << (8 * k);
+      for ( j = 0; j < n; j++) {
+	c = (c >> 8) ^ table[0][c & 0xff];
+      }
+      zeros[k][i] = c;
+    }
+  }
+}
+
+static uint32_t shift_crc( uint32_t zeros[4][256], const uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ 
+    zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+// little endian hosts only slice, others go byte by byte
+static uint32_t crc32c_table( uint32_t crc, const unsigned char *cp, size_t len) {
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for ( ; len >= 8; len -= 8, cp += 8) {
+    uint64_t v;
+    memcpy( &v, cp, 8);
+    v ^= crc;
+    crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ 
+      table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^ 
+      table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ 
+      table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+  }
+#endif
+  for ( ; len > 0; len--, cp++) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *cp) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef CRC_X86
+
+// n bytes in each of 3 streams, crc continues the first
+__attribute__(( target( "sse4.2")))
+static uint32_t crc32c_3way( uint32_t crc, const unsigned char *cp, const size_t n, uint32_t zeros[4][256]) {
+
+  uint64_t c0 = crc;
+  uint64_t c1 = 0;
+  uint64_t c2 = 0;
+  const unsigned char *end = cp + n;
+  for ( ; cp < end; cp += 8) {
+    uint64_t v0, v1, v2;
+    memcpy( &v0, cp, 8);
+    memcpy( &v1, cp + n, 8);
+    memcpy( &v2, cp + 2 * n, 8);
+    c0 = _mm_crc32_u64( c0, v0);
+    c1 = _mm_crc32_u64( c1, v1);
+    c2 = _mm_crc32_u64( c2, v2);
+  }
+  crc = shift_crc( zeros, (uint32_t) c0) ^ (uint32_t) c1;
+  return shift_crc( zeros, crc) ^ (uint32_t) c2;
+}
+
+__attribute__(( target( "sse4.2")))
+static uint32_t crc32c_sse42( uint32_t crc, const unsigned char *cp, size_t len) {
+
+  for ( ; len >= 3 * CRC_LONG; len -= 3 * CRC_LONG, cp += 3 * CRC_LONG) {
+    crc = crc32c_3way( crc, cp, CRC_LONG, long_zeros);
+  }
+  for ( ; len >= 3 * CRC_SHORT; len -= 3 * CRC_SHORT, cp += 3 * CRC_SHORT) {
+    crc = crc32c_3way( crc, cp, CRC_SHORT, short_zeros);
+  }
+
+  uint64_t c = crc;
+  for ( ; len >= 8; len -= 8, cp += 8) {
+    uint64_t v;
+    memcpy( &v, cp, 8);
+    c = _mm_crc32_u64( c, v);
+  }
+  crc = (uint32_t) c;
+  for ( ; len > 0; len--, cp++) {
+    crc = _mm_crc32_u8( crc, *cp);
+  }
+  return crc;
+}
+
+#endif
+
+static CrcFunc crc_func = crc32c_table;
+static const char *impl_name = "table";
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void select_impl() {
+  init_table();
+#ifdef CRC_X86
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "sse4.2")) {
+    init_zeros( long_zeros, CRC_LONG);
+    init_zeros( short_zeros, CRC_SHORT);
+    crc_func = crc32c_sse42;
+    impl_name = "sse4.2";
+  }
+#endif
+}
+
+uint32_t CRC_crc32c( uint32_t crc, const void *data, size_t len) {
+  pthread_once( &once, select_impl);
+  return ~crc_func( ~crc, (const unsigned char *) data, len);
+}
+
+const char *CRC_impl_name() {
+  pthread_once( &once, select_impl);
+  return impl_name;
+}
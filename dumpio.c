@@ -0,0 +1,416 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "logger.h"
+#include "json.h"
+#include "utils.h"
+#include "nlkup.h"
+#include "dumpio.h"
+
+// request latency, shared with forked checkpoints which go on pacing by it
+typedef struct {
+  long latency_usec;   // moving average
+  long latency_time;   // when the last request was done
+} DW_Shared;
+
+// private until DW_init() maps the shared one, and if mapping it fails
+static DW_Shared local_shared;
+static DW_Shared *shared = &local_shared;
+
+static long rate_limit = 0;    // bytes per second of all writers, 0 for none
+static long backoff_limit = 0; // request latency to back off at, 0 for never
+static int use_direct = FALSE;
+
+// the next write of any writer may start at pace_next
+static pthread_mutex_t pace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long pace_next = 0;
+
+struct DW_Writer {
+  int fd;                  // -1 if writing stream f
+  FILE *f;
+  int direct;              // O_DIRECT is still set
+  long start;
+  unsigned char *bufs[DW_NBR_BUFFERS];
+  int cur;                 // the buffer being filled, not queued
+  long cur_len;
+  long offset;             // in the file of buffer cur
+  long backoff;            // pause per buffer, writer thread only
+  pthread_t thread;
+  int thread_running;
+
+  pthread_mutex_t mutex;   // everything below
+  pthread_cond_t cond;
+  long lens[DW_NBR_BUFFERS];
+  long offsets[DW_NBR_BUFFERS];
+  int head;                // buffers [head, head+queued) wait to be written, in order
+  int queued;
+  int stop;
+  int failed;
+  DW_Stats stats;
+};
+
+// a forked child may have got the pace mutex locked by a thread of its parent
+static void reset_after_fork( void) {
+  pthread_mutex_init( &pace_mutex, NULL);
+}
+
+void DW_init( const long rate_mb, const long backoff_usec, const int direct) {
+
+  static int initialized = FALSE;
+
+  rate_limit = rate_mb * 1024 * 1024;
+  backoff_limit = backoff_usec;
+  use_direct = direct;
+
+  if ( initialized) 
+    return;
+  initialized = TRUE;
+
+  void *p = mmap( NULL, sizeof( DW_Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if ( p == MAP_FAILED) {
+    log_msg( ERR, "DW_init: mmap failed, forked checkpoints don't see request latency\n");
+  } else {
+    shared = p;
+  }
+  pthread_atfork( NULL, NULL, reset_after_fork);
+}
+
+void DW_note_latency( const long usec) {
+  // racy, a lost update does not matter
+  long avg = __atomic_load_n( &shared->latency_usec, __ATOMIC_RELAXED);
+  __atomic_store_n( &shared->latency_usec, avg + (usec - avg) / 8, __ATOMIC_RELAXED);
+  __atomic_store_n( &shared->latency_time, get_time_micro(), __ATOMIC_RELAXED);
+}
+
+static void sleep_usec( const long usec) {
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while ( nanosleep( &ts, &ts) < 0 && errno == EINTR) 
+    ;
+}
+
+// waits before bytes are written as long as the rate ceiling and the request
+// latency ask for. returns the usec waited.
+static long pace( DW_Writer *w, const long bytes) {
+
+  long now = get_time_micro();
+  long waited = 0;
+
+  if ( rate_limit > 0) {
+    pthread_mutex_lock( &pace_mutex);
+    long start = pace_next > now ? pace_next : now;
+    pace_next = start + bytes * 1000000 / rate_limit;
+    pthread_mutex_unlock( &pace_mutex);
+    waited = start - now;
+  }
+
+  // pauses double while requests are slow and halve when they are not
+  if ( backoff_limit > 0) {
+    long age = now - __atomic_load_n( &shared->latency_time, __ATOMIC_RELAXED);
+    if ( age < DW_LATENCY_MAX_AGE_USEC && __atomic_load_n( &shared->latency_usec, __ATOMIC_RELAXED) > backoff_limit) {
+      w->backoff = w->backoff == 0 ? DW_MIN_BACKOFF_USEC : 2 * w->backoff;
+      if ( w->backoff > DW_MAX_BACKOFF_USEC) 
+	w->backoff = DW_MAX_BACKOFF_USEC;
+    } else {
+      w->backoff = w->backoff / 2 < DW_MIN_BACKOFF_USEC ? 0 : w->backoff / 2;
+    }
+    waited += w->backoff;
+  }
+
+  if ( waited > 0) 
+    sleep_usec( waited);
+  return waited;
+}
+
+static int write_all( const int fd, const unsigned char *data, long len, long offset) {
+  while ( len > 0) {
+    ssize_t n = pwrite( fd, data, len, offset);
+    if ( n < 0 && errno == EINTR) 
+      continue;
+    if ( n <= 0) 
+      return FAILURE;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return SUCCESS;
+}
+
+// writes the queued buffers in order
+static void *writer_thread( void *arg) {
+
+  DW_Writer *w = (DW_Writer *) arg;
+
+  pthread_mutex_lock( &w->mutex);
+  for ( ;;) {
+    while ( w->queued == 0 && !w->stop) 
+      pthread_cond_wait( &w->cond, &w->mutex);
+    if ( w->queued == 0) 
+      break;
+
+    int i = w->head;
+    long len = w->lens[i];
+    long offset = w->offsets[i];
+    pthread_mutex_unlock( &w->mutex);
+
+    long waited = pace( w, len);
+    int s = write_all( w->fd, w->bufs[i], len, offset);
+
+    pthread_mutex_lock( &w->mutex);
+    if ( s != SUCCESS && !w->failed) {
+      log_msg( ERR, "DW_Writer: write failed: %s\n", strerror( errno));
+      w->failed = TRUE;
+    }
+    w->stats.bytes += s == SUCCESS ? len : 0;
+    w->stats.throttled_usec += waited;
+    w->head = (i + 1) % DW_NBR_BUFFERS;
+    w->queued--;
+    pthread_cond_broadcast( &w->cond);
+  }
+  pthread_mutex_unlock( &w->mutex);
+
+  return NULL;
+}
+
+static void free_writer( DW_Writer *w) {
+  int i = 0;
+  for ( i = 0; i < DW_NBR_BUFFERS; i++) {
+    free( w->bufs[i]);
+  }
+  if ( w->fd >= 0) 
+    close( w->fd);
+  pthread_mutex_destroy( &w->mutex);
+  pthread_cond_destroy( &w->cond);
+  free( w);
+}
+
+static DW_Writer *new_writer() {
+
+  DW_Writer *w = calloc( 1, sizeof( DW_Writer));
+  if ( w == NULL) {
+    log_msg( CRIT, "DW_open: out of heap space\n");
+    return NULL;
+  }
+  w->fd = -1;
+  w->start = get_time_micro();
+  pthread_mutex_init( &w->mutex, NULL);
+  pthread_cond_init( &w->cond, NULL);
+  return w;
+}
+
+DW_Writer *DW_open( const char *fn) {
+
+  DW_Writer *w = new_writer();
+  if ( w == NULL) 
+    return NULL;
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if ( use_direct) {
+    w->fd = open( fn, flags | O_DIRECT, 0666);
+    w->direct = w->fd >= 0;
+    if ( w->fd < 0 && errno == EINVAL) 
+      log_msg( INFO, "DW_open: no O_DIRECT for %s\n", fn);
+  }
+  if ( w->fd < 0) 
+    w->fd = open( fn, flags, 0666);
+  if ( w->fd < 0) {
+    log_msg( ERR, "DW_open: failure to write-open %s\n", fn);
+    goto fail;
+  }
+  w->stats.direct = w->direct;
+
+  int i = 0;
+  for ( i = 0; i < DW_NBR_BUFFERS; i++) {
+    if ( posix_memalign( (void **) &w->bufs[i], DW_ALIGN, DW_BUFFER_SIZE) != 0) {
+      w->bufs[i] = NULL;
+      log_msg( CRIT, "DW_open: out of heap space\n");
+      goto fail;
+    }
+  }
+
+  if ( pthread_create( &w->thread, NULL, writer_thread, w) != 0) {
+    log_msg( ERR, "DW_open: pthread_create failed\n");
+    goto fail;
+  }
+  w->thread_running = TRUE;
+  return w;
+
+ fail:
+  free_writer( w);
+  return NULL;
+}
+
+DW_Writer *DW_open_stream( FILE *f) {
+  DW_Writer *w = new_writer();
+  if ( w != NULL) 
+    w->f = f;
+  return w;
+}
+
+unsigned char *DW_space( DW_Writer *w, const long len) {
+  if ( w->fd < 0 || w->cur_len + len > DW_BUFFER_SIZE) 
+    return NULL;
+  return w->bufs[w->cur] + w->cur_len;
+}
+
+// queues the current buffer and waits until the next one is free
+static int submit( DW_Writer *w) {
+
+  pthread_mutex_lock( &w->mutex);
+  w->lens[w->cur] = w->cur_len;
+  w->offsets[w->cur] = w->offset;
+  w->queued++;
+  pthread_cond_broadcast( &w->cond);
+  while ( w->queued == DW_NBR_BUFFERS) 
+    pthread_cond_wait( &w->cond, &w->mutex);
+  int s = w->failed ? FAILURE : SUCCESS;
+  pthread_mutex_unlock( &w->mutex);
+
+  w->cur = (w->cur + 1) % DW_NBR_BUFFERS;
+  w->offset += w->cur_len;
+  w->cur_len = 0;
+  return s;
+}
+
+int DW_commit( DW_Writer *w, const long len) {
+  w->cur_len += len;
+  return w->cur_len == DW_BUFFER_SIZE ? submit( w) : SUCCESS;
+}
+
+int DW_write( DW_Writer *w, const void *data, const long len) {
+
+  if ( w->fd < 0) {
+    if ( fwrite( data, 1, len, w->f) != len) 
+      return FAILURE;
+    w->stats.bytes += len;
+    return SUCCESS;
+  }
+
+  const unsigned char *cp = data;
+  long left = len;
+  while ( left > 0) {
+    long n = DW_BUFFER_SIZE - w->cur_len;
+    if ( n > left) 
+      n = left;
+    memcpy( w->bufs[w->cur] + w->cur_len, cp, n);
+    cp += n;
+    left -= n;
+    if ( DW_commit( w, n) != SUCCESS) 
+      return FAILURE;
+  }
+  return SUCCESS;
+}
+
+// waits for the queued buffers, then writes the partly filled one itself.
+// O_DIRECT is turned off for it: its end is not aligned.
+static int flush( DW_Writer *w) {
+
+  pthread_mutex_lock( &w->mutex);
+  while ( w->queued > 0) 
+    pthread_cond_wait( &w->cond, &w->mutex);
+  int s = w->failed ? FAILURE : SUCCESS;
+  pthread_mutex_unlock( &w->mutex);
+
+  if ( w->direct) {
+    fcntl( w->fd, F_SETFL, fcntl( w->fd, F_GETFL) & ~O_DIRECT);
+    w->direct = FALSE;
+  }
+
+  if ( s == SUCCESS && w->cur_len > 0) {
+    w->stats.throttled_usec += pace( w, w->cur_len);
+    s = write_all( w->fd, w->bufs[w->cur], w->cur_len, w->offset);
+    if ( s == SUCCESS) 
+      w->stats.bytes += w->cur_len;
+    w->offset += w->cur_len;
+    w->cur_len = 0;
+  }
+  return s;
+}
+
+int DW_pwrite( DW_Writer *w, const void *data, const long len, const long offset) {
+
+  if ( w->fd < 0) {
+    if ( fseek( w->f, offset, SEEK_SET) < 0 || fwrite( data, 1, len, w->f) != len || 
+	 fseek( w->f, 0, SEEK_END) < 0) 
+      return FAILURE;
+    w->stats.bytes += len;
+    return SUCCESS;
+  }
+
+  if ( flush( w) != SUCCESS || write_all( w->fd, data, len, offset) != SUCCESS) 
+    return FAILURE;
+  w->stats.bytes += len;
+  return SUCCESS;
+}
+
+int DW_close( DW_Writer *w, const int sync, DW_Stats *stats) {
+
+  int s = SUCCESS;
+
+  if ( w->fd < 0) {
+    if ( sync && (fflush( w->f) != 0 || fsync( fileno( w->f)) < 0)) 
+      s = FAILURE;
+  } else {
+    s = flush( w);
+
+    pthread_mutex_lock( &w->mutex);
+    w->stop = TRUE;
+    pthread_cond_broadcast( &w->cond);
+    pthread_mutex_unlock( &w->mutex);
+    if ( w->thread_running) 
+      pthread_join( w->thread, NULL);
+
+    if ( s == SUCCESS && sync && fsync( w->fd) < 0) 
+      s = FAILURE;
+    if ( close( w->fd) < 0) 
+      s = FAILURE;
+    w->fd = -1;
+  }
+
+  w->stats.usec = get_time_micro() - w->start;
+  if ( stats != NULL) 
+    *stats = w->stats;
+
+  free_writer( w);
+  return s;
+}
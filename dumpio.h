@@ -0,0 +1,88 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  writing dumps without stalling requests. dump_range_v2() copies blocks into
+  large aligned buffers while their slot is locked, a writer thread per file
+  pwrite()s the filled buffers, optionally with O_DIRECT to keep them out of
+  the page cache. all writers together stay below a MB/s ceiling and back off
+  while requests get slow.
+*/
+
+#ifndef _DUMPIO_H_
+#define _DUMPIO_H_
+
+#include <stdio.h>
+
+#define DW_BUFFER_SIZE (1 << 20)
+#define DW_NBR_BUFFERS 4
+#define DW_ALIGN 4096                  // of buffers and O_DIRECT writes
+#define DW_MIN_BACKOFF_USEC 1000       // pause per buffer, doubled while requests are slow
+#define DW_MAX_BACKOFF_USEC 100000
+#define DW_LATENCY_MAX_AGE_USEC 1000000 // older request latencies don't count
+
+typedef struct {
+  long bytes;            // written
+  long usec;             // from open to close
+  long throttled_usec;   // waited for the rate ceiling or backed off
+  int direct;            // TRUE if O_DIRECT was used
+} DW_Stats;
+
+typedef struct DW_Writer DW_Writer;
+
+// rate_mb is the MB/s ceiling of all writers, 0 for none. while the average
+// request latency is above backoff_usec writers pause, 0 for never. with
+// direct files are written with O_DIRECT if the file system allows.
+void DW_init( const long rate_mb, const long backoff_usec, const int direct);
+
+// the latency of a request just served, in usec. cheap, called per request.
+void DW_note_latency( const long usec);
+
+// creates file fn and starts its writer thread. NULL if that failed.
+DW_Writer *DW_open( const char *fn);
+// writes to stream f instead, synchronously and without buffering of its own
+DW_Writer *DW_open_stream( FILE *f);
+
+// room for len bytes at the end of the current buffer, NULL if there is not
+// as much. never waits, it may be called with a slot locked.
+unsigned char *DW_space( DW_Writer *w, const long len);
+// appends the len bytes put into DW_space(). may wait for a free buffer.
+int DW_commit( DW_Writer *w, const long len);
+// appends len bytes of data. may wait for a free buffer.
+int DW_write( DW_Writer *w, const void *data, const long len);
+// writes len bytes at offset once all appended is written, for headers
+int DW_pwrite( DW_Writer *w, const void *data, const long len, const long offset);
+
+// writes out what is left and stops the writer, with sync the file is on
+// disk then. the stream of DW_open_stream() stays open. FAILURE if anything
+// could not be written.
+int DW_close( DW_Writer *w, const int sync, DW_Stats *stats);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  epoch based reclamation. each reading thread owns a cache-line sized slot
+  holding the global epoch it observed when entering a read-side section (or 0
+  when quiescent). retired storage is tagged with the epoch of its retirement
+  and freed once all active readers have moved past that epoch.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mem.h"
+#include "logger.h"
+#include "epoch.h"
+
+// reclaim once that many items are pending
+#define EP_RECLAIM_THRESHOLD 64
+
+typedef struct {
+  unsigned long epoch;  // epoch observed by reader, 0 if not reading
+  char in_use;          // slot owned by a thread
+  char pad[64 - sizeof( unsigned long) - sizeof( char)];
+} EP_ReaderSlot;
+
+typedef struct _ep_retired {
+  struct _ep_retired *next;
+  void *ptr;
+  EP_FreeFunc free_fn;
+  unsigned long epoch;  // global epoch at time of retirement
+} EP_Retired;
+
+static EP_ReaderSlot readers[EP_MAX_READERS] __attribute__ ((aligned (64)));
+
+static unsigned long global_epoch = 1;
+
+static pthread_mutex_t ep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static EP_Retired *retired_list = NULL;
+static int retired_cnt = 0;
+
+// per thread reader slot. released when the thread exits.
+static __thread int my_slot = -1;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+static void release_slot( void *arg) {
+  int slot = (int) (long) arg - 1;
+  if ( slot < 0 || slot >= EP_MAX_READERS) 
+    return;
+  __atomic_store_n( &readers[slot].epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n( &readers[slot].in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_slot_key() {
+  pthread_key_create( &slot_key, release_slot);
+}
+
+static int acquire_slot() {
+
+  pthread_once( &slot_key_once, make_slot_key);
+
+  int i = 0;
+  for ( i = 0; i < EP_MAX_READERS; i++) {
+    char expected = 0;
+    if ( __atomic_compare_exchange_n( &readers[i].in_use, &expected, 1, 0,
+				      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      // key value is slot+1 since the destructor is not called for NULL values
+      pthread_setspecific( slot_key, (void *) (long) (i+1));
+      return i;
+    }
+  }
+  return -1;
+}
+
+int EP_enter() {
+
+  if ( my_slot < 0) {
+    if (( my_slot = acquire_slot()) < 0) {
+      return -1;
+    }
+  }
+
+  EP_ReaderSlot *r = &readers[my_slot];
+  unsigned long e = __atomic_load_n( &global_epoch, __ATOMIC_SEQ_CST);
+
+  // announce epoch before reading any shared pointer
+  __atomic_store_n( &r->epoch, e, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence( __ATOMIC_SEQ_CST);
+
+  return my_slot;
+}
+
+void EP_leave( int h) {
+  assert( h >= 0 && h < EP_MAX_READERS);
+  __atomic_store_n( &readers[h].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// smallest epoch of any active reader or ~0 if none is reading
+static unsigned long min_reader_epoch() {
+  unsigned long min_epoch = ~0UL;
+  int i = 0;
+  for ( i = 0; i < EP_MAX_READERS; i++) {
+    unsigned long e = __atomic_load_n( &readers[i].epoch, __ATOMIC_SEQ_CST);
+    if ( e != 0 && e < min_epoch) {
+      min_epoch = e;
+    }
+  }
+  return min_epoch;
+}
+
+// mutex must be held
+static int reclaim_locked() {
+
+  unsigned long min_epoch = min_reader_epoch();
+  int cnt = 0;
+
+  EP_Retired **pp = &retired_list;
+  while ( *pp != NULL) {
+    EP_Retired *r = *pp;
+    if ( r->epoch < min_epoch) { // no reader can see this one anymore
+      *pp = r->next;
+      r->free_fn( r->ptr);
+      free( r);
+      retired_cnt--;
+      cnt++;
+    } else {
+      pp = &r->next;
+    }
+  }
+  return cnt;
+}
+
+void EP_retire( void *ptr, EP_FreeFunc free_fn) {
+
+  if ( ptr == NULL) 
+    return;
+
+  EP_Retired *r = calloc( 1, sizeof( EP_Retired));
+  if ( r == NULL) {
+    log_msg( CRIT, "EP_retire: out of heap space\n");
+    return; // leak rather than free storage a reader may use
+  }
+  r->ptr = ptr;
+  r->free_fn = free_fn;
+
+  pthread_mutex_lock( &ep_mutex);
+
+  // the storage has been unlinked before we get here. readers which observe
+  // a later epoch can not reach it any longer.
+  __atomic_thread_fence( __ATOMIC_SEQ_CST);
+  r->epoch = __atomic_fetch_add( &global_epoch, 1, __ATOMIC_SEQ_CST);
+
+  r->next = retired_list;
+  retired_list = r;
+  retired_cnt++;
+
+  if ( retired_cnt >= EP_RECLAIM_THRESHOLD) {
+    reclaim_locked();
+  }
+
+  pthread_mutex_unlock( &ep_mutex);
+}
+
+int EP_reclaim() {
+  pthread_mutex_lock( &ep_mutex);
+  int cnt = reclaim_locked();
+  pthread_mutex_unlock( &ep_mutex);
+  return cnt;
+}
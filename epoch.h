@@ -0,0 +1,59 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  epoch based deferred freeing of storage which lock-free readers may still be
+  looking at. readers announce themselves with EP_enter() / EP_leave(), writers
+  hand storage they unlinked to EP_retire() instead of freeing it right away.
+*/
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+// max nbr of threads which can concurrently read without locking
+#define EP_MAX_READERS 512
+
+// a free function for retired storage
+typedef void (*EP_FreeFunc)( void *ptr);
+
+// enter a read-side section. returns a handle >= 0 or -1 if no reader slot is
+// available, in which case the caller must fall back to locking.
+int EP_enter();
+
+// leave the read-side section entered with handle h
+void EP_leave( int h);
+
+// free ptr once no reader can reference it any longer
+void EP_retire( void *ptr, EP_FreeFunc free_fn);
+
+// frees all retired storage which is no longer referenced. returns # of freed items
+int EP_reclaim();
+
+#endif
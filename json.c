@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <assert.h>
 
+#include "mem.h"
 #include "json.h"
 
 #define JSON_OBJECT 1
@@ -35,13 +36,16 @@ JSON_Buffer json_new() {
   j->buf = calloc( sizeof( char), JSON_BUFR_SZ);
   j->buf_sz = JSON_BUFR_SZ;
   j->level_top = j->buf_cnt = 0;
+  mem_count( MEM_JSON, sizeof( JSON_BufferStruct) + JSON_BUFR_SZ);
   return j;
 }
 
-// free storage. if with_buffer the string buffer is freed.
+// free storage. if with_buffer the string buffer is freed, else it's
+// owned by the caller and no longer counted as JSON memory.
 void json_free( JSON_Buffer b, int with_buffer) {
   JSON_BufferStruct *j = (JSON_BufferStruct *) b;
   assert( j->level_top == 0);
+  mem_count( MEM_JSON, -(long) (sizeof( JSON_BufferStruct) + j->buf_sz));
   if ( with_buffer) {
     free( j->buf);
     j->buf = NULL;
@@ -67,6 +71,7 @@ static int grow_bufr( JSON_BufferStruct *j) {
     free( j->buf);
     j->buf = nb;
     j->buf_sz += JSON_BUFR_SZ;
+    mem_count( MEM_JSON, JSON_BUFR_SZ);
     return 0;
 }
 
@@ -190,6 +195,18 @@ int json_append_int( JSON_Buffer b, const char *name, const int val) {
 
 }
 
+int json_append_long( JSON_Buffer b, const char *name, const long val) {
+
+  char l_buf[64];
+  memset( l_buf, 0, sizeof( l_buf));
+  if ( snprintf( l_buf, sizeof( l_buf), "%ld", val) < 0) {
+    return -1;
+  }
+
+  return json_append_str( b, name, l_buf);
+
+}
+
 int json_append_str( JSON_Buffer b, const char *name, const char *val) {
   JSON_BufferStruct *j = (JSON_BufferStruct *) b;
 
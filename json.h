@@ -46,6 +46,7 @@ int json_begin_obj( JSON_Buffer b, const char *name);
 int json_end_obj( JSON_Buffer b);
 
 int json_append_int( JSON_Buffer b, const char *name, const int val);
+int json_append_long( JSON_Buffer b, const char *name, const long val);
 int json_append_str( JSON_Buffer b, const char *name, const char *val);
 
 #define JSON_APP_INT_ARR( b, val) json_append_int( b, NULL, val)
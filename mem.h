@@ -30,12 +30,40 @@
 #ifndef _MEM_H_
 #define _MEM_H_
 
+#include <stddef.h>
+
+// what memory is used for. each thread counts its allocations and frees per
+// category, the counts are only summed up when asked for.
+typedef enum {
+  MEM_OTHER = 0,
+  MEM_INDEX,          // index directory and lock stripes
+  MEM_BLOCK_HEADERS,  // lookup tables
+  MEM_ENTRY_ARRAYS,   // key and alias arrays
+  MEM_BTREE_NODES,    // B+tree blocks
+  MEM_SESSIONS,
+  MEM_JSON,           // JSON buffers being built
+  MEM_REQUESTS,       // request info and POST parameters
+  MEM_REVERSE_INDEX,  // alias to numbers index
+  MEM_NBR_CATEGORIES
+} MEM_Category;
+
 // allocating memory on heap (malloc())
 void *mem_alloc( size_t sz);
 
+// allocating memory on heap and counting it under cat
+void *mem_alloc_cat( size_t sz, MEM_Category cat);
+
 // freeing memory on heap (free())
 void mem_free( void *ptr);
 
+// counting storage which is not from mem_alloc(), delta < 0 when freed
+void mem_count( MEM_Category cat, long delta);
+
+// returns bytes counted under cat
+long mem_usage_cat( MEM_Category cat);
+
+const char *mem_category_name( MEM_Category cat);
+
 // returns heap space used by application in # bytes
 long mem_usage();
 
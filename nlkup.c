@@ -4,134 +4,187 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <ctype.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "mem.h"
 #include "logger.h"
 #include "json.h"
 #include "utils.h"
+#include "config.h"
+#include "epoch.h"
+#include "slab.h"
+#include "search.h"
 #include "nlkup.h"
-
-static LkupTblEntry *alloc_lkup_tbl_entry() {
-  LkupTblEntry *e = mem_alloc( sizeof( LkupTblEntry));
-  memset( (void *) e, 0, sizeof( LkupTblEntry));
-  return e;
+#include "btree.h"
+#include "wal.h"
+#include "bulk.h"
+#include "dumpio.h"
+#include "rindex.h"
+
+// lock-free lookups give up after that many collisions with writers and lock
+#define MAX_OPTIMISTIC_READS 8
+#define OPTIMISTIC_READ_FAILED -100
+
+// batched searches: keys of one slot searched under one version or lock, and
+// how many slots ahead the slot, block header and keys are prefetched
+#define BATCH_CHUNK 64
+#define PREFETCH_SLOT_DIST 12
+#define PREFETCH_TBL_DIST 6
+#define PREFETCH_KEYS_DIST 3
+
+// blocks with more entries are kept in a B+tree
+static long btree_threshold = DEF_BTREE_THRESHOLD;
+
+// numbers by alias, NULL if disabled by "reverse_index"
+static RX_Index *reverse_index = NULL;
+
+#define ENTRY_SIZE (sizeof( LkupKey) + sizeof( LkupAlias))
+
+// nbr of entries which fit into the slab size class needed for n entries
+static unsigned long class_capacity( const unsigned long n) {
+  return SL_class_size( n * ENTRY_SIZE) / ENTRY_SIZE;
 }
 
-static void free_lkup_tbl_entry( LkupTblEntry *e) {
-  memset( e, 0, sizeof( LkupTblEntry));
-  mem_free( e);
+// slab storage of blocks is counted under its memory category
+static void *alloc_counted( size_t sz, MEM_Category cat) {
+  void *p = SL_alloc( sz);
+  if ( p != NULL) 
+    mem_count( cat, SL_size( p));
+  return p;
 }
 
-// creates a copy of given lookup table
-static LkupTbl *copy_lkup_tbl( LkupTbl *old_t) {
-  if ( old_t == NULL) 
-    return NULL;
+static void free_entry_arrays( void *p) {
+  mem_count( MEM_ENTRY_ARRAYS, -(long) SL_size( p));
+  SL_free( p);
+}
 
-  LkupTbl *t = mem_alloc( sizeof( LkupTbl));
+static void free_block_header( void *p) {
+  mem_count( MEM_BLOCK_HEADERS, -(long) SL_size( p));
+  SL_free( p);
+}
 
-  t->table_sz = old_t->table_sz;
-  t->table_len = old_t->table_len; // used entry count
+// the snapshot stays mapped until the last reader of its tables is done
+static void free_mapped_block_header( void *p) {
+  unref_snap_map( ((LkupTbl *) p)->map);
+  free_block_header( p);
+}
 
-  t->table = mem_alloc( t->table_sz * sizeof( LkupTblEntry));
-  memcpy( t->table, old_t->table, t->table_len * sizeof( LkupTblEntry));
+// allocates key and alias arrays of a table as one chunk, keys first. the
+// table gets all entries its size class can hold, at least table_sz.
+// the old arrays, if any, are left to the caller.
+static void alloc_table_arrays( LkupTbl *t, const unsigned long table_sz) {
+  unsigned long sz = class_capacity( table_sz);
+  unsigned char *cp = alloc_counted( sz * ENTRY_SIZE, MEM_ENTRY_ARRAYS);
+  t->keys = (LkupKey *) cp;
+  t->aliases = (LkupAlias *) (cp + sz * sizeof( LkupKey));
+  t->table_sz = sz;
+}
 
-  return t;
-  
+// copies entries [from..from+len) of src into dst starting at dst_idx
+static void copy_table_entries( LkupTbl *dst, const int dst_idx, const LkupTbl *src, const int from, const int len) {
+  if ( len <= 0) 
+    return;
+  memcpy( &dst->keys[dst_idx], &src->keys[from], len * sizeof( LkupKey));
+  memcpy( &dst->aliases[dst_idx], &src->aliases[from], len * sizeof( LkupAlias));
 }
 
-// allocates an empty lookup table
-static LkupTbl *alloc_lkup_tbl() {
-  LkupTbl *t = mem_alloc( sizeof( LkupTbl));
+// allocates an empty lookup table with room for table_sz entries
+LkupTbl *new_lkup_tbl( const unsigned long table_sz) {
+  LkupTbl *t = alloc_counted( sizeof( LkupTbl), MEM_BLOCK_HEADERS);
 
-  t->table_sz = DEF_LKUP_BLK_SIZE;
+  alloc_table_arrays( t, table_sz);
   t->table_len = 0; // used entry count
 
-  int tbl_sz = t->table_sz * sizeof( LkupTblEntry);
-  // fprintf( stderr, "table size = %d [bytes]\n", tbl_sz);
-
-  t->table = mem_alloc( tbl_sz);
- 
   return t;
 }
 
-// copying [from..to] from origin table into a newly allocated table
-static LkupTbl *copy_lkup_tbl_range( LkupTbl *origin, int from_idx, int to_idx) {
-  
-  if ( to_idx - 1 <= from_idx) {
-    return NULL;
-  }
-
-  LkupTbl *t = mem_alloc( sizeof( LkupTbl));
-
-  t->table_sz = to_idx - from_idx + 1;
-  t->table_len = t->table_sz;
-
-  int tbl_sz = t->table_sz * sizeof( LkupTblEntry);
-  // fprintf( stderr, "table size = %d [bytes]\n", tbl_sz);
+LkupTbl *new_mapped_lkup_tbl( SnapMap *map, LkupKey *keys, LkupAlias *aliases, const unsigned long len) {
+  LkupTbl *t = alloc_counted( sizeof( LkupTbl), MEM_BLOCK_HEADERS);
 
-  t->table = mem_alloc( tbl_sz);
-  
-  int i = 0;
-  for ( i = from_idx; i <= to_idx; i++) {
-    t->table[i-from_idx] = origin->table[i];
-  }
+  ref_snap_map( map);
+  t->map = map;
+  t->keys = keys;
+  t->aliases = aliases;
+  t->table_sz = t->table_len = len;
 
   return t;
 }
 
-static void grow_table( LkupTbl *t) {
+long get_lkup_tbl_entries( LkupTbl *t, const long from, const long len, LkupKey keys[], LkupAlias aliases[]) {
 
-  assert( t->table_sz <= t->table_len);
+  if ( t->tree != NULL) {
+    return BT_copy( t->tree, from, len, keys, aliases);
+  }
 
-  int tbl_sz = (t->table_sz + DEF_LKUP_BLK_SIZE) * sizeof( LkupTblEntry); // bytes
-  int old_tbl_sz = t->table_sz * sizeof( LkupTblEntry);
-  LkupTblEntry *nt = mem_alloc( tbl_sz);
+  long n = t->table_len - from;
+  if ( n > len) 
+    n = len;
+  if ( from < 0 || n <= 0) 
+    return 0;
 
-  // copy old table
-  if ( t->table_sz > 0) {
-    memcpy( nt, t->table, old_tbl_sz);
-  }
+  memcpy( keys, &t->keys[from], n * sizeof( LkupKey));
+  memcpy( aliases, &t->aliases[from], n * sizeof( LkupAlias));
+  return n;
+}
+
+// creates a copy of given lookup table
+static LkupTbl *copy_lkup_tbl( LkupTbl *old_t) {
+  if ( old_t == NULL) 
+    return NULL;
 
-  // clear out upper part of new table
-  unsigned char *cp = (unsigned char *) nt;
-  cp += t->table_sz * sizeof( LkupTblEntry);  // bytes...
-  memset( cp, 0, tbl_sz - old_tbl_sz);
+  // copies are always arrays
+  LkupTbl *t = new_lkup_tbl( old_t->tree != NULL ? old_t->table_len : old_t->table_sz);
 
-  if ( t->table != NULL) {
-    mem_free( t->table);
-    t->table = NULL;
-  }
+  // used entry count
+  t->table_len = get_lkup_tbl_entries( old_t, 0, old_t->table_len, t->keys, t->aliases);
 
-  t->table = nt;
-  t->table_sz = t->table_sz + DEF_LKUP_BLK_SIZE; // # of records
+  return t;
   
 }
 
-static void shrink_table( LkupTbl *t) {
+// allocates an empty lookup table
+static LkupTbl *alloc_lkup_tbl() {
+  return new_lkup_tbl( DEF_LKUP_BLK_SIZE);
+}
 
-  assert( t->table_sz >= t->table_len + DEF_LKUP_BLK_SIZE);
+// switching to arrays of size new_sz. lock-free readers may still be searching
+// the old arrays which are freed once no reader can use them any longer.
+static void resize_table( LkupTbl *t, const unsigned long new_sz) {
 
-  int new_tbl_sz = (t->table_sz - DEF_LKUP_BLK_SIZE) * sizeof( LkupTblEntry); // bytes
-  int old_tbl_len = t->table_len * sizeof( LkupTblEntry);
+  assert( new_sz >= t->table_len);
 
-  LkupTblEntry *nt = mem_alloc( new_tbl_sz);
+  LkupTbl nt;
+  alloc_table_arrays( &nt, new_sz);
+  copy_table_entries( &nt, 0, t, 0, t->table_len);
 
-  // copy old table into new.
-  memcpy( nt, t->table, old_tbl_len);
+  LkupKey *old_keys = t->keys;
 
-  // ensure new table is zeroed out if spare space
-  if ( new_tbl_sz > old_tbl_len) {
-    unsigned char *cp = (unsigned char *) nt;
-    cp += old_tbl_len;
-    memset( cp, 0, new_tbl_sz - old_tbl_len);
-  }
+  t->keys = nt.keys;
+  t->aliases = nt.aliases;
+  t->table_sz = nt.table_sz; // # of records
+
+  EP_retire( old_keys, free_entry_arrays);
+}
 
-  // switch tables and adjust size
-  mem_free( t->table);
-  t->table = nt;
-  t->table_sz -= DEF_LKUP_BLK_SIZE;
+// moves up to the next size class
+static void grow_table( LkupTbl *t) {
+  assert( t->table_sz <= t->table_len);
+  resize_table( t, t->table_sz + 1);
+}
 
+// moves down to a smaller size class once the entries fit into half of the current one
+static void shrink_table( LkupTbl *t) {
+  unsigned long new_sz = class_capacity( t->table_len + DEF_LKUP_BLK_SIZE);
+  if ( 2 * new_sz * ENTRY_SIZE <= SL_class_size( t->table_sz * ENTRY_SIZE)) {
+    resize_table( t, new_sz);
+  }
 }
 
 static void shift_table_up( LkupTbl *t, int idx) {
@@ -140,7 +193,8 @@ static void shift_table_up( LkupTbl *t, int idx) {
   if ( idx >= t->table_len) return;
   int i = 0;
   for ( i = t->table_len; i > idx; i--) {
-    t->table[i] = t->table[i-1];
+    t->keys[i] = t->keys[i-1];
+    t->aliases[i] = t->aliases[i-1];
   }
 }
 
@@ -148,18 +202,71 @@ static void shift_table_down( LkupTbl *t, int idx) {
   if ( idx >= t->table_len-1) return;
   int i = 0;
   for ( i = idx; i < t->table_len-1; i++) {
-    t->table[i] = t->table[i+1];
+    t->keys[i] = t->keys[i+1];
+    t->aliases[i] = t->aliases[i+1];
   }
 }
 
 void free_lkup_tbl( LkupTbl *t) {
-  if ( t->table != NULL) {
-    memset( t->table, 0, t->table_sz * sizeof( LkupTblEntry));
-    mem_free( t->table);
-    t->table = NULL;
+  if ( t->tree != NULL) {
+    BT_free( t->tree);
+  }
+  if ( t->map != NULL) {
+    unref_snap_map( t->map);
+  } else if ( t->keys != NULL) {
+    memset( t->keys, 0, t->table_sz * ENTRY_SIZE);
+    free_entry_arrays( t->keys);
+    t->keys = NULL;
+    t->aliases = NULL;
   }
   memset( t, 0, sizeof( LkupTbl));
-  mem_free( t);
+  free_block_header( t);
+}
+
+// frees a lookup table which has been unlinked from the index table
+// as soon as lock-free readers are done with it.
+void retire_lkup_tbl( LkupTbl *t) {
+  if ( t->tree != NULL) {
+    BT_retire( t->tree);
+  }
+  if ( t->map != NULL) {
+    EP_retire( t, free_mapped_block_header);
+    return;
+  }
+  EP_retire( t->keys, free_entry_arrays);
+  EP_retire( t, free_block_header);
+}
+
+// large blocks go into a B+tree where inserts and deletes don't shift all entries.
+// switching back only below half the threshold avoids flapping around it.
+void adapt_lkup_tbl( LkupTbl *t) {
+
+  if ( t->tree == NULL && btree_threshold > 0 && t->table_len > btree_threshold) {
+
+    LkupKey *old_keys = t->keys;
+
+    t->tree = BT_build( t->keys, t->aliases, t->table_len);
+    t->keys = NULL;
+    t->aliases = NULL;
+    t->table_sz = t->table_len;
+
+    EP_retire( old_keys, free_entry_arrays);
+
+  } else if ( t->tree != NULL && t->table_len < btree_threshold / 2) {
+
+    BT_Tree *old_tree = t->tree;
+
+    LkupTbl nt;
+    alloc_table_arrays( &nt, t->table_len + DEF_LKUP_BLK_SIZE);
+    BT_copy( old_tree, 0, t->table_len, nt.keys, nt.aliases);
+
+    t->keys = nt.keys;
+    t->aliases = nt.aliases;
+    t->table_sz = nt.table_sz;
+    t->tree = NULL;
+
+    BT_retire( old_tree);
+  }
 }
 
 static int alloc_lkup_tbl_in_index( IdxTblEntry index_table[], int idx) {
@@ -179,116 +286,145 @@ static int free_lkup_tbl_in_index( IdxTblEntry index_table[], int idx) {
   if ( index_table[idx].table == NULL) {
     return 0;
   }
-  free_lkup_tbl( index_table[idx].table);
+  LkupTbl *t = index_table[idx].table;
   index_table[idx].table = NULL;
+  retire_lkup_tbl( t);
   return 0;
 }
 
-static int compare_entry( LkupTblEntry *e1, LkupTblEntry *e2) {
-  assert( e1 != NULL && e2 != NULL);
-
-  if ( e1 == e2) return 0;
-  
-  unsigned char *p1 = e1->postfix;
-  unsigned char *p2 = e2->postfix;
-  int i = 0;
-  for ( i = 0; i < POSTFIX_LENGTH; i++) {
-    if ( *p1 < *p2) return -1;
-    if ( *p1 > *p2) return +1;
-    p1++; p2++;
-  }
-  return 0;
-}
-
-// returns the first 6 digits of number as integer
-static int get_index( const unsigned char *nbr) {
+// returns the slot of the first 6 digits of a number of nbr_len digits
+static int get_index_len( const unsigned char *nbr, const int nbr_len) {
 
-  if ( nbr == NULL || strlen( nbr) < PREFIX_LENGTH) {
+  if ( nbr == NULL || nbr_len < PREFIX_LENGTH) {
     log_msg( ERR, "get_index: string too short or null\n");
     return NBR_TOO_SHORT;
   }
 
-  unsigned char pfx[PREFIX_LENGTH+1];
-  memcpy( pfx, nbr, PREFIX_LENGTH);
-  pfx[PREFIX_LENGTH] = 0;
+  int idx = 0;
+  int i = 0;
+  for ( i = 0; i < PREFIX_LENGTH; i++) {
+    if ( nbr[i] < '0' || nbr[i] > '9') 
+      break;
+    idx = idx * 10 + (nbr[i] - '0');
+  }
 
-  long idx = atol( pfx);
-  if ( idx <= 0) {
-    log_msg( ERR, "get_index: negative or illegal conversion %s\n", nbr);
+  if ( i < PREFIX_LENGTH || idx < INDEX_OFFSET) {
+    log_msg( ERR, "get_index: negative or illegal conversion %.*s\n", nbr_len, nbr);
     return ILLEGAL_NUMBER;
   }
-  assert( idx >= INDEX_OFFSET);
-  return (int) idx - INDEX_OFFSET;
+  return idx - INDEX_OFFSET;
 }
 
-// binary search
-// returns index (>= 0) if found or -insertion_point-1 if not found
-static int search_entry_in_table( LkupTblPtr tbl, LkupTblEntry *e) {
+// returns the first 6 digits of number as integer
+static int get_index( const unsigned char *nbr) {
+  return get_index_len( nbr, nbr == NULL ? 0 : strlen( nbr));
+}
 
-  assert( tbl != NULL && e != NULL);
+// returns the index of key among the first table_len keys or -insertion point - 1
+static int search_entry_in_array( const LkupKey keys[], const long table_len, const LkupKey key) {
+  return (int) SRCH_find( keys, table_len, key);
+}
 
-  if ( tbl->table_len == 0) return -1;
-  
-  // binary search
-  int left = 0;
-  int right = tbl->table_len - 1;
-  int mid = 0;
-  int cmp = 0;
+// returns the rank of key or -insertion point - 1
+static int search_entry_in_table( LkupTblPtr tbl, const LkupKey key) {
+  assert( tbl != NULL);
 
-  while ( left <= right) {
+  if ( tbl->tree != NULL) {
+    long rank = 0;
+    int found = BT_search( tbl->tree, key, &rank, NULL);
+    assert( found != BT_INCONSISTENT); // we hold the lock
+    return found ? rank : -rank - 1;
+  }
 
-    mid = (left + right)/2;
+  return search_entry_in_array( tbl->keys, tbl->table_len, key);
+}
 
-    cmp = compare_entry( &tbl->table[mid], e);
-    log_msg( DEBUG, "%d %d %d %d\n", left, right, mid, cmp);
+static int set_up_search_key( LkupKey *key, const unsigned char *nbr) {
 
-    if ( cmp < 0) {
-      left = mid + 1;
-    } else if ( cmp > 0) {
-      right = mid - 1;
-    } else {
-      return mid;
-    }
+  if ( encode_postfix( nbr, PREFIX_LENGTH, strlen( nbr)-PREFIX_LENGTH, key) < 0) {
+    log_msg( ERR, "set_up_search_key: failure to encode %s\n", nbr);
+    return FAILURE;
   }
+  return SUCCESS;
+}
 
-  // we return -insertion point - 1
-  int ret_val = -mid - 1;
-  if ( cmp < 0)
-    ret_val -= 1;
-
-  return ret_val;
-
+// a table served from a mapped snapshot is copied before its first modification.
+// to be called with the slot locked, between begin_table_write() and end_table_write().
+static LkupTbl *writable_table( IdxTblEntry index_table[], int idx) {
+  LkupTbl *t = index_table[idx].table;
+  if ( t != NULL && t->map != NULL) {
+    LkupTbl *nt = copy_lkup_tbl( t);
+    adapt_lkup_tbl( nt);
+    index_table[idx].table = nt;
+    retire_lkup_tbl( t);
+    t = nt;
+  }
+  return t;
 }
 
 // enters a new entry. if duplicate, overwrites the old alias
 int enter_entry( IdxTblEntry index_table[], const unsigned char *nbr, const unsigned char *alias) {
+  if ( nbr == NULL || alias == NULL) 
+    return FAILURE;
+  return enter_entry_len( index_table, nbr, strlen( nbr), alias, strlen( alias));
+}
 
-  int idx = get_index( nbr);
+// enter_entry_len(), appending the mutation to log if non NULL while the slot
+// is locked: the log has the order in which the slot saw the mutations. it is
+// appended before the table is touched, if that fails nothing is changed. a
+// checkpoint pausing writes waits for the modification of a logged mutation.
+int enter_entry_logged( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len, 
+			const unsigned char *alias, const int alias_len, WAL_Log *log, uint64_t *lsn) {
+
+  int status = SUCCESS;
+
+  int idx = get_index_len( nbr, nbr_len);
   if ( idx < 0) {
-    log_msg( ERR, "enter_entry: bad index %d: %s\n", idx, nbr);
+    log_msg( ERR, "enter_entry: bad index %d: %.*s\n", idx, nbr_len, nbr);
+    return FAILURE;
+  }
+
+  LkupKey key;
+  LkupAlias packed_alias;
+  LkupAlias old_alias;   // overwritten, for the reverse index
+  int had_alias = FALSE;
+
+  // pack before touching the table, a failure leaves the table unchanged
+  if ( encode_postfix( nbr, PREFIX_LENGTH, nbr_len - PREFIX_LENGTH, &key) < 0) {
+    log_msg( ERR, "enter_entry: failure to encode %.*s\n", nbr_len, nbr);
+    return FAILURE;
+  }
+  if ( compress_to_buf( alias, 0, alias_len, packed_alias.alias, ALIAS_LENGTH) < 0) {
+    log_msg( ERR, "enter_entry: failure to compress %.*s\n", alias_len, alias);
     return FAILURE;
   }
 
   lock_table( index_table, idx);
 
+  // readers retry while the version is odd. covers growing the table.
+  begin_table_write( index_table, idx);
+
+  if ( log != NULL && ( *lsn = WAL_append( log, WAL_ENTER, nbr, nbr_len, alias, alias_len)) == 0) {
+    status = FAILURE;
+    goto unlock;
+  }
+
   if ( index_table[idx].table == NULL) {
     index_table[idx].table = alloc_lkup_tbl();
   }
 
-  LkupTblEntry key;
-  memset( &key, 0, sizeof( LkupTblEntry));
+  LkupTbl *t = writable_table( index_table, idx);
 
-  if ( compress_to_buf( nbr, PREFIX_LENGTH, strlen( nbr)-PREFIX_LENGTH, key.postfix, POSTFIX_LENGTH) < 0) {
-    log_msg( ERR, "enter_entry: failure to compress %s\n", nbr);
-
-    unlock_table( index_table, idx);
-    return FAILURE;
+  if ( t->tree != NULL) {
+    long rank = 0;
+    had_alias = reverse_index != NULL && BT_search( t->tree, key, &rank, &old_alias) == 1;
+    BT_insert( t->tree, key, &packed_alias);
+    t->table_len = t->table_sz = BT_count( t->tree);
+    goto out;
   }
 
-  LkupTbl *t = index_table[idx].table;
-
-  int e_idx = search_entry_in_table( t, &key);
-  log_msg( DEBUG, "key = %s idx = %d\n", nbr, e_idx);
+  int e_idx = search_entry_in_table( t, key);
+  log_msg( DEBUG, "key = %.*s idx = %d\n", nbr_len, nbr, e_idx);
 
   if ( e_idx < 0) { // key not found
     // e_idx is -insertion_point - 1
@@ -301,35 +437,105 @@ int enter_entry( IdxTblEntry index_table[], const unsigned char *nbr, const unsi
     assert( t->table_len < t->table_sz);
     shift_table_up( t, i_idx);
     
-    LkupTblEntry *e = &(t->table[i_idx]);
-    memcpy( e->postfix, key.postfix, POSTFIX_LENGTH);
-    if ( compress_to_buf( alias, 0, strlen( alias), e->alias, ALIAS_LENGTH) < 0) {
-      log_msg( ERR, "enter_entry: failure to compress %s\n", alias);
-
-      unlock_table( index_table, idx);
-      return FAILURE;
-    }
+    t->keys[i_idx] = key;
+    t->aliases[i_idx] = packed_alias;
 
     t->table_len++; // bump up counter of used entries
 
+    adapt_lkup_tbl( t);
+
   } else { // found key
 
     // fprintf( stderr, "duplicate nbr: %s\n", nbr);
 
-    LkupTblEntry *e = &(t->table[e_idx]);
-    assert( compare_entry( e, &key) == 0);
+    assert( t->keys[e_idx] == key);
     // overwrite alias
-    if ( compress_to_buf( alias, 0, strlen( alias), e->alias, ALIAS_LENGTH) < 0) {
-      log_msg( ERR, "enter_entry: failure to compress %s\n", alias);
-
-      unlock_table( index_table, idx);
-      return FAILURE;
-    }
+    old_alias = t->aliases[e_idx];
+    had_alias = TRUE;
+    t->aliases[e_idx] = packed_alias;
   }
 
+ out:
+  if ( reverse_index != NULL) 
+    RX_update( reverse_index, idx, key, had_alias ? &old_alias : NULL, &packed_alias);
+
+ unlock:
+  end_table_write( index_table, idx);
   unlock_table( index_table, idx);
 
-  return SUCCESS;  
+  return status;
+}
+
+int enter_entry_len( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len, 
+		     const unsigned char *alias, const int alias_len) {
+  return enter_entry_logged( index_table, nbr, nbr_len, alias, alias_len, NULL, NULL);
+}
+
+// searches without locking the index table entry. the table and its entries can
+// change underneath, so everything we read is validated against the version of
+// the entry. storage replaced by writers is only freed after we left the epoch.
+// returns OPTIMISTIC_READ_FAILED if we kept on colliding with writers.
+static int search_entry_optimistic( IdxTblEntry index_table[], int idx, const LkupKey key,
+				    unsigned char alias[], const int alias_sz) {
+
+  int h = EP_enter();
+  if ( h < 0) { // too many readers, use the lock
+    return OPTIMISTIC_READ_FAILED;
+  }
+
+  int status = OPTIMISTIC_READ_FAILED;
+  int i = 0;
+
+  for ( i = 0; i < MAX_OPTIMISTIC_READS; i++) {
+
+    unsigned long version = begin_table_read( index_table, idx);
+
+    LkupTbl *t = index_table[idx].table;
+    if ( t == NULL) {
+      if ( retry_table_read( index_table, idx, version)) 
+	continue;
+      status = NO_SUCH_ENTRY;
+      break;
+    }
+
+    LkupKey *keys = t->keys;
+    LkupAlias *aliases = t->aliases;
+    long table_len = t->table_len;
+    BT_Tree *tree = t->tree;
+
+    // arrays and their length must be consistent before we search them
+    if ( retry_table_read( index_table, idx, version)) 
+      continue;
+
+    LkupAlias packed_alias;
+    int e_idx = 0;
+
+    if ( tree != NULL) {
+      long rank = 0;
+      int found = BT_search( tree, key, &rank, &packed_alias);
+      if ( found == BT_INCONSISTENT) 
+	continue;
+      e_idx = found ? 0 : -1;
+    } else {
+      e_idx = search_entry_in_array( keys, table_len, key);
+      if ( e_idx >= 0) {
+	packed_alias = aliases[e_idx];
+      }
+    }
+
+    if ( retry_table_read( index_table, idx, version)) 
+      continue;
+
+    if ( e_idx < 0) {
+      status = NO_SUCH_ENTRY;
+    } else {
+      status = decompress_to_buf( packed_alias.alias, alias, alias_sz) < 0 ? FAILURE : SUCCESS;
+    }
+    break;
+  }
+
+  EP_leave( h);
+  return status;
 }
 
 static int search_entry_with_buffer(IdxTblEntry index_table[], const unsigned char *nbr, 
@@ -342,28 +548,31 @@ static int search_entry_with_buffer(IdxTblEntry index_table[], const unsigned ch
     return FAILURE;
   }
 
-  lock_table( index_table, idx);
+  // set up search key
+  LkupKey key;
 
-  LkupTbl *t = index_table[idx].table;
+  if ( set_up_search_key( &key, nbr) != SUCCESS) {
+    log_msg( ERR, "search_entry: failure to encode %s\n", nbr);
+    return FAILURE;
+  }
 
-  if ( t == NULL) {
-    unlock_table( index_table, idx);
-    return NO_SUCH_ENTRY;
+  // almost all traffic is reads, try without lock first
+  int status = search_entry_optimistic( index_table, idx, key, alias, alias_sz);
+  if ( status != OPTIMISTIC_READ_FAILED) {
+    return status;
   }
 
-  // allocate search key
-  LkupTblEntry key;
-  memset( &key, 0, sizeof( LkupTblEntry));
+  lock_table( index_table, idx);
 
-  if ( compress_to_buf( nbr, PREFIX_LENGTH, strlen( nbr)-PREFIX_LENGTH, key.postfix, POSTFIX_LENGTH) < 0) {
-    log_msg( ERR, "search_entry: failure to compress %s\n", nbr);
+  LkupTbl *t = index_table[idx].table;
 
+  if ( t == NULL) {
     unlock_table( index_table, idx);
-    return FAILURE;
+    return NO_SUCH_ENTRY;
   }
 
   // do the search
-  int e_idx = search_entry_in_table( t, &key);
+  int e_idx = search_entry_in_table( t, key);
   log_msg( DEBUG, "key = %s idx = %d\n", nbr, e_idx);
 
   if ( e_idx < 0) {
@@ -371,27 +580,18 @@ static int search_entry_with_buffer(IdxTblEntry index_table[], const unsigned ch
     return NO_SUCH_ENTRY;
   }
 
+  LkupKey found_key;
+  LkupAlias packed_alias;
+  get_lkup_tbl_entries( t, e_idx, 1, &found_key, &packed_alias);
+
   // decompress into buffer
-  LkupTblEntry *e = &(t->table[e_idx]);
-  decompress_to_buf( e->alias, alias, alias_sz);
+  decompress_to_buf( packed_alias.alias, alias, alias_sz);
 
   unlock_table( index_table, idx);
   return SUCCESS;
 
 }
 
-
-static int set_up_search_key( LkupTblEntry *key, const unsigned char *nbr) {
-
-  memset( key, 0, sizeof( LkupTblEntry));
-
-  if ( compress_to_buf( nbr, PREFIX_LENGTH, strlen( nbr)-PREFIX_LENGTH, key->postfix, POSTFIX_LENGTH) < 0) {
-    log_msg( ERR, "set_up_search_key: failure to compress %s\n", nbr);
-    return FAILURE;
-  }
-  return SUCCESS;
-}
-
 // searches entry and set alias if found. 
 // returns negative value if entry not found
 int search_entry( IdxTblEntry index_table[], const unsigned char *nbr, unsigned char **alias) {
@@ -405,52 +605,292 @@ int search_entry( IdxTblEntry index_table[], const unsigned char *nbr, unsigned
   return s;
 }
 
+// one number of a batch
+typedef struct {
+  int idx;  // index table slot
+  int pos;  // position in the batch
+  LkupKey key;
+} BatchItem;
+
+static int compare_batch_items( const void *a, const void *b) {
+  const BatchItem *x = (const BatchItem *) a;
+  const BatchItem *y = (const BatchItem *) b;
+  if ( x->idx != y->idx) 
+    return x->idx < y->idx ? -1 : 1;
+  return (x->key > y->key) - (x->key < y->key);
+}
+
+// searches up to BATCH_CHUNK keys of one slot without locking, all against the
+// same version of the slot. returns OPTIMISTIC_READ_FAILED if we kept on
+// colliding with writers. must be called within an epoch.
+static int search_chunk_optimistic( IdxTblEntry index_table[], const BatchItem items[], const int m,
+				    unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]) {
+
+  LkupAlias packed[BATCH_CHUNK];
+  char found[BATCH_CHUNK];
+  int idx = items[0].idx;
+  int i = 0;
+  int j = 0;
+
+  assert( m <= BATCH_CHUNK);
+
+  for ( i = 0; i < MAX_OPTIMISTIC_READS; i++) {
+
+    unsigned long version = begin_table_read( index_table, idx);
+
+    LkupTbl *t = index_table[idx].table;
+    if ( t == NULL) {
+      if ( retry_table_read( index_table, idx, version)) 
+	continue;
+      for ( j = 0; j < m; j++) 
+	status[items[j].pos] = NO_SUCH_ENTRY;
+      return SUCCESS;
+    }
+
+    LkupKey *keys = t->keys;
+    LkupAlias *tbl_aliases = t->aliases;
+    long table_len = t->table_len;
+    BT_Tree *tree = t->tree;
+
+    if ( retry_table_read( index_table, idx, version)) 
+      continue;
+
+    int consistent = TRUE;
+    for ( j = 0; j < m && consistent; j++) {
+      if ( tree != NULL) {
+	long rank = 0;
+	int f = BT_search( tree, items[j].key, &rank, &packed[j]);
+	consistent = f != BT_INCONSISTENT;
+	found[j] = f == 1;
+      } else {
+	int e_idx = search_entry_in_array( keys, table_len, items[j].key);
+	found[j] = e_idx >= 0;
+	if ( found[j]) 
+	  packed[j] = tbl_aliases[e_idx];
+      }
+    }
+
+    if ( !consistent || retry_table_read( index_table, idx, version)) 
+      continue;
+
+    for ( j = 0; j < m; j++) {
+      int pos = items[j].pos;
+      if ( !found[j]) 
+	status[pos] = NO_SUCH_ENTRY;
+      else 
+	status[pos] = decompress_to_buf( packed[j].alias, aliases[pos], MAX_NBR_LENGTH+1) < 0 ? FAILURE : SUCCESS;
+    }
+    return SUCCESS;
+  }
+
+  return OPTIMISTIC_READ_FAILED;
+}
+
+// searches keys of one slot under its lock
+static void search_chunk_locked( IdxTblEntry index_table[], const BatchItem items[], const int m,
+				 unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]) {
+
+  int idx = items[0].idx;
+  int j = 0;
+
+  lock_table( index_table, idx);
+
+  LkupTbl *t = index_table[idx].table;
+
+  for ( j = 0; j < m; j++) {
+    int pos = items[j].pos;
+    int e_idx = t != NULL ? search_entry_in_table( t, items[j].key) : -1;
+    if ( e_idx < 0) {
+      status[pos] = NO_SUCH_ENTRY;
+      continue;
+    }
+    LkupKey found_key;
+    LkupAlias packed_alias;
+    get_lkup_tbl_entries( t, e_idx, 1, &found_key, &packed_alias);
+    status[pos] = decompress_to_buf( packed_alias.alias, aliases[pos], MAX_NBR_LENGTH+1) < 0 ? FAILURE : SUCCESS;
+  }
+
+  unlock_table( index_table, idx);
+}
+
+// searches n numbers at once. the numbers are grouped by slot, each group is
+// searched under one version or lock of its slot. while a group is searched,
+// slots, block headers and keys of the following groups are prefetched.
+// returns the nbr of numbers found.
+int search_batch( IdxTblEntry index_table[], const unsigned char *nbrs[], const int n, 
+		  unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]) {
+
+  BatchItem *items = mem_alloc( n * sizeof( BatchItem));
+  int *chunks = mem_alloc( (n + 1) * sizeof( int));
+  int found = FAILURE;
+  int m = 0;
+  int i = 0;
+
+  if ( items == NULL || chunks == NULL) {
+    log_msg( CRIT, "search_batch: out of heap space\n");
+    goto out;
+  }
+
+  for ( i = 0; i < n; i++) {
+    aliases[i][0] = '\0';
+    status[i] = FAILURE;
+    int idx = get_index( nbrs[i]);
+    if ( idx < 0 || set_up_search_key( &items[m].key, nbrs[i]) != SUCCESS) {
+      log_msg( ERR, "search_batch: bad number %s\n", nbrs[i] != NULL ? (char *) nbrs[i] : "");
+      continue;
+    }
+    items[m].idx = idx;
+    items[m].pos = i;
+    m++;
+  }
+
+  qsort( items, m, sizeof( BatchItem), compare_batch_items);
+
+  // chunks of at most BATCH_CHUNK keys of one slot
+  int nbr_chunks = 0;
+  for ( i = 0; i < m; i++) {
+    if ( i == 0 || items[i].idx != items[i-1].idx || i - chunks[nbr_chunks-1] == BATCH_CHUNK) 
+      chunks[nbr_chunks++] = i;
+  }
+  chunks[nbr_chunks] = m;
+
+  // tables are only dereferenced ahead within the epoch
+  int h = EP_enter();
+
+  // starting before the first chunk fills the prefetch pipeline
+  int c = 0;
+  for ( c = -PREFETCH_SLOT_DIST; c < nbr_chunks; c++) {
+
+    if ( c + PREFETCH_SLOT_DIST < nbr_chunks) {
+      __builtin_prefetch( &index_table[items[chunks[c + PREFETCH_SLOT_DIST]].idx]);
+    }
+    if ( h >= 0 && c + PREFETCH_TBL_DIST >= 0 && c + PREFETCH_TBL_DIST < nbr_chunks) {
+      LkupTbl *pt = index_table[items[chunks[c + PREFETCH_TBL_DIST]].idx].table;
+      if ( pt != NULL) 
+	__builtin_prefetch( pt);
+    }
+    if ( h >= 0 && c + PREFETCH_KEYS_DIST >= 0 && c + PREFETCH_KEYS_DIST < nbr_chunks) {
+      LkupTbl *pt = index_table[items[chunks[c + PREFETCH_KEYS_DIST]].idx].table;
+      if ( pt != NULL && pt->keys != NULL) {
+	// the search starts in the middle. prefetches don't fault on stale lengths.
+	long mid = pt->table_len / 2;
+	__builtin_prefetch( &pt->keys[mid]);
+	__builtin_prefetch( &pt->aliases[mid]);
+      }
+    }
+
+    if ( c < 0) 
+      continue;
+
+    const BatchItem *chunk = &items[chunks[c]];
+    int len = chunks[c+1] - chunks[c];
+
+    if ( h < 0 || search_chunk_optimistic( index_table, chunk, len, aliases, status) == OPTIMISTIC_READ_FAILED) {
+      search_chunk_locked( index_table, chunk, len, aliases, status);
+    }
+  }
+
+  if ( h >= 0) 
+    EP_leave( h);
+
+  found = 0;
+  for ( i = 0; i < n; i++) {
+    if ( status[i] == SUCCESS) 
+      found++;
+  }
+
+ out:
+  if ( items != NULL) 
+    mem_free( items);
+  if ( chunks != NULL) 
+    mem_free( chunks);
+  return found;
+}
+
 // deletes the given entry if present. no-op otherwise.
 int delete_entry( IdxTblEntry index_table[], const unsigned char *nbr) {
+  if ( nbr == NULL) 
+    return FAILURE;
+  return delete_entry_len( index_table, nbr, strlen( nbr));
+}
+
+// delete_entry_len(), appending the mutation to log if non NULL as enter_entry_logged() does
+int delete_entry_logged( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len,
+			 WAL_Log *log, uint64_t *lsn) {
 
   int status = SUCCESS;
 
-  int idx = get_index( nbr);
+  int idx = get_index_len( nbr, nbr_len);
   if ( idx < 0) {
-    log_msg( ERR, "delete_entry: bad index %d: %s\n", idx, nbr);
+    log_msg( ERR, "delete_entry: bad index %d: %.*s\n", idx, nbr_len, nbr);
+    return FAILURE;
+  }
+
+  // set up search key
+  LkupKey key;
+  LkupAlias old_alias;   // deleted, for the reverse index
+  int had_alias = FALSE;
+
+  if ( encode_postfix( nbr, PREFIX_LENGTH, nbr_len - PREFIX_LENGTH, &key) < 0) {
+    log_msg( ERR, "delete_entry: failure to set up search key %.*s\n", nbr_len, nbr);
     return FAILURE;
   }
 
   lock_table( index_table, idx);
 
+  // readers retry while the version is odd. covers shrinking the table.
+  begin_table_write( index_table, idx);
+
+  if ( log != NULL && ( *lsn = WAL_append( log, WAL_DELETE, nbr, nbr_len, NULL, 0)) == 0) {
+    status = FAILURE;
+    goto unlock;
+  }
+
   // no table, nothing to delete....
   if ( index_table[idx].table == NULL) {
     goto out;
   }
 
-  // allocate search key
-  LkupTblEntry key;
+  LkupTbl *t = index_table[idx].table;
 
-  if ( set_up_search_key( &key, nbr) != SUCCESS) {
-    log_msg( ERR, "delete_entry: failure to set up search key %s\n", nbr);
-    status = FAILURE;
+  // a mapped table is only copied if the entry is there
+  if ( t->map != NULL && search_entry_in_table( t, key) < 0) {
     goto out;
   }
+  t = writable_table( index_table, idx);
 
-  LkupTbl *t = index_table[idx].table;
+  if ( t->tree != NULL) {
+    long rank = 0;
+    had_alias = reverse_index != NULL && BT_search( t->tree, key, &rank, &old_alias) == 1;
+    BT_delete( t->tree, key);
+    t->table_len = t->table_sz = BT_count( t->tree);
+
+    if ( t->table_len == 0) { // last entry
+      index_table[idx].table = NULL;
+      retire_lkup_tbl( t);
+      goto out;
+    }
+
+    adapt_lkup_tbl( t);
+    goto out;
+  }
 
   // do the search
-  int e_idx = search_entry_in_table( t, &key);
-  log_msg( DEBUG, "key = %s idx = %d\n", nbr, e_idx);
+  int e_idx = search_entry_in_table( t, key);
+  log_msg( DEBUG, "key = %.*s idx = %d\n", nbr_len, nbr, e_idx);
 
   if ( e_idx < 0) { // no such entry. we're done
     status = SUCCESS;
     goto out;
   }
   // found the entry
+  old_alias = t->aliases[e_idx];
+  had_alias = TRUE;
 
   if ( t->table_len == 1) { // last entry
 
-    mem_free( t);
-
     index_table[idx].table = NULL;
-    t->table_len = 0;
-    t->table_sz = 0;
+    retire_lkup_tbl( t);
 
     status = SUCCESS;
     goto out;
@@ -460,19 +900,25 @@ int delete_entry( IdxTblEntry index_table[], const unsigned char *nbr) {
   t->table_len--;
   // table size unchanged...
 
-  if ( t->table_sz - t->table_len >= DEF_LKUP_BLK_SIZE) {
-    shrink_table( t);
-  }
+  shrink_table( t);
   
   status = SUCCESS;
 
  out:
+  if ( reverse_index != NULL && had_alias) 
+    RX_update( reverse_index, idx, key, &old_alias, NULL);
 
+ unlock:
+  end_table_write( index_table, idx);
   unlock_table( index_table, idx);
   return status;
 
 }
 
+int delete_entry_len( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len) {
+  return delete_entry_logged( index_table, nbr, nbr_len, NULL, NULL);
+}
+
 static void test_compression( unsigned char *s) {
 
   unsigned char *cs = compress( s, 0, strlen( s));
@@ -487,8 +933,9 @@ static void test_compression( unsigned char *s) {
   mem_free( cs);
 }
 
-// allocate index table with 1 million entries... of which we keep 100'000 empty
-static IdxTblEntry index_table[INDEX_SIZE-INDEX_OFFSET];
+// index table with 1 million entries... of which we keep 100'000 empty. mapped
+// by init_index(), on huge pages if so configured.
+static IdxTblEntry *index_table = NULL;
 
 static void test_search( unsigned char *nbr) {
   unsigned char *alias = NULL;
@@ -500,15 +947,39 @@ static void test_search( unsigned char *nbr) {
   }
 }
 
-// initializing index table
-static void init_index( IdxTblEntry index_table[]) {
-  int i = 0;
-  for ( i = 0; i < INDEX_SIZE - INDEX_OFFSET; i++) {
-    IdxTblEntry *e = &(index_table[i]);
+// initializing index table. fresh mappings are zeroed, we only need the lock stripes.
+static int init_index() {
+
+  long start_time = get_time_micro();
+
+  if ( SL_set_huge_pages( CFG_get_str( "huge_pages", NULL)) < 0) {
+    return FAILURE;
+  }
 
-    pthread_mutex_init( &(e->mutex), NULL);
+  index_table = SL_map( sizeof( IdxTblEntry) * (INDEX_SIZE - INDEX_OFFSET));
+  if ( index_table == NULL) {
+    log_msg( CRIT, "init_index: out of memory for index table\n");
+    return FAILURE;
+  }
+
+  int nbr_stripes = init_lock_stripes( CFG_get_int( "lock_stripes", DEF_LOCK_STRIPES));
+  if ( nbr_stripes < 0) {
+    return FAILURE;
+  }
 
+  if ( SRCH_init( CFG_get_str( "search_kernel", NULL)) < 0) {
+    return FAILURE;
   }
+
+  btree_threshold = CFG_get_int( "btree_threshold", DEF_BTREE_THRESHOLD);
+
+  mem_count( MEM_INDEX, sizeof( IdxTblEntry) * (INDEX_SIZE - INDEX_OFFSET));
+
+  log_msg( INFO, "init_index: %ld index bytes, %d lock stripes, %ld [usec]\n", 
+	   (long) sizeof( IdxTblEntry) * (INDEX_SIZE - INDEX_OFFSET), nbr_stripes,
+	   get_time_micro() - start_time);
+
+  return SUCCESS;
 }
 
 /*
@@ -542,668 +1013,313 @@ static void init_index( IdxTblEntry index_table[]) {
 */
 
 
-// init the module
-int nlkup_init() {
-
-  init_index( index_table);
-
-  if ( restore_all_fn( index_table, "dump.bin") != SUCCESS) {
-    log_msg( ERR, "nlkup_init: restore_all_fn() failed");
-    return -1;
-  }
-
-  return 0;
-}
-
-int nlkup_enter_entry( const unsigned char *nbr, const unsigned char *alias) {
-  return enter_entry( index_table, nbr, alias);
-}
-
-int nlkup_delete_entry( const unsigned char *nbr) {
-  return delete_entry( index_table, nbr);
-}
+// write-ahead log of nlkup_enter_entry() and nlkup_delete_entry(), if "wal_file_name" is set
+static WAL_Log *wal = NULL;
 
-// looks up the given number and returns the alias which must be mem_freed() if non NULL
-int nlkup_search_entry( const unsigned char *nbr, unsigned char **alias) {
-  return search_entry( index_table, nbr, alias);
+static int replay_mutation( void *arg, const int type, const unsigned char *nbr, const int nbr_len, 
+			    const unsigned char *alias, const int alias_len) {
+  if ( type == WAL_ENTER) 
+    return enter_entry_len( index_table, nbr, nbr_len, alias, alias_len);
+  return delete_entry_len( index_table, nbr, nbr_len);
 }
 
-// address of an entry. indexed into two levels.
-typedef struct {
-  int idx_tbl_idx;  // index into index table
-  int lkup_tbl_idx; // index into entry table
-} EntryAddressStruct;
-
-#define CHECK_IDX_TBL_IDX( eas)   assert( eas->idx_tbl_idx >= 0 && eas->idx_tbl_idx < (INDEX_SIZE-INDEX_OFFSET));
-
-// starting at the nearest_entry find the address of the nbr_before-th entry
-static int find_start_entry( const EntryAddressStruct *nearest_entry, const int nbr_before, EntryAddressStruct *start_entry) {
-
-  memset( start_entry, 0, sizeof( EntryAddressStruct));
-  if ( nbr_before <= 0) {
-    return FAILURE;
-  }
-
-  CHECK_IDX_TBL_IDX( nearest_entry);
-
-  // copy nearest entry as it is modified
-  EntryAddressStruct ne = *nearest_entry;
-  int last_non_empty_tbl_idx = 0;
-
-  int cnt = 0;
-
-  // lock current table and see if we can have the neeeded nbr entries before
-  LkupTbl *t = index_table[ne.idx_tbl_idx].table;
-
-  lock_table( index_table, ne.idx_tbl_idx);
-
-  if ( ne.lkup_tbl_idx >= nbr_before-1) { // satisfy request with current table
-
-    start_entry->idx_tbl_idx = ne.idx_tbl_idx;
-    start_entry->lkup_tbl_idx = ne.lkup_tbl_idx - (nbr_before-1);
-
-    unlock_table( index_table, ne.idx_tbl_idx);
+// init the module
+int nlkup_init() {
 
-    assert( start_entry->lkup_tbl_idx >= 0);
-    return SUCCESS;
-  } else { // need entire current table
-    cnt += ne.lkup_tbl_idx;
-    last_non_empty_tbl_idx = ne.idx_tbl_idx;
+  if ( init_index() != SUCCESS) {
+    log_msg( ERR, "nlkup_init: init_index() failed");
+    return -1;
   }
 
-  unlock_table( index_table, ne.idx_tbl_idx);
-
-  // no. iterate over tables before current table. keeping track of # of entries
-  while ( cnt <= nbr_before && ne.idx_tbl_idx > 0) {
-
-    ne.idx_tbl_idx--;
-
-    t = index_table[ne.idx_tbl_idx].table;
-
-    if ( t == NULL || t->table_len == 0) {
-      continue;
-    }
-
-    last_non_empty_tbl_idx = ne.idx_tbl_idx;
-
-    lock_table( index_table, ne.idx_tbl_idx);
-
-    if (( nbr_before - cnt) <= t->table_len) { // table has enough entries
-      start_entry->idx_tbl_idx = ne.idx_tbl_idx;
-      start_entry->lkup_tbl_idx = t->table_len - (nbr_before-cnt-1);
+  DW_init( CFG_get_int( "checkpoint_rate_mb", 0), CFG_get_int( "checkpoint_backoff_usec", 0), 
+	   CFG_get_int( "checkpoint_direct_io", FALSE));
 
-      unlock_table( index_table, ne.idx_tbl_idx);
+  // with a log the checkpoint it continues is restored, then the log is replayed
+  char *wal_fn = CFG_get_str( "wal_file_name", NULL);
+  char *base_fn = NULL;
 
-      assert( start_entry->lkup_tbl_idx >= 0);
-      return SUCCESS;
-    } else { // use the entire table and go one table back
-      cnt += t->table_len; 
+  if ( wal_fn != NULL && strlen( wal_fn) > 0) {
+    if (( wal = WAL_open( wal_fn, CFG_get_int( "wal_commit_window_usec", 0))) == NULL ||
+	( base_fn = WAL_base_fn( wal)) == NULL) {
+      log_msg( ERR, "nlkup_init: WAL_open() failed");
+      return -1;
     }
-
-    unlock_table( index_table, ne.idx_tbl_idx);
-
   }
 
+  // lazily the slots are loaded while requests are served already
+  int (*restore)( IdxTblEntry [], const unsigned char *, int) = 
+    CFG_get_int( "lazy_restore", FALSE) ? restore_lazy_fn : restore_all_fn;
+  int s = restore( index_table, base_fn != NULL && strlen( base_fn) > 0 ? base_fn : "dump.bin", 
+		   CFG_get_int( "map_snapshot", FALSE));
+  free( base_fn);
 
-  start_entry->idx_tbl_idx = last_non_empty_tbl_idx;
-  start_entry->lkup_tbl_idx = 0;
-
-  return NOT_ENOUGH_DATA;
-}
-
-// starting at the nearest_entry, find the address of the nbr_after-th entry 
-static int find_end_entry( const EntryAddressStruct *nearest_entry, const int nbr_after, EntryAddressStruct *end_entry) {
-  memset( end_entry, 0, sizeof( EntryAddressStruct));
-  if ( nbr_after <= 0) {
+  if ( s != SUCCESS) {
+    log_msg( ERR, "nlkup_init: restore failed");
     return -1;
   }
 
-  CHECK_IDX_TBL_IDX( nearest_entry);
-
-  // copy to modify
-  EntryAddressStruct ne = *nearest_entry;
-  int last_non_empty_tbl_idx = 0;
-
-  int cnt = 0;
-
-  // lock current table and see if we can have the needed nbr entries after
-  LkupTbl *t = index_table[ne.idx_tbl_idx].table;
-
-  lock_table( index_table, ne.idx_tbl_idx);
-
-  if ( t->table_len - (ne.lkup_tbl_idx+1) >= nbr_after) { // satisfy request with current table
-    end_entry->idx_tbl_idx = ne.idx_tbl_idx;
-    end_entry->lkup_tbl_idx = ne.lkup_tbl_idx + nbr_after;
-
-    unlock_table( index_table, ne.idx_tbl_idx);
-
-    assert( end_entry->lkup_tbl_idx < t->table_len);
-    return SUCCESS;
-  } else { // need entire current table
-    cnt += t->table_len - (ne.lkup_tbl_idx+1);
-    last_non_empty_tbl_idx = ne.idx_tbl_idx;
+  if ( wal != NULL && WAL_replay( wal, replay_mutation, NULL) < 0) {
+    log_msg( ERR, "nlkup_init: WAL_replay() failed");
+    return -1;
   }
 
-  unlock_table( index_table, ne.idx_tbl_idx);
-
-  // no. iterate over tables after current table. keeping track of # of entries
-  while ( cnt < nbr_after && ne.idx_tbl_idx < ((INDEX_SIZE-INDEX_OFFSET)-1)) {
-
-    ne.idx_tbl_idx++;
-
-    t = index_table[ne.idx_tbl_idx].table;
-    
-    if ( t == NULL || t->table_len == 0) {
-      continue;
-    }
-
-    last_non_empty_tbl_idx = ne.idx_tbl_idx;
-
-    lock_table( index_table, ne.idx_tbl_idx);
-
-    if (( nbr_after - cnt) <= t->table_len) { // table has enough entries
-      end_entry->idx_tbl_idx = ne.idx_tbl_idx;
-      end_entry->lkup_tbl_idx = (nbr_after-cnt-1);
-
-      unlock_table( index_table, ne.idx_tbl_idx);
-
-      assert( end_entry->lkup_tbl_idx < t->table_len);
-      return SUCCESS;
-
-    } else { // use the entire table and go one table back
-      cnt += t->table_len; 
+  // built in the background, lookups by alias are served meanwhile but may miss numbers
+  if ( CFG_get_int( "reverse_index", FALSE)) {
+    if (( reverse_index = RX_new( index_table)) == NULL || RX_rebuild( reverse_index) != SUCCESS) {
+      log_msg( ERR, "nlkup_init: reverse index failed");
+      return -1;
     }
-
-    unlock_table( index_table, ne.idx_tbl_idx);
   }
 
-  end_entry->idx_tbl_idx = last_non_empty_tbl_idx;
-  end_entry->lkup_tbl_idx = index_table[ last_non_empty_tbl_idx].table->table_len-1;
-
-  return NOT_ENOUGH_DATA;
-
+  return 0;
 }
 
-// find the next entry up or down around lkup_tbl_idx if it is >= 0. 
-// if lkup_tlb_idx == -1 we are looking at a new table.
-static int find_nearest_table_entry( LkupTbl *t, const int up, int lkup_tbl_idx) {
-
-  // table is locked
-
-  if ( t->table_len <= 0) // empty table...
-    return -1;
-  
-  // table not empty...
-
-  if ( lkup_tbl_idx < 0) { // looking into a "new" table..
-    // start at bottom or top, depending on direction of search
-    if ( up) {
-      return 0; // first entry in table
-    } else {
-      return t->table_len-1; // last entry in table
-    }
-  } else { // looking into the table where we started search
-    // must look around index
-    if ( up) {
-      if ( lkup_tbl_idx + 1 <= t->table_len - 1) { // next entry up
-	return lkup_tbl_idx+1;
-      } else { // no next entry up
-	return -1;
-      }
-    } else {
-      if ( lkup_tbl_idx > 0) { // next entry down
-	return lkup_tbl_idx-1;
-      } else { // no next entry down
-	return -1;
-      }
-    }
-  }
+// a mutation is durable before it is acknowledged, if logged
+int nlkup_enter_entry( const unsigned char *nbr, const unsigned char *alias) {
+  if ( wal == NULL) 
+    return enter_entry( index_table, nbr, alias);
+  if ( nbr == NULL || alias == NULL) 
+    return FAILURE;
 
-  assert( FALSE);
-  return -1;
+  uint64_t lsn = 0;
+  int s = enter_entry_logged( index_table, nbr, strlen( nbr), alias, strlen( alias), wal, &lsn);
+  return s == SUCCESS ? WAL_sync( wal, lsn) : s;
 }
 
-// move along the search tables up or down and find nearest non-empty entry.
-// in case the initial search for a number did not find the nbr.
-// in case of success, the table with nearest entry is locked.
-static int find_nearest_entry( int idx_tbl_idx, int lkup_tbl_idx, const int up, EntryAddressStruct *nearest_entry) {
-
-  memset( nearest_entry, 0, sizeof( EntryAddressStruct));
-
-  int found = FALSE;
-
-  while ( !found) {
-
-    lock_table( index_table, idx_tbl_idx);
-
-    // current lookup table
-    LkupTbl *t = index_table[idx_tbl_idx].table;
-    int e_idx = find_nearest_table_entry( t, up, lkup_tbl_idx);
-
-    if ( e_idx >= 0) {
-      found = TRUE;
-      nearest_entry->idx_tbl_idx = idx_tbl_idx;
-      nearest_entry->lkup_tbl_idx = e_idx;
-      // keep lock on that table....
-      return SUCCESS;
-    }
-
-    unlock_table( index_table, idx_tbl_idx);
-  
-    // inc/dec index into index-table
-    if ( up) {
-      if ( idx_tbl_idx >= INDEX_SIZE - INDEX_OFFSET) {
-	return -1;
-      }
-      idx_tbl_idx++;
-    } else {
-      if ( idx_tbl_idx <= 0) {
-	return -1;
-      }
-      idx_tbl_idx--;
-    }
-
-    // we switched lookup-table, thus the lkup table entry index is no longer valid...
-    lkup_tbl_idx = -1;
+int nlkup_delete_entry( const unsigned char *nbr) {
+  if ( wal == NULL) 
+    return delete_entry( index_table, nbr);
+  if ( nbr == NULL) 
+    return FAILURE;
 
-  }
-  
-  return -1;
+  uint64_t lsn = 0;
+  int s = delete_entry_logged( index_table, nbr, strlen( nbr), wal, &lsn);
+  return s == SUCCESS ? WAL_sync( wal, lsn) : s;
 }
 
-// copy data from one table between [start .. end] indices into data[] array
-// returns index into next empty slot, i.e. the current length used (data_offset)
-static int copy_table_data( int tbl_idx,              // table index into index_table array
-			    int start_idx,            // start & end indices into table
-			    int end_idx, 
-			    int data_offset,          // offset into data array
-			    NumberAliasStruct data[], // data array
-			    int data_sz,              // size of data array
-			    int lock_table_flag       // need to lock table?
-) {
-
-  if ( start_idx > end_idx) { // nothing to copy
-    return data_offset;
-  }
-
-  char prefix[7]; 
-
-  memset( prefix, 0, sizeof( prefix));
-  snprintf( prefix, sizeof( prefix), "%ld", (long) (tbl_idx+INDEX_OFFSET));
-
-  int prefix_len = strlen( prefix);
-
-  LkupTbl *t = index_table[tbl_idx].table;
-  if ( lock_table_flag)
-    lock_table( index_table, tbl_idx);
-
-  // table size can have changed....
+// looks up the given number and returns the alias which must be mem_freed() if non NULL
+int nlkup_search_entry( const unsigned char *nbr, unsigned char **alias) {
+  return search_entry( index_table, nbr, alias);
+}
 
-  if ( t == NULL || t->table_len == 0) { // table is empty
+int nlkup_search_batch( const unsigned char *nbrs[], const int n, 
+			unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]) {
+  return search_batch( index_table, nbrs, n, aliases, status);
+}
 
-    if ( lock_table_flag)
-      unlock_table( index_table, tbl_idx);
+#define CURSOR_CHUNK 64           // entries read per lock of a slot
+#define CURSOR_END_KEY 0x7FFFFFFF // beyond all keys of a slot, the search kernels compare signed
 
-    return data_offset;
-  }
+// moves c up or down over up to n entries of the first non-empty slot of
+// [c->idx..bound], copying them into keys[] and aliases[] in ascending order.
+// the slot is locked for the copy only. returns the nbr of entries, their slot
+// is c->idx. 0 if there are none, c is then at the end of bound.
+static long cursor_read( NlkupCursor *c, const int up, const int bound, const long n, 
+			 LkupKey keys[], LkupAlias aliases[]) {
 
-  // table shrank...
-  if ( start_idx >= t->table_len-1) 
-    start_idx = t->table_len-1;
-  if ( end_idx >= t->table_len-1) 
-    end_idx = t->table_len-1;
+  while ( TRUE) {
 
-  // copy whatever is left
-  while ( start_idx <= end_idx && data_offset < data_sz) {
+    long len = 0;
 
-    // get the entry
-    LkupTblEntry *e = &(t->table[start_idx]);
+    if ( peek_table( index_table, c->idx) != NULL) { // racy peek, most slots are empty
 
-    // buffers for decompressed string data
-    char alias[MAX_NBR_LENGTH+1];
-    char postfix[MAX_NBR_LENGTH+1];
+      lock_table( index_table, c->idx);
+      LkupTbl *t = index_table[c->idx].table;
 
-    int decompression_ok = TRUE;
+      if ( t != NULL && t->table_len > 0) {
+	long r = search_entry_in_table( t, c->key);
+	if ( r < 0) // first entry after the position
+	  r = -r - 1;
+	if ( up) {
+	  len = get_lkup_tbl_entries( t, r, n, keys, aliases);
+	  if ( len > 0) 
+	    c->key = keys[len-1] + 1;
+	} else {
+	  len = r < n ? r : n;
+	  len = get_lkup_tbl_entries( t, r - len, len, keys, aliases);
+	  if ( len > 0) 
+	    c->key = keys[0];
+	}
+      }
 
-    // decompress the data
-    if ( decompress_to_buf( e->postfix, postfix, sizeof( postfix)) < 0) {
-      log_msg( ERR, "copy_table_data: decompress postfix failed\n");
-      decompression_ok = FALSE;
-    }
-    if ( decompress_to_buf( e->alias, alias, sizeof( alias)) < 0) {
-      log_msg( ERR, "copy_table_data: decompress alias failed\n");
-      decompression_ok = FALSE;
+      unlock_table( index_table, c->idx);
     }
 
-    if ( decompression_ok) {
-      // destination
-      NumberAliasStruct *na = &(data[data_offset]);
-      memset( na, 0, sizeof( NumberAliasStruct));
-
-      strncpy( na->nbr, prefix, sizeof( na->nbr));
-      strncpy( na->nbr+prefix_len, postfix, sizeof( na->nbr)+prefix_len);
-    
-      strncpy( na->alias, alias, sizeof( alias));
-
-      data_offset++;
-    } // else decompression failed, skip entry
+    if ( len > 0) 
+      return len;
 
-    start_idx++;
-    
+    // on to the next slot, the position goes to its start or end
+    if ( c->idx == bound) {
+      c->key = up ? CURSOR_END_KEY : 0;
+      return 0;
+    }
+    c->idx += up ? 1 : -1;
+    c->key = up ? 0 : CURSOR_END_KEY;
   }
-
-  if ( lock_table_flag)
-    unlock_table( index_table, tbl_idx);
-
-  // next empty slot, viz. the length
-  return data_offset;
 }
 
-// given two addresses copy the range between into data array
-static int copy_numbers( EntryAddressStruct *start, EntryAddressStruct *end, int *data_len, NumberAliasStruct *data[], int data_sz) {
-
-  *data = calloc( sizeof( NumberAliasStruct), data_sz);
-  int data_idx = 0;
-  
-  int cur_idx = start->idx_tbl_idx; // current lookup table index
-  while ( (cur_idx <= end->idx_tbl_idx) && (*data_len < data_sz)) {
-
-    LkupTbl *t = index_table[cur_idx].table;
-
-    if ( t == NULL || t->table_len == 0) {
-      cur_idx++;
+// decodes the n entries of slot idx into data[]. returns the nbr decoded,
+// entries which fail to are skipped.
+static long decode_entries( const int idx, const LkupKey keys[], const LkupAlias aliases[], const long n, 
+			    NumberAliasStruct data[]) {
+
+  char prefix[PREFIX_LENGTH+1];
+  snprintf( prefix, sizeof( prefix), "%ld", (long) (idx + INDEX_OFFSET));
+
+  long m = 0;
+  long i = 0;
+  for ( i = 0; i < n; i++) {
+    NumberAliasStruct *na = &data[m];
+    memcpy( na->nbr, prefix, PREFIX_LENGTH);
+    if ( decode_postfix( keys[i], na->nbr + PREFIX_LENGTH, sizeof( na->nbr) - PREFIX_LENGTH) < 0 || 
+	 decompress_to_buf( aliases[i].alias, na->alias, sizeof( na->alias)) < 0) {
+      log_msg( ERR, "decode_entries: failure to decode entry of %s\n", prefix);
       continue;
     }
-
-    if ( cur_idx == start->idx_tbl_idx) {    // first block
-      int start_lkup_idx = start->lkup_tbl_idx;
-      int end_lkup_idx = t->table_len-1;
-      if ( cur_idx == end->idx_tbl_idx) { // end is in first block, only copy until end->lkup_tbl_idx
-	end_lkup_idx = end->lkup_tbl_idx;
-	data_idx = copy_table_data( cur_idx, start_lkup_idx, end_lkup_idx, data_idx, *data, data_sz, TRUE);
-	*data_len = data_idx;
-	return SUCCESS;
-      } else { // copy upper part of table
-	data_idx = copy_table_data( cur_idx, start_lkup_idx, end_lkup_idx, data_idx, *data, data_sz, TRUE);
-	*data_len = data_idx;
-      }
-    } else if ( cur_idx == end->idx_tbl_idx) { // current block is last block
-      int start_lkup_idx = 0;
-      int end_lkup_idx = end->lkup_tbl_idx;
-
-      data_idx = copy_table_data( cur_idx, start_lkup_idx, end_lkup_idx, data_idx, *data, data_sz, TRUE);
-      *data_len = data_idx;
-      return SUCCESS;
-
-    } else { // block in middle
-      data_idx = copy_table_data( cur_idx, 0, t->table_len-1, data_idx, *data, data_sz, TRUE);
-      *data_len = data_idx;
-    }
-
-    cur_idx++;
+    m++;
   }
-
-  return SUCCESS;
-
-}
-
-// data structure to hold a range of number-aliases
-typedef struct {
-  int data_sz;
-  int data_len;
-  NumberAliasStruct *data;
-} RangeDataStruct;
-
-static int cmp_number_alias_struct ( const void *s1, const void *s2) {
-
-  if ( s1 == s2) 
-    return 0;
-
-  const NumberAliasStruct *n1 = (NumberAliasStruct *) s1;
-  const NumberAliasStruct *n2 = (NumberAliasStruct *) s2;
-
-  return strcasecmp( n1->nbr, n2->nbr);
+  return m;
 }
 
-static void sort_range_data( RangeDataStruct *range) {
-  qsort( range->data, range->data_len, sizeof( NumberAliasStruct), cmp_number_alias_struct);
-}
+// reads the entries of slot c->idx up to to_key into a new table, NULL if there are none
+static LkupTbl *cursor_read_table( NlkupCursor *c, const LkupKey to_key) {
 
-// starting with start we copy data before and after into range data buffer
-// the data we copy out is not sorted.
-static int copy_range_data( RangeDataStruct *range, EntryAddressStruct *start, int nbr_before, int nbr_after) {
+  const int idx = c->idx;
+  LkupTbl *t = new_lkup_tbl( DEF_LKUP_BLK_SIZE);
 
-  int end_idx = 0;
-  int start_idx = 0;
+  while ( TRUE) {
 
-  assert( range->data_sz > 0);
-  assert( range->data_len == 0);
+    if ( t->table_sz - t->table_len < CURSOR_CHUNK) 
+      resize_table( t, 2 * (t->table_len + CURSOR_CHUNK));
 
-  // allocate data array
-  range->data = calloc( sizeof( NumberAliasStruct), range->data_sz);
+    // straight into the table, as much as fits
+    long n = cursor_read( c, TRUE, idx, t->table_sz - t->table_len, 
+			  t->keys + t->table_len, t->aliases + t->table_len);
 
-  // starting table is locked. copy data before & after
+    long m = 0;
+    while ( m < n && t->keys[t->table_len + m] <= to_key) 
+      m++;
+    t->table_len += m;
 
-  // before, including nearest-entry. from start of block or nbr_before
-  start_idx = 0;
-  end_idx = start->lkup_tbl_idx-1; // excluding nearest-entry
-  if ( nbr_before < (end_idx+1) - start_idx) { // truncate start
-    start_idx = (end_idx+1) - nbr_before;
+    if ( n == 0 || m < n) 
+      break;
   }
 
-  range->data_len = copy_table_data( start->idx_tbl_idx, 
-				     start_idx, end_idx+1,  // include nearest entry!
-				     0, range->data, range->data_sz, 
-				     FALSE);
-  nbr_before -= (end_idx+1) - start_idx; // don't count nearest-entry here...
-
-  LkupTbl *t = index_table[start->idx_tbl_idx].table; // alias
-
-  // after nearest entry til end of table or nbr_after
-  start_idx = start->lkup_tbl_idx+1; // after nearest entry
-  end_idx = t->table_len-1; // max end idx
-  if ( nbr_after < (end_idx+1) - start_idx) { // truncate end
-    end_idx = start_idx + (nbr_after - 1); // indices...
-  }
-
-  range->data_len = copy_table_data( start->idx_tbl_idx, 
-				     start_idx, end_idx,
-				     range->data_len, range->data, range->data_sz, 
-				     FALSE);
-  nbr_after -= (end_idx+1) - start_idx;
-
-  // starting table is still locked....
-
-  // if necessary, copy from block tables before
-  int tbl_idx = start->idx_tbl_idx - 1;
-
-  while ( nbr_before > 0 && tbl_idx >= 0) {
-
-    t = index_table[tbl_idx].table; // alias
-
-    if ( t == NULL || t->table_len == 0) { // empty block
-      tbl_idx--;
-      continue;
-    }
-
-    lock_table( index_table, tbl_idx);
-
-    end_idx = t->table_len-1;
-    start_idx = t->table_len - nbr_before;
-    if ( start_idx < 0) // truncate
-      start_idx = 0;
-
-    range->data_len = copy_table_data( tbl_idx, 
-				       start_idx, end_idx, 
-				       range->data_len, range->data, range->data_sz, 
-				       FALSE);
-
-    unlock_table( index_table, tbl_idx);
-
-    // adjust the count before nearest entry
-    nbr_before -= (end_idx + 1) - start_idx;
-
-    tbl_idx--;  // go back one block
-  }
-
-  // if necessary, copy from block tables after
-  tbl_idx = start->idx_tbl_idx + 1;
-  while ( nbr_after > 0 && tbl_idx < (INDEX_SIZE-INDEX_OFFSET)) {
-
-    t = index_table[tbl_idx].table; // alias
-
-    if ( t == NULL || t->table_len == 0) { // empty block
-      tbl_idx++;
-      continue;
-    }
-
-    lock_table( index_table, tbl_idx);
-
-    start_idx = 0;
-    end_idx = nbr_after-1;
-    if ( end_idx >= t->table_len)
-      end_idx = t->table_len-1;
-
-    range->data_len = copy_table_data( tbl_idx, 
-				       start_idx, end_idx, 
-				       range->data_len, range->data, range->data_sz, 
-				       FALSE);
-
-    unlock_table( index_table, tbl_idx);
-
-    // adjust count after
-    nbr_after -= (end_idx + 1) - start_idx;
-
-    tbl_idx++;  // go forward one block
-
+  if ( t->table_len == 0) {
+    free_lkup_tbl( t);
+    return NULL;
   }
-
-  // the starting table is locked!
-
-  return SUCCESS;
+  return t;
 }
 
-
-// data is allocated and must be freed after use.
-int nlkup_get_range_around( const unsigned char *nbr, const int nbr_before, const int nbr_after, 
-			    int *data_len, NumberAliasStruct *data[]) {
-
-  *data_len = 0;
-  *data = NULL;
-
-  if ( nbr_before + nbr_after == 0) {
-    return FAILURE;
-  }
+int nlkup_cursor_seek( NlkupCursor *c, const unsigned char *nbr) {
 
   int idx = get_index( nbr);
   if ( idx < 0) {
-    log_msg( ERR, "nlkup_get_range_around: bad index %d: %s\n", idx, nbr);
+    log_msg( ERR, "nlkup_cursor_seek: bad index %d: %s\n", idx, nbr);
     return FAILURE;
   }
 
-  LkupTblEntry key;
-  memset( &key, 0, sizeof( LkupTblEntry));
-
-  if ( compress_to_buf( nbr, PREFIX_LENGTH, strlen( nbr)-PREFIX_LENGTH, key.postfix, POSTFIX_LENGTH) < 0) {
-    log_msg( ERR, "nlkup_get_range_around: failure to compress %s\n", nbr);
-
-    unlock_table( index_table, idx);
+  LkupKey key;
+  if ( set_up_search_key( &key, nbr) != SUCCESS) 
     return FAILURE;
-  }
-
-  EntryAddressStruct nearest_entry;
-
-  LkupTbl *t = index_table[idx].table;
-
-  lock_table( index_table, idx);
-
-  int e_idx = search_entry_in_table( t, &key);
-
-  if ( e_idx < 0) { // no such entry. take nearest neighbor
 
-    unlock_table( index_table, idx);
-
-    int i_idx = -e_idx-1; // insertion point
-
-    // find_nearest_entry if successful locks the relevant table...
-    if ( find_nearest_entry( idx, i_idx, TRUE, &nearest_entry) < 0) {
-      if ( find_nearest_entry( idx, i_idx, FALSE, &nearest_entry) < 0) {
-	log_msg( WARN, "no nearest entry for %s\n", nbr);
-	return FAILURE;
-      }
-    } 
+  c->idx = idx;
+  c->key = key;
+  return SUCCESS;
+}
 
-  } else { // found the nbr
-    nearest_entry.lkup_tbl_idx = e_idx;
-    nearest_entry.idx_tbl_idx = idx;
-  }
+static int cursor_step( NlkupCursor *c, const int up, NumberAliasStruct *na) {
 
-  // table with nearest entry is locked...
-  assert( nearest_entry.lkup_tbl_idx >= 0 && nearest_entry.idx_tbl_idx >= 0);
+  LkupKey key;
+  LkupAlias alias;
 
-  // allocate storage to copy out numbers and move along the needed blocks, locking
-  // blocks as we move along up and down the set of blocks. This avoids need for global
-  // locking. Need to sort copied out numbers since ordering is random - which is the price
-  // we pay for locking table per table and not using a global lock.
-  RangeDataStruct range;
-  memset( &range, 0, sizeof( range));
-  range.data_sz = nbr_before + nbr_after + 1;
+  if ( cursor_read( c, up, up ? INDEX_SIZE - INDEX_OFFSET - 1 : 0, 1, &key, &alias) == 0) 
+    return NO_SUCH_ENTRY;
+  return decode_entries( c->idx, &key, &alias, 1, na) == 1 ? SUCCESS : FAILURE;
+}
 
-  if ( copy_range_data( &range, &nearest_entry, nbr_before, nbr_after) < 0) {
-    log_msg( WARN, "copy_range_data failure\n", nbr);
-    return FAILURE;
-  }
+int nlkup_cursor_next( NlkupCursor *c, NumberAliasStruct *na) {
+  return cursor_step( c, TRUE, na);
+}
 
-  // unlock table with nearest matching entry
-  unlock_table( index_table, nearest_entry.idx_tbl_idx);
+int nlkup_cursor_prev( NlkupCursor *c, NumberAliasStruct *na) {
+  return cursor_step( c, FALSE, na);
+}
 
-  sort_range_data( &range);
+// data is allocated and must be freed after use. the entries around the nearest
+// one, nbr itself or the one after it, are read in order by two cursors.
+int nlkup_get_range_around( const unsigned char *nbr, const int nbr_before, const int nbr_after, 
+			    int *data_len, NumberAliasStruct *data[]) {
 
-  // set the out parameters...
-  *data = range.data;
-  *data_len = range.data_len;
+  *data_len = 0;
+  *data = NULL;
 
-  // indicate if not enough data has been copied out...
-  if ( range.data_len < nbr_before + nbr_after + 1) {
-    return NOT_ENOUGH_DATA;
+  if ( nbr_before + nbr_after == 0) {
+    return FAILURE;
   }
 
-#if 0
-
-  EntryAddressStruct start_entry;
-  EntryAddressStruct end_entry;
-  
-  memset( &start_entry, 0, sizeof( start_entry));
-  memset( &end_entry, 0, sizeof( end_entry));
+  NlkupCursor up;
+  if ( nlkup_cursor_seek( &up, nbr) != SUCCESS) {
+    log_msg( ERR, "nlkup_get_range_around: bad number %s\n", nbr);
+    return FAILURE;
+  }
+  NlkupCursor down = up;
 
-  log_msg( DEBUG, "nearest_entry: lkup_tbl_idx %d idx_tbl_idx %d\n", nearest_entry.lkup_tbl_idx, nearest_entry.idx_tbl_idx);
+  LkupKey keys[CURSOR_CHUNK];
+  LkupAlias aliases[CURSOR_CHUNK];
 
-  int rc = 0;
-  if (( rc = find_start_entry( &nearest_entry, nbr_before, &start_entry)) < 0) {
-    if ( rc != NOT_ENOUGH_DATA) {
-      log_msg( ERR, "no starting entry found for %s\n", nbr);
-      return FAILURE;
-    }
-  } 
-  
-  if (( rc = find_end_entry( &nearest_entry, nbr_after, &end_entry)) < 0) {
-    if ( rc != NOT_ENOUGH_DATA) {
-      log_msg( ERR, "no ending entry found for %s\n", nbr);
+  // the nearest entry, the last one if there is none after nbr
+  if ( cursor_read( &up, TRUE, INDEX_SIZE - INDEX_OFFSET - 1, 1, keys, aliases) == 0) {
+    up = down;
+    if ( cursor_read( &up, FALSE, 0, 1, keys, aliases) == 0) {
+      log_msg( WARN, "no nearest entry for %s\n", nbr);
       return FAILURE;
     }
   }
+  down.idx = up.idx;
+  down.key = keys[0];
+  up.key = keys[0] + 1;
 
-  log_msg( DEBUG, "start_entry: lkup_tbl_idx %d idx_tbl_idx %d\n", start_entry.lkup_tbl_idx, start_entry.idx_tbl_idx);
-  log_msg( DEBUG, "end_entry: lkup_tbl_idx %d idx_tbl_idx %d\n", end_entry.lkup_tbl_idx, end_entry.idx_tbl_idx);
-
-  if ( copy_numbers( &start_entry, &end_entry, data_len, data, nbr_before+nbr_after+1) < 0) {
-    *data_len = 0;
-    *data = NULL;
+  NumberAliasStruct *d = calloc( nbr_before + nbr_after + 1, sizeof( NumberAliasStruct));
+  if ( d == NULL) {
+    log_msg( CRIT, "nlkup_get_range_around: out of heap space\n");
     return FAILURE;
   }
 
-#endif
+  // the ones before come in descending chunks, each is put in front of the previous one
+  long n = decode_entries( up.idx, keys, aliases, 1, d + nbr_before);
+  long before = 0;
+  while ( before < nbr_before) {
+    long want = nbr_before - before < CURSOR_CHUNK ? nbr_before - before : CURSOR_CHUNK;
+    long got = cursor_read( &down, FALSE, 0, want, keys, aliases);
+    if ( got == 0) 
+      break;
+    long dst = nbr_before - before - got;
+    long m = decode_entries( down.idx, keys, aliases, got, d + dst);
+    if ( m < got) // close the gap of those failing to decode
+      memmove( d + dst + got - m, d + dst, m * sizeof( NumberAliasStruct));
+    before += m;
+  }
+  if ( before < nbr_before) 
+    memmove( d, d + nbr_before - before, (before + n) * sizeof( NumberAliasStruct));
+  n += before;
+
+  while ( n < before + 1 + nbr_after) {
+    long want = before + 1 + nbr_after - n < CURSOR_CHUNK ? before + 1 + nbr_after - n : CURSOR_CHUNK;
+    long got = cursor_read( &up, TRUE, INDEX_SIZE - INDEX_OFFSET - 1, want, keys, aliases);
+    if ( got == 0) 
+      break;
+    n += decode_entries( up.idx, keys, aliases, got, d + n);
+  }
 
+  *data = d;
+  *data_len = n;
+
+  // indicate if not enough data has been copied out...
+  if ( n < nbr_before + nbr_after + 1) {
+    return NOT_ENOUGH_DATA;
+  }
   return SUCCESS;
 }
 
@@ -1240,61 +1356,97 @@ int nlkup_get_range( const unsigned char *nbr, const unsigned char *postfix_rang
 
   log_msg( DEBUG, "nlkup_get_range: from_nbr %s to_nbr %s\n", from_nbr, to_nbr);
 
-  // find the indices of nbr+"00000" and nbr+"99999"
-  int idx = get_index( nbr);
-  if ( idx < 0) {
-    log_msg( ERR, "nlkup_get_range: bad index %d: %s\n", idx, nbr);
+  // both are of the slot of nbr
+  NlkupCursor c;
+  LkupKey to_key;
+
+  if ( nlkup_cursor_seek( &c, from_nbr) != SUCCESS || 
+       set_up_search_key( &to_key, to_nbr) != SUCCESS) {
+    log_msg( ERR, "nlkup_get_range: setting up search keys %s %s\n", from_nbr, to_nbr);
     return FAILURE;
   }
 
-  int status = SUCCESS;
-  lock_table( index_table, idx);
-
-  LkupTbl *t = index_table[idx].table;
+  *table = cursor_read_table( &c, to_key);
+  return SUCCESS;
+}
 
-  // no table, no data...
-  if ( t == NULL) {
-    goto out;
-  }
+int nlkup_numbers_for_alias( const unsigned char *alias, const int prefix, 
+			     const unsigned char *after_alias, const unsigned char *after_nbr, const int limit, 
+			     int *data_len, NumberAliasStruct *data[], int *more, int *ready) {
 
-  LkupTblEntry from_key;
-  LkupTblEntry to_key;
+  *data_len = 0;
+  *data = NULL;
+  *more = FALSE;
+  *ready = FALSE;
 
-  if ( set_up_search_key( &from_key, from_nbr) != SUCCESS || 
-       set_up_search_key( &to_key, to_nbr) != SUCCESS) {
-    log_msg( ERR, "nlkup_get_range: setting up search keys %s %s\n", from_nbr, to_nbr);
-    status = FAILURE;
-    goto out;
+  if ( reverse_index == NULL) {
+    log_msg( ERR, "nlkup_numbers_for_alias: reverse index disabled\n");
+    return FAILURE;
   }
 
-  int from_idx = search_entry_in_table( t, &from_key);
-  int to_idx = search_entry_in_table( t, &to_key);
+  uint64_t key = 0;
+  if ( alias == NULL || strlen( alias) == 0 || RX_alias_key( alias, strlen( alias), &key) < 0) {
+    log_msg( ERR, "nlkup_numbers_for_alias: bad alias %s\n", alias != NULL ? (char *) alias : "");
+    return FAILURE;
+  }
 
-  // log_msg( DEBUG, "nlkup_get_range: from_idx %d to_idx %d\n", from_idx, to_idx);
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+  RX_prefix_range( key, prefix ? strlen( alias) : RX_MAX_DIGITS, &lo, &hi);
 
-  // idx < 0: not found. index = -insertion_point - 1
-  if ( from_idx < 0) { // insertion point is *after* next smaller entry
-    from_idx = -from_idx-1;
-  }
-  if ( to_idx < 0) { // insertion point is *after* last largest entry. hence -1 once more
-    to_idx = -to_idx-1-1;
+  // the page goes on after the last entry of the previous one
+  RX_Entry after;
+  if ( after_nbr != NULL) {
+    const unsigned char *a = after_alias != NULL ? after_alias : alias;
+    int idx = get_index( after_nbr);
+    LkupKey k;
+    if ( idx < 0 || set_up_search_key( &k, after_nbr) != SUCCESS || 
+	 RX_alias_key( a, strlen( a), &after.alias) < 0) {
+      log_msg( ERR, "nlkup_numbers_for_alias: bad page start %s %s\n", a, after_nbr);
+      return FAILURE;
+    }
+    after.nbr = ((uint64_t) idx << 32) | k;
   }
 
-  log_msg( DEBUG, "nlkup_get_range: from_idx %d to_idx %d\n", from_idx, to_idx);
+  int n = limit <= 0 ? DEF_ALIAS_PAGE_LENGTH : limit;
+  if ( n > MAX_ALIAS_PAGE_LENGTH) 
+    n = MAX_ALIAS_PAGE_LENGTH;
 
-  assert( from_idx >= 0 && from_idx < t->table_len);
-  assert( to_idx >= 0 && to_idx < t->table_len);
-  assert( from_idx <= to_idx);
+  // complete if the index was ready before we looked
+  *ready = RX_ready( reverse_index);
 
-  // copy data into a newly allocated table, [from_idx..to_idx]
-  LkupTbl *new_table = copy_lkup_tbl_range( t, from_idx, to_idx);
+  // one more tells whether there is a next page
+  RX_Entry *found = malloc( (n + 1) * sizeof( RX_Entry));
+  NumberAliasStruct *d = calloc( n + 1, sizeof( NumberAliasStruct));
+  if ( found == NULL || d == NULL) {
+    log_msg( ERR, "nlkup_numbers_for_alias: out of memory\n");
+    free( found);
+    free( d);
+    return FAILURE;
+  }
 
-  *table = new_table;
+  long m = RX_find( reverse_index, lo, hi, after_nbr != NULL ? &after : NULL, n + 1, found);
+  if ( m > n) {
+    *more = TRUE;
+    m = n;
+  }
 
- out:
-  unlock_table( index_table, idx);
-  return status;
+  long i = 0;
+  for ( i = 0; i < m; i++) {
+    int idx = (int) (found[i].nbr >> 32);
+    NumberAliasStruct *na = &d[*data_len];
+    snprintf( na->nbr, sizeof( na->nbr), "%ld", (long) (idx + INDEX_OFFSET));
+    if ( decode_postfix( (LkupKey) found[i].nbr, na->nbr + PREFIX_LENGTH, sizeof( na->nbr) - PREFIX_LENGTH) < 0 || 
+	 RX_alias_digits( found[i].alias, na->alias, sizeof( na->alias)) < 0) {
+      log_msg( ERR, "nlkup_numbers_for_alias: failure to decode entry of %ld\n", (long) (idx + INDEX_OFFSET));
+      continue;
+    }
+    (*data_len)++;
+  }
 
+  free( found);
+  *data = d;
+  return SUCCESS;
 }
 
 
@@ -1329,132 +1481,456 @@ JSON_Buffer number_aliases_to_json( const int data_len, const NumberAliasStruct
   return json;
 }
 
-// attempts to retrieve the block of given number. must be mem_freed() if non NULL
-int nlkup_get_block( const unsigned char *nbr, LkupTblPtr *table) {
-  int idx = get_index( nbr);
-  if ( idx < 0) {
-    log_msg( ERR, "nlkup_get_block: bad index %d: %s\n", idx, nbr);
-    return FAILURE;
+// quoted number, anything but digits replaced. numbers may come from the request.
+static void quote_number( char buf[], const int buf_sz, const unsigned char *nbr) {
+  int i = 0;
+  int n = 0;
+  buf[n++] = '"';
+  for ( i = 0; nbr[i] != '\0' && i < MAX_NBR_LENGTH && n < buf_sz - 2; i++) {
+    buf[n++] = isdigit( nbr[i]) ? nbr[i] : '?';
   }
+  buf[n++] = '"';
+  buf[n] = '\0';
+}
 
-  lock_table( index_table, idx);
-  LkupTbl *t = index_table[idx].table;
-  if ( t == NULL) {
-    *table = NULL;
-  } else {
-    *table = copy_lkup_tbl( t);
+// a page of numbers by alias, empty pages included
+JSON_Buffer alias_numbers_to_json( const int data_len, const NumberAliasStruct *data, const int more, const int ready) {
+
+  JSON_Buffer json = json_new();
+  char buf[MAX_NBR_LENGTH+3];
+
+  json_begin_obj( json, NULL);
+
+  json_begin_arr( json, "data");
+  int i = 0;
+  for ( i = 0; i < data_len; i++) {
+    json_begin_obj( json, NULL);
+    // aliases may have leading zeros, bare they are no JSON numbers
+    quote_number( buf, sizeof( buf), (unsigned char *) data[i].nbr);
+    json_append_str( json, "number", buf);
+    quote_number( buf, sizeof( buf), (unsigned char *) data[i].alias);
+    json_append_str( json, "alias", buf);
+    json_end_obj( json);
   }
-  unlock_table( index_table, idx);
-  return SUCCESS;
-}
+  json_end_arr( json);
 
-int nlkup_dump_file( const unsigned char *fn, int binary) {
-  return dump_all_fn( index_table, fn, binary);
-}
+  json_append_long( json, "more", more);
+  json_append_long( json, "ready", ready);
 
-int nlkup_restore_file( const unsigned char *fn, int binary) {
-  return restore_all_fn( index_table, fn);
+  json_end_obj( json);
+  return json;
 }
 
-static int check_nbr( const char *nbr) {
-  if ( !all_digits( nbr) || strlen( nbr) >= MAX_NBR_LENGTH) {
-    log_msg( ERR, "process_file: illegal number %s\n", nbr);
-    return 0;
+// an array of { "number": ..., "alias": ..., "status": ... }
+JSON_Buffer nbr_alias_status_to_json( const int n, const unsigned char *nbrs[], 
+				      unsigned char aliases[][MAX_NBR_LENGTH+1], const int status[]) {
+
+  JSON_Buffer json = json_new();
+  char buf[MAX_NBR_LENGTH+3];
+  int i = 0;
+
+  json_begin_arr( json, NULL);
+
+  for ( i = 0; i < n; i++) {
+    json_begin_obj( json, NULL);
+    quote_number( buf, sizeof( buf), nbrs[i]);
+    json_append_str( json, "number", buf);
+    quote_number( buf, sizeof( buf), status[i] == SUCCESS ? aliases[i] : (unsigned char *) "");
+    json_append_str( json, "alias", buf);
+    json_append_int( json, "status", status[i]);
+    json_end_obj( json);
   }
-  return 1;
+
+  json_end_arr( json);
+  return json;
 }
 
-static int process_file( IdxTblEntry index_table[], FILE *f) {
+// memory by category, entry counts and slab usage
+JSON_Buffer stats_to_json( const NlkupStats *stats) {
+
+  JSON_Buffer json = json_new();
 
-  int s = 0;
+  long total = 0;
+  int i = 0;
 
-  char str_buf[1024];
+  json_begin_obj( json, NULL);
+
+  json_begin_obj( json, "memory");
+  for ( i = 0; i < MEM_NBR_CATEGORIES; i++) {
+    long bytes = mem_usage_cat( i);
+    json_append_long( json, mem_category_name( i), bytes);
+    total += bytes;
+  }
+  json_append_long( json, "total", total);
+  json_end_obj( json);
+
+  long reserved = SL_reserved();
+  long used = SL_used();
+
+  json_begin_obj( json, "slab");
+  json_append_long( json, "reserved", reserved);
+  json_append_long( json, "used", used);
+  json_append_long( json, "fragmentation_pct", reserved > 0 ? 100 * (reserved - used) / reserved : 0);
+  json_end_obj( json);
+
+  // what the numbers themselves cost, index and block storage
+  long nbr_bytes = mem_usage_cat( MEM_INDEX) + mem_usage_cat( MEM_BLOCK_HEADERS) + 
+    mem_usage_cat( MEM_ENTRY_ARRAYS) + mem_usage_cat( MEM_BTREE_NODES);
+
+  char bpn[64];
+  snprintf( bpn, sizeof( bpn), "%.2f", stats->entries > 0 ? (double) nbr_bytes / stats->entries : 0.0);
+
+  json_append_long( json, "entries", stats->entries);
+  json_append_long( json, "blocks", stats->blocks);
+  json_append_long( json, "tree_blocks", stats->tree_blocks);
+  json_append_long( json, "mapped_blocks", stats->mapped_blocks);
+  json_append_long( json, "slots", stats->slots);
+  json_append_str( json, "bytes_per_number", bpn);
+
+  json_begin_obj( json, "checkpoint");
+  json_append_long( json, "written", stats->checkpoints);
+  json_append_long( json, "failures", stats->checkpoint_failures);
+  json_append_long( json, "last_usec", stats->last_checkpoint_usec);
+  json_append_long( json, "last_pause_usec", stats->last_checkpoint_pause_usec);
+  json_append_long( json, "last_bytes", stats->last_checkpoint_bytes);
+  json_append_long( json, "last_max_lock_usec", stats->last_checkpoint_max_lock_usec);
+  json_append_long( json, "last_throttled_usec", stats->last_checkpoint_throttled_usec);
+  json_append_long( json, "last_status", stats->last_checkpoint_status);
+  json_append_long( json, "last_forked", stats->last_checkpoint_forked);
+  json_end_obj( json);
+
+  json_begin_obj( json, "restore");
+  json_append_long( json, "ready", stats->ready);
+  json_append_long( json, "progress_pct", stats->restore_pct);
+  json_append_long( json, "blocks_left", stats->restore_blocks_left);
+  json_append_long( json, "on_demand", stats->restore_on_demand);
+  json_end_obj( json);
+
+  char bpe[64];
+  snprintf( bpe, sizeof( bpe), "%.2f", stats->reverse_index_entries > 0 ? 
+	    (double) stats->reverse_index_bytes / stats->reverse_index_entries : 0.0);
+
+  json_begin_obj( json, "reverse_index");
+  json_append_long( json, "enabled", stats->reverse_index);
+  json_append_long( json, "ready", stats->reverse_index_ready);
+  json_append_long( json, "progress_pct", stats->reverse_index_pct);
+  json_append_long( json, "entries", stats->reverse_index_entries);
+  json_append_long( json, "bytes", stats->reverse_index_bytes);
+  json_append_str( json, "bytes_per_entry", bpe);
+  json_end_obj( json);
+
+  json_end_obj( json);
+  return json;
+}
 
-  while ( fgets( str_buf, sizeof( str_buf), f) != NULL) {
-    
-    if ( strlen( str_buf) == 0 || all_spaces( str_buf) || str_buf[0] == '#') {
+// the outcome of checkpoints, only the checkpoint fields are used
+static pthread_mutex_t checkpoint_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static NlkupStats checkpoint_stats;
+
+void nlkup_get_stats( NlkupStats *stats) {
+
+  memset( stats, 0, sizeof( NlkupStats));
+  stats->slots = INDEX_SIZE - INDEX_OFFSET;
+
+  pthread_mutex_lock( &checkpoint_stats_mutex);
+  stats->checkpoints = checkpoint_stats.checkpoints;
+  stats->checkpoint_failures = checkpoint_stats.checkpoint_failures;
+  stats->last_checkpoint_usec = checkpoint_stats.last_checkpoint_usec;
+  stats->last_checkpoint_pause_usec = checkpoint_stats.last_checkpoint_pause_usec;
+  stats->last_checkpoint_bytes = checkpoint_stats.last_checkpoint_bytes;
+  stats->last_checkpoint_max_lock_usec = checkpoint_stats.last_checkpoint_max_lock_usec;
+  stats->last_checkpoint_throttled_usec = checkpoint_stats.last_checkpoint_throttled_usec;
+  stats->last_checkpoint_status = checkpoint_stats.last_checkpoint_status;
+  stats->last_checkpoint_forked = checkpoint_stats.last_checkpoint_forked;
+  pthread_mutex_unlock( &checkpoint_stats_mutex);
+
+  long total = 0;
+  lazy_restore_progress( &stats->restore_blocks_left, &total, &stats->restore_on_demand);
+  stats->ready = stats->restore_blocks_left == 0;
+  stats->restore_pct = total > 0 ? (int) (100 * (total - stats->restore_blocks_left) / total) : 100;
+
+  if ( reverse_index != NULL) {
+    RX_Stats rs;
+    RX_get_stats( reverse_index, &rs);
+    stats->reverse_index = TRUE;
+    stats->reverse_index_ready = rs.ready;
+    stats->reverse_index_pct = rs.build_pct;
+    stats->reverse_index_entries = rs.entries;
+    stats->reverse_index_bytes = rs.bytes;
+  }
+
+  int idx = 0;
+  for ( idx = 0; idx < INDEX_SIZE - INDEX_OFFSET; idx++) {
+
+    if ( index_table[idx].table == NULL) // racy peek, most slots are empty
       continue;
-    }
 
-    int nbr_tokens;
-    char **tokens = str_split( str_buf, '=', &nbr_tokens);
-    if ( tokens == NULL) {
-      log_msg( ERR, "process_file: str_split returned NULL\n");
-      s = -1;
-      continue;
-    }
-    if ( nbr_tokens < 2 || tokens[0] == NULL || tokens[1] == NULL) {
-      log_msg( ERR, "process_file: str_split returned not enough tokens\n");      
-      s = -1;
-      continue;
+    lock_table( index_table, idx);
+    LkupTbl *t = index_table[idx].table;
+    if ( t != NULL) {
+      stats->entries += t->table_len;
+      stats->blocks++;
+      if ( t->tree != NULL) 
+	stats->tree_blocks++;
+      if ( t->map != NULL) 
+	stats->mapped_blocks++;
     }
+    unlock_table( index_table, idx);
+  }
+}
 
-    if ( strcasecmp( tokens[0], "add") == 0) {
+// attempts to retrieve the block of given number. must be mem_freed() if non NULL
+int nlkup_get_block( const unsigned char *nbr, LkupTblPtr *table) {
 
-      if ( nbr_tokens < 3 || IS_NULL( tokens[1]) || IS_NULL( tokens[2])) {
-	log_msg( ERR, "process_file: illegal add %s\n", str_buf);
-	s = -1;
-      } else {
-	char *nbr = tokens[1];
-	char *alias = tokens[2];
+  *table = NULL;
 
-	if ( check_nbr( nbr) && check_nbr( alias)) {
-	  enter_entry( index_table, nbr, alias);
-	} else {
-	  log_msg( ERR, "process_file: bad number or alias %s\n", str_buf);
-	  s = -1;
-	}
+  int idx = get_index( nbr);
+  if ( idx < 0) {
+    log_msg( ERR, "nlkup_get_block: bad index %d: %s\n", idx, nbr);
+    return FAILURE;
+  }
 
-      }
+  NlkupCursor c = { idx, 0 };
+  *table = cursor_read_table( &c, CURSOR_END_KEY);
+  return SUCCESS;
+}
 
-    } else if ( strcasecmp( tokens[0], "del") == 0) {
+// binary dumps are split into "checkpoint_threads" segments written in parallel,
+// compressed if "checkpoint_compression" is set
+int nlkup_dump_file( const unsigned char *fn, int binary) {
+  if ( binary) 
+    return dump_segments_fn( index_table, fn, CFG_get_int( "checkpoint_threads", 1),
+			     CFG_get_int( "checkpoint_compression", FALSE) ? DUMP_V2_DELTA : 0);
+  return dump_all_fn( index_table, fn, binary);
+}
 
-	char *nbr = tokens[1];
+// the chain of checkpoints written so far, generation 0 if there is none yet
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DumpCheckpoint last_checkpoint;
+static char last_checkpoint_fn[DUMP_SEGMENT_FN_LENGTH];
+static int checkpoint_increments = 0;
 
-	if ( check_nbr( nbr)) {
-	  delete_entry( index_table, nbr);
-	} else {
-	  log_msg( ERR, "process_file: bad number %s\n", str_buf);
-	}
+int nlkup_restore_file( const unsigned char *fn, int binary) {
+  pthread_mutex_lock( &checkpoint_mutex);
 
+  int s = restore_all_fn( index_table, fn, CFG_get_int( "map_snapshot", FALSE));
 
-    } else {
-      log_msg( ERR, "process_file: unhandled command %s\n", str_buf);
-      s = -1;
-    }
-    
-    free_tokens( tokens);
-  }
-  
-  return s;
+  // the tables were replaced wholesale, even if the restore failed half way
+  if ( reverse_index != NULL && RX_rebuild( reverse_index) != SUCCESS) 
+    s = FAILURE;
+
+  // the log goes on from the restored file, the next checkpoint starts a new chain
+  if ( s == SUCCESS && wal != NULL) 
+    s = WAL_checkpoint( wal, fn, WAL_last_lsn( wal));
+  last_checkpoint.generation = 0;
 
+  pthread_mutex_unlock( &checkpoint_mutex);
+  return s;
 }
 
-// processing a file of add or del commands
-int nlkup_process_file( const unsigned char *fn) {
+char *nlkup_wal_base_fn() {
+  return wal != NULL ? WAL_base_fn( wal) : NULL;
+}
 
-  if ( IS_NULL( fn))
+// writes the checkpoint in a forked child. writers are held back just for the
+// fork, the child dumps the copy-on-write image of that moment while this
+// process serves on. epoch and lsn are taken at the fork, the child reports
+// its stats through a pipe. forked is FALSE if there was no child.
+// the child only runs code whose locks are reset after the fork, the config
+// is read before. a child not done within timeout_sec is killed.
+static int fork_checkpoint( const unsigned char *fn, const int nbr_threads, const int flags, const DumpCheckpoint *ck, 
+			    const int timeout_sec, DumpStats *stats, uint32_t *epoch, uint64_t *lsn, long *pause_usec, int *forked) {
+
+  int fds[2];
+  if ( pipe( fds) < 0) {
+    log_msg( ERR, "fork_checkpoint: pipe() failed: %s\n", strerror( errno));
+    *forked = FALSE;
     return FAILURE;
+  }
 
-  FILE *f = fopen( fn, "r");
-  if ( f == NULL) {
-    log_msg( ERR, "failure to read-open %s\n", fn);
-    return FAILURE;
+  long start = get_time_micro();
+  pause_table_writes();
+
+  *epoch = next_change_epoch();
+  *lsn = wal != NULL ? WAL_last_lsn( wal) : 0;
+
+  pid_t pid = fork();
+  if ( pid == 0) {
+    // only this thread lives on. stripes other threads held at the fork are
+    // unlocked, the logger is not: it is silenced.
+    reset_lock_stripes();
+    log_set_level( EMERG);
+    close( fds[0]);
+    int s = dump_checkpoint_fn( index_table, fn, nbr_threads, flags, ck, stats);
+    if ( write( fds[1], stats, sizeof( DumpStats)) != sizeof( DumpStats)) 
+      s = FAILURE;
+    _exit( s == SUCCESS ? 0 : 1);
   }
 
-  log_msg( INFO, "starting process file from %s\n", fn);
+  resume_table_writes();
+  *pause_usec = get_time_micro() - start;
 
-  int s = process_file( index_table, f);
+  close( fds[1]);
+  *forked = pid > 0;
+  if ( pid < 0) {
+    log_msg( ERR, "fork_checkpoint: fork() failed: %s\n", strerror( errno));
+    close( fds[0]);
+    return FAILURE;
+  }
 
-  log_msg( INFO, "processing done\n");
-  
-  if ( fclose( f) < 0) {
-    log_msg( ERR, "failure to close %s\n", fn);
+  // the stats fit into the pipe, the child does not wait for them to be read.
+  // the pipe is closed without stats if the child fails before.
+  long deadline = start + timeout_sec * 1000000L;
+  struct pollfd pfd;
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  int ready = 0;
+  do {
+    long msec = (deadline - get_time_micro()) / 1000;
+    ready = poll( &pfd, 1, msec > 0 ? msec : 0);
+  } while ( ready < 0 && errno == EINTR);
+  if ( ready > 0) {
+    while ( read( fds[0], stats, sizeof( DumpStats)) < 0 && errno == EINTR) 
+      ;
+  }
+  close( fds[0]);
+
+  int status = 0;
+  pid_t done = 0;
+  while (( done = waitpid( pid, &status, WNOHANG)) == 0 || (done < 0 && errno == EINTR)) {
+    if ( get_time_micro() >= deadline) 
+      break;
+    usleep( 1000);
+  }
+
+  if ( done < 0) {
+    log_msg( ERR, "fork_checkpoint: waitpid() failed: %s\n", strerror( errno));
     return FAILURE;
   }
+  if ( done == 0) {
+    log_msg( ERR, "fork_checkpoint: %s: child not done in %d s, killed\n", fn, timeout_sec);
+    kill( pid, SIGKILL);
+    while ( waitpid( pid, &status, 0) < 0 && errno == EINTR) 
+      ;
+    return FAILURE;
+  }
+
+  if ( WIFSIGNALED( status)) {
+    log_msg( ERR, "fork_checkpoint: %s: child killed by signal %d\n", fn, WTERMSIG( status));
+    return FAILURE;
+  }
+  return WIFEXITED( status) && WEXITSTATUS( status) == 0 ? SUCCESS : FAILURE;
+}
+
+int nlkup_checkpoint_file( const unsigned char *fn) {
+
+  int full_interval = CFG_get_int( "checkpoint_full_interval", 10);
+  int flags = CFG_get_int( "checkpoint_compression", FALSE) ? DUMP_V2_DELTA : 0;
+  int nbr_threads = CFG_get_int( "checkpoint_threads", 1);
+  int use_fork = CFG_get_int( "checkpoint_fork", FALSE);
+  int fork_timeout_sec = CFG_get_int( "checkpoint_fork_timeout_sec", 600);
+
+  pthread_mutex_lock( &checkpoint_mutex);
+
+  // a forked child could not load what a lazy restore has left, slots which
+  // failed to load must not be written as empty
+  int lazy = finish_lazy_restore( index_table);
+
+  long start = get_time_micro();
+  long pause_usec = 0;
+  int forked = FALSE;
+  uint32_t epoch = 0;
+  uint64_t lsn = 0;
+  DumpStats ds;
+  memset( &ds, 0, sizeof( ds));
+
+  DumpCheckpoint ck;
+  memset( &ck, 0, sizeof( ck));
+  ck.generation = get_time_micro();
+
+  // an increment needs the previous checkpoint, it may have been removed meanwhile
+  if ( last_checkpoint.generation != 0 && checkpoint_increments + 1 < full_interval &&
+       strlen( fn) < sizeof( last_checkpoint_fn) && access( last_checkpoint_fn, R_OK) == 0) {
+    flags |= DUMP_V2_INCREMENT;
+    ck.since = last_checkpoint.since;
+    ck.chain.base_generation = last_checkpoint.chain.base_generation;
+    ck.chain.prev_generation = last_checkpoint.generation;
+    strcpy( ck.chain.prev_fn, last_checkpoint_fn);
+  } else if ( last_checkpoint.generation != 0 && strcmp( fn, last_checkpoint_fn) != 0 && 
+	      access( last_checkpoint_fn, R_OK) == 0) {
+    // a full one names the previous checkpoint, restored instead if this one is corrupt
+    flags |= DUMP_V2_LINKED;
+    ck.chain.prev_generation = last_checkpoint.generation;
+    strcpy( ck.chain.prev_fn, last_checkpoint_fn);
+  }
+
+  // whatever is stamped up to epoch or logged up to lsn gets into this checkpoint
+  int s = FAILURE;
+  if ( lazy == SUCCESS && use_fork) 
+    s = fork_checkpoint( fn, nbr_threads, flags, &ck, fork_timeout_sec, &ds, &epoch, &lsn, &pause_usec, &forked);
+  if ( lazy == SUCCESS && !forked) {
+    epoch = next_change_epoch();
+    lsn = wal != NULL ? WAL_last_lsn( wal) : 0;
+    s = dump_checkpoint_fn( index_table, fn, nbr_threads, flags, &ck, &ds);
+  }
+
+  if ( s == SUCCESS) {
+    if ( flags & DUMP_V2_INCREMENT) {
+      checkpoint_increments++;
+    } else {
+      ck.chain.base_generation = ck.generation;
+      checkpoint_increments = 0;
+    }
+    ck.since = epoch;
+    last_checkpoint = ck;
+    // too long names are never linked to, the next checkpoint is a full one
+    if ( strlen( fn) < sizeof( last_checkpoint_fn)) 
+      strcpy( last_checkpoint_fn, fn);
+    else 
+      last_checkpoint.generation = 0;
+
+    // the checkpoint and its directory are synced, the log only keeps what came after
+    if ( wal != NULL) 
+      s = WAL_checkpoint( wal, fn, lsn);
+  }
+
+  long usec = get_time_micro() - start;
+  if ( s == SUCCESS) 
+    log_msg( INFO, "nlkup_checkpoint_file: %s: %s checkpoint of %ld bytes in %ld usec%s, writers paused %ld usec, "
+	     "slots locked %ld usec at most, throttled %ld usec\n", fn, flags & DUMP_V2_INCREMENT ? "incremental" : "full", 
+	     ds.bytes, usec, forked ? " by child" : "", pause_usec, ds.max_lock_usec, ds.throttled_usec);
+  else 
+    log_msg( ERR, "nlkup_checkpoint_file: %s: checkpoint failed after %ld usec\n", fn, usec);
+
+  pthread_mutex_lock( &checkpoint_stats_mutex);
+  if ( s == SUCCESS) 
+    checkpoint_stats.checkpoints++;
+  else 
+    checkpoint_stats.checkpoint_failures++;
+  checkpoint_stats.last_checkpoint_usec = usec;
+  checkpoint_stats.last_checkpoint_pause_usec = pause_usec;
+  checkpoint_stats.last_checkpoint_bytes = ds.bytes;
+  checkpoint_stats.last_checkpoint_max_lock_usec = ds.max_lock_usec;
+  checkpoint_stats.last_checkpoint_throttled_usec = ds.throttled_usec;
+  checkpoint_stats.last_checkpoint_status = s;
+  checkpoint_stats.last_checkpoint_forked = forked;
+  pthread_mutex_unlock( &checkpoint_stats_mutex);
+
+  pthread_mutex_unlock( &checkpoint_mutex);
+  return s;
+}
+
+int nlkup_bulk_load( const unsigned char *fn, BL_Stats *stats) {
+  int s = BL_load( index_table, fn, CFG_get_int( "bulk_load_threads", 0), wal, stats);
 
+  // the loaded tables were switched in without the reverse index seeing their entries
+  if ( reverse_index != NULL && RX_rebuild( reverse_index) != SUCCESS) 
+    s = FAILURE;
   return s;
+}
 
+int nlkup_process_file( const unsigned char *fn, BL_ProcStats *stats) {
+  return BL_process( index_table, fn, CFG_get_int( "process_file_threads", 0), wal, stats);
 }
 
 
@@ -1468,9 +1944,6 @@ int main( int argc, char **argv) {
   mem_free( pp);
   exit( 0);
 
-  LkupTblEntry *e = alloc_lkup_tbl_entry();
-  free_lkup_tbl_entry( e);
-
   LkupTbl *t = alloc_lkup_tbl();
   free_lkup_tbl( t);
 
@@ -1478,7 +1951,7 @@ int main( int argc, char **argv) {
 
 #if 0
 
-  fprintf( stderr, "sizeof( LkupTblEntry) = %ld\n", sizeof( LkupTblEntry));
+  fprintf( stderr, "sizeof( LkupKey) = %ld\n", sizeof( LkupKey));
   alloc_lkup_tbl_in_index( index_table, 100);
   alloc_lkup_tbl_in_index( index_table, 200);
   alloc_lkup_tbl_in_index( index_table, 12345);
@@ -1540,7 +2013,7 @@ int main( int argc, char **argv) {
   dump_all_fn( index_table, "dump.txt", FALSE);
   dump_all_fn( index_table, "dump.bin", TRUE);
 
-  restore_all_fn( index_table, "dump.bin");
+  restore_all_fn( index_table, "dump.bin", FALSE);
   dump_all_fn( index_table, "dump2.txt", FALSE);
 
   fprintf( stderr, "done\n");
@@ -1548,3 +2021,287 @@ int main( int argc, char **argv) {
 }
 
 #endif
+
+#ifdef _LOOKUP_MAIN_
+
+// lookup benchmark: ns per lookup over many blocks, e.g.
+//   lookup_bench off 10000000
+//   lookup_bench madvise 10000000
+
+// numbers reproducible from their sequence number
+static void bench_nbr( unsigned long i, char nbr[]) {
+  unsigned long h = (i + 1) * 0x9E3779B97F4A7C15UL;
+  h ^= h >> 29;
+  snprintf( nbr, MAX_NBR_LENGTH + 1, "%06lu%04lu", 100000 + (h >> 8) % 900000, (h >> 40) % 10000);
+}
+
+static long anon_huge_kb() {
+  FILE *f = fopen( "/proc/self/smaps_rollup", "r");
+  char line[256];
+  long kb = -1;
+  if ( f == NULL) 
+    return -1;
+  while ( fgets( line, sizeof( line), f) != NULL) {
+    if ( sscanf( line, "AnonHugePages: %ld kB", &kb) == 1) 
+      break;
+  }
+  fclose( f);
+  return kb;
+}
+
+int main( int argc, char **argv) {
+
+  const char *mode = argc > 1 ? argv[1] : "off";
+  long n = argc > 2 ? atol( argv[2]) : 10000000;
+  const long nbr_probes = 4000000;
+  char nbr[MAX_NBR_LENGTH+1];
+  unsigned char alias[MAX_NBR_LENGTH+1];
+  long i = 0;
+
+  log_set_level( ERR);
+
+  // other settings come from configs.txt, if any. huge_pages there takes precedence.
+  CFG_init( "configs.txt");
+
+  if ( SL_set_huge_pages( mode) < 0 || init_index() != SUCCESS) {
+    fprintf( stderr, "init failed\n");
+    exit( 1);
+  }
+
+  long t0 = get_time_micro();
+  for ( i = 0; i < n; i++) {
+    bench_nbr( i, nbr);
+    nlkup_enter_entry( nbr, "41791234567");
+  }
+  long t1 = get_time_micro();
+
+  NlkupStats stats;
+  nlkup_get_stats( &stats);
+
+  // random probes over all blocks, generated up front
+  char (*probes)[MAX_NBR_LENGTH+1] = malloc( nbr_probes * sizeof( *probes));
+  unsigned long x = 12345;
+  for ( i = 0; i < nbr_probes; i++) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    bench_nbr( (x >> 20) % n, probes[i]);
+  }
+
+  long found = 0;
+  int r = 0;
+  double best = 0.0;
+  for ( r = 0; r < 3; r++) {
+    long s0 = get_time_micro();
+    for ( i = 0; i < nbr_probes; i++) {
+      found += search_entry_with_buffer( index_table, probes[i], alias, sizeof( alias)) == SUCCESS;
+    }
+    double ns = 1000.0 * (get_time_micro() - s0) / nbr_probes;
+    if ( r == 0 || ns < best) 
+      best = ns;
+  }
+
+  printf( "huge_pages %s: %ld entries in %ld blocks, load %.2f s, lookup %.1f ns, AnonHugePages %ld kB, found %ld of %ld\n",
+	  mode, stats.entries, stats.blocks, (t1 - t0) / 1e6, best, anon_huge_kb(), found, 3 * nbr_probes);
+
+  // the same probes in batches
+  static const int batch_sizes[] = { 16, 64, 256, 1024 };
+  const unsigned char **batch = malloc( 1024 * sizeof( char *));
+  unsigned char (*aliases)[MAX_NBR_LENGTH+1] = malloc( 1024 * sizeof( *aliases));
+  int *status = malloc( 1024 * sizeof( int));
+  int b = 0;
+
+  for ( b = 0; b < sizeof( batch_sizes) / sizeof( batch_sizes[0]); b++) {
+    int bs = batch_sizes[b];
+    found = 0;
+    best = 0.0;
+    for ( r = 0; r < 3; r++) {
+      long s0 = get_time_micro();
+      for ( i = 0; i + bs <= nbr_probes; i += bs) {
+	int j = 0;
+	for ( j = 0; j < bs; j++) 
+	  batch[j] = (unsigned char *) probes[i + j];
+	found += nlkup_search_batch( batch, bs, aliases, status);
+      }
+      double ns = 1000.0 * (get_time_micro() - s0) / (nbr_probes / bs * bs);
+      if ( r == 0 || ns < best) 
+	best = ns;
+    }
+    printf( "  batches of %4d: %.1f ns per number, found %ld\n", bs, best, found);
+  }
+
+  return 0;
+}
+
+#endif
+
+#ifdef _RESTORE_TEST_MAIN_
+
+// restores a chain whose base has a corrupt block, e.g.
+//   restore_test
+// the checkpoints are segmented full ones and increments in a fresh directory
+// below /tmp. the restore has to fall back to the checkpoint before the base.
+
+#include <dirent.h>
+#include <arpa/inet.h>
+
+#define TEST_NBRS 20000
+
+static void test_nbr( const int i, char nbr[]) {
+  snprintf( nbr, MAX_NBR_LENGTH + 1, "%06d%04d", 100000 + (i % 1000) * 37, i / 1000);
+}
+
+static void enter_all( const char *alias) {
+  char nbr[MAX_NBR_LENGTH+1];
+  int i = 0;
+  for ( i = 0; i < TEST_NBRS; i++) {
+    test_nbr( i, nbr);
+    nlkup_enter_entry( nbr, alias);
+  }
+}
+
+// the nbr of test numbers without the given alias
+static int count_other( const char *alias) {
+  char nbr[MAX_NBR_LENGTH+1];
+  unsigned char buf[MAX_NBR_LENGTH+1];
+  int other = 0;
+  int i = 0;
+  for ( i = 0; i < TEST_NBRS; i++) {
+    test_nbr( i, nbr);
+    if ( search_entry_with_buffer( index_table, nbr, buf, sizeof( buf)) != SUCCESS || strcmp( buf, alias) != 0) 
+      other++;
+  }
+  return other;
+}
+
+// flips a byte of the block of slot idx in checkpoint fn, in its segment if fn is a manifest
+static int corrupt_block( const char *fn, const int idx) {
+
+  char seg_fn[DUMP_SEGMENT_FN_LENGTH];
+  DumpManifestHeader manifest;
+  DumpSegment seg;
+  DumpHeaderV2 header;
+  DumpDirEntryV2 e;
+  int s = FAILURE;
+
+  FILE *f = fopen( fn, "r");
+  if ( f == NULL || fread( &manifest, sizeof( manifest), 1, f) != 1) 
+    goto out;
+  snprintf( seg_fn, sizeof( seg_fn), "%s", fn);
+  if ( ntohl( manifest.format) == DUMP_FORMAT_MANIFEST) {
+    while ( fread( &seg, sizeof( seg), 1, f) == 1) {
+      if ( seg.from_prefix <= idx + INDEX_OFFSET && idx + INDEX_OFFSET < seg.to_prefix) {
+	snprintf( seg_fn, sizeof( seg_fn), "%s", seg.fn);
+	break;
+      }
+    }
+  }
+  fclose( f);
+
+  if (( f = fopen( seg_fn, "r+")) == NULL || fread( &header, sizeof( header), 1, f) != 1 || 
+      fseek( f, header.dir_offset, SEEK_SET) < 0) 
+    goto out;
+  while ( fread( &e, sizeof( e), 1, f) == 1 && e.prefix != idx + INDEX_OFFSET) 
+    ;
+  if ( e.prefix != idx + INDEX_OFFSET || e.len == 0) 
+    goto out;
+
+  unsigned char c = 0;
+  if ( fseek( f, e.offset + 1, SEEK_SET) == 0 && fread( &c, 1, 1, f) == 1 && 
+       fseek( f, e.offset + 1, SEEK_SET) == 0) {
+    c ^= 0x40;
+    s = fwrite( &c, 1, 1, f) == 1 ? SUCCESS : FAILURE;
+  }
+
+ out:
+  if ( f != NULL) 
+    fclose( f);
+  return s;
+}
+
+static void remove_dir( const char *dir) {
+  DIR *d = opendir( dir);
+  struct dirent *de = NULL;
+  char path[1024];
+  while ( d != NULL && (de = readdir( d)) != NULL) {
+    if ( de->d_name[0] == '.') 
+      continue;
+    snprintf( path, sizeof( path), "%s/%s", dir, de->d_name);
+    unlink( path);
+  }
+  if ( d != NULL) 
+    closedir( d);
+  rmdir( dir);
+}
+
+int main( int argc, char **argv) {
+
+  char dir[] = "/tmp/restore_test_XXXXXX";
+  char fn[4][256];
+  char cfg[256];
+  char nbr[MAX_NBR_LENGTH+1];
+  int failures = 0;
+  int i = 0;
+
+  log_set_level( ERR);
+
+  if ( mkdtemp( dir) == NULL) {
+    fprintf( stderr, "restore_test: mkdtemp failed\n");
+    exit( 1);
+  }
+
+  // segmented full checkpoints, each followed by an increment
+  snprintf( cfg, sizeof( cfg), "%s/configs.txt", dir);
+  FILE *f = fopen( cfg, "w");
+  if ( f == NULL) 
+    exit( 1);
+  fprintf( f, "checkpoint_threads=4\ncheckpoint_full_interval=2\n");
+  fclose( f);
+  CFG_init( cfg);
+
+  if ( init_index() != SUCCESS) {
+    fprintf( stderr, "restore_test: init failed\n");
+    exit( 1);
+  }
+
+  // 0: full, 1: increment, 2: full linked to 1, 3: increment
+  for ( i = 0; i < 4; i++) {
+    char alias[8];
+    snprintf( alias, sizeof( alias), "%d", i + 1);
+    snprintf( fn[i], sizeof( fn[i]), "%s/ck%d.bin", dir, i);
+    enter_all( alias);
+    if ( nlkup_checkpoint_file( fn[i]) != SUCCESS) {
+      fprintf( stderr, "restore_test: checkpoint %s failed\n", fn[i]);
+      failures++;
+    }
+  }
+
+  test_nbr( 0, nbr);
+  if ( corrupt_block( fn[2], get_index( nbr)) != SUCCESS) {
+    fprintf( stderr, "restore_test: failure to corrupt %s\n", fn[2]);
+    failures++;
+  }
+
+  // the base of 3 is corrupt, 1 is restored from its chain instead. last
+  // unmapped, the files are changed below.
+  int mapped = 0;
+  for ( mapped = TRUE; mapped >= FALSE; mapped--) {
+    enter_all( "9");
+    if ( restore_all_fn( index_table, fn[3], mapped) != SUCCESS || count_other( "2") != 0) {
+      fprintf( stderr, "restore_test: no fallback from corrupt base %s, mapped %d\n", fn[2], mapped);
+      failures++;
+    }
+  }
+
+  // the first checkpoint has nothing to fall back to, the index is left alone
+  if ( corrupt_block( fn[0], get_index( nbr)) != SUCCESS || 
+       restore_all_fn( index_table, fn[1], FALSE) == SUCCESS || count_other( "2") != 0) {
+    fprintf( stderr, "restore_test: corrupt %s restored or index changed\n", fn[0]);
+    failures++;
+  }
+
+  remove_dir( dir);
+
+  printf( "restore_test: %s\n", failures == 0 ? "ok" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
+
+#endif
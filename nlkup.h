@@ -32,6 +32,7 @@
 #define _NLKUP_H_
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include "queue.h"
 
@@ -42,29 +43,57 @@
 
 // 9 bytes
 #define ALIAS_LENGTH ((MAX_NBR_LENGTH+1)/2 + 1)  
-// 6 bytes
+// 6 bytes, compressed postfix of old binary dumps
 #define POSTFIX_LENGTH ((POSTFIX_MAX_LENGTH+1)/2 + 1)
 
+// a postfix is packed into an integer. the digit count is folded into the
+// high end of the key: postfixes of n digits map to [base(n), base(n+1)) with
+// base(n) = (10^n-1)/9. "0012" and "12" are thus distinct and keys order like
+// the compressed postfixes did: shorter first, then by value.
+typedef unsigned int LkupKey; // 4 bytes, max key 1'111'111'110
+
 typedef struct {
-  // one length byte, 2 digits per byte
-  unsigned char postfix[POSTFIX_LENGTH]; // 6 bytes
   // one length byte, 2 digits per byte
   unsigned char alias[ALIAS_LENGTH];  // 9 bytes
-} LkupTblEntry; // 15 bytes
+} LkupAlias;
+
+struct BT_Tree;
 
+// a DUMP_FORMAT_V2 file mapped read-only. tables served from it in place count
+// as references, it is unmapped with the last one.
 typedef struct {
-  LkupTblEntry *table;     // pointer to data
+  unsigned char *data;
+  size_t data_sz;
+  long refs;
+} SnapMap;
+
+// keys and aliases are kept in parallel arrays which are allocated as one chunk.
+// searching only touches the keys. blocks with more than "btree_threshold" entries
+// are kept in a B+tree instead, keys and aliases are NULL then and table_sz equals
+// table_len. entries are addressed by rank in both cases. tables of a mapped
+// snapshot point into the file, they are read-only and copied before the first
+// modification.
+typedef struct {
+  LkupKey *keys;           // sorted postfix keys, start of the chunk
+  LkupAlias *aliases;      // aliases[i] belongs to keys[i]
   unsigned long table_sz;  // total size
   unsigned long table_len; // in use count
+  struct BT_Tree *tree;    // non NULL if the entries live in a B+tree
+  SnapMap *map;            // non NULL if keys and aliases are in a mapped snapshot
 } LkupTbl, *LkupTblPtr;
 
-// we allow locking of individual slots in the index table to enable
-// multithreading
+// the index table is a dense array of pointers. for multithreading slots are
+// locked via a pool of lock stripes, a slot maps to stripe (idx % nbr of stripes).
+// writers also bump the stripe's version around any modification of a slot's
+// lookup table, readers use it to search without locking.
+// the change epochs of the slots are kept apart, see table_changed().
 typedef struct {
-  pthread_mutex_t mutex; // thread-safety 
   LkupTblPtr table;  // loookup table for a 6 digit number prefix
 } IdxTblEntry;
 
+// default nbr of lock stripes, configurable by "lock_stripes". power of 2.
+#define DEF_LOCK_STRIPES 4096
+
 // 6 decimal digits => 1'000'000 entries of which 100'000 are not used
 #define INDEX_SIZE 1000000L
 #define INDEX_OFFSET 100000L
@@ -73,6 +102,10 @@ typedef struct {
 // about 100 entries per lookup table....
 #define DEF_LKUP_BLK_SIZE 10 // 100L 
 
+// blocks switch to a B+tree above that many entries and back below half of it.
+// configurable by "btree_threshold", 0 disables B+trees.
+#define DEF_BTREE_THRESHOLD 4096
+
 /* we allocate an index table containing references to LkupTbl. Each LkupTbl is then
    allocated dynamically if needed. Assumption is that numbers are not distributed
    uniformly over the prefix space. Allocating 1 million lookup-tables eats up a lot
@@ -92,18 +125,178 @@ typedef struct {
 #define NOT_LOGGED_IN   -6
 #define NOT_ENOUGH_DATA -7
 
-// to lock an index table entry for a given prefix
+// binary dump formats. DUMP_FORMAT_BCD files have no file header, the other formats
+// start with the magic number and format, both 4 bytes in network byte order.
+#define DUMP_TEXT        0 // human readable
+#define DUMP_FORMAT_BCD  1 // compressed 6 byte postfix and 9 byte alias per entry
+#define DUMP_FORMAT_KEYS 2 // per block: 4 byte keys followed by the 9 byte aliases
+#define DUMP_FORMAT_V2   3 // sparse: header, blocks as in memory, directory
+#define DUMP_FORMAT_MANIFEST 4 // list of DUMP_FORMAT_V2 segment files of a checkpoint
+
+#define DUMP_MAGIC 0x4e4c4b55 // "NLKU"
+
+// DUMP_FORMAT_V2 is written in host byte order except for magic and format.
+// only non-empty blocks are written, each as keys[len] followed by aliases[len]
+// like the arrays of a table, starting at a DUMP_V2_ALIGN aligned offset. the
+// directory at the end lists them by ascending prefix.
+#define DUMP_V2_BYTE_ORDER 0x01020304
+#define DUMP_V2_ALIGN 8
+
+// with DUMP_V2_DELTA blocks are compressed and follow each other unaligned: the
+// first key and the deltas between keys as varints, each alias as the nbr of
+// bytes shared with the previous one and the bytes which differ.
+#define DUMP_V2_DELTA 0x1
+
+// a DUMP_V2_INCREMENT file only has the slots changed since the previous
+// checkpoint of its chain, emptied slots as blocks of len 0. a DumpChainV2
+// record right after the header links it to the previous checkpoint.
+#define DUMP_V2_INCREMENT 0x2
+#define DUMP_MAX_CHAIN 1024
+
+// with DUMP_V2_CHECKSUM the directory is followed by a CRC32C of each block,
+// in directory order, and the header check covers the header itself (check
+// 0), the chain record, the directory and the block checksums. written always.
+#define DUMP_V2_CHECKSUM 0x4
+
+// a full checkpoint with DUMP_V2_LINKED has a DumpChainV2 record as well, as
+// increments do, naming the checkpoint taken before it. a restore falls back
+// to that one if the full checkpoint turns out to be corrupt.
+#define DUMP_V2_LINKED 0x8
+
+typedef struct {
+  uint32_t magic;       // network byte order
+  uint32_t format;      // network byte order
+  uint32_t byte_order;  // DUMP_V2_BYTE_ORDER as written
+  uint32_t nbr_blocks;  // directory entries
+  uint64_t nbr_entries;
+  uint64_t dir_offset;
+  uint64_t file_size;
+  uint32_t flags;       // DUMP_V2_xxx
+  uint32_t check;       // CRC32C, with DUMP_V2_CHECKSUM
+  uint64_t generation;  // of the checkpoint, 0 for plain dumps
+  unsigned char reserved[8];
+} DumpHeaderV2;         // 64 bytes
+
+typedef struct {
+  uint32_t prefix;      // idx + INDEX_OFFSET
+  uint32_t len;         // nbr of entries
+  uint64_t offset;      // of the keys
+} DumpDirEntryV2;
+
+// a checkpoint dumped in parallel: each segment is a DUMP_FORMAT_V2 file of a
+// range of prefixes. the manifest lists them in prefix order, host byte order
+// except for magic and format. with DUMP_V2_LINKED a DumpChainV2 record
+// follows the list.
+#define DUMP_MAX_SEGMENTS 64
+#define DUMP_SEGMENT_FN_LENGTH 240
+
+typedef struct {
+  uint32_t magic;       // network byte order
+  uint32_t format;      // DUMP_FORMAT_MANIFEST, network byte order
+  uint32_t byte_order;  // DUMP_V2_BYTE_ORDER as written
+  uint32_t nbr_segments;
+  uint64_t generation;  // part of the segment file names
+  uint32_t flags;       // DUMP_V2_LINKED
+  unsigned char reserved[36];
+} DumpManifestHeader;   // 64 bytes
+
+typedef struct {
+  uint32_t from_prefix; // first prefix of the segment
+  uint32_t to_prefix;   // first prefix after the segment
+  uint64_t file_size;
+  char fn[DUMP_SEGMENT_FN_LENGTH];
+} DumpSegment;          // 256 bytes
+
+typedef struct {
+  uint64_t base_generation; // the full checkpoint the chain starts with
+  uint64_t prev_generation;
+  char prev_fn[DUMP_SEGMENT_FN_LENGTH];
+} DumpChainV2;          // 256 bytes
+
+// a checkpoint to write. increments hold the slots changed after epoch since.
+typedef struct {
+  uint64_t generation;
+  uint32_t since;       // change epoch of the previous checkpoint
+  DumpChainV2 chain;    // of increments and linked full checkpoints
+} DumpCheckpoint;
+
+// allocates the lock stripes, rounded up to a power of 2, and the change epochs
+// of the slots. returns the nbr of stripes
+int init_lock_stripes( int nbr_stripes);
+
+// to lock an index table entry for a given prefix. locks are recursive since
+// several slots of a range can map to the same stripe.
 void lock_table( IdxTblEntry index_table[], int idx);
 // to unlock an index table entry for a given prefix
 void unlock_table( IdxTblEntry index_table[], int idx);
+// the lock stripe of a slot. slots of different stripes never contend.
+int table_stripe( int idx);
+
+// to bracket modifications of a locked index table entry. the entry is stamped
+// with the current change epoch.
+void begin_table_write( IdxTblEntry index_table[], int idx);
+void end_table_write( IdxTblEntry index_table[], int idx);
+// holds back writers in begin_table_write() until resumed. returns once no
+// write is under way. lock-free readers go on.
+void pause_table_writes( void);
+void resume_table_writes( void);
+// in a forked child: the stripes may have been locked by threads of the parent
+void reset_lock_stripes( void);
+// starts a new change epoch and returns the one ending. entries modified from
+// now on are stamped later than it.
+uint32_t next_change_epoch( void);
+// the change epoch of the last modification of slot idx, for incremental checkpoints
+uint32_t table_changed( int idx);
+
+// optimistic reading: returns version to pass to retry_table_read() which is TRUE
+// if the entry has been modified in the meantime and the read must be repeated.
+unsigned long begin_table_read( IdxTblEntry index_table[], int idx);
+int retry_table_read( IdxTblEntry index_table[], int idx, unsigned long version);
+// the table of an entry for a racy peek before locking it. locking and reading
+// an entry that a lazy restore has still to load loads it first, so does this.
+LkupTblPtr peek_table( IdxTblEntry index_table[], int idx);
+
+// packing postfix digits [from..from+nbr_len) into a key. returns FAILURE if not all digits or too long
+int encode_postfix( const unsigned char nbr[], const int from, const int nbr_len, LkupKey *key);
+// unpacking a key into a null-terminated string of digits
+int decode_postfix( const LkupKey key, unsigned char dest[], const int dest_sz);
 
 // nlkup.c 
+LkupTblPtr new_lkup_tbl( const unsigned long table_sz);
+// a read-only table of len entries served from a mapped snapshot, takes a reference
+LkupTblPtr new_mapped_lkup_tbl( SnapMap *map, LkupKey *keys, LkupAlias *aliases, const unsigned long len);
+void free_lkup_tbl( LkupTblPtr t);
+// frees a lookup table unlinked from the index table once lock-free readers are done
+void retire_lkup_tbl( LkupTblPtr t);
+// copies up to len entries starting at rank from, whatever the layout. returns the nbr copied.
+long get_lkup_tbl_entries( LkupTblPtr t, const long from, const long len, LkupKey keys[], LkupAlias aliases[]);
+// switches between array and B+tree layout depending on the nbr of entries
+void adapt_lkup_tbl( LkupTblPtr t);
+
 int enter_entry( IdxTblEntry index_table[], const unsigned char *nbr, const unsigned char *alias);
 int search_entry( IdxTblEntry index_table[], const unsigned char *nbr, unsigned char **alias);
+int search_batch( IdxTblEntry index_table[], const unsigned char *nbrs[], const int n, 
+		  unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]);
 int delete_entry( IdxTblEntry index_table[], const unsigned char *nbr);
 
+// the same for numbers and aliases of known length which need not be NUL terminated
+int enter_entry_len( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len, 
+		     const unsigned char *alias, const int alias_len);
+int delete_entry_len( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len);
+
+// the same, appending the mutation to log if non NULL, *lsn is its lsn then. see wal.h
+struct WAL_Log;
+int enter_entry_logged( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len, 
+			const unsigned char *alias, const int alias_len, struct WAL_Log *log, uint64_t *lsn);
+int delete_entry_logged( IdxTblEntry index_table[], const unsigned char *nbr, const int nbr_len,
+			 struct WAL_Log *log, uint64_t *lsn);
+
 // entry points from HTTP server code.
 int nlkup_search_entry( const unsigned char *nbr, unsigned char **alias);
+// searches n numbers. aliases[i] and status[i] (SUCCESS, NO_SUCH_ENTRY or FAILURE)
+// are set for nbrs[i]. returns the nbr of numbers found, FAILURE if out of memory.
+int nlkup_search_batch( const unsigned char *nbrs[], const int n, 
+			unsigned char aliases[][MAX_NBR_LENGTH+1], int status[]);
 int nlkup_get_block( const unsigned char *nbr, LkupTblPtr *table);
 int nlkup_get_range( const unsigned char *nbr, const unsigned char *postfix_range_len, LkupTblPtr *table);
 
@@ -115,26 +308,132 @@ typedef struct {
 int nlkup_get_range_around( const unsigned char *nbr, const int nbr_before, const int nbr_after, 
 			    int *data_len, NumberAliasStruct *data[]);
 
+// an ordered cursor over all numbers: by prefix, then by postfix length and value.
+// it is a position between two entries and holds no lock between calls, a step
+// locks the one slot it reads. entries entered or deleted meanwhile are seen or
+// not, as with separate lookups.
+typedef struct {
+  int idx;      // slot
+  LkupKey key;  // the position is before the entries of the slot with keys >= key
+} NlkupCursor;
+
+// positions c just before nbr, which need not exist. FAILURE if nbr is bad.
+int nlkup_cursor_seek( NlkupCursor *c, const unsigned char *nbr);
+// the entry after c, c moves past it. NO_SUCH_ENTRY at the end.
+int nlkup_cursor_next( NlkupCursor *c, NumberAliasStruct *na);
+// the entry before c, c moves before it. NO_SUCH_ENTRY at the start.
+int nlkup_cursor_prev( NlkupCursor *c, NumberAliasStruct *na);
+
+// entries of a page of nlkup_numbers_for_alias(), by default and at most
+#define DEF_ALIAS_PAGE_LENGTH 100
+#define MAX_ALIAS_PAGE_LENGTH 1000
+
+// the numbers of alias, or of the aliases starting with it if prefix, in order
+// of alias then number. a page is up to limit entries following the entry
+// after_nbr, after_alias of the previous page, both NULL for the first one.
+// after_alias defaults to alias. *more is TRUE if there may be further pages,
+// *ready FALSE while the index is being built and numbers may be missing.
+// FAILURE if the reverse index is disabled or alias is bad. data must be free()-ed.
+int nlkup_numbers_for_alias( const unsigned char *alias, const int prefix, 
+			     const unsigned char *after_alias, const unsigned char *after_nbr, const int limit, 
+			     int *data_len, NumberAliasStruct *data[], int *more, int *ready);
+
 int nlkup_delete_entry( const unsigned char *nbr);
 int nlkup_enter_entry( const unsigned char *nbr, const unsigned char *alias);
 int nlkup_dump_file( const unsigned char *fn, int binary);
 int nlkup_restore_file( const unsigned char *fn, int binary);
-int nlkup_process_file( const unsigned char *fn);
+// writes a checkpoint: an increment of the slots changed since the previous
+// checkpoint, a full one every "checkpoint_full_interval" checkpoints.
+// with "checkpoint_fork" set it is written by a forked child from a copy-on-write
+// image of the moment of the fork, writers are held back only for the fork.
+int nlkup_checkpoint_file( const unsigned char *fn);
+// the checkpoint the write-ahead log continues, NULL if there is no log. to be free()-ed.
+char *nlkup_wal_base_fn();
 
 int nlkup_init();
 
-// dumping one lookup table
-int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int binary);
-// dumping entire index table
+typedef struct {
+  long entries;       // numbers stored
+  long blocks;        // non-empty lookup tables
+  long tree_blocks;   // of which kept as B+tree
+  long mapped_blocks; // of which served from a mapped snapshot
+  long slots;         // index table slots
+  long checkpoints;   // checkpoints written since started
+  long checkpoint_failures;
+  long last_checkpoint_usec;       // how long the last checkpoint took
+  long last_checkpoint_pause_usec; // writers held back to fork it, 0 if not forked
+  long last_checkpoint_bytes;
+  long last_checkpoint_max_lock_usec;  // longest a slot was kept locked for it
+  long last_checkpoint_throttled_usec; // it waited for the rate ceiling or backed off
+  int last_checkpoint_status;      // SUCCESS or FAILURE
+  int last_checkpoint_forked;      // TRUE if written by a forked child
+  int ready;                // FALSE while a lazy restore is loading blocks
+  int restore_pct;          // of the blocks of the lazy restore loaded
+  long restore_blocks_left;
+  long restore_on_demand;   // blocks it loaded for a request
+  int reverse_index;        // FALSE if disabled
+  int reverse_index_ready;  // FALSE while it is being built
+  int reverse_index_pct;    // of the slots it has scanned
+  long reverse_index_entries;
+  long reverse_index_bytes;
+} NlkupStats;
+
+// counts entries and blocks, slot by slot. not a consistent snapshot under updates.
+// slots a lazy restore has still to load are not counted.
+void nlkup_get_stats( NlkupStats *stats);
+
+// what writing a dump took
+typedef struct {
+  long bytes;           // written
+  long usec;            // from start to end
+  long max_lock_usec;   // longest a slot was kept locked for copying
+  long throttled_usec;  // writers waited for the rate ceiling or backed off
+} DumpStats;
+
+// dumping one lookup table in given format, DUMP_TEXT or DUMP_FORMAT_xxx
+int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int format);
+// dumping entire index table. binary dumps are written in DUMP_FORMAT_V2
 int dump_all( IdxTblEntry index_table[], FILE *f, int binary);
 // dumping entire index table to given file name
 int dump_all_fn( IdxTblEntry index_table[], const unsigned char *fn, int binary);
+// dumping entire index table into nbr_segments segments in parallel, fn
+// becomes their manifest. a single segment is a plain DUMP_FORMAT_V2 file.
+// flags are DUMP_V2_xxx.
+int dump_segments_fn( IdxTblEntry index_table[], const unsigned char *fn, int nbr_segments, const int flags);
+// the same for a checkpoint of a chain. increments (DUMP_V2_INCREMENT) are
+// always a single file. stats, if not NULL, gets what writing it took.
+int dump_checkpoint_fn( IdxTblEntry index_table[], const unsigned char *fn, int nbr_segments, 
+			const int flags, const DumpCheckpoint *ck, DumpStats *stats);
+// the previous checkpoint of increment fn, NULL if fn is none. to be free()-ed.
+char *dump_prev_fn( const unsigned char *fn);
+// the checkpoint linked full checkpoint fn falls back to if corrupt, NULL if
+// fn is none or the checkpoint is gone. to be free()-ed.
+char *dump_fallback_fn( const unsigned char *fn);
 
-// restoring (binary) dump from file
-int restore_all_fn( IdxTblEntry index_table[], const unsigned char *fn);
+// restoring (binary) dump from file. DUMP_FORMAT_V2 files can be mapped and
+// served in place, blocks are then only copied when modified. an increment is
+// restored with its chain: the base first, then the increments in order. a
+// corrupt base is replaced by the checkpoint linked to it, see DUMP_V2_LINKED.
+int restore_all_fn( IdxTblEntry index_table[], const unsigned char *fn, int mapped);
+// the same but returns once the files of the chain are checked and kept mapped:
+// each slot is loaded when it is first locked or read, background threads load
+// the others in prefix order. the index must be empty.
+int restore_lazy_fn( IdxTblEntry index_table[], const unsigned char *fn, int mapped);
+// loads what a lazy restore has left. dumps and restores do so first. FAILURE
+// if a slot failed to load, it is left pending rather than empty.
+int finish_lazy_restore( IdxTblEntry index_table[]);
+// blocks of a lazy restore still to load out of total, loaded on demand so far
+void lazy_restore_progress( long *left, long *total, long *on_demand);
+// reference counting of mapped snapshots
+void ref_snap_map( SnapMap *map);
+void unref_snap_map( SnapMap *map);
 
 unsigned char *table_to_json( const LkupTblPtr table, const int status, const unsigned char *nbr);
 unsigned char *status_to_json( const int status, const unsigned char *msg);
 JSON_Buffer number_aliases_to_json( const int data_len, const NumberAliasStruct *data);
+JSON_Buffer stats_to_json( const NlkupStats *stats);
+JSON_Buffer alias_numbers_to_json( const int data_len, const NumberAliasStruct *data, const int more, const int ready);
+JSON_Buffer nbr_alias_status_to_json( const int n, const unsigned char *nbrs[], 
+				      unsigned char aliases[][MAX_NBR_LENGTH+1], const int status[]);
 
 #endif
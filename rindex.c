@@ -0,0 +1,583 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "json.h"
+#include "utils.h"
+#include "mem.h"
+#include "nlkup.h"
+#include "rindex.h"
+
+#define RX_SCAN_CHUNK 1024   // entries of a slot copied at a time by the scan
+#define RX_MIN_DIRECTORY 4
+
+typedef struct {
+  long len;
+  RX_Entry e[RX_BUCKET_ENTRIES];  // sorted
+} RX_Bucket;
+
+// a bucket holds the records from first up to the first of the next bucket.
+// first is searched without touching the buckets. it is the record a bucket
+// started with and kept if that is deleted, it remains a valid bound.
+typedef struct {
+  RX_Entry first;
+  RX_Bucket *bucket;
+} RX_DirEntry;
+
+// the buckets in order. buckets are never empty, an empty shard has none.
+typedef struct {
+  pthread_mutex_t mutex;    // everything below
+  RX_DirEntry *buckets;
+  long nbr_buckets;
+  long directory_sz;        // of buckets
+  long entries;
+} __attribute__ ((aligned (64))) RX_Shard;
+
+struct RX_Index {
+  RX_Shard shards[RX_SHARDS];
+  IdxTblEntry *index_table;
+  unsigned char *scanned;      // per slot, TRUE once the scan has done it
+  pthread_mutex_t build_mutex; // starting and stopping the scan
+  pthread_t thread;
+  int building;                // thread is to be joined
+  int cancel;
+  int ready;
+  long slots_done;
+};
+
+static int compare_entries( const RX_Entry *a, const RX_Entry *b) {
+  if ( a->alias != b->alias) 
+    return a->alias < b->alias ? -1 : 1;
+  if ( a->nbr != b->nbr) 
+    return a->nbr < b->nbr ? -1 : 1;
+  return 0;
+}
+
+static RX_Shard *shard_of( RX_Index *rx, const uint64_t alias) {
+  return &rx->shards[((alias * 0x9E3779B97F4A7C15UL) >> 32) & (RX_SHARDS - 1)];
+}
+
+// the last bucket whose first is <= e, 0 if there is none. the shard must have a bucket.
+static long find_bucket( const RX_Shard *s, const RX_Entry *e) {
+  long lo = 0;
+  long hi = s->nbr_buckets - 1;
+  while ( lo < hi) {
+    long mid = (lo + hi + 1) / 2;
+    if ( compare_entries( &s->buckets[mid].first, e) <= 0) 
+      lo = mid;
+    else 
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// the first record of b which is >= e, b->len if none
+static long find_in_bucket( const RX_Bucket *b, const RX_Entry *e) {
+  long lo = 0;
+  long hi = b->len;
+  while ( lo < hi) {
+    long mid = (lo + hi) / 2;
+    if ( compare_entries( &b->e[mid], e) < 0) 
+      lo = mid + 1;
+    else 
+      hi = mid;
+  }
+  return lo;
+}
+
+// a new empty bucket at pos, which starts with first. NULL if out of memory.
+static RX_Bucket *add_bucket( RX_Shard *s, const long pos, const RX_Entry *first) {
+
+  if ( s->nbr_buckets >= s->directory_sz) {
+    long sz = s->directory_sz > 0 ? 2 * s->directory_sz : RX_MIN_DIRECTORY;
+    RX_DirEntry *d = mem_alloc_cat( sz * sizeof( RX_DirEntry), MEM_REVERSE_INDEX);
+    if ( d == NULL) 
+      return NULL;
+    if ( s->buckets != NULL) {
+      memcpy( d, s->buckets, s->nbr_buckets * sizeof( RX_DirEntry));
+      mem_free( s->buckets);
+    }
+    s->buckets = d;
+    s->directory_sz = sz;
+  }
+
+  RX_Bucket *b = mem_alloc_cat( sizeof( RX_Bucket), MEM_REVERSE_INDEX);
+  if ( b == NULL) 
+    return NULL;
+
+  memmove( s->buckets + pos + 1, s->buckets + pos, (s->nbr_buckets - pos) * sizeof( RX_DirEntry));
+  s->buckets[pos].first = *first;
+  s->buckets[pos].bucket = b;
+  s->nbr_buckets++;
+  return b;
+}
+
+static void remove_bucket( RX_Shard *s, const long pos) {
+  mem_free( s->buckets[pos].bucket);
+  memmove( s->buckets + pos, s->buckets + pos + 1, (s->nbr_buckets - pos - 1) * sizeof( RX_DirEntry));
+  s->nbr_buckets--;
+}
+
+// joins bucket pos+1 into bucket pos if both together are at most half full
+static void merge_buckets( RX_Shard *s, const long pos) {
+  if ( pos < 0 || pos + 1 >= s->nbr_buckets) 
+    return;
+  RX_Bucket *b = s->buckets[pos].bucket;
+  RX_Bucket *next = s->buckets[pos+1].bucket;
+  if ( b->len + next->len > RX_BUCKET_ENTRIES / 2) 
+    return;
+  memcpy( b->e + b->len, next->e, next->len * sizeof( RX_Entry));
+  b->len += next->len;
+  remove_bucket( s, pos + 1);
+}
+
+// adding a record twice is a no-op. FAILURE if out of memory.
+static int rx_insert( RX_Index *rx, const RX_Entry *e) {
+
+  int status = SUCCESS;
+  RX_Shard *s = shard_of( rx, e->alias);
+
+  pthread_mutex_lock( &s->mutex);
+
+  if ( s->nbr_buckets == 0 && add_bucket( s, 0, e) == NULL) {
+    status = FAILURE;
+    goto out;
+  }
+
+  long bi = find_bucket( s, e);
+  RX_Bucket *b = s->buckets[bi].bucket;
+  long i = find_in_bucket( b, e);
+
+  if ( i < b->len && compare_entries( &b->e[i], e) == 0) // already there
+    goto out;
+
+  if ( b->len == RX_BUCKET_ENTRIES) { // full, the upper half moves to a new bucket
+    long half = b->len / 2;
+    RX_Bucket *nb = add_bucket( s, bi + 1, &b->e[half]);
+    if ( nb == NULL) {
+      status = FAILURE;
+      goto out;
+    }
+    nb->len = b->len - half;
+    memcpy( nb->e, b->e + half, nb->len * sizeof( RX_Entry));
+    b->len = half;
+    if ( i > half) {
+      b = nb;
+      i -= half;
+    }
+  }
+
+  memmove( b->e + i + 1, b->e + i, (b->len - i) * sizeof( RX_Entry));
+  b->e[i] = *e;
+  b->len++;
+  s->entries++;
+
+ out:
+  pthread_mutex_unlock( &s->mutex);
+  return status;
+}
+
+// removing a record which is not there is a no-op
+static void rx_delete( RX_Index *rx, const RX_Entry *e) {
+
+  RX_Shard *s = shard_of( rx, e->alias);
+
+  pthread_mutex_lock( &s->mutex);
+
+  if ( s->nbr_buckets == 0) 
+    goto out;
+
+  long bi = find_bucket( s, e);
+  RX_Bucket *b = s->buckets[bi].bucket;
+  long i = find_in_bucket( b, e);
+
+  if ( i >= b->len || compare_entries( &b->e[i], e) != 0) 
+    goto out;
+
+  memmove( b->e + i, b->e + i + 1, (b->len - i - 1) * sizeof( RX_Entry));
+  b->len--;
+  s->entries--;
+
+  if ( b->len == 0) {
+    remove_bucket( s, bi);
+  } else { // keeps the buckets at least a quarter full on average
+    merge_buckets( s, bi);
+    merge_buckets( s, bi - 1);
+  }
+
+ out:
+  pthread_mutex_unlock( &s->mutex);
+}
+
+static void clear_shard( RX_Shard *s) {
+  pthread_mutex_lock( &s->mutex);
+  long i = 0;
+  for ( i = 0; i < s->nbr_buckets; i++) {
+    mem_free( s->buckets[i].bucket);
+  }
+  if ( s->buckets != NULL) 
+    mem_free( s->buckets);
+  s->buckets = NULL;
+  s->nbr_buckets = s->directory_sz = s->entries = 0;
+  pthread_mutex_unlock( &s->mutex);
+}
+
+// copies up to n records of s with alias in [lo, hi] which are after after, if not NULL
+static long find_in_shard( RX_Shard *s, const uint64_t lo, const uint64_t hi, const RX_Entry *after, 
+			   const long n, RX_Entry out[]) {
+
+  long m = 0;
+
+  pthread_mutex_lock( &s->mutex);
+
+  if ( s->nbr_buckets == 0) 
+    goto out;
+
+  RX_Entry from = { lo, 0 };
+  int skip = FALSE; // the record after itself is excluded
+  if ( after != NULL && compare_entries( after, &from) >= 0) {
+    from = *after;
+    skip = TRUE;
+  }
+
+  long bi = find_bucket( s, &from);
+  long i = find_in_bucket( s->buckets[bi].bucket, &from);
+
+  for ( ; bi < s->nbr_buckets && m < n; bi++, i = 0) {
+    RX_Bucket *b = s->buckets[bi].bucket;
+    for ( ; i < b->len && m < n; i++) {
+      if ( b->e[i].alias > hi) 
+	goto out;
+      if ( skip && compare_entries( &b->e[i], &from) == 0) 
+	continue;
+      out[m++] = b->e[i];
+    }
+  }
+
+ out:
+  pthread_mutex_unlock( &s->mutex);
+  return m;
+}
+
+long RX_find( RX_Index *rx, const uint64_t lo, const uint64_t hi, const RX_Entry *after, 
+	      const long n, RX_Entry out[]) {
+
+  if ( n <= 0 || lo > hi) 
+    return 0;
+
+  if ( lo == hi) // a single alias, a single shard
+    return find_in_shard( shard_of( rx, lo), lo, hi, after, n, out);
+
+  // the first n of each shard, merged
+  RX_Entry *found = malloc( RX_SHARDS * n * sizeof( RX_Entry));
+  if ( found == NULL) {
+    log_msg( ERR, "RX_find: out of memory\n");
+    return 0;
+  }
+
+  long len[RX_SHARDS];
+  long pos[RX_SHARDS];
+  int i = 0;
+  for ( i = 0; i < RX_SHARDS; i++) {
+    len[i] = find_in_shard( &rx->shards[i], lo, hi, after, n, found + i * n);
+    pos[i] = 0;
+  }
+
+  long m = 0;
+  while ( m < n) {
+    int min = -1;
+    for ( i = 0; i < RX_SHARDS; i++) {
+      if ( pos[i] < len[i] && 
+	   ( min < 0 || compare_entries( &found[i * n + pos[i]], &found[min * n + pos[min]]) < 0)) 
+	min = i;
+    }
+    if ( min < 0) 
+      break;
+    out[m++] = found[min * n + pos[min]++];
+  }
+
+  free( found);
+  return m;
+}
+
+static RX_Entry make_entry( const int idx, const LkupKey key, const LkupAlias *alias) {
+  RX_Entry e = { RX_packed_alias_key( alias), ((uint64_t) idx << 32) | key };
+  return e;
+}
+
+void RX_update( RX_Index *rx, const int idx, const LkupKey key, 
+		const LkupAlias *old_alias, const LkupAlias *new_alias) {
+
+  if ( !__atomic_load_n( &rx->scanned[idx], __ATOMIC_ACQUIRE)) // the scan picks it up
+    return;
+
+  if ( old_alias != NULL && new_alias != NULL && 
+       memcmp( old_alias->alias, new_alias->alias, ALIAS_LENGTH) == 0) 
+    return;
+
+  if ( old_alias != NULL) {
+    RX_Entry e = make_entry( idx, key, old_alias);
+    rx_delete( rx, &e);
+  }
+  if ( new_alias != NULL) {
+    RX_Entry e = make_entry( idx, key, new_alias);
+    if ( rx_insert( rx, &e) < 0) 
+      log_msg( ERR, "RX_update: out of memory, alias of %ld not indexed\n", (long) (idx + INDEX_OFFSET));
+  }
+}
+
+// adds the entries of the slots in order. a slot is done while it is locked:
+// writers see its flag set only together with its entries in the index.
+static void *scan_slots( void *arg) {
+
+  RX_Index *rx = (RX_Index *) arg;
+
+  long t0 = get_time_micro();
+  long failed = 0;
+
+  LkupKey keys[RX_SCAN_CHUNK];
+  LkupAlias aliases[RX_SCAN_CHUNK];
+
+  int idx = 0;
+  for ( idx = 0; idx < INDEX_SIZE - INDEX_OFFSET; idx++) {
+
+    if ( __atomic_load_n( &rx->cancel, __ATOMIC_ACQUIRE)) 
+      return NULL;
+
+    lock_table( rx->index_table, idx);
+
+    LkupTbl *t = rx->index_table[idx].table;
+    long from = 0;
+    long m = 0;
+    while ( t != NULL && ( m = get_lkup_tbl_entries( t, from, RX_SCAN_CHUNK, keys, aliases)) > 0) {
+      long i = 0;
+      for ( i = 0; i < m; i++) {
+	RX_Entry e = make_entry( idx, keys[i], &aliases[i]);
+	if ( rx_insert( rx, &e) < 0) 
+	  failed++;
+      }
+      from += m;
+    }
+
+    __atomic_store_n( &rx->scanned[idx], TRUE, __ATOMIC_RELEASE);
+    unlock_table( rx->index_table, idx);
+
+    __atomic_store_n( &rx->slots_done, idx + 1, __ATOMIC_RELAXED);
+  }
+
+  if ( failed > 0) 
+    log_msg( ERR, "RX scan: out of memory, %ld entries not indexed\n", failed);
+
+  __atomic_store_n( &rx->ready, TRUE, __ATOMIC_RELEASE);
+  log_msg( INFO, "RX scan: reverse index built in %ld ms\n", (get_time_micro() - t0) / 1000);
+  return NULL;
+}
+
+// to be called with build_mutex locked
+static void stop_scan( RX_Index *rx) {
+  if ( !rx->building) 
+    return;
+  __atomic_store_n( &rx->cancel, TRUE, __ATOMIC_RELEASE);
+  pthread_join( rx->thread, NULL);
+  rx->building = FALSE;
+  rx->cancel = FALSE;
+}
+
+RX_Index *RX_new( IdxTblEntry index_table[]) {
+
+  RX_Index *rx = NULL;
+  if ( posix_memalign( (void **) &rx, 64, sizeof( RX_Index)) != 0) 
+    return NULL;
+  memset( rx, 0, sizeof( RX_Index));
+
+  if (( rx->scanned = mem_alloc_cat( INDEX_SIZE - INDEX_OFFSET, MEM_REVERSE_INDEX)) == NULL) {
+    free( rx);
+    return NULL;
+  }
+  mem_count( MEM_REVERSE_INDEX, sizeof( RX_Index));
+
+  int i = 0;
+  for ( i = 0; i < RX_SHARDS; i++) {
+    pthread_mutex_init( &rx->shards[i].mutex, NULL);
+  }
+  pthread_mutex_init( &rx->build_mutex, NULL);
+  rx->index_table = index_table;
+
+  return rx;
+}
+
+void RX_free( RX_Index *rx) {
+
+  if ( rx == NULL) 
+    return;
+
+  pthread_mutex_lock( &rx->build_mutex);
+  stop_scan( rx);
+  pthread_mutex_unlock( &rx->build_mutex);
+
+  int i = 0;
+  for ( i = 0; i < RX_SHARDS; i++) {
+    clear_shard( &rx->shards[i]);
+    pthread_mutex_destroy( &rx->shards[i].mutex);
+  }
+  pthread_mutex_destroy( &rx->build_mutex);
+
+  mem_free( rx->scanned);
+  mem_count( MEM_REVERSE_INDEX, -(long) sizeof( RX_Index));
+  free( rx);
+}
+
+int RX_rebuild( RX_Index *rx) {
+
+  int status = SUCCESS;
+
+  pthread_mutex_lock( &rx->build_mutex);
+
+  stop_scan( rx);
+
+  // writers which still saw a slot done may add to the cleared index, the
+  // scan adds their records again which is a no-op
+  __atomic_store_n( &rx->ready, FALSE, __ATOMIC_RELEASE);
+  __atomic_store_n( &rx->slots_done, 0, __ATOMIC_RELAXED);
+  int i = 0;
+  for ( i = 0; i < INDEX_SIZE - INDEX_OFFSET; i++) {
+    __atomic_store_n( &rx->scanned[i], FALSE, __ATOMIC_RELAXED);
+  }
+  for ( i = 0; i < RX_SHARDS; i++) {
+    clear_shard( &rx->shards[i]);
+  }
+
+  if ( pthread_create( &rx->thread, NULL, scan_slots, rx) != 0) {
+    log_msg( ERR, "RX_rebuild: pthread_create failed\n");
+    status = FAILURE;
+  } else {
+    rx->building = TRUE;
+  }
+
+  pthread_mutex_unlock( &rx->build_mutex);
+  return status;
+}
+
+int RX_alias_key( const unsigned char *alias, const int alias_len, uint64_t *key) {
+
+  if ( alias_len > RX_MAX_DIGITS) 
+    return FAILURE;
+
+  *key = 0;
+  int i = 0;
+  for ( i = 0; i < alias_len; i++) {
+    if ( alias[i] < '0' || alias[i] > '9') 
+      return FAILURE;
+    *key |= (uint64_t) (alias[i] - '0' + 1) << (60 - 4 * i);
+  }
+  return SUCCESS;
+}
+
+uint64_t RX_packed_alias_key( const LkupAlias *alias) {
+
+  int len = alias->alias[0];
+  if ( len > RX_MAX_DIGITS) 
+    len = RX_MAX_DIGITS;
+
+  uint64_t key = 0;
+  int i = 0;
+  for ( i = 0; i < len; i++) {
+    unsigned char b = alias->alias[1 + i / 2];
+    unsigned char d = i % 2 == 1 ? b & 0xF : b >> 4;
+    key |= (uint64_t) (d + 1) << (60 - 4 * i);
+  }
+  return key;
+}
+
+int RX_alias_digits( const uint64_t key, unsigned char dest[], const int dest_sz) {
+
+  int i = 0;
+  for ( i = 0; i < RX_MAX_DIGITS; i++) {
+    int d = (key >> (60 - 4 * i)) & 0xF;
+    if ( d == 0) 
+      break;
+    if ( i + 1 >= dest_sz) 
+      return FAILURE;
+    dest[i] = '0' + d - 1;
+  }
+  if ( i >= dest_sz) 
+    return FAILURE;
+  dest[i] = '\0';
+  return SUCCESS;
+}
+
+void RX_prefix_range( const uint64_t key, const int prefix_len, uint64_t *lo, uint64_t *hi) {
+
+  if ( prefix_len >= RX_MAX_DIGITS) {
+    *lo = *hi = key;
+    return;
+  }
+  if ( prefix_len <= 0) {
+    *lo = 0;
+    *hi = UINT64_MAX;
+    return;
+  }
+
+  uint64_t rest = (1UL << (4 * (RX_MAX_DIGITS - prefix_len))) - 1;
+  *lo = key & ~rest;
+  *hi = *lo | rest;
+}
+
+int RX_ready( RX_Index *rx) {
+  return __atomic_load_n( &rx->ready, __ATOMIC_ACQUIRE);
+}
+
+void RX_get_stats( RX_Index *rx, RX_Stats *stats) {
+
+  memset( stats, 0, sizeof( RX_Stats));
+
+  long directory = 0;
+  int i = 0;
+  for ( i = 0; i < RX_SHARDS; i++) {
+    RX_Shard *s = &rx->shards[i];
+    pthread_mutex_lock( &s->mutex);
+    stats->entries += s->entries;
+    stats->buckets += s->nbr_buckets;
+    directory += s->directory_sz;
+    pthread_mutex_unlock( &s->mutex);
+  }
+
+  stats->bytes = sizeof( RX_Index) + (INDEX_SIZE - INDEX_OFFSET) + 
+    stats->buckets * sizeof( RX_Bucket) + directory * sizeof( RX_DirEntry);
+  stats->ready = RX_ready( rx);
+  stats->build_pct = (int) (100 * __atomic_load_n( &rx->slots_done, __ATOMIC_RELAXED) / 
+			    (INDEX_SIZE - INDEX_OFFSET));
+}
@@ -0,0 +1,103 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  reverse index: the numbers of an alias. records of (alias, number) are kept
+  sorted in buckets, split into shards by alias so writers of different
+  aliases rarely contend. an alias prefix spans all shards, their matches are
+  merged.
+
+  the index is built by a background scan of the slots. writers keep it up to
+  date under their slot lock, but only for slots the scan has done already:
+  the scan picks up the others as they are then. requires nlkup.h.
+*/
+
+#ifndef _RINDEX_H_
+#define _RINDEX_H_
+
+#include <stdint.h>
+
+#define RX_SHARDS 64             // power of 2
+#define RX_BUCKET_ENTRIES 255    // records per bucket, a bucket is 4KB incl. its header
+#define RX_MAX_DIGITS 16         // of an alias packed into a key
+
+// aliases are packed into a key one nibble per digit, digit + 1 from the high
+// end on, so keys order like the digit strings and the keys with a given
+// prefix are a range. numbers are (slot << 32 | postfix key) and thus order
+// like the numbers.
+typedef struct {
+  uint64_t alias;
+  uint64_t nbr;
+} RX_Entry;     // 16 bytes
+
+typedef struct {
+  long entries;   // records
+  long buckets;
+  long bytes;     // buckets, bucket directories and scan flags
+  int ready;      // FALSE while the index is being built
+  int build_pct;  // of the slots scanned
+} RX_Stats;
+
+typedef struct RX_Index RX_Index;
+
+// a new, empty index for the slots of index_table. NULL if out of memory.
+RX_Index *RX_new( IdxTblEntry index_table[]);
+// stops a build and frees the index
+void RX_free( RX_Index *rx);
+
+// clears the index and (re)starts building it in the background, a build
+// under way is given up. SUCCESS if the scan could be started.
+int RX_rebuild( RX_Index *rx);
+
+// number (idx, key) changes its alias from old_alias to new_alias, either NULL
+// if the number was not there or is deleted. to be called with slot idx locked.
+void RX_update( RX_Index *rx, const int idx, const LkupKey key, 
+		const LkupAlias *old_alias, const LkupAlias *new_alias);
+
+// packing alias digits. FAILURE if not all digits or too long.
+int RX_alias_key( const unsigned char *alias, const int alias_len, uint64_t *key);
+// the same for a packed alias
+uint64_t RX_packed_alias_key( const LkupAlias *alias);
+// unpacking a key into a null-terminated string of digits. FAILURE if dest is too small.
+int RX_alias_digits( const uint64_t key, unsigned char dest[], const int dest_sz);
+// the range of the keys of the aliases starting with the first prefix_len digits of key
+void RX_prefix_range( const uint64_t key, const int prefix_len, uint64_t *lo, uint64_t *hi);
+
+// copies the records with alias in [lo, hi] into out[], in order of alias then
+// number, starting after record after if not NULL. returns the nbr copied, up to n.
+long RX_find( RX_Index *rx, const uint64_t lo, const uint64_t hi, const RX_Entry *after, 
+	      const long n, RX_Entry out[]);
+
+// FALSE while the index is being built, lookups may then miss numbers
+int RX_ready( RX_Index *rx);
+
+void RX_get_stats( RX_Index *rx, RX_Stats *stats);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  lower bound search in sorted key arrays. a branch-free binary search narrows
+  the range down to a few cache lines which are then scanned linearly, counting
+  the keys below the search key. the count is the lower bound, no compare
+  depends on the outcome of a previous one.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined( __x86_64__) || defined( __i386__)
+#include <immintrin.h>
+#define SRCH_X86
+#endif
+
+#include "logger.h"
+#include "search.h"
+
+// counts the keys < key in keys[0..len)
+typedef long (*CountFunc)( const unsigned int keys[], const long len, const unsigned int key);
+
+static long count_less_scalar( const unsigned int keys[], const long len, const unsigned int key) {
+  long n = 0;
+  long i = 0;
+  for ( i = 0; i < len; i++) {
+    n += ( keys[i] < key);
+  }
+  return n;
+}
+
+#ifdef SRCH_X86
+
+__attribute__(( target( "sse4.2,popcnt")))
+static long count_less_sse42( const unsigned int keys[], const long len, const unsigned int key) {
+  const __m128i k = _mm_set1_epi32( (int) key);
+  long n = 0;
+  long i = 0;
+  for ( ; i + 4 <= len; i += 4) {
+    __m128i v = _mm_loadu_si128( (const __m128i *) &keys[i]);
+    n += __builtin_popcount( _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( k, v))));
+  }
+  for ( ; i < len; i++) {
+    n += ( keys[i] < key);
+  }
+  return n;
+}
+
+__attribute__(( target( "avx2,popcnt")))
+static long count_less_avx2( const unsigned int keys[], const long len, const unsigned int key) {
+  const __m256i k = _mm256_set1_epi32( (int) key);
+  long n = 0;
+  long i = 0;
+  for ( ; i + 16 <= len; i += 16) {
+    __m256i v0 = _mm256_loadu_si256( (const __m256i *) &keys[i]);
+    __m256i v1 = _mm256_loadu_si256( (const __m256i *) &keys[i+8]);
+    n += __builtin_popcount( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( k, v0))));
+    n += __builtin_popcount( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( k, v1))));
+  }
+  for ( ; i + 8 <= len; i += 8) {
+    __m256i v = _mm256_loadu_si256( (const __m256i *) &keys[i]);
+    n += __builtin_popcount( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( k, v))));
+  }
+  for ( ; i < len; i++) {
+    n += ( keys[i] < key);
+  }
+  return n;
+}
+
+#endif
+
+static const char *kernel_names[] = { "scalar", "sse4.2", "avx2" };
+
+// ranges up to that many keys are scanned linearly
+static const long linear_max[] = { 16, 32, 64 };
+
+static int kernel = SRCH_SCALAR;
+static CountFunc count_less = count_less_scalar;
+static long scan_max = 16;
+
+static int cpu_supports( int k) {
+#ifdef SRCH_X86
+  __builtin_cpu_init();
+  switch ( k) {
+  case SRCH_AVX2:
+    return __builtin_cpu_supports( "avx2") && __builtin_cpu_supports( "popcnt");
+  case SRCH_SSE42:
+    return __builtin_cpu_supports( "sse4.2") && __builtin_cpu_supports( "popcnt");
+  }
+#endif
+  return k == SRCH_SCALAR;
+}
+
+int SRCH_init( const char *name) {
+
+  int k = SRCH_AVX2;
+
+  if ( name != NULL && strcmp( name, "auto") != 0) {
+    for ( k = SRCH_AVX2; k >= SRCH_SCALAR; k--) {
+      if ( strcmp( name, kernel_names[k]) == 0) 
+	break;
+    }
+    if ( k < SRCH_SCALAR) {
+      log_msg( ERR, "SRCH_init: unknown search kernel %s\n", name);
+      return -1;
+    }
+    if ( !cpu_supports( k)) {
+      log_msg( WARN, "SRCH_init: %s not supported by cpu\n", name);
+    }
+  }
+
+  // fall back to the next best one
+  while ( !cpu_supports( k)) 
+    k--;
+
+  CountFunc f = count_less_scalar;
+#ifdef SRCH_X86
+  if ( k == SRCH_AVX2) 
+    f = count_less_avx2;
+  else if ( k == SRCH_SSE42) 
+    f = count_less_sse42;
+#endif
+
+  kernel = k;
+  scan_max = linear_max[k];
+  count_less = f;
+
+  log_msg( INFO, "SRCH_init: %s search kernel\n", kernel_names[k]);
+  return k;
+}
+
+const char *SRCH_kernel_name() {
+  return kernel_names[kernel];
+}
+
+long SRCH_find( const unsigned int keys[], const long len, const unsigned int key) {
+
+  assert( keys != NULL || len == 0);
+
+  const unsigned int *base = keys;
+  long n = len;
+
+  // lower bound lies in base[0..n]
+  while ( n > scan_max) {
+    long half = n / 2;
+    base = ( base[half] < key) ? base + half : base;
+    n -= half;
+  }
+
+  long pos = ( base - keys) + count_less( base, n, key);
+
+  if ( pos < len && keys[pos] == key) 
+    return pos;
+
+  // we return -insertion point - 1
+  return -pos - 1;
+}
+
+#ifdef _SEARCH_MAIN_
+
+// micro benchmark: ns per lookup for each kernel and block size
+#include <time.h>
+
+static double bench( const unsigned int keys[], const long len, const unsigned int probes[], const int nbr_probes, const int rounds) {
+  struct timespec t0, t1;
+  long sum = 0;
+  int r = 0;
+  int i = 0;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0);
+  for ( r = 0; r < rounds; r++) {
+    for ( i = 0; i < nbr_probes; i++) {
+      sum += SRCH_find( keys, len, probes[i]);
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+
+  if ( sum == 42) // keep the loop alive
+    fprintf( stderr, "\n");
+
+  double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  return ns / ((double) rounds * nbr_probes);
+}
+
+// the previous binary search, as reference
+static long binary_search( const unsigned int keys[], const long len, const unsigned int key) {
+  long left = 0;
+  long right = len - 1;
+  while ( left <= right) {
+    long mid = (left + right) / 2;
+    if ( keys[mid] < key) 
+      left = mid + 1;
+    else if ( keys[mid] > key) 
+      right = mid - 1;
+    else 
+      return mid;
+  }
+  return -left - 1;
+}
+
+int main( int argc, char **argv) {
+
+  static const long sizes[] = { 8, 16, 32, 64, 128, 300, 1000, 4000 };
+  const int nbr_sizes = sizeof( sizes) / sizeof( sizes[0]);
+  const int nbr_probes = 4096;
+
+  unsigned int *keys = malloc( 4000 * sizeof( unsigned int));
+  unsigned int *probes = malloc( nbr_probes * sizeof( unsigned int));
+
+  log_set_level( ERR);
+  srand( 4711);
+
+  printf( "%8s %10s %10s %10s %10s  [ns/lookup]\n", "len", "binary", "scalar", "sse4.2", "avx2");
+
+  int s = 0;
+  for ( s = 0; s < nbr_sizes; s++) {
+    long len = sizes[s];
+    long i = 0;
+    unsigned int k = 1000000;
+    for ( i = 0; i < len; i++) {
+      k += 1 + rand() % 1000;
+      keys[i] = k;
+    }
+    for ( i = 0; i < nbr_probes; i++) {
+      probes[i] = ( rand() & 1) ? keys[rand() % len] : 1000000 + rand() % (k - 1000000 + 1);
+    }
+
+    // the kernels must agree with the binary search
+    int kk = 0;
+    for ( kk = SRCH_SCALAR; kk <= SRCH_AVX2; kk++) {
+      if ( SRCH_init( kernel_names[kk]) != kk) 
+	continue;
+      for ( i = 0; i < nbr_probes; i++) {
+	assert( SRCH_find( keys, len, probes[i]) == binary_search( keys, len, probes[i]));
+      }
+    }
+
+    int rounds = 20000000 / (nbr_probes * 8);
+    struct timespec t0, t1;
+    long sum = 0;
+    int r = 0;
+    clock_gettime( CLOCK_MONOTONIC, &t0);
+    for ( r = 0; r < rounds; r++) {
+      for ( i = 0; i < nbr_probes; i++) {
+	sum += binary_search( keys, len, probes[i]);
+      }
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1);
+    double bs = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ((double) rounds * nbr_probes);
+    if ( sum == 42) 
+      fprintf( stderr, "\n");
+
+    printf( "%8ld %10.2f", len, bs);
+    for ( kk = SRCH_SCALAR; kk <= SRCH_AVX2; kk++) {
+      if ( SRCH_init( kernel_names[kk]) != kk) {
+	printf( " %10s", "n/a");
+	continue;
+      }
+      printf( " %10.2f", bench( keys, len, probes, nbr_probes, rounds));
+    }
+    printf( "\n");
+  }
+
+  free( keys);
+  free( probes);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  search of a key in a sorted array of block keys. the kernel is picked at
+  start-up from the instruction set the cpu supports: AVX2 compares 8 keys,
+  SSE4.2 4 keys per instruction, the scalar kernel serves everywhere else.
+*/
+
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+// kernels
+#define SRCH_SCALAR 0
+#define SRCH_SSE42  1
+#define SRCH_AVX2   2
+
+// selects the kernel by name ("avx2", "sse4.2", "scalar") or the best one the
+// cpu supports if name is NULL or "auto". returns the selected kernel or -1.
+int SRCH_init( const char *name);
+
+// name of the kernel in use
+const char *SRCH_kernel_name();
+
+// keys must be ascending and below 2^31 (the SIMD compares are signed).
+// returns the index of key or -(insertion point) - 1 if not found.
+long SRCH_find( const unsigned int keys[], const long len, const unsigned int key);
+
+#endif
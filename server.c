@@ -34,6 +34,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <ctype.h>
 
 #include <sys/types.h>
 #include <sys/select.h>
@@ -47,9 +48,14 @@
 #include "config.h"
 #include "json.h"
 #include "utils.h"
+#include "mem.h"
 #include "nlkup.h"
 #include "sessions.h"
 #include "logger.h"
+#include "slab.h"
+#include "wal.h"
+#include "bulk.h"
+#include "dumpio.h"
 
 // file name of configs
 #define CONFIG_FILE_NAME "configs.txt"
@@ -68,6 +74,9 @@
 #define POST_BUFFER_SIZE 4096
 #define POST_RESPONSE_BUFFER_SIZE 512
 
+// max nbr of numbers in one aliases command
+#define DEF_MAX_BATCH_NUMBERS 1024
+
 // expect url of form "host:port/nlkup?..."
 #define SERVER_URL "/nlkup"
 #define GUI_URL "/nlkup_gui"
@@ -79,9 +88,14 @@
 // GET cmd=block number=1234567890
 // GET cmd=range number=123456 range_postfix_length=4
 // GET cmd=range_around number=1234567890 nbr_before=xxx nbr_after=xxx
+// GET cmd=stats
+// GET cmd=aliases numbers=1234567890,1234567891,...
 
 // POST cmd=delete number=123456890
 // POST cmd=insert number=1234567890 alias=1234567890
+// POST cmd=aliases numbers=1234567890,1234567891,...
+// POST cmd=bulk_load file_name=....
+// POST cmd=process_file file_name=....
 // POST cmd=dump_file file_name=....
 // POST cmd=restore_file file_name=.... binary=true|false
 
@@ -152,6 +166,166 @@ static int check_logged_in( const Session session) {
   return FALSE;
 }
 
+// looks up a comma separated list of numbers in one batch. the response is a JSON
+// array of { number, alias, status } in the order of the list.
+static struct MHD_Response *handle_aliases( const char *numbers, int *http_status) {
+
+  int max_numbers = CFG_get_int( "max_batch_numbers", DEF_MAX_BATCH_NUMBERS);
+
+  struct MHD_Response *response = NULL;
+  JSON_Buffer json = NULL;
+
+  char *list = NULL;
+  const unsigned char **nbrs = NULL;      // as listed
+  int *status = NULL;
+  unsigned char (*aliases)[MAX_NBR_LENGTH+1] = NULL;
+  const unsigned char **batch = NULL;     // well formed numbers only
+  int *batch_pos = NULL;
+  int *batch_status = NULL;
+  unsigned char (*batch_aliases)[MAX_NBR_LENGTH+1] = NULL;
+
+  if ( IS_NULL( numbers)) {
+    log_msg( ERR, "handle_aliases: missing numbers\n");
+    *http_status = MHD_HTTP_BAD_REQUEST;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  list = strdup( numbers);
+  nbrs = mem_alloc_cat( max_numbers * sizeof( char *), MEM_REQUESTS);
+  status = mem_alloc_cat( max_numbers * sizeof( int), MEM_REQUESTS);
+  aliases = mem_alloc_cat( max_numbers * sizeof( *aliases), MEM_REQUESTS);
+  batch = mem_alloc_cat( max_numbers * sizeof( char *), MEM_REQUESTS);
+  batch_pos = mem_alloc_cat( max_numbers * sizeof( int), MEM_REQUESTS);
+  batch_status = mem_alloc_cat( max_numbers * sizeof( int), MEM_REQUESTS);
+  batch_aliases = mem_alloc_cat( max_numbers * sizeof( *batch_aliases), MEM_REQUESTS);
+
+  if ( list == NULL || nbrs == NULL || status == NULL || aliases == NULL || 
+       batch == NULL || batch_pos == NULL || batch_status == NULL || batch_aliases == NULL) {
+    log_msg( CRIT, "handle_aliases: out of heap space\n");
+    *http_status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  int n = 0;
+  int batch_len = 0;
+  char *save_ptr = NULL;
+  char *nbr = NULL;
+
+  for ( nbr = strtok_r( list, ",", &save_ptr); nbr != NULL; nbr = strtok_r( NULL, ",", &save_ptr)) {
+
+    if ( n == max_numbers) {
+      log_msg( ERR, "handle_aliases: more than %d numbers\n", max_numbers);
+      *http_status = MHD_HTTP_BAD_REQUEST;
+      response = gen_response_status( FAILURE);
+      goto out;
+    }
+
+    // "+" in the query string decodes to a space
+    while ( isspace( *nbr)) 
+      nbr++;
+    char *ep = nbr + strlen( nbr);
+    while ( ep > nbr && isspace( ep[-1])) 
+      *--ep = '\0';
+
+    nbrs[n] = nbr;
+
+    if ( strlen( nbr) < PREFIX_LENGTH) {
+      status[n] = NBR_TOO_SHORT;
+    } else if ( strlen( nbr) > MAX_NBR_LENGTH || !all_digits( nbr)) {
+      status[n] = ILLEGAL_NUMBER;
+    } else {
+      batch[batch_len] = nbr;
+      batch_pos[batch_len] = n;
+      batch_len++;
+    }
+    n++;
+  }
+
+  if ( batch_len > 0 && nlkup_search_batch( batch, batch_len, batch_aliases, batch_status) < 0) {
+    log_msg( ERR, "handle_aliases: nlkup_search_batch failed\n");
+    *http_status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  int i = 0;
+  for ( i = 0; i < batch_len; i++) {
+    int pos = batch_pos[i];
+    status[pos] = batch_status[i];
+    memcpy( aliases[pos], batch_aliases[i], MAX_NBR_LENGTH+1);
+  }
+
+  json = nbr_alias_status_to_json( n, nbrs, aliases, status);
+
+  *http_status = MHD_HTTP_OK;
+  response = MHD_create_response_from_buffer( json_get_length( json), (void *) json_get( json), MHD_RESPMEM_MUST_FREE);
+
+  json_free( json, FALSE); json = NULL;
+
+ out:
+  if ( list != NULL) free( list);
+  if ( nbrs != NULL) mem_free( nbrs);
+  if ( status != NULL) mem_free( status);
+  if ( aliases != NULL) mem_free( aliases);
+  if ( batch != NULL) mem_free( batch);
+  if ( batch_pos != NULL) mem_free( batch_pos);
+  if ( batch_status != NULL) mem_free( batch_status);
+  if ( batch_aliases != NULL) mem_free( batch_aliases);
+  return response;
+}
+
+// numbers by alias: alias, optional prefix=1 to match the aliases starting
+// with it, limit and for the following pages after_alias and after_number of
+// the last entry of the previous page
+static struct MHD_Response *handle_numbers_for_alias( struct MHD_Connection *connection, int *http_status) {
+
+  const char *alias = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "alias");
+  const char *prefix = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "prefix");
+  const char *limit = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "limit");
+  const char *after_alias = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "after_alias");
+  const char *after_nbr = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "after_number");
+
+  struct MHD_Response *response = NULL;
+  int data_len = 0;
+  NumberAliasStruct *data = NULL;
+
+  if ( IS_NULL( alias) || !all_digits( alias) || 
+       ( !IS_NULL( prefix) && !all_digits( prefix)) || 
+       ( !IS_NULL( limit) && !all_digits( limit)) || 
+       ( !IS_NULL( after_alias) && !all_digits( after_alias)) || 
+       ( !IS_NULL( after_nbr) && ( !all_digits( after_nbr) || strlen( after_nbr) < PREFIX_LENGTH))) {
+    log_msg( ERR, "handle_numbers_for_alias: missing or ill-formed parameters\n");
+    *http_status = MHD_HTTP_BAD_REQUEST;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  int more = FALSE;
+  int ready = FALSE;
+
+  if ( nlkup_numbers_for_alias( alias, !IS_NULL( prefix) && atoi( prefix) != 0, 
+				IS_NULL( after_alias) ? NULL : after_alias, IS_NULL( after_nbr) ? NULL : after_nbr,
+				IS_NULL( limit) ? 0 : atoi( limit), &data_len, &data, &more, &ready) != SUCCESS) {
+    log_msg( ERR, "handle_numbers_for_alias: nlkup_numbers_for_alias failed %s\n", alias);
+    *http_status = MHD_HTTP_SERVICE_UNAVAILABLE;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  JSON_Buffer json = alias_numbers_to_json( data_len, data, more, ready);
+
+  *http_status = MHD_HTTP_OK;
+  response = MHD_create_response_from_buffer( json_get_length( json), (void *) json_get( json), MHD_RESPMEM_MUST_FREE);
+
+  json_free( json, FALSE); json = NULL;
+
+ out:
+  if ( data != NULL) free( data);
+  return response;
+}
+
 static struct MHD_Response *handle_get_request( struct MHD_Connection *connection, 
 						int *http_status, 
 						struct request_info_struct *req_info,
@@ -165,7 +339,40 @@ static struct MHD_Response *handle_get_request( struct MHD_Connection *connectio
 
   struct MHD_Response *response = NULL;
 
-  if ( cmd == NULL || nbr == NULL) {
+  if ( cmd == NULL) {
+    log_msg( ERR, "handle_get_request: missing query parameters\n");
+    *http_status = MHD_HTTP_BAD_REQUEST;
+    response = GEN_EMPTY_RESP();
+    goto out;
+  }
+
+  if ( !is_gui_request && strcasecmp( cmd, "stats") == 0) { // the only command without a number
+
+    NlkupStats stats;
+    nlkup_get_stats( &stats);
+
+    JSON_Buffer json = stats_to_json( &stats);
+
+    *http_status = MHD_HTTP_OK;
+    response = MHD_create_response_from_buffer( json_get_length( json), (void *) json_get( json), MHD_RESPMEM_MUST_FREE);
+
+    json_free( json, FALSE); json = NULL;
+
+    goto out;
+  }
+
+  if ( !is_gui_request && strcasecmp( cmd, "aliases") == 0) {
+    const char *numbers = MHD_lookup_connection_value( connection, MHD_GET_ARGUMENT_KIND, "numbers");
+    response = handle_aliases( numbers, http_status);
+    goto out;
+  }
+
+  if ( !is_gui_request && strcasecmp( cmd, "numbers_for_alias") == 0) {
+    response = handle_numbers_for_alias( connection, http_status);
+    goto out;
+  }
+
+  if ( nbr == NULL) {
     log_msg( ERR, "handle_get_request: missing query parameters\n");
     *http_status = MHD_HTTP_BAD_REQUEST;
     response = GEN_EMPTY_RESP();
@@ -340,6 +547,8 @@ static struct MHD_Response *handle_get_request( struct MHD_Connection *connectio
  out:
   end_time = get_time_micro();  
   log_msg( INFO, "get request: %s %ld [usec]\n", (cmd!=NULL?cmd:""), (long) (end_time-start_time));
+  // checkpoint writers back off while lookups get slow
+  DW_note_latency( end_time - start_time);
 
   return response;
 }
@@ -353,6 +562,7 @@ static KV_KeyValuePtr alloc_key_value( const unsigned char *key, const char *val
 
   kv->key = strdup( key); 
   kv->value = strdup( value);
+  mem_count( MEM_REQUESTS, sizeof( KV_KeyValue) + strlen( kv->key) + strlen( kv->value) + 2);
   
   return kv;
 }
@@ -362,6 +572,7 @@ static void free_key_value( KV_KeyValuePtr kv) {
     return;
   }
 
+  mem_count( MEM_REQUESTS, -(long) (sizeof( KV_KeyValue) + strlen( kv->key) + strlen( kv->value) + 2));
   free( kv->key); 
   free( kv->value); 
 
@@ -395,6 +606,23 @@ static unsigned char *get_key_value( const unsigned char *key, const KV_KeyValue
 }
 
 
+// long values are posted in pieces which we append
+static int append_key_value( KV_KeyValuePtr kv, const char *data, const int size) {
+
+  int len = strlen( kv->value);
+  unsigned char *value = realloc( kv->value, len + size + 1);
+  if ( value == NULL) {
+    log_msg( CRIT, "append_key_value: out of heap space\n");
+    return -1;
+  }
+  memcpy( value + len, data, size);
+  value[len + size] = '\0';
+  kv->value = value;
+
+  mem_count( MEM_REQUESTS, size);
+  return 0;
+}
+
 static int insert_key_value( struct request_info_struct *req_info, 
 			     const unsigned char *key, 
 			     const unsigned char *value, 
@@ -507,6 +735,10 @@ iterate_post (void *coninfo_cls, enum MHD_ValueKind kind, const char *key,
     return MHD_NO;
   }
 
+  if ( off > 0 && req_info->kv_len > 0 && strcmp( req_info->key_values[req_info->kv_len-1]->key, key) == 0) {
+    return append_key_value( req_info->key_values[req_info->kv_len-1], data, size) < 0 ? MHD_NO : MHD_YES;
+  }
+
   // record key value pair in request info
   if ( insert_key_value( req_info, key, data, size) < 0) {
       return MHD_NO;
@@ -547,6 +779,7 @@ static void request_completed (void *cls, struct MHD_Connection *connection,
   }
 
   // release memory
+  mem_count( MEM_REQUESTS, -(long) sizeof( struct request_info_struct));
   free (req_info);
   *con_cls = NULL;
 }
@@ -592,6 +825,7 @@ static int alloc_request_info( struct MHD_Connection *connection,
   }
 
 
+  mem_count( MEM_REQUESTS, sizeof( struct request_info_struct));
   *con_cls = (void *) req_info;
   return MHD_YES;
  
@@ -856,6 +1090,53 @@ static struct MHD_Response *handle_post_request_url_encoded( struct MHD_Connecti
     response = MHD_create_response_from_buffer( strlen( response_buffer), response_buffer, MHD_RESPMEM_MUST_FREE);
 
     goto out;
+  } else if ( strcasecmp( cmd, "aliases") == 0) {
+
+    free( response_buffer); response_buffer = NULL;
+
+    response = handle_aliases( get_key_value_from_req_info( req_info, "numbers"), http_status);
+    goto out;
+
+  } else if ( strcasecmp( cmd, "bulk_load") == 0) {
+
+    const unsigned char *file_name = get_key_value_from_req_info( req_info, "file_name");
+    if ( IS_NULL( file_name)) {
+      log_msg( WARN, "missing or empty file_name in POST bulk_load request\n");
+      *http_status = MHD_HTTP_BAD_REQUEST;
+      response = gen_response_status( FAILURE);
+      goto out;
+    }
+
+    BL_Stats stats;
+    response_status = nlkup_bulk_load( file_name, &stats);
+
+    snprintf( response_buffer, POST_RESPONSE_BUFFER_SIZE, 
+	      "{ \"status\" : %d, \"lines\" : %ld, \"errors\" : %ld, \"entries\" : %ld, \"usec\" : %ld, \"entries_per_sec\" : %.0f }\n",
+	      response_status, stats.lines, stats.errors, stats.entries, stats.usec,
+	      stats.usec > 0 ? 1e6 * stats.lines / stats.usec : 0.0);
+    response = MHD_create_response_from_buffer( strlen( response_buffer), response_buffer, MHD_RESPMEM_MUST_FREE);
+    goto out;
+
+  } else if ( strcasecmp( cmd, "process_file") == 0) {
+
+    const unsigned char *file_name = get_key_value_from_req_info( req_info, "file_name");
+    if ( IS_NULL( file_name)) {
+      log_msg( WARN, "missing or empty file_name in POST process_file request\n");
+      *http_status = MHD_HTTP_BAD_REQUEST;
+      response = gen_response_status( FAILURE);
+      goto out;
+    }
+
+    free( response_buffer); response_buffer = NULL;
+
+    BL_ProcStats stats;
+    response_status = nlkup_process_file( file_name, &stats);
+
+    JSON_Buffer json = BL_proc_stats_to_json( response_status, &stats);
+    response = MHD_create_response_from_buffer( json_get_length( json), (void *) json_get( json), MHD_RESPMEM_MUST_FREE);
+    json_free( json, FALSE); json = NULL;
+    goto out;
+
   } else if ( strcasecmp( cmd, "dump_file") == 0) {
     
     const unsigned char *file_name = get_key_value_from_req_info( req_info, "file_name");
@@ -1145,7 +1426,7 @@ static int save_check_point_file() {
 
   log_msg( INFO, "checkpointing into %s\n", fn);
 
-  int s = nlkup_dump_file( fn, 1);
+  int s = nlkup_checkpoint_file( fn);
 
   free( fn);
 
@@ -1153,6 +1434,66 @@ static int save_check_point_file() {
 
 }
 
+// checkpoints which are too old but still needed by the chain of a kept
+// increment. only used by the check point thread.
+#define MAX_NEEDED_CHECKPOINTS 4096
+static char *needed_check_points[MAX_NEEDED_CHECKPOINTS];
+static int nbr_needed_check_points = 0;
+
+// TRUE if fpath is a needed checkpoint or one of its segment files
+static int check_point_needed( const char *fpath) {
+  int i = 0;
+  for ( i = 0; i < nbr_needed_check_points; i++) {
+    size_t len = strlen( needed_check_points[i]);
+    if ( strncmp( fpath, needed_check_points[i], len) == 0 && (fpath[len] == '\0' || fpath[len] == '.')) 
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// fn and the checkpoints it builds upon are needed, with fallback also the
+// checkpoint its base falls back to if corrupt and that one's chain. takes fn over.
+static void need_check_point_chain( char *fn, const int fallback) {
+  char *base = NULL;
+  int links = 0;
+  // back to the base. a link known already may have been needed without its fallback
+  while ( fn != NULL && links++ < DUMP_MAX_CHAIN) {
+    free( base);
+    base = fn;
+    char *needed = NULL;
+    if ( !check_point_needed( fn) && nbr_needed_check_points < MAX_NEEDED_CHECKPOINTS && 
+	 ( needed = strdup( fn)) != NULL) 
+      needed_check_points[nbr_needed_check_points++] = needed;
+    fn = dump_prev_fn( base);
+  }
+  free( fn);
+
+  // only one step back, the fallback's own fallback may go
+  if ( fallback && base != NULL) 
+    need_check_point_chain( dump_fallback_fn( base), FALSE);
+  free( base);
+}
+
+static int check_point_too_old( const struct stat *sb) {
+  int keep_time = CFG_get_int( "check_point_keep_time", DEFAULT_CHECKPOINT_KEEP_TIME);
+  time_t now;
+  time( &now);
+  return keep_time < difftime( now, sb->st_mtime);
+}
+
+// callback for directory traversal to collect the chains of the checkpoints kept
+static int ftw_chain_call_back( const char *fpath, const struct stat *sb, int typeflag) {
+
+  char *check_point_fn = CFG_get_str( "check_point_filename", DEFAULT_CHECKPOINT_FN);
+
+  if ( typeflag != FTW_F || strstr( fpath, check_point_fn) == NULL || check_point_too_old( sb)) {
+    return 0;
+  }
+
+  need_check_point_chain( strdup( fpath), TRUE);
+  return 0;
+}
+
 // callback for directory traversal to delete old check point files
 static int ftw_call_back( const char *fpath, const struct stat *sb, int typeflag) {
 
@@ -1177,7 +1518,9 @@ static int ftw_call_back( const char *fpath, const struct stat *sb, int typeflag
 
     log_msg( DEBUG, "ftw_call_back: %s %d\n", fpath, delta_t);
 
-    if ( keep_time < delta_t) { // file is too old to be kept
+    if ( keep_time < delta_t && check_point_needed( fpath)) {
+      log_msg( DEBUG, "ftw_call_back: keeping %s, increments or fallbacks need it\n", fpath);
+    } else if ( keep_time < delta_t) { // file is too old to be kept
       log_msg( DEBUG, "ftw_call_back: deleting %s\n", fpath);
       if ( remove( fpath) < 0) {
 	log_msg( WARN, "ftw_call_back: failure to remove %s\n", fpath);
@@ -1189,18 +1532,37 @@ static int ftw_call_back( const char *fpath, const struct stat *sb, int typeflag
   return s;
 }
 
-// traverse directory of checkpoint files and remove old ones.
+// traverse directory of checkpoint files and remove old ones. bases and
+// increments which kept increments or the write-ahead log build upon stay,
+// as do the checkpoints their bases fall back to.
 static int remove_old_check_point_files() {
 
   char *check_point_dir = CFG_get_str( "check_point_directory", DEFAULT_CHECKPOINT_DIR);
   // char *check_point_fn = CFG_get_str( "check_point_filename", DEFAULT_CHECKPOINT_FN);
 
-  if ( ftw( check_point_dir, ftw_call_back, 1) != 0) {
+  int s = 0;
+
+  // the write-ahead log continues its checkpoint, it must stay too
+  char *wal_base_fn = nlkup_wal_base_fn();
+  if ( wal_base_fn != NULL && strlen( wal_base_fn) > 0) {
+    need_check_point_chain( wal_base_fn, TRUE);
+  } else {
+    free( wal_base_fn);
+  }
+
+  if ( ftw( check_point_dir, ftw_chain_call_back, 1) != 0 || 
+       ftw( check_point_dir, ftw_call_back, 1) != 0) {
     log_msg( ERR, "remove_old_check_point_files: nftw() failure\n");
-    return -1;
+    s = -1;
   }
 
-  return 0;
+  int i = 0;
+  for ( i = 0; i < nbr_needed_check_points; i++) {
+    free( needed_check_points[i]);
+  }
+  nbr_needed_check_points = 0;
+
+  return s;
 }
 
 static void *check_point_thread_body( void *arg) {
@@ -1232,6 +1594,8 @@ static void *check_point_thread_body( void *arg) {
       // save new checkpoint file
       save_check_point_file();
 
+      SL_log_stats();
+
       time( &last_check_point);
     }
 
@@ -1280,6 +1644,17 @@ int main ( int argc, char **argv)
     return -1;
   }
 
+  // server -l file: bulk load a number/alias file before serving
+  if ( argc == 3 && strcmp( argv[1], "-l") == 0) {
+    BL_Stats stats;
+    if ( nlkup_bulk_load( argv[2], &stats) < 0) {
+      log_msg( CRIT, "bulk load of %s failed\n", argv[2]);
+      return -1;
+    }
+    fprintf( stderr, "loaded %ld lines (%ld errors) in %.2f s, %.0f entries/s, %d threads\n",
+	     stats.lines, stats.errors, stats.usec / 1e6, stats.usec > 0 ? 1e6 * stats.lines / stats.usec : 0.0, stats.threads);
+  }
+
 
 #if 0
   {
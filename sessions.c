@@ -44,6 +44,7 @@
 
 #include "config.h"
 #include "utils.h"
+#include "mem.h"
 #include "json.h"
 #include "nlkup.h"
 #include "sessions.h"
@@ -105,6 +106,7 @@ Session sessions_get( struct MHD_Connection *connection) {
   time ( &session->last_access);
 
   HT_insert( sessions_table, strdup( session->session_id), session, 0);
+  mem_count( MEM_SESSIONS, sizeof( SessionStruct) + strlen( session->session_id) + 1);
 
   return session;
 }
@@ -189,6 +191,7 @@ static int expiration_call_back( const void *key, const void *data, void *arg) {
   if ( difftime( cb_arg->now, s->last_access) > cb_arg->time_out) {
     // an expired session
     log_msg( DEBUG, "deleting session %s\n", s->session_id);
+    mem_count( MEM_SESSIONS, -(long) (sizeof( SessionStruct) + strlen( k) + 1));
     return HT_DELETE_KEY;
   }
 
@@ -0,0 +1,636 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  slabs are 64 KB aligned, so the slab header of an object is found by masking
+  its address. a slab hands out objects of one class, from its free list or
+  from the part never used so far. classes keep the slabs with free objects
+  in lists by how full they are and allocate from the fullest ones, so that
+  the others can drain. slabs which became entirely free are given back
+  unless it is the only one left. allocations above the largest class get a mapping of their
+  own, with the same header in front.
+
+  with huge pages, slabs are carved from 2 MB arenas which are mapped with
+  MADV_HUGEPAGE or from hugetlbfs. empty slabs then go back to a pool instead
+  of the system, giving back parts of an arena would split its huge pages.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "logger.h"
+#include "slab.h"
+
+// small slabs drain and are given back more easily when blocks move to
+// bigger classes
+#define SL_SLAB_SIZE (64UL * 1024)
+#define SL_HEADER_SIZE 64
+
+// classes 64, 80, 96, 112, 128, 160, ... 8K
+#define SL_MIN_SIZE 64
+#define SL_MAX_SIZE (8UL * 1024)
+#define SL_NBR_CLASSES 29
+
+#define SL_PAGE_SIZE 4096
+#define SL_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+#define SL_LARGE -1
+
+// partial slabs are kept in that many lists by fullness
+#define SL_BUCKETS 4
+
+// thread caches hold at most that many objects or bytes per class. each
+// cached object can keep a slab from being given back.
+#define SL_CACHE_MAX 16
+#define SL_CACHE_BYTES (16 * 1024)
+
+#define SLAB_OF( ptr) ((SL_Slab *) ((uintptr_t) (ptr) & ~(SL_SLAB_SIZE - 1)))
+
+typedef struct _sl_slab {
+  struct _sl_slab *prev;  // list of slabs with free objects
+  struct _sl_slab *next;
+  void *free_list;        // freed objects
+  char *unused;           // first object never handed out
+  int cls;                // class or SL_LARGE
+  int nbr_free;           // objects on free list or unused
+  int bucket;             // partial list we're on, -1 if full
+  size_t size;            // mapped bytes
+} SL_Slab;
+
+typedef struct {
+  size_t size;
+  int objs_per_slab;
+  int cache_max;
+  pthread_mutex_t mutex;
+  SL_Slab *partial[SL_BUCKETS]; // slabs with free objects, fullest first
+  long nbr_partial;
+  long slabs;
+  long objs_out;
+  long objs_free;
+} SL_Class;
+
+typedef struct {
+  int n;
+  void *objs[SL_CACHE_MAX];
+} SL_Cache;
+
+static SL_Class classes[SL_NBR_CLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+static const char *huge_names[] = { "off", "madvise", "hugetlb" };
+static int huge_mode = SL_HUGE_OFF;
+static int huge_warned = 0;
+
+// free slabs carved from huge page arenas
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SL_Slab *pool = NULL;
+static long pool_cnt = 0;
+static long arena_bytes = 0;
+
+static pthread_mutex_t large_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long large_cnt = 0;
+static long large_bytes = 0;
+
+static __thread SL_Cache caches[SL_NBR_CLASSES];
+static __thread int cache_registered = 0;
+static pthread_key_t cache_key;
+
+static void flush_cache( const int c, SL_Cache *cache, int n);
+
+// hands back the cached objects of an exiting thread
+static void release_caches( void *arg) {
+  int c = 0;
+  for ( c = 0; c < SL_NBR_CLASSES; c++) {
+    flush_cache( c, &caches[c], caches[c].n);
+  }
+}
+
+static void init_classes() {
+  int c = 0;
+  size_t b = SL_MIN_SIZE;
+
+  classes[0].size = SL_MIN_SIZE;
+  for ( c = 1; c < SL_NBR_CLASSES; c++) {
+    int j = (c - 1) % 4 + 1;
+    classes[c].size = b + j * (b / 4);
+    if ( j == 4) 
+      b *= 2;
+  }
+
+  for ( c = 0; c < SL_NBR_CLASSES; c++) {
+    SL_Class *cl = &classes[c];
+    cl->objs_per_slab = (SL_SLAB_SIZE - SL_HEADER_SIZE) / cl->size;
+    cl->cache_max = SL_CACHE_BYTES / cl->size;
+    if ( cl->cache_max > SL_CACHE_MAX) 
+      cl->cache_max = SL_CACHE_MAX;
+    if ( cl->cache_max < 1) 
+      cl->cache_max = 1;
+    pthread_mutex_init( &cl->mutex, NULL);
+  }
+  assert( classes[SL_NBR_CLASSES-1].size == SL_MAX_SIZE);
+
+  pthread_key_create( &cache_key, release_caches);
+}
+
+// largest power of 2 below sz
+static size_t pow2_below( size_t sz) {
+  return 1UL << (63 - __builtin_clzl( sz - 1));
+}
+
+size_t SL_class_size( size_t sz) {
+  if ( sz <= SL_MIN_SIZE) 
+    return SL_MIN_SIZE;
+  size_t step = pow2_below( sz) / 4;
+  return (sz + step - 1) / step * step;
+}
+
+static int class_index( size_t sz) {
+  if ( sz <= SL_MIN_SIZE) 
+    return 0;
+  size_t b = pow2_below( sz);
+  size_t s = SL_class_size( sz);
+  return 4 * (__builtin_ctzl( b) - __builtin_ctzl( SL_MIN_SIZE)) + (s - b) / (b / 4);
+}
+
+// maps sz bytes aligned to align, a power of 2
+static void *map_aligned( size_t sz, size_t align) {
+
+  size_t map_sz = sz + align;
+  char *cp = mmap( NULL, map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( cp == MAP_FAILED) {
+    log_msg( CRIT, "SL: mmap of %ld bytes failed\n", (long) map_sz);
+    return NULL;
+  }
+
+  // cut off what is not needed before and after the aligned part
+  char *start = (char *) (((uintptr_t) cp + align - 1) & ~(align - 1));
+  if ( start > cp) 
+    munmap( cp, start - cp);
+  if ( start + sz < cp + map_sz) 
+    munmap( start + sz, (cp + map_sz) - (start + sz));
+
+  return start;
+}
+
+// maps sz bytes, a multiple of the huge page size, backed by huge pages as far
+// as the system has them. hugetlbfs falls back to transparent huge pages, those
+// to normal pages.
+static void *map_huge( size_t sz) {
+
+  if ( huge_mode == SL_HUGE_TLB) {
+    void *p = mmap( NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if ( p != MAP_FAILED) 
+      return p;
+    log_msg( WARN, "SL: no hugetlbfs pages for %ld bytes, using transparent huge pages\n", (long) sz);
+    huge_mode = SL_HUGE_MADVISE;
+  }
+
+  void *p = map_aligned( sz, SL_HUGE_PAGE_SIZE);
+  if ( p != NULL && madvise( p, sz, MADV_HUGEPAGE) != 0 && !huge_warned) {
+    log_msg( WARN, "SL: madvise( MADV_HUGEPAGE) failed, using normal pages\n");
+    huge_warned = 1;
+  }
+  return p;
+}
+
+static SL_Slab *new_slab() {
+
+  if ( huge_mode == SL_HUGE_OFF) 
+    return map_aligned( SL_SLAB_SIZE, SL_SLAB_SIZE);
+
+  pthread_mutex_lock( &arena_mutex);
+
+  if ( pool == NULL) {
+    char *arena = map_huge( SL_HUGE_PAGE_SIZE);
+    if ( arena == NULL) {
+      pthread_mutex_unlock( &arena_mutex);
+      return NULL;
+    }
+    arena_bytes += SL_HUGE_PAGE_SIZE;
+
+    char *cp = NULL;
+    for ( cp = arena + SL_HUGE_PAGE_SIZE - SL_SLAB_SIZE; cp >= arena; cp -= SL_SLAB_SIZE) {
+      SL_Slab *s = (SL_Slab *) cp;
+      s->next = pool;
+      pool = s;
+      pool_cnt++;
+    }
+  }
+
+  SL_Slab *s = pool;
+  pool = s->next;
+  pool_cnt--;
+
+  pthread_mutex_unlock( &arena_mutex);
+
+  // objects are zeroed when handed out, only the header must be clean
+  memset( s, 0, SL_HEADER_SIZE);
+  return s;
+}
+
+static void release_slab( SL_Slab *s) {
+
+  if ( huge_mode == SL_HUGE_OFF) {
+    munmap( s, s->size);
+    return;
+  }
+
+  pthread_mutex_lock( &arena_mutex);
+  s->next = pool;
+  pool = s;
+  pool_cnt++;
+  pthread_mutex_unlock( &arena_mutex);
+}
+
+int SL_set_huge_pages( const char *mode) {
+
+  if ( mode == NULL) 
+    return huge_mode;
+
+  int m = 0;
+  for ( m = SL_HUGE_TLB; m >= SL_HUGE_OFF; m--) {
+    if ( strcmp( mode, huge_names[m]) == 0) 
+      break;
+  }
+  if ( m < SL_HUGE_OFF) {
+    log_msg( ERR, "SL_set_huge_pages: unknown mode %s\n", mode);
+    return -1;
+  }
+
+  huge_mode = m;
+  log_msg( INFO, "SL_set_huge_pages: %s\n", huge_names[m]);
+  return m;
+}
+
+void *SL_map( size_t sz) {
+
+  if ( huge_mode == SL_HUGE_OFF) 
+    return map_aligned( (sz + SL_PAGE_SIZE - 1) & ~(SL_PAGE_SIZE - 1), SL_PAGE_SIZE);
+
+  return map_huge( (sz + SL_HUGE_PAGE_SIZE - 1) & ~(SL_HUGE_PAGE_SIZE - 1));
+}
+
+// 0 for the fullest slabs
+static int bucket_of( SL_Class *cl, SL_Slab *s) {
+  return (s->nbr_free - 1) * SL_BUCKETS / cl->objs_per_slab;
+}
+
+static void unlink_slab( SL_Class *cl, SL_Slab *s) {
+  if ( s->prev != NULL) 
+    s->prev->next = s->next;
+  else 
+    cl->partial[s->bucket] = s->next;
+  if ( s->next != NULL) 
+    s->next->prev = s->prev;
+  s->prev = s->next = NULL;
+  s->bucket = -1;
+  cl->nbr_partial--;
+}
+
+static void push_slab( SL_Class *cl, SL_Slab *s) {
+  int b = bucket_of( cl, s);
+  s->prev = NULL;
+  s->next = cl->partial[b];
+  if ( s->next != NULL) 
+    s->next->prev = s;
+  cl->partial[b] = s;
+  s->bucket = b;
+  cl->nbr_partial++;
+}
+
+// after nbr_free changed
+static void update_slab( SL_Class *cl, SL_Slab *s) {
+  if ( s->bucket >= 0) {
+    if ( s->nbr_free > 0 && bucket_of( cl, s) == s->bucket) 
+      return;
+    unlink_slab( cl, s);
+  }
+  if ( s->nbr_free > 0) 
+    push_slab( cl, s);
+}
+
+// class mutex must be held
+static void *take_obj( const int c) {
+
+  SL_Class *cl = &classes[c];
+  SL_Slab *s = NULL;
+  int b = 0;
+
+  for ( b = 0; b < SL_BUCKETS && s == NULL; b++) {
+    s = cl->partial[b];
+  }
+
+  if ( s == NULL) {
+    if (( s = new_slab()) == NULL) 
+      return NULL;
+    s->cls = c;
+    s->size = SL_SLAB_SIZE;
+    s->unused = (char *) s + SL_HEADER_SIZE;
+    s->nbr_free = cl->objs_per_slab;
+    push_slab( cl, s);
+    cl->slabs++;
+    cl->objs_free += cl->objs_per_slab;
+  }
+
+  void *p = NULL;
+  if ( s->free_list != NULL) {
+    p = s->free_list;
+    s->free_list = *((void **) p);
+  } else {
+    p = s->unused;
+    s->unused += cl->size;
+  }
+
+  s->nbr_free--;
+  update_slab( cl, s);
+
+  cl->objs_out++;
+  cl->objs_free--;
+  return p;
+}
+
+// class mutex must be held
+static void return_obj( const int c, void *p) {
+
+  SL_Class *cl = &classes[c];
+  SL_Slab *s = SLAB_OF( p);
+
+  assert( s->cls == c);
+
+  *((void **) p) = s->free_list;
+  s->free_list = p;
+
+  cl->objs_out--;
+  cl->objs_free++;
+
+  s->nbr_free++;
+  update_slab( cl, s);
+
+  // give back an empty slab unless it's the only one with free objects
+  if ( s->nbr_free == cl->objs_per_slab && cl->nbr_partial > 1) {
+    unlink_slab( cl, s);
+    cl->slabs--;
+    cl->objs_free -= cl->objs_per_slab;
+    release_slab( s);
+  }
+}
+
+// flush caches when the thread exits
+static void register_caches() {
+  pthread_setspecific( cache_key, (void *) 1);
+  cache_registered = 1;
+}
+
+static void refill_cache( const int c, SL_Cache *cache) {
+
+  if ( !cache_registered) 
+    register_caches();
+
+  SL_Class *cl = &classes[c];
+  int n = (cl->cache_max + 1) / 2;
+
+  pthread_mutex_lock( &cl->mutex);
+  while ( cache->n < n) {
+    void *p = take_obj( c);
+    if ( p == NULL) 
+      break;
+    cache->objs[cache->n++] = p;
+  }
+  pthread_mutex_unlock( &cl->mutex);
+}
+
+// returns the n least recently cached objects
+static void flush_cache( const int c, SL_Cache *cache, int n) {
+
+  if ( n > cache->n) 
+    n = cache->n;
+  if ( n <= 0) 
+    return;
+
+  SL_Class *cl = &classes[c];
+  int i = 0;
+
+  pthread_mutex_lock( &cl->mutex);
+  for ( i = 0; i < n; i++) {
+    return_obj( c, cache->objs[i]);
+  }
+  pthread_mutex_unlock( &cl->mutex);
+
+  cache->n -= n;
+  memmove( &cache->objs[0], &cache->objs[n], cache->n * sizeof( void *));
+}
+
+static void *alloc_large( size_t sz) {
+
+  size_t map_sz = (SL_class_size( SL_HEADER_SIZE + sz) + SL_PAGE_SIZE - 1) & ~(SL_PAGE_SIZE - 1);
+  SL_Slab *s = NULL;
+  if ( huge_mode != SL_HUGE_OFF && map_sz >= SL_HUGE_PAGE_SIZE) {
+    map_sz = (map_sz + SL_HUGE_PAGE_SIZE - 1) & ~(SL_HUGE_PAGE_SIZE - 1);
+    s = map_huge( map_sz);
+  } else {
+    s = map_aligned( map_sz, SL_SLAB_SIZE);
+  }
+  if ( s == NULL) 
+    return NULL;
+
+  s->cls = SL_LARGE;
+  s->size = map_sz;
+
+  pthread_mutex_lock( &large_mutex);
+  large_cnt++;
+  large_bytes += map_sz;
+  pthread_mutex_unlock( &large_mutex);
+
+  // fresh mappings are zeroed
+  return (char *) s + SL_HEADER_SIZE;
+}
+
+static void free_large( SL_Slab *s) {
+
+  pthread_mutex_lock( &large_mutex);
+  large_cnt--;
+  large_bytes -= s->size;
+  pthread_mutex_unlock( &large_mutex);
+
+  munmap( s, s->size);
+}
+
+void *SL_alloc( size_t sz) {
+
+  pthread_once( &classes_once, init_classes);
+
+  if ( sz > SL_MAX_SIZE) 
+    return alloc_large( sz);
+
+  int c = class_index( sz);
+  SL_Cache *cache = &caches[c];
+
+  if ( cache->n == 0) {
+    refill_cache( c, cache);
+    if ( cache->n == 0) {
+      log_msg( CRIT, "SL_alloc: out of memory for %ld bytes\n", (long) sz);
+      return NULL;
+    }
+  }
+
+  void *p = cache->objs[--cache->n];
+  memset( p, 0, sz);
+  return p;
+}
+
+void SL_free( void *ptr) {
+
+  assert( ptr != NULL);
+
+  SL_Slab *s = SLAB_OF( ptr);
+  if ( s->cls == SL_LARGE) {
+    free_large( s);
+    return;
+  }
+
+  int c = s->cls;
+  SL_Cache *cache = &caches[c];
+
+  if ( !cache_registered) 
+    register_caches();
+
+  if ( cache->n >= classes[c].cache_max) {
+    flush_cache( c, cache, (classes[c].cache_max + 1) / 2);
+  }
+  cache->objs[cache->n++] = ptr;
+}
+
+size_t SL_size( void *ptr) {
+  SL_Slab *s = SLAB_OF( ptr);
+  if ( s->cls == SL_LARGE) 
+    return s->size - SL_HEADER_SIZE;
+  return classes[s->cls].size;
+}
+
+int SL_get_stats( SL_ClassStats stats[], int max) {
+
+  pthread_once( &classes_once, init_classes);
+
+  int n = 0;
+  int c = 0;
+
+  for ( c = 0; c < SL_NBR_CLASSES && n < max; c++, n++) {
+    SL_Class *cl = &classes[c];
+    pthread_mutex_lock( &cl->mutex);
+    stats[n].obj_size = cl->size;
+    stats[n].slabs = cl->slabs;
+    stats[n].objs_out = cl->objs_out;
+    stats[n].objs_free = cl->objs_free;
+    stats[n].reserved = cl->slabs * SL_SLAB_SIZE;
+    pthread_mutex_unlock( &cl->mutex);
+  }
+
+  if ( n < max) {
+    pthread_mutex_lock( &large_mutex);
+    stats[n].obj_size = 0;
+    stats[n].slabs = large_cnt;
+    stats[n].objs_out = large_cnt;
+    stats[n].objs_free = 0;
+    stats[n].reserved = large_bytes;
+    pthread_mutex_unlock( &large_mutex);
+    n++;
+  }
+
+  return n;
+}
+
+// free slabs in the huge page pool
+static long pool_bytes() {
+  pthread_mutex_lock( &arena_mutex);
+  long bytes = pool_cnt * SL_SLAB_SIZE;
+  pthread_mutex_unlock( &arena_mutex);
+  return bytes;
+}
+
+long SL_reserved() {
+  SL_ClassStats stats[SL_NBR_CLASSES+1];
+  int n = SL_get_stats( stats, SL_NBR_CLASSES+1);
+  long reserved = pool_bytes();
+  int i = 0;
+  for ( i = 0; i < n; i++) {
+    reserved += stats[i].reserved;
+  }
+  return reserved;
+}
+
+long SL_used() {
+
+  SL_ClassStats stats[SL_NBR_CLASSES+1];
+  int n = SL_get_stats( stats, SL_NBR_CLASSES+1);
+  long used = 0;
+  int i = 0;
+
+  for ( i = 0; i < n; i++) {
+    used += stats[i].obj_size > 0 ? stats[i].objs_out * stats[i].obj_size : stats[i].reserved;
+  }
+  return used;
+}
+
+void SL_log_stats() {
+
+  SL_ClassStats stats[SL_NBR_CLASSES+1];
+  int n = SL_get_stats( stats, SL_NBR_CLASSES+1);
+  long reserved = 0;
+  long used = 0;
+  int i = 0;
+
+  for ( i = 0; i < n; i++) {
+    SL_ClassStats *st = &stats[i];
+    if ( st->slabs == 0) 
+      continue;
+
+    long obj_bytes = st->obj_size > 0 ? st->objs_out * st->obj_size : st->reserved;
+    reserved += st->reserved;
+    used += obj_bytes;
+
+    log_msg( INFO, "SL: class %7ld: %6ld slabs %9ld objects %9ld free %12ld bytes\n",
+	     (long) st->obj_size, st->slabs, st->objs_out, st->objs_free, st->reserved);
+  }
+
+  if ( arena_bytes > 0) {
+    long pooled = pool_bytes();
+    log_msg( INFO, "SL: %ld bytes in huge page arenas, %ld of them in free slabs\n", arena_bytes, pooled);
+    reserved += pooled;
+  }
+
+  // free objects in slabs and slab tails. rounding up to the class size is on top.
+  log_msg( INFO, "SL: %ld bytes reserved, %ld in objects, fragmentation %.1f%%\n",
+	   reserved, used, reserved > 0 ? 100.0 * (reserved - used) / reserved : 0.0);
+}
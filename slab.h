@@ -0,0 +1,88 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  slab allocator for lookup tables, their entry arrays and B+tree nodes.
+  sizes are rounded up to geometric size classes, 4 per power of 2. objects
+  of a class are carved from 64 KB slabs, each thread keeps a small cache of
+  free objects per class so that most allocations don't take any lock.
+*/
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+typedef struct {
+  size_t obj_size;  // class size, 0 for allocations larger than the biggest class
+  long slabs;       // nbr of slabs (or large allocations)
+  long objs_out;    // objects handed out, including those in thread caches
+  long objs_free;   // objects free within the slabs
+  long reserved;    // bytes taken from the system
+} SL_ClassStats;
+
+// zeroed storage of at least sz bytes or NULL
+void *SL_alloc( size_t sz);
+
+// frees storage from SL_alloc(). any thread may free.
+void SL_free( void *ptr);
+
+// bytes SL_alloc( sz) reserves, i.e. sz rounded up to its class
+size_t SL_class_size( size_t sz);
+
+// usable size of ptr
+size_t SL_size( void *ptr);
+
+// fills in stats per class, the last entry covering large allocations.
+// returns the nbr of entries filled in.
+int SL_get_stats( SL_ClassStats stats[], int max);
+
+// total bytes taken from the system
+long SL_reserved();
+
+// huge page backing of slabs and SL_map(): "off", "madvise" for transparent
+// huge pages or "hugetlb" for hugetlbfs pages. set before storage is
+// allocated. NULL keeps the mode. returns the mode or -1 if unknown.
+#define SL_HUGE_OFF 0
+#define SL_HUGE_MADVISE 1
+#define SL_HUGE_TLB 2
+
+int SL_set_huge_pages( const char *mode);
+
+// zeroed mapping of sz bytes for long lived storage, huge pages if enabled
+void *SL_map( size_t sz);
+
+// bytes of objects handed out, rounded up to their classes
+long SL_used();
+
+// logs per class statistics and the fragmentation
+void SL_log_stats();
+
+#endif
@@ -36,14 +36,24 @@
 #include <assert.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mem.h"
 #include "json.h"
 #include "utils.h"
 #include "logger.h"
 #include "queue.h"
+#include "epoch.h"
+#include "slab.h"
+#include "dumpio.h"
+#include "crc32c.h"
 #include "nlkup.h"
 
 
@@ -178,28 +188,136 @@ unsigned char *compress( const unsigned char nbr[], const int from, const int nb
   return dest;
 }
 
-  
-static int dump_tbl_entry( LkupTblEntry *e, FILE *f, int binary) {
-  if ( binary) {
-    if ( fwrite( &e->postfix, sizeof( unsigned char), POSTFIX_LENGTH, f) != POSTFIX_LENGTH) {
+
+// length-major bases of the key space, postfixes of n digits start at postfix_key_base[n]
+static const LkupKey postfix_key_base[POSTFIX_MAX_LENGTH+2] = {
+  0, 1, 11, 111, 1111, 11111, 111111, 1111111, 11111111, 111111111, 1111111111
+};
+
+// packs nbr_len digits of nbr, starting at from, into a key.
+// returns the nbr of digits or FAILURE.
+int encode_postfix( const unsigned char nbr[], const int from, const int nbr_len, LkupKey *key) {
+
+  if ( nbr_len < 0 || nbr_len > POSTFIX_MAX_LENGTH) {
+    log_msg( ERR, "encode_postfix: bad postfix length %d in %s\n", nbr_len, nbr);
+    return FAILURE;
+  }
+
+  LkupKey v = 0;
+  int i = 0;
+  for ( i = from; i < from+nbr_len; i++) {
+    unsigned char c = nbr[i];
+    if ( c < '0' || c > '9') {
+      log_msg( ERR, "illegal, non-digital, digit in %s\n", nbr);
       return FAILURE;
     }
-    if ( fwrite( &e->alias, sizeof( unsigned char), ALIAS_LENGTH, f) != ALIAS_LENGTH) {
+    v = v*10 + (c - '0');
+  }
+
+  *key = postfix_key_base[nbr_len] + v;
+  return nbr_len;
+}
+
+// unpacks key into a null-terminated string. returns the nbr of digits or FAILURE.
+int decode_postfix( const LkupKey key, unsigned char dest[], const int dest_sz) {
+
+  if ( key >= postfix_key_base[POSTFIX_MAX_LENGTH+1]) {
+    log_msg( ERR, "decode_postfix: bad key %u\n", key);
+    return FAILURE;
+  }
+
+  // the nbr of digits is given by the base range the key falls into
+  int len = 0;
+  while ( key >= postfix_key_base[len+1]) 
+    len++;
+
+  if ( dest_sz < len + 1) { // test buffer space, accounting 0 byte
+    log_msg( ERR, "decode_postfix: %d <= %d\n", dest_sz, (len+1));
+    return FAILURE;
+  }
+
+  LkupKey v = key - postfix_key_base[len];
+  int i = 0;
+
+  dest[len] = 0;
+  for ( i = len-1; i >= 0; i--) {
+    dest[i] = '0' + v % 10;
+    v /= 10;
+  }
+
+  return len;
+}
+
+// converting between keys and the compressed postfixes of DUMP_FORMAT_BCD
+static int key_to_bcd( const LkupKey key, unsigned char bcd[POSTFIX_LENGTH]) {
+  unsigned char postfix[POSTFIX_MAX_LENGTH+1];
+  int len = decode_postfix( key, postfix, sizeof( postfix));
+  if ( len < 0) 
+    return FAILURE;
+  return compress_to_buf( postfix, 0, len, bcd, POSTFIX_LENGTH);
+}
+
+static int bcd_to_key( const unsigned char bcd[POSTFIX_LENGTH], LkupKey *key) {
+  unsigned char postfix[2*POSTFIX_LENGTH];
+  if ( decompress_to_buf( bcd, postfix, sizeof( postfix)) < 0)
+    return FAILURE;
+  return encode_postfix( postfix, 0, strlen( postfix), key);
+}
+
+// writes entries [0..len) of table t
+static int dump_tbl_entries( LkupTblPtr t, FILE *f, int format) {
+
+  int i = 0;
+
+  if ( format == DUMP_FORMAT_KEYS) {
+    // keys in network byte order, then the aliases as they are
+    uint32_t *keys = malloc( t->table_len * sizeof( uint32_t));
+    if ( keys == NULL) 
       return FAILURE;
+
+    for ( i = 0; i < t->table_len; i++) {
+      keys[i] = htonl( t->keys[i]);
     }
-  } else {
-    unsigned char *postfix = decompress( e->postfix);
-    unsigned char *alias = decompress( e->alias);
 
-    fprintf( f, "%s %s\n", postfix, alias);
+    int s = SUCCESS;
+    if ( fwrite( keys, sizeof( uint32_t), t->table_len, f) != t->table_len ||
+	 fwrite( t->aliases, sizeof( LkupAlias), t->table_len, f) != t->table_len) {
+      s = FAILURE;
+    }
+    free( keys);
+    return s;
+  }
+
+  for ( i = 0; i < t->table_len; i++) {
+
+    if ( format == DUMP_FORMAT_BCD) {
+
+      unsigned char postfix[POSTFIX_LENGTH];
+      if ( key_to_bcd( t->keys[i], postfix) < 0) {
+	return FAILURE;
+      }
+      if ( fwrite( postfix, sizeof( unsigned char), POSTFIX_LENGTH, f) != POSTFIX_LENGTH) {
+	return FAILURE;
+      }
+      if ( fwrite( t->aliases[i].alias, sizeof( unsigned char), ALIAS_LENGTH, f) != ALIAS_LENGTH) {
+	return FAILURE;
+      }
+
+    } else {
+
+      unsigned char postfix[POSTFIX_MAX_LENGTH+1];
+      unsigned char alias[MAX_NBR_LENGTH+1];
 
-    mem_free( postfix);
-    mem_free( alias);
+      decode_postfix( t->keys[i], postfix, sizeof( postfix));
+      decompress_to_buf( t->aliases[i].alias, alias, sizeof( alias));
+
+      fprintf( f, "%s %s\n", postfix, alias);
+    }
   }
   return SUCCESS;
 }
 
-int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int binary) {
+int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int format) {
 
   if ( f == NULL) {
     f = stderr;
@@ -210,7 +328,7 @@ int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int binary) {
   LkupTblPtr t = index_table[idx].table;
 
   if ( t == NULL) {
-    if ( binary) {
+    if ( format != DUMP_TEXT) {
 
       long block_header[3];
       block_header[0] = htonl( (long) (idx + INDEX_OFFSET));
@@ -229,7 +347,7 @@ int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int binary) {
     return SUCCESS;
   }
 
-  if ( binary) {
+  if ( format != DUMP_TEXT) {
       long block_header[3];
 
       // network byte order....
@@ -246,149 +364,1621 @@ int dump_table( IdxTblEntry index_table[], int idx, FILE *f, int binary) {
     fprintf( f, "idx: %ld, sz: %ld, len: %ld\n", (long) (idx+INDEX_OFFSET), t->table_sz, t->table_len);
   }
 
-  int i = 0;
-  for ( i = 0; i < t->table_len; i++) {
-    LkupTblEntry *e = &(t->table[i]);
-    if ( dump_tbl_entry( e, f, binary) < SUCCESS) {
-      unlock_table( index_table, idx);
+  // B+tree blocks are written just like arrays
+  LkupTblPtr flat = NULL;
+  if ( t->tree != NULL) {
+    flat = new_lkup_tbl( t->table_len);
+    flat->table_len = get_lkup_tbl_entries( t, 0, t->table_len, flat->keys, flat->aliases);
+    t = flat;
+  }
+
+  int s = dump_tbl_entries( t, f, format);
+
+  if ( flat != NULL) {
+    free_lkup_tbl( flat);
+  }
+
+  unlock_table( index_table, idx);
+  return s;
+
+}
+
+#define DUMP_V2_ENTRY_SIZE (sizeof( LkupKey) + sizeof( LkupAlias))
+#define DUMP_V2_MAX_DELTA_SIZE (5 + 1 + ALIAS_LENGTH) // varint key delta, shared count, alias
+
+// dumping or restoring slots [from, to) to or from file fn, one per thread
+typedef struct {
+  IdxTblEntry *index_table;
+  char fn[DUMP_SEGMENT_FN_LENGTH];
+  int from;
+  int to;
+  int flags;               // DUMP_V2_xxx
+  int status;
+  unsigned char *data;     // the mapped file
+  size_t data_sz;
+  SnapMap *map;            // if served in place
+  int verified;            // the blocks were checked against their checksums
+  LkupTbl **tables;        // restored, one per block of the range
+  long nbr_tables;
+  const DumpCheckpoint *ck; // if dumping a checkpoint
+  DW_Stats io;             // of writing it
+  long max_lock_usec;
+} DumpSegmentJob;
+
+static unsigned char *put_varint( unsigned char *cp, uint32_t v) {
+  while ( v >= 0x80) {
+    *cp++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *cp++ = v;
+  return cp;
+}
+
+// NULL if the varint runs past end
+static const unsigned char *get_varint( const unsigned char *cp, const unsigned char *end, uint32_t *v) {
+  uint32_t r = 0;
+  int shift = 0;
+  while ( cp < end && shift < 35) {
+    unsigned char c = *cp++;
+    r |= (uint32_t) (c & 0x7f) << shift;
+    if ( c < 0x80) {
+      *v = r;
+      return cp;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+// bytes of a packed alias in use: its length byte and 2 digits per byte
+static int alias_bytes( const LkupAlias *a) {
+  int n = 1 + (a->alias[0] + 1) / 2;
+  return n < ALIAS_LENGTH ? n : ALIAS_LENGTH;
+}
+
+// DUMP_V2_DELTA encoding of the len entries. buf needs len * DUMP_V2_MAX_DELTA_SIZE bytes.
+static long encode_block_delta( const LkupKey keys[], const LkupAlias aliases[], const long len, unsigned char *buf) {
+
+  unsigned char *cp = buf;
+  LkupKey prev_key = 0;
+  long i = 0;
+
+  for ( i = 0; i < len; i++) {
+    cp = put_varint( cp, keys[i] - prev_key);
+    prev_key = keys[i];
+  }
+
+  static const LkupAlias no_alias;
+  const LkupAlias *prev = &no_alias;
+
+  for ( i = 0; i < len; i++) {
+    const LkupAlias *a = &aliases[i];
+    int n = alias_bytes( a);
+    int shared = 0;
+    while ( shared < n && a->alias[shared] == prev->alias[shared]) 
+      shared++;
+    *cp++ = shared;
+    memcpy( cp, &a->alias[shared], n - shared);
+    cp += n - shared;
+    prev = a;
+  }
+
+  return cp - buf;
+}
+
+// decodes a DUMP_V2_DELTA block in [cp, end). FAILURE unless it holds exactly
+// len entries with ascending keys.
+static int decode_block_delta( const unsigned char *cp, const unsigned char *end, const long len, 
+			       LkupKey keys[], LkupAlias aliases[]) {
+
+  uint32_t key = 0;
+  long i = 0;
+
+  for ( i = 0; i < len; i++) {
+    uint32_t delta = 0;
+    if (( cp = get_varint( cp, end, &delta)) == NULL || (i > 0 && delta == 0) || key + delta < key) 
       return FAILURE;
+    key += delta;
+    keys[i] = key;
+  }
+
+  static const LkupAlias no_alias;
+  const LkupAlias *prev = &no_alias;
+
+  for ( i = 0; i < len; i++) {
+    LkupAlias *a = &aliases[i];
+    if ( cp >= end || *cp > ALIAS_LENGTH) 
+      return FAILURE;
+    int shared = *cp++;
+
+    memset( a, 0, sizeof( LkupAlias));
+    memcpy( a->alias, prev->alias, shared);
+    if ( shared == 0) { // the length byte differs
+      if ( cp >= end) 
+	return FAILURE;
+      a->alias[0] = *cp++;
+      shared = 1;
     }
+
+    int n = alias_bytes( a);
+    if ( shared > n || cp + (n - shared) > end) 
+      return FAILURE;
+    memcpy( &a->alias[shared], cp, n - shared);
+    cp += n - shared;
+    prev = a;
   }
 
-  unlock_table( index_table, idx);
+  // the last block is followed by the padding of the directory
+  if ( end - cp >= DUMP_V2_ALIGN) 
+    return FAILURE;
+  for ( ; cp < end; cp++) {
+    if ( *cp != 0) 
+      return FAILURE;
+  }
   return SUCCESS;
+}
+
+// writes the non-empty blocks of slots [from, to), then the directory, then
+// the final file header. increments write the changed slots instead. blocks
+// are copied while their slot is locked, the writer puts them on disk after.
+static int dump_range_v2( IdxTblEntry index_table[], DW_Writer *w, const int from, const int to, 
+			  const int flags, const DumpCheckpoint *ck, long *max_lock_usec) {
+
+  assert( ck != NULL || !(flags & (DUMP_V2_INCREMENT | DUMP_V2_LINKED)));
+  const int increment = flags & DUMP_V2_INCREMENT;
+  const int linked = flags & (DUMP_V2_INCREMENT | DUMP_V2_LINKED); // has a chain record
+
+  static const unsigned char padding[DUMP_V2_ALIGN];
+
+  DumpHeaderV2 header;
+  memset( &header, 0, sizeof( header));
+  header.magic = htonl( DUMP_MAGIC);
+  header.format = htonl( DUMP_FORMAT_V2);
+  header.byte_order = DUMP_V2_BYTE_ORDER;
+  header.flags = flags | DUMP_V2_CHECKSUM;
+  header.generation = ck != NULL ? ck->generation : 0;
+
+  if ( DW_write( w, &header, sizeof( header)) != SUCCESS || 
+       (linked && DW_write( w, &ck->chain, sizeof( DumpChainV2)) != SUCCESS)) 
+    return FAILURE;
+
+  DumpDirEntryV2 *dir = NULL;
+  uint32_t *checks = NULL;    // of the blocks in dir
+  long dir_sz = 0;
+  unsigned char *buf = NULL;  // a block not fitting into the writer's buffer
+  long buf_sz = 0;
+  LkupKey *flat_keys = NULL;  // a B+tree block to be compressed
+  LkupAlias *flat_aliases = NULL;
+  long flat_sz = 0;
+  uint64_t offset = sizeof( header) + (linked ? sizeof( DumpChainV2) : 0);
+  int s = SUCCESS;
+  int idx = 0;
+
+  for ( idx = from; idx < to && s == SUCCESS; idx++) {
+
+    // racy peek, most slots are empty. checkpoints must not miss a write
+    // stamped before they started, they look at every slot locked.
+    if ( ck == NULL && index_table[idx].table == NULL) 
+      continue;
+
+    lock_table( index_table, idx);
+
+    LkupTblPtr t = index_table[idx].table;
+    if ( increment ? table_changed( idx) <= ck->since : t == NULL || t->table_len == 0) {
+      unlock_table( index_table, idx);
+      continue;
+    }
+
+    long locked = get_time_micro();
+
+    long len = t != NULL ? t->table_len : 0;
+    long need = (flags & DUMP_V2_DELTA) ? len * DUMP_V2_MAX_DELTA_SIZE : len * DUMP_V2_ENTRY_SIZE + DUMP_V2_ALIGN;
+
+    // scratch space is from the heap, a forked checkpoint must stay clear of the slab locks
+    unsigned char *out = DW_space( w, need);
+    int in_place = out != NULL;
+    if ( !in_place && need > buf_sz) {
+      free( buf);
+      buf_sz = need;
+      if (( buf = malloc( buf_sz)) == NULL) {
+	buf_sz = 0;
+	s = FAILURE;
+      }
+    }
+    if ( !in_place) 
+      out = buf;
+
+    LkupKey *keys = t != NULL ? t->keys : NULL;
+    LkupAlias *aliases = t != NULL ? t->aliases : NULL;
+    if ( s == SUCCESS && len > 0 && (flags & DUMP_V2_DELTA) && t->tree != NULL) {
+      if ( len > flat_sz) {
+	free( flat_keys);
+	free( flat_aliases);
+	flat_sz = len;
+	flat_keys = malloc( flat_sz * sizeof( LkupKey));
+	flat_aliases = malloc( flat_sz * sizeof( LkupAlias));
+	if ( flat_keys == NULL || flat_aliases == NULL) {
+	  flat_sz = 0;
+	  s = FAILURE;
+	}
+      }
+      if ( s == SUCCESS) 
+	len = get_lkup_tbl_entries( t, 0, len, flat_keys, flat_aliases);
+      keys = flat_keys;
+      aliases = flat_aliases;
+    }
+
+    long bytes = 0;
+    long pad = 0;
+    if ( s != SUCCESS || len == 0) { // emptied slot of an increment
+      ;
+    } else if ( flags & DUMP_V2_DELTA) {
+      bytes = encode_block_delta( keys, aliases, len, out);
+    } else { // keys, aliases, then padding to keep the next block aligned
+      len = get_lkup_tbl_entries( t, 0, len, (LkupKey *) out, (LkupAlias *) (out + len * sizeof( LkupKey)));
+      bytes = len * DUMP_V2_ENTRY_SIZE;
+      pad = -bytes & (DUMP_V2_ALIGN - 1);
+      memset( out + bytes, 0, pad);
+    }
+
+    long held = get_time_micro() - locked;
+    if ( max_lock_usec != NULL && held > *max_lock_usec) 
+      *max_lock_usec = held;
+
+    unlock_table( index_table, idx);
+
+    if ( s != SUCCESS) {
+      log_msg( CRIT, "dump_range_v2: out of heap space\n");
+      break;
+    }
+
+    uint32_t check = CRC_crc32c( 0, out, bytes);
+
+    if ( bytes + pad > 0) 
+      s = in_place ? DW_commit( w, bytes + pad) : DW_write( w, out, bytes + pad);
+
+    if ( s == SUCCESS && header.nbr_blocks == dir_sz) {
+      dir_sz = dir_sz == 0 ? 1024 : 2 * dir_sz;
+      DumpDirEntryV2 *d = realloc( dir, dir_sz * sizeof( DumpDirEntryV2));
+      dir = d != NULL ? d : dir;
+      uint32_t *c = realloc( checks, dir_sz * sizeof( uint32_t));
+      checks = c != NULL ? c : checks;
+      if ( d == NULL || c == NULL) {
+	log_msg( CRIT, "dump_range_v2: out of heap space\n");
+	s = FAILURE;
+      }
+    }
 
+    if ( s == SUCCESS) {
+      checks[header.nbr_blocks] = check;
+      DumpDirEntryV2 *e = &dir[header.nbr_blocks++];
+      e->prefix = idx + INDEX_OFFSET;
+      e->len = len;
+      e->offset = offset;
+      offset += bytes + pad;
+      header.nbr_entries += len;
+    }
+  }
+
+  // the directory stays aligned. a compressed last block ends with the padding.
+  long pad = -offset & (DUMP_V2_ALIGN - 1);
+  if ( s == SUCCESS && DW_write( w, padding, pad) != SUCCESS) 
+    s = FAILURE;
+  offset += pad;
+  long last = header.nbr_blocks - 1;
+  if ( (flags & DUMP_V2_DELTA) && last >= 0 && dir[last].len > 0) 
+    checks[last] = CRC_crc32c( checks[last], padding, pad);
+
+  header.dir_offset = offset;
+  header.file_size = offset + header.nbr_blocks * (sizeof( DumpDirEntryV2) + sizeof( uint32_t));
+
+  header.check = CRC_crc32c( 0, &header, sizeof( header));
+  if ( linked) 
+    header.check = CRC_crc32c( header.check, &ck->chain, sizeof( DumpChainV2));
+  header.check = CRC_crc32c( header.check, dir, header.nbr_blocks * sizeof( DumpDirEntryV2));
+  header.check = CRC_crc32c( header.check, checks, header.nbr_blocks * sizeof( uint32_t));
+
+  if ( s == SUCCESS && 
+       (DW_write( w, dir, header.nbr_blocks * sizeof( DumpDirEntryV2)) != SUCCESS ||
+	DW_write( w, checks, header.nbr_blocks * sizeof( uint32_t)) != SUCCESS ||
+	DW_pwrite( w, &header, sizeof( header), 0) != SUCCESS)) {
+    s = FAILURE;
+  }
+
+  free( checks);
+  free( flat_keys);
+  free( flat_aliases);
+  free( buf);
+  free( dir);
+  return s;
 }
 
 int dump_all( IdxTblEntry index_table[], FILE *f, int binary) {
   if ( f == NULL) {
     f = stderr;
   }
+
+  if ( binary) {
+    DW_Writer *w = DW_open_stream( f);
+    if ( w == NULL) 
+      return FAILURE;
+    int s = dump_range_v2( index_table, w, 0, INDEX_SIZE-INDEX_OFFSET, 0, NULL, NULL);
+    return DW_close( w, FALSE, NULL) == SUCCESS ? s : FAILURE;
+  }
+
   int i = 0;
   for ( i = 0; i < INDEX_SIZE-INDEX_OFFSET; i++) {
-    if ( dump_table( index_table, i, f, binary) < SUCCESS) {
+    if ( dump_table( index_table, i, f, DUMP_TEXT) < SUCCESS) {
       return FAILURE;
     }
   }
   return SUCCESS;
 }
 
-int dump_all_fn( IdxTblEntry index_table[], const unsigned char *fn, int binary) {
+// adds what writing one file took to stats
+static void add_dump_stats( DumpStats *stats, const DW_Stats *ws, const long max_lock_usec) {
+  stats->bytes += ws->bytes;
+  stats->throttled_usec += ws->throttled_usec;
+  if ( max_lock_usec > stats->max_lock_usec) 
+    stats->max_lock_usec = max_lock_usec;
+}
+
+static void log_dump_stats( const unsigned char *fn, const DumpStats *stats) {
+  log_msg( INFO, "dump to %s done: %ld bytes in %ld usec, slots locked %ld usec at most, throttled %ld usec\n", 
+	   fn, stats->bytes, stats->usec, stats->max_lock_usec, stats->throttled_usec);
+}
+
+// writes a text dump or a single DUMP_FORMAT_V2 file with given flags
+static int dump_to_fn( IdxTblEntry index_table[], const unsigned char *fn, const int binary, 
+		       const int flags, const DumpCheckpoint *ck, DumpStats *stats) {
 
   assert( fn != NULL && strlen( fn) > 0);
 
-  FILE *f = fopen( fn, "w");
-  if ( f == NULL) {
-    log_msg( ERR, "failure to write-open %s\n", fn);
+  // the racy peeks at empty slots must not miss any still to load
+  if ( finish_lazy_restore( index_table) != SUCCESS) 
+    return FAILURE;
+
+  // written aside and renamed: the file may be a snapshot which is mapped and served
+  char *tmp_fn = str_cat( fn, ".tmp", NULL);
+  if ( tmp_fn == NULL) {
+    log_msg( CRIT, "dump_to_fn: str_cat filename\n");
     return FAILURE;
   }
 
-  log_msg( INFO, "starting dump to %s\n", fn);
+  int s = FAILURE;
+
+  if ( binary) {
+    DW_Writer *w = DW_open( tmp_fn);
+    if ( w == NULL) {
+      free( tmp_fn);
+      return FAILURE;
+    }
+
+    log_msg( INFO, "starting dump to %s\n", fn);
+
+    long max_lock_usec = 0;
+    s = dump_range_v2( index_table, w, 0, INDEX_SIZE-INDEX_OFFSET, flags, ck, &max_lock_usec);
+
+    // a checkpoint replaces the log records it covers, it must be on disk first
+    DW_Stats ws;
+    if ( DW_close( w, TRUE, &ws) != SUCCESS) {
+      log_msg( ERR, "failure to write %s\n", tmp_fn);
+      s = FAILURE;
+    }
+
+    DumpStats ds;
+    memset( &ds, 0, sizeof( ds));
+    add_dump_stats( &ds, &ws, max_lock_usec);
+    ds.usec = ws.usec;
+    log_dump_stats( fn, &ds);
+    if ( stats != NULL) 
+      *stats = ds;
+
+  } else {
+    FILE *f = fopen( tmp_fn, "w");
+    if ( f == NULL) {
+      log_msg( ERR, "failure to write-open %s\n", tmp_fn);
+      free( tmp_fn);
+      return FAILURE;
+    }
+
+    log_msg( INFO, "starting dump to %s\n", fn);
 
-  int s = dump_all( index_table, f, binary);
+    s = dump_all( index_table, f, FALSE);
 
-  log_msg( INFO, "dump done\n");
+    log_msg( INFO, "dump done\n");
   
-  if ( fclose( f) < 0) {
-    log_msg( ERR, "failure to close %s\n", fn);
+    if ( fflush( f) != 0 || fsync( fileno( f)) < 0) {
+      log_msg( ERR, "failure to sync %s\n", tmp_fn);
+      s = FAILURE;
+    }
+    if ( fclose( f) < 0) {
+      log_msg( ERR, "failure to close %s\n", tmp_fn);
+      s = FAILURE;
+    }
+  }
+
+  if ( s == SUCCESS && rename( tmp_fn, fn) < 0) {
+    log_msg( ERR, "failure to rename %s to %s\n", tmp_fn, fn);
+    s = FAILURE;
+  } else if ( s == SUCCESS && sync_dir_of( fn) != SUCCESS) {
+    s = FAILURE;
+  }
+  if ( s != SUCCESS) {
+    unlink( tmp_fn);
+  }
+
+  free( tmp_fn);
+  return s;
+}
+
+int dump_all_fn( IdxTblEntry index_table[], const unsigned char *fn, int binary) {
+  return dump_to_fn( index_table, fn, binary, 0, NULL, NULL);
+}
+
+// reads len entries in given format into table t
+static int restore_tbl_entries( LkupTblPtr t, const long len, FILE *f, int format) {
+
+  int i = 0;
+
+  if ( format == DUMP_FORMAT_KEYS) {
+
+    if ( fread( t->keys, sizeof( uint32_t), len, f) != len ||
+	 fread( t->aliases, sizeof( LkupAlias), len, f) != len) {
+      return FAILURE;
+    }
+    for ( i = 0; i < len; i++) {
+      t->keys[i] = ntohl( t->keys[i]);
+    }
+    t->table_len = len;
+    return SUCCESS;
+  }
+
+  // DUMP_FORMAT_BCD
+  for ( i = 0; i < len; i++) {
+
+    unsigned char postfix[POSTFIX_LENGTH];
+
+    if ( fread( postfix, sizeof( unsigned char), POSTFIX_LENGTH, f) != POSTFIX_LENGTH) {
+      return FAILURE;
+    }
+
+    if ( fread( t->aliases[i].alias, sizeof( unsigned char), ALIAS_LENGTH, f) != ALIAS_LENGTH) {
+      return FAILURE;
+    }
+
+    if ( bcd_to_key( postfix, &t->keys[i]) < 0) {
+      return FAILURE;
+    }
+
+    t->table_len = i+1; // entries actually read
+  }
+  return SUCCESS;
+}
+
+static int restore_table( IdxTblEntry index_table[], int idx, FILE *f, int format) {
+
+  // read the block header
+  long block_header[3];
+  if ( fread( block_header, sizeof( long), 3, f) != 3) {
     return FAILURE;
   }
+
+  // ensure host byte order
+  int i = 0;
+  for ( i = 0; i < 3; i++) {
+    block_header[i] = ntohl( block_header[i]);
+  }
+
+  // first long is the index + INDEX_OFFSET
+  if ( block_header[0] - INDEX_OFFSET != idx || block_header[1] < block_header[2] || block_header[2] < 0) {
+    log_msg( ERR, "restore_table: corrupt block header at prefix %d\n", idx + INDEX_OFFSET);
+    return FAILURE;
+  }
+
+  lock_table( index_table, idx);
+  LkupTblPtr t = index_table[idx].table;
+
+  if ( t == NULL && block_header[1] == 0) { // stays empty, we're done
+    unlock_table( index_table, idx);
+    return SUCCESS;
+  }
+
+  LkupTblPtr nt = NULL;
+  int s = SUCCESS;
+
+  if ( block_header[1] != 0) { // table in file not empty
+
+    // newly allocate in-memory table and load entries from file
+    nt = new_lkup_tbl( block_header[1]);
+    s = restore_tbl_entries( nt, block_header[2], f, format);
+    adapt_lkup_tbl( nt);
+  }
+
+  // switch tables. lock-free readers may still look at the old one.
+  begin_table_write( index_table, idx);
+  index_table[idx].table = nt;
+  end_table_write( index_table, idx);
+
+  if ( t != NULL) {
+    retire_lkup_tbl( t);
+  }
+
+  unlock_table( index_table, idx);
   return s;
+
 }
 
-static int restore_table( IdxTblEntry index_table[], int idx, FILE *f) {
+// returns the format given in the file header. files without header are DUMP_FORMAT_BCD.
+static int read_dump_header( FILE *f) {
+
+  uint32_t file_header[2];
+
+  if ( fread( file_header, sizeof( uint32_t), 2, f) == 2 && ntohl( file_header[0]) == DUMP_MAGIC) {
+    return ntohl( file_header[1]);
+  }
+
+  // no header, first block starts at offset 0
+  rewind( f);
+  return DUMP_FORMAT_BCD;
+}
+
+static int restore_all( IdxTblEntry index_table[], FILE *f) {
+
+  int format = read_dump_header( f);
+  if ( format != DUMP_FORMAT_BCD && format != DUMP_FORMAT_KEYS) {
+    log_msg( ERR, "restore_all: unsupported dump format %d\n", format);
+    return FAILURE;
+  }
+
+  int i = 0;
+  for ( i = 0; i < INDEX_SIZE-INDEX_OFFSET; i++) {
+    if ( restore_table( index_table, i, f, format) < SUCCESS) {
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+// end of block i of a DUMP_FORMAT_V2 file. compressed blocks end where the next starts.
+static uint64_t dump_block_end( const DumpHeaderV2 *header, const DumpDirEntryV2 dir[], const long i) {
+  if ( !(header->flags & DUMP_V2_DELTA)) 
+    return dir[i].offset + dir[i].len * DUMP_V2_ENTRY_SIZE;
+  return i + 1 < header->nbr_blocks ? dir[i+1].offset : header->dir_offset;
+}
+
+// the block checksums of a DUMP_V2_CHECKSUM file, NULL if it has none
+static const uint32_t *dump_block_checks( const unsigned char *data) {
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) data;
+  if ( !(header->flags & DUMP_V2_CHECKSUM)) 
+    return NULL;
+  return (const uint32_t *) (data + header->dir_offset + header->nbr_blocks * sizeof( DumpDirEntryV2));
+}
+
+// checks header and directory of a mapped DUMP_FORMAT_V2 file whose blocks
+// must all be in slots [from, to). the blocks are checked as they are loaded.
+static int check_dump_v2( const unsigned char *data, const size_t data_sz, const int from, const int to) {
+
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) data;
+
+  if ( data_sz < sizeof( DumpHeaderV2) || header->byte_order != DUMP_V2_BYTE_ORDER) {
+    log_msg( ERR, "check_dump_v2: short file or foreign byte order\n");
+    return FAILURE;
+  }
+
+  if (( header->flags & ~(DUMP_V2_DELTA | DUMP_V2_INCREMENT | DUMP_V2_CHECKSUM | DUMP_V2_LINKED)) != 0) {
+    log_msg( ERR, "check_dump_v2: unknown flags %x\n", header->flags);
+    return FAILURE;
+  }
+
+  size_t dir_entry_sz = sizeof( DumpDirEntryV2) + (header->flags & DUMP_V2_CHECKSUM ? sizeof( uint32_t) : 0);
+  if ( header->file_size != data_sz || header->dir_offset < sizeof( DumpHeaderV2) || 
+       header->dir_offset % DUMP_V2_ALIGN != 0 || 
+       header->dir_offset + header->nbr_blocks * dir_entry_sz != data_sz) {
+    log_msg( ERR, "check_dump_v2: inconsistent sizes, truncated file?\n");
+    return FAILURE;
+  }
+
+  const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (data + header->dir_offset);
+  uint32_t prev_prefix = from + INDEX_OFFSET - 1;
+  const int increment = header->flags & DUMP_V2_INCREMENT;
+  const int linked = header->flags & (DUMP_V2_INCREMENT | DUMP_V2_LINKED);
+  uint64_t prev_end = sizeof( DumpHeaderV2) + (linked ? sizeof( DumpChainV2) : 0);
+  uint64_t entries = 0;
+  long i = 0;
+
+  if ( header->dir_offset < prev_end) {
+    log_msg( ERR, "check_dump_v2: no room for the chain record\n");
+    return FAILURE;
+  }
+
+  if ( header->flags & DUMP_V2_CHECKSUM) {
+    DumpHeaderV2 h = *header;
+    h.check = 0;
+    uint32_t check = CRC_crc32c( 0, &h, sizeof( h));
+    check = CRC_crc32c( check, data + sizeof( h), prev_end - sizeof( h)); // the chain record
+    check = CRC_crc32c( check, data + header->dir_offset, data_sz - header->dir_offset);
+    if ( check != header->check) {
+      log_msg( ERR, "check_dump_v2: checksum mismatch in header or directory\n");
+      return FAILURE;
+    }
+  }
+
+  for ( i = 0; i < header->nbr_blocks; i++) {
+    const DumpDirEntryV2 *e = &dir[i];
+    uint64_t end = e->len == 0 ? e->offset : dump_block_end( header, dir, i);
+    if ( e->prefix <= prev_prefix || e->prefix >= to + INDEX_OFFSET || (e->len == 0 && !increment) || 
+	 e->offset < prev_end || end < e->offset || (end == e->offset && e->len > 0) || 
+	 end > header->dir_offset ||
+	 (!(header->flags & DUMP_V2_DELTA) && e->offset % DUMP_V2_ALIGN != 0)) {
+      log_msg( ERR, "check_dump_v2: bad directory entry %ld\n", i);
+      return FAILURE;
+    }
+    prev_prefix = e->prefix;
+    prev_end = end;
+    entries += e->len;
+  }
+
+  if ( entries != header->nbr_entries) {
+    log_msg( ERR, "check_dump_v2: %lu entries, header says %lu\n", 
+	     (unsigned long) entries, (unsigned long) header->nbr_entries);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+void ref_snap_map( SnapMap *map) {
+  __atomic_add_fetch( &map->refs, 1, __ATOMIC_RELAXED);
+}
+
+void unref_snap_map( SnapMap *map) {
+  if ( __atomic_sub_fetch( &map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    log_msg( INFO, "unmapping snapshot of %ld bytes\n", (long) map->data_sz);
+    munmap( map->data, map->data_sz);
+    mem_free( map);
+  }
+}
+
+static void run_segment_jobs( void *(*f)( void *), DumpSegmentJob jobs[], const int n);
+
+// maps the DUMP_FORMAT_V2 file of the job and checks that it only has blocks of
+// the job's slots. if mapped, its tables are going to be served in place.
+// compressed files are always decoded.
+static int open_dump_v2( DumpSegmentJob *job, int mapped) {
+
+  job->data = NULL;
+  job->map = NULL;
+
+  int fd = open( job->fn, O_RDONLY);
+  if ( fd < 0) {
+    log_msg( ERR, "open_dump_v2: failure to open %s\n", job->fn);
+    return FAILURE;
+  }
+
+  struct stat st;
+  if ( fstat( fd, &st) < 0 || st.st_size < sizeof( DumpHeaderV2)) {
+    log_msg( ERR, "open_dump_v2: failure to stat %s or too short\n", job->fn);
+    close( fd);
+    return FAILURE;
+  }
+
+  unsigned char *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close( fd);
+  if ( data == MAP_FAILED) {
+    log_msg( ERR, "open_dump_v2: failure to map %s\n", job->fn);
+    return FAILURE;
+  }
+  madvise( data, st.st_size, MADV_SEQUENTIAL);
+
+  if ( check_dump_v2( data, st.st_size, job->from, job->to) != SUCCESS) {
+    log_msg( ERR, "open_dump_v2: bad dump %s\n", job->fn);
+    munmap( data, st.st_size);
+    return FAILURE;
+  }
+
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) data;
+  if ( mapped && (header->flags & DUMP_V2_DELTA)) {
+    log_msg( INFO, "open_dump_v2: %s is compressed, decoding instead of mapping\n", job->fn);
+    mapped = FALSE;
+  }
+
+  // the restore holds a reference of its own while tables are set up
+  if ( mapped) {
+    if (( job->map = mem_alloc( sizeof( SnapMap))) == NULL) {
+      log_msg( CRIT, "open_dump_v2: out of heap space\n");
+      munmap( data, st.st_size);
+      return FAILURE;
+    }
+    job->map->data = data;
+    job->map->data_sz = st.st_size;
+    job->map->refs = 1;
+  }
+
+  job->data = data;
+  job->data_sz = st.st_size;
+  return SUCCESS;
+}
+
+// a mapped file is read sequentially while its blocks are checked, served like
+// the heap once they are. checking costs a read of the whole file at startup,
+// with readahead that is about what copying it would, and the pages are cached
+// for serving. not checking would serve a corrupt block as if it were fine.
+static void serve_in_place( DumpSegmentJob *job) {
+  if ( job->map != NULL) 
+    madvise( job->map->data, job->map->data_sz, MADV_RANDOM);
+}
+
+// drops the restore's hold of the file of the job
+static void close_dump_v2( DumpSegmentJob *job) {
+  if ( job->map != NULL) {
+    unref_snap_map( job->map);
+  } else if ( job->data != NULL) {
+    munmap( job->data, job->data_sz);
+  }
+  job->map = NULL;
+  job->data = NULL;
+}
+
+// closes and frees n jobs of files of their own
+static void close_dump_jobs( DumpSegmentJob *jobs, const int n) {
+  int i = 0;
+  for ( i = 0; i < n && jobs != NULL; i++) {
+    close_dump_v2( &jobs[i]);
+  }
+  free( jobs);
+}
+
+// the directory entries of the job's slots: [*first, *first + returned)
+static long dump_job_blocks( const DumpSegmentJob *job, long *first) {
+
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) job->data;
+  const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (job->data + header->dir_offset);
+  long lo = 0;
+  long hi = header->nbr_blocks;
+
+  while ( lo < hi) { // first block at or after from
+    long mid = (lo + hi) / 2;
+    if ( dir[mid].prefix < job->from + INDEX_OFFSET) 
+      lo = mid + 1;
+    else 
+      hi = mid;
+  }
+  *first = lo;
+
+  hi = lo;
+  while ( hi < header->nbr_blocks && dir[hi].prefix < job->to + INDEX_OFFSET) 
+    hi++;
+  return hi - lo;
+}
+
+static void free_dump_job_tables( DumpSegmentJob *job) {
+  long i = 0;
+  for ( i = 0; i < job->nbr_tables; i++) {
+    if ( job->tables[i] != NULL) 
+      free_lkup_tbl( job->tables[i]);
+  }
+  free( job->tables);
+  job->tables = NULL;
+  job->nbr_tables = 0;
+}
+
+// sets up the table of block i of the job's file, decoded or copied from the
+// file or served in place if mapped. *table is NULL for a slot emptied by an increment.
+static int load_dump_block( DumpSegmentJob *job, const long i, LkupTbl **table) {
+
+  unsigned char *data = job->data;
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) data;
+  const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (data + header->dir_offset);
+  const uint32_t *checks = dump_block_checks( data);
+  const DumpDirEntryV2 *e = &dir[i];
+  long len = e->len;
+  unsigned char *cp = data + e->offset;
+  LkupTbl *nt = NULL;
+
+  *table = NULL;
+
+  if ( len > 0 && checks != NULL && !job->verified && 
+       CRC_crc32c( 0, cp, dump_block_end( header, dir, i) - e->offset) != checks[i]) {
+    log_msg( ERR, "load_dump_block: %s: checksum mismatch in block of prefix %u\n", job->fn, e->prefix);
+    return FAILURE;
+  }
+
+  if ( len == 0) { // emptied by an increment
+    return SUCCESS;
+  } else if ( job->map != NULL) {
+    nt = new_mapped_lkup_tbl( job->map, (LkupKey *) cp, (LkupAlias *) (cp + len * sizeof( LkupKey)), len);
+  } else {
+    nt = new_lkup_tbl( len);
+    if ( header->flags & DUMP_V2_DELTA) {
+      if ( decode_block_delta( cp, data + dump_block_end( header, dir, i), len, nt->keys, nt->aliases) != SUCCESS) {
+	log_msg( ERR, "load_dump_block: bad block %u in %s\n", e->prefix, job->fn);
+	free_lkup_tbl( nt);
+	return FAILURE;
+      }
+    } else {
+      memcpy( nt->keys, cp, len * sizeof( LkupKey));
+      memcpy( nt->aliases, cp + len * sizeof( LkupKey), len * sizeof( LkupAlias));
+    }
+    nt->table_len = len;
+    adapt_lkup_tbl( nt);
+  }
+
+  *table = nt;
+  return SUCCESS;
+}
+
+// sets up a table for each block of the job's slots. nothing is switched into
+// the index yet.
+static void *load_dump_v2( void *arg) {
+
+  DumpSegmentJob *job = (DumpSegmentJob *) arg;
+
+  job->status = FAILURE;
+
+  long first = 0;
+  long n = dump_job_blocks( job, &first);
+  long i = 0;
+
+  if (( job->tables = calloc( n + 1, sizeof( LkupTbl *))) == NULL) {
+    log_msg( CRIT, "load_dump_v2: out of heap space\n");
+    return NULL;
+  }
+  job->nbr_tables = n;
+
+  for ( i = 0; i < n; i++) {
+    if ( load_dump_block( job, first + i, &job->tables[i]) != SUCCESS) {
+      free_dump_job_tables( job);
+      return NULL;
+    }
+  }
+
+  job->status = SUCCESS;
+  return NULL;
+}
+
+// checks the blocks of the job's slots against their checksums
+static void *verify_dump_v2( void *arg) {
+
+  DumpSegmentJob *job = (DumpSegmentJob *) arg;
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) job->data;
+  const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (job->data + header->dir_offset);
+  const uint32_t *checks = dump_block_checks( job->data);
+
+  long first = 0;
+  long n = dump_job_blocks( job, &first);
+  long i = 0;
+
+  job->status = SUCCESS;
+  for ( i = first; i < first + n && checks != NULL; i++) {
+    if ( dir[i].len > 0 && 
+	 CRC_crc32c( 0, job->data + dir[i].offset, dump_block_end( header, dir, i) - dir[i].offset) != checks[i]) {
+      log_msg( ERR, "verify_dump_v2: %s: checksum mismatch in block of prefix %u\n", job->fn, dir[i].prefix);
+      job->status = FAILURE;
+      break;
+    }
+  }
+  return NULL;
+}
+
+// checks the blocks of the n jobs, each job's slots split among the cores
+static int verify_dump_jobs( DumpSegmentJob jobs[], const int n) {
+
+  DumpSegmentJob parts[DUMP_MAX_SEGMENTS];
+  int nbr_parts = sysconf( _SC_NPROCESSORS_ONLN);
+  if ( nbr_parts > DUMP_MAX_SEGMENTS) 
+    nbr_parts = DUMP_MAX_SEGMENTS;
+  if ( nbr_parts < 1) 
+    nbr_parts = 1;
+
+  int s = SUCCESS;
+  int i = 0;
+  int k = 0;
+  for ( i = 0; i < n && s == SUCCESS; i++) {
+    long slots = jobs[i].to - jobs[i].from;
+    for ( k = 0; k < nbr_parts; k++) {
+      parts[k] = jobs[i];
+      parts[k].from = jobs[i].from + slots * k / nbr_parts;
+      parts[k].to = jobs[i].from + slots * (k + 1) / nbr_parts;
+    }
+    run_segment_jobs( verify_dump_v2, parts, nbr_parts);
+    for ( k = 0; k < nbr_parts; k++) {
+      if ( parts[k].status != SUCCESS) 
+	s = FAILURE;
+    }
+  }
+  return s;
+}
+
+// switches the loaded tables into the job's slots, slots without a block are
+// emptied. increments leave them alone.
+static void *install_dump_v2( void *arg) {
+
+  DumpSegmentJob *job = (DumpSegmentJob *) arg;
+  IdxTblEntry *index_table = job->index_table;
+  const DumpHeaderV2 *header = (const DumpHeaderV2 *) job->data;
+  const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (job->data + header->dir_offset);
+
+  long first = 0;
+  long n = dump_job_blocks( job, &first);
+  long b = 0;
+  int idx = 0;
+
+  for ( idx = job->from; idx < job->to; idx++) {
+
+    LkupTblPtr nt = NULL;
+
+    if ( b < n && dir[first + b].prefix == idx + INDEX_OFFSET) {
+      nt = job->tables[b++];
+    } else if (( header->flags & DUMP_V2_INCREMENT) || 
+	       index_table[idx].table == NULL) { // racy peek, stays empty
+      continue;
+    }
+
+    lock_table( index_table, idx);
+    LkupTblPtr t = index_table[idx].table;
+
+    // switch tables. lock-free readers may still look at the old one.
+    begin_table_write( index_table, idx);
+    index_table[idx].table = nt;
+    end_table_write( index_table, idx);
+
+    if ( t != NULL) {
+      retire_lkup_tbl( t);
+    }
+
+    unlock_table( index_table, idx);
+  }
+
+  free( job->tables);
+  job->tables = NULL;
+  job->nbr_tables = 0;
+  return NULL;
+}
+
+// restores the jobs' files: all blocks are loaded in parallel first, the index
+// is only touched if every one of them is fine.
+static int restore_dump_jobs( DumpSegmentJob jobs[], const int n) {
+
+  int s = SUCCESS;
+  int i = 0;
+
+  run_segment_jobs( load_dump_v2, jobs, n);
+
+  for ( i = 0; i < n; i++) {
+    if ( jobs[i].status != SUCCESS) 
+      s = FAILURE;
+    serve_in_place( &jobs[i]);
+  }
+
+  if ( s == SUCCESS) {
+    run_segment_jobs( install_dump_v2, jobs, n);
+  } else {
+    for ( i = 0; i < n; i++) {
+      if ( jobs[i].tables != NULL) 
+	free_dump_job_tables( &jobs[i]);
+    }
+  }
+  return s;
+}
+
+// opens the single file fn as a job of all slots
+static int open_dump_file( IdxTblEntry index_table[], const unsigned char *fn, int mapped, DumpSegmentJob *job) {
+
+  memset( job, 0, sizeof( DumpSegmentJob));
+  job->index_table = index_table;
+  job->from = 0;
+  job->to = INDEX_SIZE-INDEX_OFFSET;
+
+  if ( strlen( fn) >= sizeof( job->fn)) {
+    log_msg( ERR, "open_dump_file: file name too long %s\n", fn);
+    return FAILURE;
+  }
+  strcpy( job->fn, fn);
+
+  return open_dump_v2( job, mapped);
+}
+
+// opens the single file fn in jobs[0] and gives as many jobs as there are
+// cores a range of its slots each. returns the nbr of jobs, FAILURE if fn is bad.
+static int split_dump_file( IdxTblEntry index_table[], const unsigned char *fn, int mapped, 
+			    DumpSegmentJob jobs[DUMP_MAX_SEGMENTS]) {
+
+  memset( jobs, 0, DUMP_MAX_SEGMENTS * sizeof( DumpSegmentJob));
+  if ( open_dump_file( index_table, fn, mapped, &jobs[0]) != SUCCESS) 
+    return FAILURE;
+
+  int n = sysconf( _SC_NPROCESSORS_ONLN);
+  if ( n > DUMP_MAX_SEGMENTS) 
+    n = DUMP_MAX_SEGMENTS;
+  if ( n < 1) 
+    n = 1;
+
+  int i = 0;
+  for ( i = 0; i < n; i++) {
+    jobs[i] = jobs[0];
+    jobs[i].from = (long) (INDEX_SIZE-INDEX_OFFSET) * i / n;
+    jobs[i].to = (long) (INDEX_SIZE-INDEX_OFFSET) * (i + 1) / n;
+  }
+  return n;
+}
+
+// a single file is restored by as many threads as there are cores, each
+// taking a range of its slots
+static int restore_all_v2( IdxTblEntry index_table[], const unsigned char *fn, int mapped) {
+
+  DumpSegmentJob jobs[DUMP_MAX_SEGMENTS];
+  int n = split_dump_file( index_table, fn, mapped, jobs);
+  if ( n == FAILURE) 
+    return FAILURE;
+
+  int s = restore_dump_jobs( jobs, n);
+
+  close_dump_v2( &jobs[0]); // they all share the file
+  return s;
+}
+
+// checks a single file and its blocks, in parallel like restore_all_v2()
+static int verify_all_v2( const unsigned char *fn) {
+
+  DumpSegmentJob jobs[DUMP_MAX_SEGMENTS];
+  int n = split_dump_file( NULL, fn, FALSE, jobs);
+  if ( n == FAILURE) 
+    return FAILURE;
+
+  run_segment_jobs( verify_dump_v2, jobs, n);
+
+  int s = SUCCESS;
+  int i = 0;
+  for ( i = 0; i < n; i++) {
+    if ( jobs[i].status != SUCCESS) 
+      s = FAILURE;
+  }
+
+  close_dump_v2( &jobs[0]);
+  return s;
+}
+
+// runs f for each of the n jobs in a thread of its own
+static void run_segment_jobs( void *(*f)( void *), DumpSegmentJob jobs[], const int n) {
+
+  pthread_t threads[DUMP_MAX_SEGMENTS];
+  int i = 0;
+
+  for ( i = 0; i < n; i++) {
+    if ( pthread_create( &threads[i], NULL, f, &jobs[i]) != 0) {
+      log_msg( ERR, "run_segment_jobs: pthread_create failed\n");
+      f( &jobs[i]); // do it ourselves
+      threads[i] = 0;
+    }
+  }
+  for ( i = 0; i < n; i++) {
+    if ( threads[i] != 0) 
+      pthread_join( threads[i], NULL);
+  }
+}
+
+static void *dump_segment( void *arg) {
+
+  DumpSegmentJob *job = (DumpSegmentJob *) arg;
+  job->status = FAILURE;
+
+  DW_Writer *w = DW_open( job->fn);
+  if ( w == NULL) 
+    return NULL;
+
+  int s = dump_range_v2( job->index_table, w, job->from, job->to, job->flags, job->ck, &job->max_lock_usec);
+
+  // on disk before the manifest refers to it
+  if ( DW_close( w, s == SUCCESS, &job->io) != SUCCESS) 
+    s = FAILURE;
+
+  struct stat st;
+  if ( s == SUCCESS && stat( job->fn, &st) == 0) 
+    job->data_sz = st.st_size;
+
+  job->status = s;
+  return NULL;
+}
+
+// splits the slots into n consecutive ranges of about the same nbr of entries
+static int split_into_ranges( IdxTblEntry index_table[], DumpSegmentJob jobs[], const int n) {
+
+  const int nbr_slots = INDEX_SIZE-INDEX_OFFSET;
+  long *counts = malloc( nbr_slots * sizeof( long));
+  if ( counts == NULL) 
+    return FAILURE;
+
+  long total = 0;
+  int idx = 0;
+  for ( idx = 0; idx < nbr_slots; idx++) {
+    counts[idx] = 0;
+    if ( index_table[idx].table == NULL) // racy peek, most slots are empty
+      continue;
+    lock_table( index_table, idx);
+    if ( index_table[idx].table != NULL) 
+      counts[idx] = index_table[idx].table->table_len;
+    unlock_table( index_table, idx);
+    total += counts[idx];
+  }
+
+  long sum = 0;
+  int i = 0;
+  idx = 0;
+  for ( i = 0; i < n; i++) {
+    jobs[i].from = idx;
+    long limit = total * (i + 1) / n;
+    while ( idx < nbr_slots && (i == n - 1 || sum + counts[idx] <= limit)) 
+      sum += counts[idx++];
+    jobs[i].to = idx;
+  }
+
+  free( counts);
+  return SUCCESS;
+}
+
+// returns the segments listed in manifest fn, NULL if it is none or broken
+static DumpSegment *read_manifest( const unsigned char *fn, int *nbr_segments) {
+
+  FILE *f = fopen( fn, "r");
+  if ( f == NULL) 
+    return NULL;
+
+  DumpSegment *segments = NULL;
+  DumpManifestHeader header;
+
+  if ( fread( &header, sizeof( header), 1, f) == 1 && 
+       ntohl( header.magic) == DUMP_MAGIC && ntohl( header.format) == DUMP_FORMAT_MANIFEST &&
+       header.byte_order == DUMP_V2_BYTE_ORDER && 
+       header.nbr_segments > 0 && header.nbr_segments <= DUMP_MAX_SEGMENTS) {
+
+    segments = malloc( header.nbr_segments * sizeof( DumpSegment));
+    if ( segments != NULL && fread( segments, sizeof( DumpSegment), header.nbr_segments, f) != header.nbr_segments) {
+      free( segments);
+      segments = NULL;
+    }
+  }
+  fclose( f);
+
+  if ( segments == NULL) 
+    return NULL;
+
+  int i = 0;
+  for ( i = 0; i < header.nbr_segments; i++) {
+    segments[i].fn[sizeof( segments[i].fn) - 1] = '\0';
+  }
+  *nbr_segments = header.nbr_segments;
+  return segments;
+}
+
+int dump_segments_fn( IdxTblEntry index_table[], const unsigned char *fn, int nbr_segments, const int flags) {
+
+  DumpCheckpoint ck;
+  memset( &ck, 0, sizeof( ck));
+  ck.generation = get_time_micro();
+
+  return dump_checkpoint_fn( index_table, fn, nbr_segments, flags & ~DUMP_V2_INCREMENT, &ck, NULL);
+}
+
+int dump_checkpoint_fn( IdxTblEntry index_table[], const unsigned char *fn, int nbr_segments, 
+			const int flags, const DumpCheckpoint *ck, DumpStats *stats) {
+
+  assert( fn != NULL && strlen( fn) > 0);
+
+  if ( finish_lazy_restore( index_table) != SUCCESS) 
+    return FAILURE;
+
+  if ( nbr_segments <= 1 || (flags & DUMP_V2_INCREMENT)) 
+    return dump_to_fn( index_table, fn, TRUE, flags, ck, stats);
+  if ( nbr_segments > DUMP_MAX_SEGMENTS) 
+    nbr_segments = DUMP_MAX_SEGMENTS;
+
+  int s = FAILURE;
+  int i = 0;
+  char *tmp_fn = NULL;
+  FILE *f = NULL;
+  DumpSegment *old_segments = NULL;
+  int nbr_old_segments = 0;
+  int renamed = FALSE;
+
+  DumpSegmentJob *jobs = calloc( nbr_segments, sizeof( DumpSegmentJob));
+  DumpSegment *segments = calloc( nbr_segments, sizeof( DumpSegment));
+  if ( jobs == NULL || segments == NULL || split_into_ranges( index_table, jobs, nbr_segments) != SUCCESS) {
+    log_msg( CRIT, "dump_checkpoint_fn: out of heap space\n");
+    goto out;
+  }
+
+  // segment names are unique per checkpoint, the current one stays intact until replaced
+  unsigned long generation = ck->generation;
+
+  // the manifest has the link, not the segments
+  for ( i = 0; i < nbr_segments; i++) {
+    jobs[i].index_table = index_table;
+    jobs[i].flags = flags & ~DUMP_V2_LINKED;
+    jobs[i].ck = ck;
+    if ( snprintf( jobs[i].fn, sizeof( jobs[i].fn), "%s.%lx.%d", fn, generation, i) >= sizeof( jobs[i].fn)) {
+      log_msg( ERR, "dump_checkpoint_fn: file name too long %s\n", fn);
+      goto out;
+    }
+  }
+
+  log_msg( INFO, "starting dump to %s in %d segments\n", fn, nbr_segments);
+
+  long start = get_time_micro();
+  run_segment_jobs( dump_segment, jobs, nbr_segments);
+
+  DumpStats ds;
+  memset( &ds, 0, sizeof( ds));
+  for ( i = 0; i < nbr_segments; i++) {
+    add_dump_stats( &ds, &jobs[i].io, jobs[i].max_lock_usec);
+  }
+  ds.usec = get_time_micro() - start;
+  if ( stats != NULL) 
+    *stats = ds;
+
+  for ( i = 0; i < nbr_segments; i++) {
+    if ( jobs[i].status != SUCCESS) {
+      log_msg( ERR, "dump_checkpoint_fn: failure to dump segment %s\n", jobs[i].fn);
+      goto out;
+    }
+    segments[i].from_prefix = jobs[i].from + INDEX_OFFSET;
+    segments[i].to_prefix = jobs[i].to + INDEX_OFFSET;
+    segments[i].file_size = jobs[i].data_sz;
+    strcpy( segments[i].fn, jobs[i].fn);
+  }
+
+  // the manifest ties the segments together. renaming it over fn switches atomically.
+  DumpManifestHeader header;
+  memset( &header, 0, sizeof( header));
+  header.magic = htonl( DUMP_MAGIC);
+  header.format = htonl( DUMP_FORMAT_MANIFEST);
+  header.byte_order = DUMP_V2_BYTE_ORDER;
+  header.nbr_segments = nbr_segments;
+  header.generation = generation;
+  header.flags = flags & DUMP_V2_LINKED;
+
+  if (( tmp_fn = str_cat( fn, ".tmp", NULL)) == NULL || ( f = fopen( tmp_fn, "w")) == NULL) {
+    log_msg( ERR, "dump_checkpoint_fn: failure to write-open manifest of %s\n", fn);
+    goto out;
+  }
+  if ( fwrite( &header, sizeof( header), 1, f) != 1 ||
+       fwrite( segments, sizeof( DumpSegment), nbr_segments, f) != nbr_segments ||
+       ((flags & DUMP_V2_LINKED) && fwrite( &ck->chain, sizeof( DumpChainV2), 1, f) != 1) ||
+       fflush( f) != 0 || fsync( fileno( f)) < 0) {
+    log_msg( ERR, "dump_checkpoint_fn: failure to write manifest %s\n", tmp_fn);
+    goto out;
+  }
+  if ( fclose( f) != 0) {
+    f = NULL;
+    goto out;
+  }
+  f = NULL;
+
+  old_segments = read_manifest( fn, &nbr_old_segments);
+
+  if ( rename( tmp_fn, fn) < 0) {
+    log_msg( ERR, "dump_checkpoint_fn: failure to rename %s to %s\n", tmp_fn, fn);
+    goto out;
+  }
+  renamed = TRUE;
+  // the segments are synced, the renames in their directory must be as well.
+  // until then the replaced checkpoint may come back and keeps its segments.
+  if ( sync_dir_of( fn) != SUCCESS) 
+    goto out;
+
+  // segments of the replaced checkpoint, mapped ones live on until unmapped
+  for ( i = 0; i < nbr_old_segments; i++) {
+    unlink( old_segments[i].fn);
+  }
+
+  log_dump_stats( fn, &ds);
+  s = SUCCESS;
+
+ out:
+  if ( f != NULL) 
+    fclose( f);
+  if ( s != SUCCESS && !renamed && jobs != NULL) {
+    for ( i = 0; i < nbr_segments; i++) {
+      if ( jobs[i].fn[0] != '\0') 
+	unlink( jobs[i].fn);
+    }
+    if ( tmp_fn != NULL) 
+      unlink( tmp_fn);
+  }
+  free( tmp_fn);
+  free( old_segments);
+  free( segments);
+  free( jobs);
+  return s;
+}
+
+// opens the segments of manifest fn as jobs, one per segment. to be closed
+// with close_dump_jobs().
+static DumpSegmentJob *open_segments( IdxTblEntry index_table[], const unsigned char *fn, int mapped, 
+				      int *nbr_jobs) {
+
+  int nbr_segments = 0;
+  DumpSegment *segments = read_manifest( fn, &nbr_segments);
+  if ( segments == NULL) {
+    log_msg( ERR, "open_segments: bad manifest %s\n", fn);
+    return NULL;
+  }
+
+  int i = 0;
+  DumpSegmentJob *jobs = calloc( nbr_segments, sizeof( DumpSegmentJob));
+  if ( jobs == NULL) 
+    goto out;
+
+  for ( i = 0; i < nbr_segments; i++) {
+    DumpSegment *seg = &segments[i];
+    DumpSegmentJob *job = &jobs[i];
+
+    // consecutive ranges covering all slots
+    if ( seg->from_prefix != (i == 0 ? INDEX_OFFSET : segments[i-1].to_prefix) || 
+	 seg->to_prefix < seg->from_prefix || 
+	 seg->to_prefix > INDEX_SIZE || (i == nbr_segments - 1 && seg->to_prefix != INDEX_SIZE)) {
+      log_msg( ERR, "open_segments: bad range of segment %d in %s\n", i, fn);
+      goto fail;
+    }
+
+    job->index_table = index_table;
+    job->from = seg->from_prefix - INDEX_OFFSET;
+    job->to = seg->to_prefix - INDEX_OFFSET;
+    strcpy( job->fn, seg->fn);
+
+    if ( open_dump_v2( job, mapped) != SUCCESS) 
+      goto fail;
+    if ( job->data_sz != seg->file_size) {
+      log_msg( ERR, "open_segments: %s has %ld bytes, manifest says %ld\n", 
+	       job->fn, (long) job->data_sz, (long) seg->file_size);
+      goto fail;
+    }
+  }
+
+  *nbr_jobs = nbr_segments;
+  goto out;
+
+ fail:
+  close_dump_jobs( jobs, nbr_segments);
+  jobs = NULL;
+ out:
+  free( segments);
+  return jobs;
+}
+
+// restores the segments of a manifest in parallel. all segments are checked
+// before the first is restored.
+static int restore_segments( IdxTblEntry index_table[], const unsigned char *fn, int mapped) {
+
+  int n = 0;
+  DumpSegmentJob *jobs = open_segments( index_table, fn, mapped, &n);
+  if ( jobs == NULL) 
+    return FAILURE;
+
+  int s = restore_dump_jobs( jobs, n);
+
+  close_dump_jobs( jobs, n);
+  return s;
+}
 
-  lock_table( index_table, idx);
-  LkupTblPtr t = index_table[idx].table;
+// reads generation and format of checkpoint fn, for increments and linked full
+// checkpoints also the link to the previous checkpoint. returns the format,
+// FAILURE if fn is no checkpoint.
+static int read_dump_link( const unsigned char *fn, uint64_t *generation, int *increment, int *linked, 
+			   DumpChainV2 *chain) {
 
-  // read the block header
-  long block_header[3];
-  if ( fread( block_header, sizeof( long), 3, f) != 3) {
-    unlock_table( index_table, idx);
+  FILE *f = fopen( fn, "r");
+  if ( f == NULL) 
     return FAILURE;
-  }
 
-  // ensure host byte order
-  int i = 0;
-  for ( i = 0; i < 3; i++) {
-    block_header[i] = ntohl( block_header[i]);
+  int format = FAILURE;
+  union {
+    DumpHeaderV2 v2;
+    DumpManifestHeader manifest;
+  } header;
+
+  *increment = FALSE;
+  *linked = FALSE;
+
+  if ( fread( &header, sizeof( header), 1, f) == 1 && ntohl( header.v2.magic) == DUMP_MAGIC && 
+       header.v2.byte_order == DUMP_V2_BYTE_ORDER) {
+
+    format = ntohl( header.v2.format);
+    if ( format == DUMP_FORMAT_MANIFEST) {
+      *generation = header.manifest.generation;
+      *linked = (header.manifest.flags & DUMP_V2_LINKED) != 0;
+      // the link follows the segment list
+      if ( *linked && fseek( f, sizeof( DumpManifestHeader) + 
+			     (long) header.manifest.nbr_segments * sizeof( DumpSegment), SEEK_SET) < 0) 
+	format = FAILURE;
+    } else if ( format == DUMP_FORMAT_V2) {
+      *generation = header.v2.generation;
+      *increment = (header.v2.flags & DUMP_V2_INCREMENT) != 0;
+      *linked = (header.v2.flags & (DUMP_V2_INCREMENT | DUMP_V2_LINKED)) != 0;
+    } else {
+      format = FAILURE;
+    }
+
+    if ( format != FAILURE && *linked) {
+      if ( fread( chain, sizeof( DumpChainV2), 1, f) != 1) 
+	format = FAILURE;
+      chain->prev_fn[sizeof( chain->prev_fn) - 1] = '\0';
+    }
   }
 
-  // first long is the index + INDEX_OFFSET
-  assert( block_header[0] - INDEX_OFFSET == idx);
+  fclose( f);
+  return format;
+}
 
-  if ( t == NULL) { // in-memory table empty
-    if ( block_header[1] == 0) { // stays empty, we're done
-      unlock_table( index_table, idx);
-      return SUCCESS;
-    } else { // in-memory table is empty, allocate table to accommodate file data
-      index_table[idx].table = t = mem_alloc( sizeof( LkupTbl));
-    }
-  } else { // in-memory table not empty
-    if ( block_header[1] == 0) { // table in file is empty
+char *dump_prev_fn( const unsigned char *fn) {
 
-      // free in-memory table...
-      if ( t->table != NULL) {
-	mem_free( t->table); 
-	t->table = NULL;
-      }
+  uint64_t generation = 0;
+  int increment = FALSE;
+  int linked = FALSE;
+  DumpChainV2 chain;
 
-      mem_free( t);
-      index_table[idx].table = NULL;
+  if ( read_dump_link( fn, &generation, &increment, &linked, &chain) != DUMP_FORMAT_V2 || !increment) 
+    return NULL;
+  return strdup( chain.prev_fn);
+}
 
-      unlock_table( index_table, idx);
-      return SUCCESS;      
-    } // table in file not empty
-  }
+// the checkpoint taken before full checkpoint fn, to restore if fn is corrupt.
+// NULL if fn has no link or the checkpoint is gone. to be free()-ed.
+char *dump_fallback_fn( const unsigned char *fn) {
+
+  uint64_t generation = 0;
+  int increment = FALSE;
+  int linked = FALSE;
+  DumpChainV2 chain;
+  DumpChainV2 prev_chain;
 
-  // free old in-memory table
-  if ( t->table != NULL) {
-    mem_free( t->table); t->table = NULL;
+  if ( read_dump_link( fn, &generation, &increment, &linked, &chain) == FAILURE || increment || !linked) 
+    return NULL;
+  if ( read_dump_link( chain.prev_fn, &generation, &increment, &linked, &prev_chain) == FAILURE || 
+       generation != chain.prev_generation) {
+    log_msg( ERR, "dump_fallback_fn: %s, the checkpoint before %s, is gone or replaced\n", chain.prev_fn, fn);
+    return NULL;
   }
+  return strdup( chain.prev_fn);
+}
 
-  // restore size and length
-  t->table_sz = block_header[1];
-  t->table_len = block_header[2];
+// follows the chain of checkpoint fn back to its base, every link must carry
+// the generation its successor names. fns[n-1] is the base, fns[0] fn. the
+// increments are checked, fns[*last] is the newest one fine with all before
+// it: a corrupt increment ends the chain. fns[] are to be free()-ed.
+static int read_chain( const unsigned char *fn, char *fns[DUMP_MAX_CHAIN], int *n, int *last, int *format) {
+
+  int s = FAILURE;
+  int increment = FALSE;
+  int linked = FALSE;
+  uint64_t generation = 0;
+  uint64_t expected = 0;
+  uint64_t base = 0;
+  DumpChainV2 chain;
+  char *cur = strdup( fn);
+  int i = 0;
 
-  assert( t->table_sz >= t->table_len);
+  *n = 0;
+  *last = 0;
 
-  // newly allocate in-memory table
-  t->table = mem_alloc( sizeof( LkupTblEntry) * t->table_sz);
+  if ( cur == NULL) {
+    log_msg( CRIT, "read_chain: out of heap space\n");
+    goto out;
+  }
 
-  int s = SUCCESS;
+  while ( TRUE) {
 
-  // load table entries from file
-  for ( i = 0; i < t->table_len; i++) {
-    LkupTblEntry *e = &t->table[i];
+    *format = read_dump_link( cur, &generation, &increment, &linked, &chain);
+    if ( *format == FAILURE || (*n > 0 && generation != expected)) {
+      log_msg( ERR, "read_chain: broken chain of %s at %s\n", fn, cur);
+      goto out;
+    }
+    if ( *n > 0 && increment && chain.base_generation != base) {
+      log_msg( ERR, "read_chain: %s is of another chain than %s\n", cur, fn);
+      goto out;
+    }
+    fns[(*n)++] = cur;
+    cur = NULL;
 
-    if ( fread( &e->postfix, sizeof( unsigned char), POSTFIX_LENGTH, f) != POSTFIX_LENGTH) {
-      s = FAILURE;
+    if ( !increment) 
       break;
+    if ( *n == DUMP_MAX_CHAIN) {
+      log_msg( ERR, "read_chain: chain of %s too long\n", fn);
+      goto out;
     }
+    base = chain.base_generation;
+    expected = chain.prev_generation;
+    if (( cur = strdup( chain.prev_fn)) == NULL) {
+      log_msg( CRIT, "read_chain: out of heap space\n");
+      goto out;
+    }
+  }
 
-    if ( fread( &e->alias, sizeof( unsigned char), ALIAS_LENGTH, f) != ALIAS_LENGTH) {
-      s = FAILURE;
+  if ( *n > 1 && generation != base) {
+    log_msg( ERR, "read_chain: %s is not the base of %s\n", fns[*n-1], fn);
+    goto out;
+  }
+
+  // the increments are checked before the base replaces the index
+  for ( i = *n - 2; i >= 0; i--) {
+    if ( verify_all_v2( fns[i]) != SUCCESS) {
+      log_msg( ERR, "read_chain: %s is corrupt, falling back to %s. changes after it are lost\n", 
+	       fns[i], fns[i+1]);
+      *last = i + 1;
       break;
     }
   }
 
-  unlock_table( index_table, idx);
+  if ( *n > 1) 
+    log_msg( INFO, "restoring %s from base %s and %d increments\n", fns[*last], fns[*n-1], *n - 1 - *last);
+  s = SUCCESS;
+
+ out:
+  free( cur);
   return s;
+}
 
+static void free_chain( char *fns[], const int n) {
+  int i = 0;
+  for ( i = 0; i < n; i++) {
+    free( fns[i]);
+  }
+  free( fns);
 }
 
-static int restore_all( IdxTblEntry index_table[], FILE *f) {
+// restores checkpoint fn. for an increment the base is restored first, then
+// the increments switch the slots they changed. a base which can't be restored
+// leaves the index alone, the checkpoint taken before it is restored instead,
+// back as far as checkpoints are kept.
+static int restore_chain( IdxTblEntry index_table[], const unsigned char *fn, int mapped) {
+
+  char **fns = calloc( DUMP_MAX_CHAIN, sizeof( char *));
+  char *cur = strdup( fn);
+  int n = 0;
+  int last = 0;
+  int format = FAILURE;
+  int fallbacks = 0;
+  int s = FAILURE;
   int i = 0;
-  for ( i = 0; i < INDEX_SIZE-INDEX_OFFSET; i++) {
-    if ( restore_table( index_table, i, f) < SUCCESS) {
-      return FAILURE;
+
+  if ( fns == NULL || cur == NULL) {
+    log_msg( CRIT, "restore_chain: out of heap space\n");
+    free( fns);
+    free( cur);
+    return FAILURE;
+  }
+
+  while ( read_chain( cur, fns, &n, &last, &format) == SUCCESS) {
+
+    s = format == DUMP_FORMAT_MANIFEST ? 
+      restore_segments( index_table, fns[n-1], mapped) : restore_all_v2( index_table, fns[n-1], mapped);
+    if ( s == SUCCESS || ++fallbacks == DUMP_MAX_CHAIN) 
+      break;
+
+    char *prev = dump_fallback_fn( fns[n-1]);
+    if ( prev == NULL) 
+      break;
+    log_msg( ERR, "restore_chain: %s is corrupt, falling back to %s. changes after it are lost\n", fns[n-1], prev);
+
+    for ( i = 0; i < n; i++) {
+      free( fns[i]);
+      fns[i] = NULL;
     }
+    n = 0;
+    free( cur);
+    cur = prev;
   }
-  return SUCCESS;
+
+  for ( i = n - 2; i >= last && s == SUCCESS; i--) {
+    s = restore_all_v2( index_table, fns[i], mapped);
+  }
+
+  free( cur);
+  free_chain( fns, n);
+  return s;
 }
 
 // restore from binary dump file
-int restore_all_fn( IdxTblEntry index_table[], const unsigned char *fn) {
+int restore_all_fn( IdxTblEntry index_table[], const unsigned char *fn, int mapped) {
 
   assert( fn != NULL && strlen( fn) > 0);
 
@@ -398,9 +1988,22 @@ int restore_all_fn( IdxTblEntry index_table[], const unsigned char *fn) {
     return FAILURE;
   }
 
+  // slots still to load would overwrite the restored ones
+  if ( finish_lazy_restore( index_table) != SUCCESS) {
+    fclose( f);
+    return FAILURE;
+  }
+
   log_msg( INFO, "starting restore from %s\n", fn);
 
-  int s = restore_all( index_table, f);
+  int s = FAILURE;
+  int format = read_dump_header( f);
+  if ( format == DUMP_FORMAT_V2 || format == DUMP_FORMAT_MANIFEST) {
+    s = restore_chain( index_table, fn, mapped);
+  } else {
+    rewind( f);
+    s = restore_all( index_table, f);
+  }
 
   log_msg( INFO, "restore done\n");
   
@@ -470,43 +2073,603 @@ void test_index( IdxTblEntry index_table[]) {
 }
 
 
-// memory statistics. allocated # of bytes on heap. zeroed out.
-static long mem_cnt = 0;
+// memory statistics. each thread has its own counters which only it writes,
+// so counting doesn't contend. counters of exited threads are folded into
+// exited_bytes, frees in one thread of storage allocated in another are fine
+// since only the sum over all counters is meaningful.
+typedef struct _mem_counters {
+  long bytes[MEM_NBR_CATEGORIES];
+  struct _mem_counters *next;
+} __attribute__ ((aligned (64))) MemCounters;
 
-void *mem_alloc( size_t sz) {
+static MemCounters *all_counters = NULL;
+static long exited_bytes[MEM_NBR_CATEGORIES];
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread MemCounters *my_counters = NULL;
+static pthread_key_t counters_key;
+static pthread_once_t counters_key_once = PTHREAD_ONCE_INIT;
+
+static const char *mem_category_names[MEM_NBR_CATEGORIES] = {
+  "other", "index", "block_headers", "entry_arrays", "btree_nodes", "sessions", "json", "requests", "reverse_index"
+};
+
+static void release_counters( void *arg) {
+  MemCounters *c = (MemCounters *) arg;
+
+  pthread_mutex_lock( &counters_mutex);
+
+  MemCounters **pp = &all_counters;
+  while ( *pp != c) 
+    pp = &(*pp)->next;
+  *pp = c->next;
+
+  int i = 0;
+  for ( i = 0; i < MEM_NBR_CATEGORIES; i++) {
+    exited_bytes[i] += c->bytes[i];
+  }
+
+  pthread_mutex_unlock( &counters_mutex);
+
+  my_counters = NULL;
+  free( c);
+}
+
+static void make_counters_key() {
+  pthread_key_create( &counters_key, release_counters);
+}
+
+static MemCounters *get_counters() {
+
+  if ( my_counters != NULL) 
+    return my_counters;
+
+  MemCounters *c = NULL;
+  if ( posix_memalign( (void **) &c, 64, sizeof( MemCounters)) != 0) 
+    return NULL;
+  memset( c, 0, sizeof( MemCounters));
+
+  pthread_once( &counters_key_once, make_counters_key);
+  pthread_setspecific( counters_key, c);
+
+  pthread_mutex_lock( &counters_mutex);
+  c->next = all_counters;
+  all_counters = c;
+  pthread_mutex_unlock( &counters_mutex);
+
+  my_counters = c;
+  return c;
+}
+
+void mem_count( MEM_Category cat, long delta) {
+  MemCounters *c = get_counters();
+  if ( c == NULL) 
+    return;
+  // only this thread writes, readers may see the old or the new value
+  __atomic_store_n( &c->bytes[cat], c->bytes[cat] + delta, __ATOMIC_RELAXED);
+}
+
+long mem_usage_cat( MEM_Category cat) {
+
+  pthread_mutex_lock( &counters_mutex);
+
+  long sum = exited_bytes[cat];
+  MemCounters *c = NULL;
+  for ( c = all_counters; c != NULL; c = c->next) {
+    sum += __atomic_load_n( &c->bytes[cat], __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock( &counters_mutex);
+  return sum;
+}
+
+const char *mem_category_name( MEM_Category cat) {
+  return mem_category_names[cat];
+}
+
+// the length field keeps the category in its top byte
+#define MEM_CAT_SHIFT 56
+#define MEM_SIZE_MASK ((1L << MEM_CAT_SHIFT) - 1)
+
+void *mem_alloc_cat( size_t sz, MEM_Category cat) {
   sz += sizeof( long);
-  mem_cnt += sz;
 
   char *cp = calloc( sz, sizeof( unsigned char));
   if ( cp == NULL) {
     return NULL;
   }
 
-  *((long *) cp) = sz;
+  *((long *) cp) = sz | ((long) cat << MEM_CAT_SHIFT);
+  mem_count( cat, sz);
 
   // return ptr after length field
   return cp + sizeof( long);
 }
 
+void *mem_alloc( size_t sz) {
+  return mem_alloc_cat( sz, MEM_OTHER);
+}
 
 void mem_free( void *ptr) {
   assert( ptr != NULL);
   char *lp = ((char *) ptr) - sizeof( long);
-  long sz = *((long *) lp);
-  mem_cnt -= sz;
+  long hdr = *((long *) lp);
+  mem_count( (MEM_Category) (hdr >> MEM_CAT_SHIFT), -(hdr & MEM_SIZE_MASK));
   free( lp);
 }
 
 long mem_usage() {
-  return mem_cnt;
+  long sum = 0;
+  int i = 0;
+  for ( i = 0; i < MEM_NBR_CATEGORIES; i++) {
+    sum += mem_usage_cat( i);
+  }
+  return sum;
+}
+
+// a lock stripe protects all index table slots which map to it. one cache
+// line per stripe so that stripes don't share lines.
+typedef struct {
+  pthread_mutex_t mutex; // thread-safety 
+  unsigned long version; // odd while a write is in progress
+} LockStripe __attribute__ ((aligned (64)));
+
+static LockStripe *lock_stripes = NULL;
+static unsigned long lock_stripe_mask = 0;
+
+static uint32_t change_epoch = 1;
+// per slot, a dense array of its own to keep the index table at a pointer per slot
+static uint32_t *slot_changed = NULL;
+
+// writers wait in begin_table_write() while paused
+static int writes_paused = FALSE;
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writes_resumed = PTHREAD_COND_INITIALIZER;
+
+#define STRIPE( idx) (&lock_stripes[(idx) & lock_stripe_mask])
+
+int init_lock_stripes( int nbr_stripes) {
+
+  assert( lock_stripes == NULL);
+
+  unsigned long n = 1;
+  while ( n < nbr_stripes) 
+    n <<= 1;
+
+  if ( posix_memalign( (void **) &lock_stripes, 64, n * sizeof( LockStripe)) != 0) {
+    log_msg( CRIT, "init_lock_stripes: out of heap space\n");
+    return FAILURE;
+  }
+  memset( lock_stripes, 0, n * sizeof( LockStripe));
+  mem_count( MEM_INDEX, n * sizeof( LockStripe));
+
+  slot_changed = mem_alloc_cat( (INDEX_SIZE - INDEX_OFFSET) * sizeof( uint32_t), MEM_INDEX);
+  if ( slot_changed == NULL) {
+    log_msg( CRIT, "init_lock_stripes: out of heap space\n");
+    return FAILURE;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr);
+  pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE);
+
+  int i = 0;
+  for ( i = 0; i < n; i++) {
+    pthread_mutex_init( &lock_stripes[i].mutex, &attr);
+  }
+
+  pthread_mutexattr_destroy( &attr);
+
+  lock_stripe_mask = n - 1;
+  return (int) n;
 }
 
+// slots a lazy restore has still to load, only then lock_table() looks further
+static long lazy_slots_left = 0;
+static void lazy_load_slot( IdxTblEntry index_table[], const int idx, const int on_demand);
+
 void lock_table( IdxTblEntry index_table[], int idx) {
-  pthread_mutex_lock( &index_table[idx].mutex);
+  pthread_mutex_lock( &STRIPE( idx)->mutex);
+  if ( __builtin_expect( __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE) > 0, 0)) 
+    lazy_load_slot( index_table, idx, TRUE);
 }
 
 void unlock_table( IdxTblEntry index_table[], int idx) {
-  pthread_mutex_unlock( &index_table[idx].mutex);
+  pthread_mutex_unlock( &STRIPE( idx)->mutex);
+}
+
+int table_stripe( int idx) {
+  return (int) (idx & lock_stripe_mask);
+}
+
+// a sequence lock on top of the mutex. writers make the version odd while
+// they modify the lookup table of an entry of the stripe.
+void begin_table_write( IdxTblEntry index_table[], int idx) {
+  LockStripe *ls = STRIPE( idx);
+  unsigned long v = ls->version;
+  assert( (v & 1) == 0);
+  __atomic_store_n( &ls->version, v+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence( __ATOMIC_SEQ_CST);
+
+  // either pause_table_writes() sees the odd version or we see the pause
+  while ( __atomic_load_n( &writes_paused, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n( &ls->version, v+2, __ATOMIC_RELEASE);
+    pthread_mutex_lock( &pause_mutex);
+    while ( writes_paused) 
+      pthread_cond_wait( &writes_resumed, &pause_mutex);
+    pthread_mutex_unlock( &pause_mutex);
+    v += 2;
+    __atomic_store_n( &ls->version, v+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_SEQ_CST);
+  }
+
+  // a checkpoint reading the slot after next_change_epoch() waits for our lock
+  slot_changed[idx] = __atomic_load_n( &change_epoch, __ATOMIC_SEQ_CST);
+}
+
+void end_table_write( IdxTblEntry index_table[], int idx) {
+  LockStripe *ls = STRIPE( idx);
+  unsigned long v = ls->version;
+  assert( (v & 1) == 1);
+  __atomic_store_n( &ls->version, v+1, __ATOMIC_RELEASE);
+}
+
+void pause_table_writes( void) {
+
+  pthread_mutex_lock( &pause_mutex);
+  __atomic_store_n( &writes_paused, TRUE, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock( &pause_mutex);
+
+  // writes under way are finished, the next ones wait
+  unsigned long i = 0;
+  for ( i = 0; i <= lock_stripe_mask; i++) {
+    while ( __atomic_load_n( &lock_stripes[i].version, __ATOMIC_SEQ_CST) & 1) 
+      sched_yield();
+  }
+}
+
+void resume_table_writes( void) {
+  pthread_mutex_lock( &pause_mutex);
+  __atomic_store_n( &writes_paused, FALSE, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast( &writes_resumed);
+  pthread_mutex_unlock( &pause_mutex);
+}
+
+void reset_lock_stripes( void) {
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr);
+  pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE);
+
+  unsigned long i = 0;
+  for ( i = 0; i <= lock_stripe_mask; i++) {
+    pthread_mutex_init( &lock_stripes[i].mutex, &attr);
+  }
+  pthread_mutexattr_destroy( &attr);
+
+  pthread_mutex_init( &pause_mutex, NULL);
+  pthread_cond_init( &writes_resumed, NULL);
+  writes_paused = FALSE;
+}
+
+uint32_t table_changed( int idx) {
+  return slot_changed[idx];
+}
+
+uint32_t next_change_epoch( void) {
+  return __atomic_fetch_add( &change_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+// readers never wait: an odd version makes the subsequent retry_table_read() fail
+unsigned long begin_table_read( IdxTblEntry index_table[], int idx) {
+  if ( __builtin_expect( __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE) > 0, 0)) 
+    peek_table( index_table, idx);
+  return __atomic_load_n( &STRIPE( idx)->version, __ATOMIC_ACQUIRE);
+}
+
+int retry_table_read( IdxTblEntry index_table[], int idx, unsigned long version) {
+  __atomic_thread_fence( __ATOMIC_ACQUIRE);
+  return ( version & 1) != 0 || __atomic_load_n( &STRIPE( idx)->version, __ATOMIC_RELAXED) != version;
+}
+
+// a lazy restore keeps the files of the chain mapped. a slot is loaded from the
+// newest file with a block of it, under the lock of its stripe.
+typedef struct {
+  int job;        // of the file, -1 once loaded or if no file has a block
+  uint32_t block; // in its directory
+} LazySlot;
+
+#define LAZY_CHUNK 256 // slots a background thread takes at a time
+
+static LazySlot *lazy_slots = NULL; // never freed, readers may peek at it anytime
+static DumpSegmentJob *lazy_jobs = NULL;
+static int lazy_nbr_jobs = 0;
+static long lazy_blocks = 0;
+static long lazy_on_demand = 0;
+static long lazy_next_slot = 0;     // for the background threads
+static long lazy_start_time = 0;
+
+// stripe of idx is locked. the blocks were checked before the restore returned,
+// a block which still fails to load leaves the slot pending: it is neither
+// served nor checkpointed as empty.
+static void lazy_load_slot( IdxTblEntry index_table[], const int idx, const int on_demand) {
+
+  LazySlot *ls = &lazy_slots[idx];
+  if ( __atomic_load_n( &ls->job, __ATOMIC_ACQUIRE) < 0) 
+    return;
+
+  LkupTbl *nt = NULL;
+  if ( load_dump_block( &lazy_jobs[ls->job], ls->block, &nt) != SUCCESS) {
+    log_msg( CRIT, "lazy_load_slot: failure to load slot %d\n", idx);
+    return;
+  }
+
+  LkupTbl *t = index_table[idx].table;
+  begin_table_write( index_table, idx);
+  index_table[idx].table = nt;
+  end_table_write( index_table, idx);
+  if ( t != NULL) 
+    retire_lkup_tbl( t);
+
+  __atomic_store_n( &ls->job, -1, __ATOMIC_RELEASE);
+  if ( on_demand) 
+    __atomic_add_fetch( &lazy_on_demand, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch( &lazy_slots_left, 1, __ATOMIC_RELEASE);
+}
+
+LkupTblPtr peek_table( IdxTblEntry index_table[], int idx) {
+  if ( __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE) > 0 && 
+       __atomic_load_n( &lazy_slots[idx].job, __ATOMIC_ACQUIRE) >= 0) {
+    lock_table( index_table, idx);
+    unlock_table( index_table, idx);
+  }
+  return index_table[idx].table;
+}
+
+// loads the pending slots of [from, to)
+static void lazy_load_range( IdxTblEntry index_table[], const long from, const long to) {
+  long idx = 0;
+  for ( idx = from; idx < to && __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE) > 0; idx++) {
+    if ( __atomic_load_n( &lazy_slots[idx].job, __ATOMIC_ACQUIRE) >= 0) {
+      pthread_mutex_lock( &STRIPE( idx)->mutex);
+      lazy_load_slot( index_table, idx, FALSE);
+      pthread_mutex_unlock( &STRIPE( idx)->mutex);
+    }
+  }
+}
+
+// background thread, takes the slots in prefix order
+static void *lazy_restore_slots( void *arg) {
+
+  IdxTblEntry *index_table = (IdxTblEntry *) arg;
+  const long nbr_slots = INDEX_SIZE-INDEX_OFFSET;
+
+  while ( TRUE) {
+    long from = __atomic_fetch_add( &lazy_next_slot, LAZY_CHUNK, __ATOMIC_RELAXED);
+    if ( from >= nbr_slots) 
+      break;
+    lazy_load_range( index_table, from, from + LAZY_CHUNK < nbr_slots ? from + LAZY_CHUNK : nbr_slots);
+  }
+  return NULL;
+}
+
+// runs the background threads and drops the files once all slots are loaded
+static void *lazy_restore_run( void *arg) {
+
+  int n = sysconf( _SC_NPROCESSORS_ONLN);
+  if ( n > DUMP_MAX_SEGMENTS) 
+    n = DUMP_MAX_SEGMENTS;
+  if ( n < 1) 
+    n = 1;
+
+  pthread_t threads[DUMP_MAX_SEGMENTS];
+  int i = 0;
+  int started = 0;
+  for ( i = 0; i < n; i++) {
+    if ( pthread_create( &threads[started], NULL, lazy_restore_slots, arg) == 0) 
+      started++;
+  }
+  if ( started == 0) // left to on demand loads, the files are kept
+    log_msg( ERR, "lazy_restore_run: failure to start a thread\n");
+  for ( i = 0; i < started; i++) {
+    pthread_join( threads[i], NULL);
+  }
+
+  // all slots have been loaded or are being loaded by the holder of their lock
+  if ( started > 0) 
+    finish_lazy_restore( (IdxTblEntry *) arg);
+  return NULL;
+}
+
+// opens the files of the chain of checkpoint fn as jobs: the segments of the
+// base, then the increments in order. the blocks of the base are checked in
+// parallel, those of the increments were by read_chain(). a corrupt base is
+// replaced by the checkpoint taken before it. to be closed with close_dump_jobs().
+static DumpSegmentJob *open_lazy_chain( IdxTblEntry index_table[], const unsigned char *fn, int mapped, 
+					int *nbr_jobs) {
+
+  char **fns = calloc( DUMP_MAX_CHAIN, sizeof( char *));
+  char *cur = strdup( fn);
+  DumpSegmentJob *jobs = NULL;
+  int n = 0;
+  int last = 0;
+  int format = FAILURE;
+  int fallbacks = 0;
+  int i = 0;
+
+  *nbr_jobs = 0;
+
+  if ( fns == NULL || cur == NULL) {
+    log_msg( CRIT, "open_lazy_chain: out of heap space\n");
+    goto out;
+  }
+
+  while ( read_chain( cur, fns, &n, &last, &format) == SUCCESS) {
+
+    int nbr_segments = 1;
+    DumpSegmentJob *segments = NULL;
+    if ( format == DUMP_FORMAT_MANIFEST) {
+      segments = open_segments( index_table, fns[n-1], mapped, &nbr_segments);
+    } else if (( segments = calloc( 1, sizeof( DumpSegmentJob))) != NULL && 
+	       open_dump_file( index_table, fns[n-1], mapped, segments) != SUCCESS) {
+      free( segments);
+      segments = NULL;
+    }
+
+    if ( segments != NULL && verify_dump_jobs( segments, nbr_segments) == SUCCESS) {
+      if (( jobs = calloc( nbr_segments + n - 1 - last, sizeof( DumpSegmentJob))) == NULL) {
+	log_msg( CRIT, "open_lazy_chain: out of heap space\n");
+	close_dump_jobs( segments, nbr_segments);
+	goto out;
+      }
+      memcpy( jobs, segments, nbr_segments * sizeof( DumpSegmentJob));
+      free( segments);
+      *nbr_jobs = nbr_segments;
+      break;
+    }
+    close_dump_jobs( segments, nbr_segments);
+
+    char *prev = ++fallbacks < DUMP_MAX_CHAIN ? dump_fallback_fn( fns[n-1]) : NULL;
+    if ( prev == NULL) 
+      goto out;
+    log_msg( ERR, "open_lazy_chain: %s is corrupt, falling back to %s. changes after it are lost\n", fns[n-1], prev);
+
+    for ( i = 0; i < n; i++) {
+      free( fns[i]);
+      fns[i] = NULL;
+    }
+    n = 0;
+    free( cur);
+    cur = prev;
+  }
+
+  for ( i = n - 2; i >= last && jobs != NULL; i--) {
+    if ( open_dump_file( index_table, fns[i], mapped, &jobs[*nbr_jobs]) != SUCCESS) {
+      close_dump_jobs( jobs, *nbr_jobs);
+      jobs = NULL;
+      *nbr_jobs = 0;
+    } else {
+      (*nbr_jobs)++;
+    }
+  }
+
+  // loading a slot need not check its block again
+  for ( i = 0; i < *nbr_jobs; i++) {
+    jobs[i].verified = TRUE;
+    serve_in_place( &jobs[i]);
+  }
+
+ out:
+  free( cur);
+  if ( fns != NULL) 
+    free_chain( fns, n);
+  return jobs;
+}
+
+int restore_lazy_fn( IdxTblEntry index_table[], const unsigned char *fn, int mapped) {
+
+  const long nbr_slots = INDEX_SIZE-INDEX_OFFSET;
+
+  FILE *f = fopen( fn, "r");
+  if ( f == NULL) {
+    log_msg( ERR, "failure to read-open %s\n", fn);
+    return FAILURE;
+  }
+  int format = read_dump_header( f);
+  fclose( f);
+
+  // older formats have no directory to load a slot from. restored once only.
+  if (( format != DUMP_FORMAT_V2 && format != DUMP_FORMAT_MANIFEST) || lazy_slots != NULL) 
+    return restore_all_fn( index_table, fn, mapped);
+
+  log_msg( INFO, "starting lazy restore from %s\n", fn);
+
+  DumpSegmentJob *jobs = NULL;
+  int nbr_jobs = 0;
+  int s = FAILURE;
+  int i = 0;
+  long idx = 0;
+
+  if (( lazy_slots = malloc( nbr_slots * sizeof( LazySlot))) == NULL) {
+    log_msg( CRIT, "restore_lazy_fn: out of heap space\n");
+    goto out;
+  }
+  mem_count( MEM_INDEX, nbr_slots * sizeof( LazySlot));
+  for ( idx = 0; idx < nbr_slots; idx++) {
+    lazy_slots[idx].job = -1;
+  }
+
+  if (( jobs = open_lazy_chain( index_table, fn, mapped, &nbr_jobs)) == NULL) 
+    goto out;
+
+  // later files take the slots of their blocks over
+  long left = 0;
+  for ( i = 0; i < nbr_jobs; i++) {
+    const DumpHeaderV2 *header = (const DumpHeaderV2 *) jobs[i].data;
+    const DumpDirEntryV2 *dir = (const DumpDirEntryV2 *) (jobs[i].data + header->dir_offset);
+    long first = 0;
+    long nbr_blocks = dump_job_blocks( &jobs[i], &first);
+    long b = 0;
+    for ( b = first; b < first + nbr_blocks; b++) {
+      LazySlot *ls = &lazy_slots[dir[b].prefix - INDEX_OFFSET];
+      left += (dir[b].len > 0) - (ls->job >= 0);
+      ls->job = dir[b].len > 0 ? i : -1;
+      ls->block = b;
+    }
+  }
+
+  lazy_jobs = jobs;
+  lazy_nbr_jobs = nbr_jobs;
+  lazy_blocks = left;
+  lazy_start_time = get_time_micro();
+  jobs = NULL;
+  s = SUCCESS;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init( &attr);
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED);
+
+  __atomic_store_n( &lazy_slots_left, left, __ATOMIC_RELEASE);
+  if ( left == 0 || pthread_create( &thread, &attr, lazy_restore_run, index_table) != 0) 
+    s = finish_lazy_restore( index_table);
+  pthread_attr_destroy( &attr);
+
+ out:
+  close_dump_jobs( jobs, nbr_jobs);
+  return s;
+}
+
+int finish_lazy_restore( IdxTblEntry index_table[]) {
+
+  if ( __atomic_load_n( &lazy_jobs, __ATOMIC_ACQUIRE) == NULL) 
+    return SUCCESS;
+
+  lazy_load_range( index_table, 0, INDEX_SIZE-INDEX_OFFSET);
+
+  // each slot has been locked since, those left failed. their files are kept.
+  long left = __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE);
+  if ( left > 0) {
+    log_msg( ERR, "finish_lazy_restore: %ld slots failed to load\n", left);
+    return FAILURE;
+  }
+
+  // whoever gets here first drops the files
+  DumpSegmentJob *jobs = __atomic_exchange_n( &lazy_jobs, NULL, __ATOMIC_ACQ_REL);
+  if ( jobs == NULL) 
+    return SUCCESS;
+
+  log_msg( INFO, "lazy restore done: %ld blocks in %.3f s, %ld loaded on demand\n", 
+	   lazy_blocks, (get_time_micro() - lazy_start_time) / 1e6, 
+	   __atomic_load_n( &lazy_on_demand, __ATOMIC_RELAXED));
+  close_dump_jobs( jobs, lazy_nbr_jobs);
+  return SUCCESS;
+}
+
+void lazy_restore_progress( long *left, long *total, long *on_demand) {
+  *left = __atomic_load_n( &lazy_slots_left, __ATOMIC_ACQUIRE);
+  *total = lazy_blocks;
+  *on_demand = __atomic_load_n( &lazy_on_demand, __ATOMIC_RELAXED);
 }
 
 // generates a heap based string containing a JSON status.
@@ -559,13 +2722,12 @@ unsigned char *table_to_json( const LkupTblPtr table, const int status, const un
 		   status, prefix, table->table_sz, table->table_len);
 
   for ( i = 0; i < table->table_len; i++) {
-    LkupTblEntry *e = &(table->table[i]);
 
     unsigned char postfix[32];
     unsigned char alias[48];
 
-    decompress_to_buf( e->postfix, postfix, sizeof( postfix));
-    decompress_to_buf( e->alias, alias, sizeof( alias));    
+    decode_postfix( table->keys[i], postfix, sizeof( postfix));
+    decompress_to_buf( table->aliases[i].alias, alias, sizeof( alias));    
 
     cnt += snprintf( cp+cnt, buf_sz-cnt, "[ \"%s\", \"%s\" ]", postfix, alias);
 
@@ -735,3 +2897,32 @@ char *str_cat( const char *s, ...) {
   
 }
 
+
+int sync_dir_of( const char *fn) {
+
+  char *dir = strdup( fn);
+  if ( dir == NULL) 
+    return FAILURE;
+
+  char *slash = strrchr( dir, '/');
+  const char *path = ".";
+  if ( slash == dir) {
+    path = "/";
+  } else if ( slash != NULL) {
+    *slash = '\0';
+    path = dir;
+  }
+
+  int s = FAILURE;
+  int fd = open( path, O_RDONLY | O_DIRECTORY);
+  if ( fd >= 0) {
+    if ( fsync( fd) == 0) 
+      s = SUCCESS;
+    close( fd);
+  }
+  if ( s != SUCCESS) 
+    log_msg( ERR, "sync_dir_of: failure to sync directory %s\n", path);
+
+  free( dir);
+  return s;
+}
@@ -27,6 +27,9 @@ char** str_split(const char* a_str, const char a_delim, int *nbr_tokens);
 // concatenates list of strings. list is terminated with NULL
 char *str_cat( const char *s, ...);
 
+// fsyncs the directory holding fn, so a rename into it survives a crash
+int sync_dir_of( const char *fn);
+
 #define IS_NULL(s) ((s) == NULL || strlen(s) == 0)
 
 
@@ -0,0 +1,538 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "json.h"
+#include "utils.h"
+#include "nlkup.h"
+#include "wal.h"
+
+#define WAL_INITIAL_BUFFER_SIZE (64*1024)
+#define WAL_READ_BUFFER_SIZE (1024*1024)
+#define WAL_MAX_RECORD_SIZE (sizeof( WAL_Record) + 2 * 255 + 8)
+
+// records are padded to keep the next one aligned
+#define WAL_RECORD_SIZE( nbr_len, alias_len) ((sizeof( WAL_Record) + (nbr_len) + (alias_len) + 7) & ~7UL)
+
+struct WAL_Log {
+  char fn[WAL_FN_LENGTH];
+  int fd;                  // appending
+  WAL_FileHeader header;
+
+  pthread_mutex_t mutex;   // everything below
+  pthread_cond_t work;     // a writer waits for a commit, or stop
+  pthread_cond_t synced;   // synced_lsn advanced
+  unsigned char *buf;      // appended, not yet written
+  size_t buf_len;
+  size_t buf_sz;
+  uint64_t next_lsn;
+  uint64_t wanted_lsn;     // highest lsn waited for
+  uint64_t synced_lsn;     // durable up to
+  int failed;              // writing failed, no more commits
+  int stop;
+  WAL_Stats stats;
+
+  pthread_mutex_t io_mutex; // the file, held while writing or rewriting
+  long window_usec;
+  pthread_t flusher;
+};
+
+static uint32_t fnv1a( uint32_t h, const unsigned char *cp, const size_t len) {
+  size_t i = 0;
+  for ( i = 0; i < len; i++) {
+    h ^= cp[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t record_check( const WAL_Record *r) {
+  WAL_Record c = *r;
+  c.check = 0;
+  uint32_t h = fnv1a( 2166136261u, (const unsigned char *) &c, sizeof( c));
+  return fnv1a( h, (const unsigned char *) (r + 1), r->nbr_len + r->alias_len);
+}
+
+static int write_all( int fd, const unsigned char *cp, size_t len) {
+  while ( len > 0) {
+    ssize_t n = write( fd, cp, len);
+    if ( n < 0 && errno == EINTR) 
+      continue;
+    if ( n <= 0) 
+      return FAILURE;
+    cp += n;
+    len -= n;
+  }
+  return SUCCESS;
+}
+
+// reading the records of a log file one by one
+typedef struct {
+  int fd;
+  unsigned char *buf;
+  size_t len;              // bytes in buf
+  size_t pos;              // of the next record in buf
+  off_t offset;            // of buf in the file
+} WAL_Reader;
+
+// the next valid record or NULL at the end of the valid records
+static const WAL_Record *next_record( WAL_Reader *rd) {
+
+  if ( rd->len - rd->pos < WAL_MAX_RECORD_SIZE) { // refill
+    memmove( rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+    rd->offset += rd->pos;
+    rd->len -= rd->pos;
+    rd->pos = 0;
+    ssize_t n = 0;
+    while ( rd->len < WAL_READ_BUFFER_SIZE && 
+	    ( n = read( rd->fd, rd->buf + rd->len, WAL_READ_BUFFER_SIZE - rd->len)) > 0) 
+      rd->len += n;
+  }
+
+  const WAL_Record *r = (const WAL_Record *) (rd->buf + rd->pos);
+  if ( rd->len - rd->pos < sizeof( WAL_Record) || 
+       rd->len - rd->pos < WAL_RECORD_SIZE( r->nbr_len, r->alias_len) ||
+       ( r->type != WAL_ENTER && r->type != WAL_DELETE) || r->check != record_check( r)) 
+    return NULL;
+
+  rd->pos += WAL_RECORD_SIZE( r->nbr_len, r->alias_len);
+  return r;
+}
+
+// reads the header of log fn and positions a reader after it
+static int open_reader( const char *fn, WAL_Reader *rd, WAL_FileHeader *header) {
+
+  memset( rd, 0, sizeof( WAL_Reader));
+  if (( rd->fd = open( fn, O_RDONLY)) < 0) 
+    return FAILURE;
+
+  if ( read( rd->fd, header, sizeof( WAL_FileHeader)) != sizeof( WAL_FileHeader) ||
+       ntohl( header->magic) != WAL_MAGIC || header->byte_order != WAL_BYTE_ORDER ||
+       ( rd->buf = malloc( WAL_READ_BUFFER_SIZE)) == NULL) {
+    close( rd->fd);
+    return FAILURE;
+  }
+  header->base_fn[sizeof( header->base_fn) - 1] = '\0';
+  rd->offset = sizeof( WAL_FileHeader);
+  return SUCCESS;
+}
+
+static void close_reader( WAL_Reader *rd) {
+  close( rd->fd);
+  free( rd->buf);
+}
+
+// creates log fn with just a header
+static int create_log( const char *fn, const WAL_FileHeader *header) {
+  int fd = open( fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ( fd < 0) 
+    return FAILURE;
+  int s = write_all( fd, (const unsigned char *) header, sizeof( WAL_FileHeader));
+  if ( s == SUCCESS && fdatasync( fd) < 0) 
+    s = FAILURE;
+  close( fd);
+  return s;
+}
+
+// takes the appended records out of the buffer, to be called with the mutex held
+static unsigned char *take_buffer( WAL_Log *log, size_t *len, uint64_t *last_lsn) {
+  unsigned char *buf = log->buf;
+  *len = log->buf_len;
+  *last_lsn = log->next_lsn - 1;
+  log->buf = NULL;
+  log->buf_len = log->buf_sz = 0;
+  return buf;
+}
+
+static void *flusher_body( void *arg) {
+
+  WAL_Log *log = (WAL_Log *) arg;
+
+  pthread_mutex_lock( &log->mutex);
+
+  while ( TRUE) {
+
+    while ( !log->stop && log->wanted_lsn <= log->synced_lsn) 
+      pthread_cond_wait( &log->work, &log->mutex);
+    if ( log->stop && log->buf_len == 0) 
+      break;
+
+    // writers arriving meanwhile join this commit
+    if ( log->window_usec > 0 && !log->stop) {
+      pthread_mutex_unlock( &log->mutex);
+      usleep( log->window_usec);
+      pthread_mutex_lock( &log->mutex);
+    }
+
+    // the file first: buffers are written in the order they are taken
+    pthread_mutex_unlock( &log->mutex);
+    pthread_mutex_lock( &log->io_mutex);
+    pthread_mutex_lock( &log->mutex);
+    size_t len = 0;
+    uint64_t last_lsn = 0;
+    unsigned char *buf = take_buffer( log, &len, &last_lsn);
+    pthread_mutex_unlock( &log->mutex);
+
+    int s = write_all( log->fd, buf, len);
+    if ( s == SUCCESS && fdatasync( log->fd) < 0) 
+      s = FAILURE;
+    pthread_mutex_unlock( &log->io_mutex);
+    free( buf);
+
+    pthread_mutex_lock( &log->mutex);
+    if ( s == SUCCESS) {
+      if ( last_lsn > log->synced_lsn) 
+	log->synced_lsn = last_lsn;
+      log->stats.commits++;
+      log->stats.bytes += len;
+    } else {
+      log_msg( CRIT, "WAL flusher: failure to write %s, mutations are no longer durable\n", log->fn);
+      log->failed = TRUE;
+      log->stop = TRUE;
+    }
+    pthread_cond_broadcast( &log->synced);
+  }
+
+  pthread_mutex_unlock( &log->mutex);
+  return NULL;
+}
+
+WAL_Log *WAL_open( const char *fn, const long window_usec) {
+
+  assert( fn != NULL);
+
+  WAL_Log *log = calloc( 1, sizeof( WAL_Log));
+  if ( log == NULL) {
+    log_msg( CRIT, "WAL_open: out of heap space\n");
+    return NULL;
+  }
+  if ( strlen( fn) >= sizeof( log->fn)) {
+    log_msg( ERR, "WAL_open: file name too long %s\n", fn);
+    free( log);
+    return NULL;
+  }
+  strcpy( log->fn, fn);
+  log->window_usec = window_usec;
+
+  WAL_Reader rd;
+  uint64_t last_lsn = 0;
+
+  if ( open_reader( fn, &rd, &log->header) == SUCCESS) {
+
+    // the valid records, a crash may have torn the last one
+    const WAL_Record *r = NULL;
+    last_lsn = log->header.base_lsn;
+    while (( r = next_record( &rd)) != NULL && r->lsn > last_lsn) 
+      last_lsn = r->lsn;
+    off_t end = rd.offset + rd.pos - (r != NULL ? WAL_RECORD_SIZE( r->nbr_len, r->alias_len) : 0);
+    close_reader( &rd);
+
+    log->fd = open( fn, O_WRONLY | O_APPEND);
+    if ( log->fd >= 0 && lseek( log->fd, 0, SEEK_END) > end) {
+      log_msg( WARN, "WAL_open: cutting off torn records at %ld of %s\n", (long) end, fn);
+      if ( ftruncate( log->fd, end) < 0 || fdatasync( log->fd) < 0) {
+	close( log->fd);
+	log->fd = -1;
+      }
+    }
+  } else if ( access( fn, F_OK) == 0) {
+    log_msg( ERR, "WAL_open: %s is no log\n", fn);
+    free( log);
+    return NULL;
+  } else {
+    memset( &log->header, 0, sizeof( log->header));
+    log->header.magic = htonl( WAL_MAGIC);
+    log->header.byte_order = WAL_BYTE_ORDER;
+    log->fd = create_log( fn, &log->header) == SUCCESS ? open( fn, O_WRONLY | O_APPEND) : -1;
+  }
+
+  if ( log->fd < 0) {
+    log_msg( ERR, "WAL_open: failure to open %s for appending\n", fn);
+    free( log);
+    return NULL;
+  }
+
+  log->next_lsn = last_lsn + 1;
+  log->wanted_lsn = log->synced_lsn = last_lsn;
+
+  pthread_mutex_init( &log->mutex, NULL);
+  pthread_mutex_init( &log->io_mutex, NULL);
+  pthread_cond_init( &log->work, NULL);
+  pthread_cond_init( &log->synced, NULL);
+
+  if ( pthread_create( &log->flusher, NULL, flusher_body, log) != 0) {
+    log_msg( ERR, "WAL_open: pthread_create failed\n");
+    close( log->fd);
+    free( log);
+    return NULL;
+  }
+
+  log_msg( INFO, "WAL_open: %s continues checkpoint \"%s\" up to lsn %lu\n", 
+	   fn, log->header.base_fn, (unsigned long) last_lsn);
+  return log;
+}
+
+void WAL_close( WAL_Log *log) {
+
+  pthread_mutex_lock( &log->mutex);
+  log->stop = TRUE;
+  pthread_cond_signal( &log->work);
+  pthread_mutex_unlock( &log->mutex);
+
+  pthread_join( log->flusher, NULL);
+
+  close( log->fd);
+  free( log->buf);
+  pthread_mutex_destroy( &log->mutex);
+  pthread_mutex_destroy( &log->io_mutex);
+  pthread_cond_destroy( &log->work);
+  pthread_cond_destroy( &log->synced);
+  free( log);
+}
+
+char *WAL_base_fn( WAL_Log *log) {
+  pthread_mutex_lock( &log->io_mutex);
+  char *fn = strdup( log->header.base_fn);
+  pthread_mutex_unlock( &log->io_mutex);
+  return fn;
+}
+
+long WAL_replay( WAL_Log *log, WAL_Apply apply, void *arg) {
+
+  WAL_Reader rd;
+  WAL_FileHeader header;
+
+  pthread_mutex_lock( &log->io_mutex);
+
+  if ( open_reader( log->fn, &rd, &header) != SUCCESS) {
+    pthread_mutex_unlock( &log->io_mutex);
+    log_msg( ERR, "WAL_replay: failure to read %s\n", log->fn);
+    return FAILURE;
+  }
+
+  long n = 0;
+  long errors = 0;
+  const WAL_Record *r = NULL;
+
+  while (( r = next_record( &rd)) != NULL) {
+    if ( r->lsn <= header.base_lsn) 
+      continue;
+    const unsigned char *nbr = (const unsigned char *) (r + 1);
+    if ( apply( arg, r->type, nbr, r->nbr_len, nbr + r->nbr_len, r->alias_len) != SUCCESS) 
+      errors++;
+    n++;
+  }
+
+  close_reader( &rd);
+  pthread_mutex_unlock( &log->io_mutex);
+
+  if ( errors > 0) 
+    log_msg( WARN, "WAL_replay: %ld of %ld records failed\n", errors, n);
+  log_msg( INFO, "WAL_replay: %ld records replayed from %s\n", n, log->fn);
+  return n;
+}
+
+uint64_t WAL_append( WAL_Log *log, const int type, const unsigned char *nbr, const int nbr_len, 
+		     const unsigned char *alias, const int alias_len) {
+
+  assert( nbr_len >= 0 && nbr_len <= 255 && alias_len >= 0 && alias_len <= 255);
+
+  size_t len = WAL_RECORD_SIZE( nbr_len, alias_len);
+  uint64_t lsn = 0;
+
+  pthread_mutex_lock( &log->mutex);
+
+  if ( log->failed) {
+    pthread_mutex_unlock( &log->mutex);
+    return 0;
+  }
+
+  if ( log->buf_len + len > log->buf_sz) {
+    size_t sz = log->buf_sz == 0 ? WAL_INITIAL_BUFFER_SIZE : 2 * log->buf_sz;
+    unsigned char *buf = realloc( log->buf, sz);
+    if ( buf == NULL) {
+      pthread_mutex_unlock( &log->mutex);
+      log_msg( CRIT, "WAL_append: out of heap space\n");
+      return 0;
+    }
+    log->buf = buf;
+    log->buf_sz = sz;
+  }
+
+  WAL_Record *r = (WAL_Record *) (log->buf + log->buf_len);
+  memset( r, 0, len);
+  r->lsn = lsn = log->next_lsn++;
+  r->type = type;
+  r->nbr_len = nbr_len;
+  r->alias_len = alias_len;
+  memcpy( r + 1, nbr, nbr_len);
+  memcpy( (unsigned char *) (r + 1) + nbr_len, alias, alias_len);
+  r->check = record_check( r);
+
+  log->buf_len += len;
+  log->stats.records++;
+
+  pthread_mutex_unlock( &log->mutex);
+  return lsn;
+}
+
+int WAL_sync( WAL_Log *log, const uint64_t lsn) {
+
+  pthread_mutex_lock( &log->mutex);
+
+  if ( lsn > log->wanted_lsn) {
+    log->wanted_lsn = lsn;
+    pthread_cond_signal( &log->work);
+  }
+  while ( log->synced_lsn < lsn && !log->failed) 
+    pthread_cond_wait( &log->synced, &log->mutex);
+
+  int s = log->synced_lsn >= lsn ? SUCCESS : FAILURE;
+  pthread_mutex_unlock( &log->mutex);
+  return s;
+}
+
+uint64_t WAL_last_lsn( WAL_Log *log) {
+  pthread_mutex_lock( &log->mutex);
+  uint64_t lsn = log->next_lsn - 1;
+  pthread_mutex_unlock( &log->mutex);
+  return lsn;
+}
+
+int WAL_checkpoint( WAL_Log *log, const char *base_fn, const uint64_t base_lsn) {
+
+  if ( strlen( base_fn) >= sizeof( log->header.base_fn)) {
+    log_msg( ERR, "WAL_checkpoint: file name too long %s\n", base_fn);
+    return FAILURE;
+  }
+
+  char *tmp_fn = str_cat( log->fn, ".tmp", NULL);
+  if ( tmp_fn == NULL) {
+    log_msg( CRIT, "WAL_checkpoint: str_cat filename\n");
+    return FAILURE;
+  }
+
+  // the commits wait, appending goes on
+  pthread_mutex_lock( &log->io_mutex);
+
+  pthread_mutex_lock( &log->mutex);
+  size_t len = 0;
+  uint64_t last_lsn = 0;
+  unsigned char *buf = take_buffer( log, &len, &last_lsn);
+  int failed = log->failed;
+  pthread_mutex_unlock( &log->mutex);
+
+  WAL_FileHeader header = log->header;
+  header.base_lsn = base_lsn;
+  strcpy( header.base_fn, base_fn);
+
+  WAL_Reader rd;
+  WAL_FileHeader old_header;
+  int fd = -1;
+  int s = FAILURE;
+
+  // all records in the old file first, then the later ones copied aside
+  if ( failed || write_all( log->fd, buf, len) != SUCCESS || 
+       open_reader( log->fn, &rd, &old_header) != SUCCESS) {
+    log_msg( ERR, "WAL_checkpoint: failure to write or read %s\n", log->fn);
+    goto out;
+  }
+
+  const WAL_Record *r = NULL;
+  long kept = 0;
+  s = create_log( tmp_fn, &header);
+  if ( s == SUCCESS && ( fd = open( tmp_fn, O_WRONLY | O_APPEND)) < 0) 
+    s = FAILURE;
+  while ( s == SUCCESS && ( r = next_record( &rd)) != NULL) {
+    if ( r->lsn > base_lsn) {
+      s = write_all( fd, (const unsigned char *) r, WAL_RECORD_SIZE( r->nbr_len, r->alias_len));
+      kept++;
+    }
+  }
+  close_reader( &rd);
+
+  if ( s == SUCCESS && ( fdatasync( fd) < 0 || rename( tmp_fn, log->fn) < 0)) 
+    s = FAILURE;
+  if ( s != SUCCESS) {
+    log_msg( ERR, "WAL_checkpoint: failure to rewrite %s\n", log->fn);
+    if ( fd >= 0) 
+      close( fd);
+    unlink( tmp_fn);
+    goto out;
+  }
+
+  close( log->fd);
+  log->fd = fd;
+  log->header = header;
+
+  // the new file is in use either way, but not durable without its directory entry
+  if ( sync_dir_of( log->fn) != SUCCESS) 
+    s = FAILURE;
+
+  WAL_Stats stats;
+  WAL_get_stats( log, &stats);
+  log_msg( INFO, "WAL_checkpoint: %s continues %s, %ld records kept. %ld records in %ld commits so far\n", 
+	   log->fn, base_fn, kept, stats.records, stats.commits);
+
+ out:
+  pthread_mutex_unlock( &log->io_mutex);
+
+  pthread_mutex_lock( &log->mutex);
+  if ( s == SUCCESS && last_lsn > log->synced_lsn) { // the new file is synced
+    log->synced_lsn = last_lsn;
+    pthread_cond_broadcast( &log->synced);
+  } else if ( s != SUCCESS && !failed) {
+    log_msg( CRIT, "WAL_checkpoint: mutations are no longer durable\n");
+    log->failed = TRUE;
+    pthread_cond_broadcast( &log->synced);
+  }
+  pthread_mutex_unlock( &log->mutex);
+
+  free( buf);
+  free( tmp_fn);
+  return s;
+}
+
+void WAL_get_stats( WAL_Log *log, WAL_Stats *stats) {
+  pthread_mutex_lock( &log->mutex);
+  *stats = log->stats;
+  pthread_mutex_unlock( &log->mutex);
+}
@@ -0,0 +1,112 @@
+/*
+  Copyright (c) 2017, Carl Binding, LI-9494 Schaan
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ The views and conclusions contained in the software and documentation are those
+ of the authors and should not be interpreted as representing official policies,
+ either expressed or implied, of the FreeBSD Project.
+*/
+
+/*
+  write-ahead log of mutations. records are appended to a buffer in memory,
+  a flusher thread writes them out and makes them durable with one
+  fdatasync() for all writers waiting at the time (group commit).
+
+  the log starts with the checkpoint it continues: after a checkpoint the
+  records it covers are dropped and the log names the new checkpoint. on
+  startup that checkpoint is restored and the records are replayed.
+*/
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdint.h>
+
+#define WAL_MAGIC 0x4e4c4b57 // "NLKW"
+#define WAL_BYTE_ORDER 0x01020304
+#define WAL_FN_LENGTH 240
+
+// record types
+#define WAL_ENTER  1
+#define WAL_DELETE 2
+
+// host byte order except for magic
+typedef struct {
+  uint32_t magic;      // network byte order
+  uint32_t byte_order; // WAL_BYTE_ORDER as written
+  uint64_t base_lsn;   // records up to base_lsn are in checkpoint base_fn
+  char base_fn[WAL_FN_LENGTH]; // empty if none yet
+} WAL_FileHeader;      // 256 bytes
+
+typedef struct {
+  uint64_t lsn;        // log sequence nbr, ascending
+  uint32_t check;      // FNV-1a of the record and its digits, with check 0
+  uint8_t type;        // WAL_ENTER or WAL_DELETE
+  uint8_t nbr_len;
+  uint8_t alias_len;   // 0 for WAL_DELETE
+  uint8_t reserved;
+} WAL_Record;          // 16 bytes, followed by the digits of nbr and alias, padded to 8
+
+typedef struct {
+  long records;        // appended since opened
+  long commits;        // fdatasync() calls
+  long bytes;          // written
+} WAL_Stats;
+
+typedef struct WAL_Log WAL_Log;
+
+// opens or creates log fn and starts its flusher. a torn record at the end,
+// left by a crash while writing, is cut off. the flusher waits window_usec
+// after the first waiter for more writers to join a commit.
+WAL_Log *WAL_open( const char *fn, const long window_usec);
+
+// stops the flusher after writing out what has been appended
+void WAL_close( WAL_Log *log);
+
+// the checkpoint the log continues, "" if none. to be free()-ed.
+char *WAL_base_fn( WAL_Log *log);
+
+// calls apply for each record after the base checkpoint, in log order.
+// returns the nbr of records replayed or FAILURE.
+typedef int (*WAL_Apply)( void *arg, const int type, const unsigned char *nbr, const int nbr_len, 
+			  const unsigned char *alias, const int alias_len);
+long WAL_replay( WAL_Log *log, WAL_Apply apply, void *arg);
+
+// appends a record, returns its lsn, 0 if out of memory or the log failed. not yet durable.
+uint64_t WAL_append( WAL_Log *log, const int type, const unsigned char *nbr, const int nbr_len, 
+		     const unsigned char *alias, const int alias_len);
+
+// waits until the records up to lsn are on disk. FAILURE if the log can't be written.
+int WAL_sync( WAL_Log *log, const uint64_t lsn);
+
+// the lsn of the last record appended
+uint64_t WAL_last_lsn( WAL_Log *log);
+
+// drops the records up to base_lsn which are in checkpoint base_fn now.
+// the log is rewritten aside and renamed.
+int WAL_checkpoint( WAL_Log *log, const char *base_fn, const uint64_t base_lsn);
+
+void WAL_get_stats( WAL_Log *log, WAL_Stats *stats);
+
+#endif